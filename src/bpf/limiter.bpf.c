@@ -1,15 +1,44 @@
 // SPDX-License-Identifier: GPL-2.0
 /*
  * 文件用途
- * - 该 eBPF 程序挂载在 cgroup egress 路径 (cgroup_skb/egress)，
+ * - limit_egress 挂载在 cgroup egress 路径 (cgroup_skb/egress)，
  *   对每个发往网络栈的 skb 进行令牌桶限速。
+ * - limit_ingress 挂载在 cgroup ingress 路径 (cgroup_skb/ingress)，
+ *   使用独立的规则 map 与令牌桶，对交付给本地 socket 的 skb 限速。
+ * - limit_tc 挂载在选定网卡的 tcx 出方向 (tc)，限制没有本机 socket 的转发流量
+ *   （容器 veth、虚拟机 tap），按 fwmark/入口网卡/源地址找到规则后沿用同一套规则与令牌桶。
  *
  * 实现原理
- * - 以 cgroup_id 作为键，使用两个 HASH map 分别存储配置与状态：
- *   config(rate_bps/bucket_size) 与 state(tokens/last_update_ns)。
+ * - 以 cgroup_id 作为键，在一个 HASH map 中同时存放配置与状态：
+ *   state(lock/tokens/last_update_ns) 与 config 的热区共占值的前 64 字节，每包仅查找一次。
+ *   内核支持时改用 cgroup 本地存储 (CGRP_STORAGE)：规则挂在 cgroup 上，
+ *   cgroup 删除时由内核自动释放，不再残留过期条目。
  * - 每次有 skb 到达时，按与上次更新时间的纳秒差补充令牌，封顶到 bucket_size，
  *   然后判断 tokens 是否足够支付本次包长 (skb->len)，足够则扣减并放行，否则丢弃。
- * - eBPF 返回值：1 放行 (allow)，0 丢弃 (deny)。
+ * - 分片模式下各 CPU 先消耗本地额度，不足时才加锁从共享桶批量领取，降低锁竞争。
+ * - pace 模式下不直接丢包，而是按令牌桶推算最早发送时间 (EDT) 写入 skb->tstamp，
+ *   由 fq qdisc 延迟发送；仅当需要延迟的时间超过 horizon 时才丢弃。
+ * - ecn 模式下令牌低于软阈值的包仍放行，但标记 CE 并返回 CN 让本机 TCP 降窗，
+ *   令牌耗尽（已用完硬阈值的透支额度）才丢包。
+ * - tcm 模式为双速率三色标记 (RFC 2698，色盲)：承诺桶与峰值桶都够为绿色，直接放行；
+ *   只有峰值桶够为黄色，放行并写入 skb->mark，由出口网卡上的 tc 规则改写成较低的 DSCP；
+ *   峰值桶也不够为红色，丢弃。
+ * - shape 模式只分类不丢包：出方向的包写入规则对应的 HTB classid (skb->priority)，
+ *   由用户态在整形网卡上装好的 HTB 按类排队整形。
+ * - 公平分享：在 socket 本地存储中记录各 socket 的近期用量，放行时要求桶里至少还剩
+ *   该 socket 的近期用量（不超过 fair_reserve），桶紧张时用量大的连接先被限制。
+ * - 可选的包速率桶 (pps/pkt_burst) 与字节桶在同一把锁内检查，两者都满足才放行。
+ * - 嵌套规则（HTB 式）：config.ancestor_mask 标记了哪些祖先层级上也有规则，
+ *   包须在每一层都有足够令牌才放行，任一层不足则退还已扣减的令牌并丢弃。
+ * - 流量分类（出方向）：规则带有分类时按目的地址查 LPM 表，再比对协议与目的端口，
+ *   命中的分类改用自己的子桶，或绕过本规则。
+ * - 原地进程规则（出方向）：以 tgid 为键的独立规则表，不迁移进程的 cgroup。
+ *   tag_sock_owner 挂在 cgroup/sock_create 上，在进程上下文中把创建者记入 socket 本地存储，
+ *   包按 socket 的创建者计费；在 cgroup 规则之前检查。
+ * - 控制包放行：桶不足时 TCP 控制包（SYN/FIN/RST、纯 ACK）与 TCP 小包改用每条规则的小额度
+ *   放行，避免丢掉 ACK 拖慢反方向的流量；包速率桶已空时照常丢弃。只在丢包路径上判断，放行路径没有额外开销。
+ * - eBPF 返回值：1 放行 (allow)，0 丢弃 (deny)；出方向 3 为放行并通知拥塞 (NET_XMIT_CN)。
+ *   limit_tc 放行返回 TC_ACT_UNSPEC（交给同一网卡上的后续程序），丢弃返回 TC_ACT_SHOT。
  */
 #include <vmlinux.h>
 
@@ -43,42 +72,352 @@ typedef __u32 __wsum;
 
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
 #include "../include/limiter.h"
 
-/* 从skb获取cgroup_id的辅助函数 */
-static __always_inline __u64 get_cgroup_id_from_skb(struct __sk_buff *skb)
-{
-	struct sock *sk;
-	struct cgroup *cgrp;
+/* 出方向返回值的 bit 1：通知拥塞，发送方 TCP 收到 NET_XMIT_CN 后进入 CWR 降窗 */
+#define VERDICT_CN 2
+/* 内部标志：放行但打了标记（tcm 黄色），只用于计数，返回内核前清除 */
+#define VERDICT_MARK 4
 
-	/* 获取socket指针 */
-	sk = (struct sock *)BPF_CORE_READ(skb, sk);
-	if (!sk)
-		return 0;
+/* tc 程序的返回值：TC_ACT_UNSPEC 在 tcx 上即 TCX_NEXT，交给后续程序继续处理 */
+#ifndef TC_ACT_UNSPEC
+#define TC_ACT_UNSPEC -1
+#endif
+#ifndef TC_ACT_SHOT
+#define TC_ACT_SHOT 2
+#endif
+
+#ifndef ETH_P_IP
+#define ETH_P_IP 0x0800
+#endif
 
-	/* 获取cgroup指针 */
-	cgrp = BPF_CORE_READ(sk, sk_cgrp_data.cgroup);
-	if (!cgrp)
+/* TCP 头部第 13 字节的标志位（vmlinux.h 中的 TCP_FLAG_* 是按 32 位大端定义的，不能直接用） */
+#ifndef TCPHDR_FIN
+#define TCPHDR_FIN 0x01
+#define TCPHDR_SYN 0x02
+#define TCPHDR_RST 0x04
+#define TCPHDR_ACK 0x10
+#endif
+#ifndef ETH_P_IPV6
+#define ETH_P_IPV6 0x86DD
+#endif
+
+/*
+ * 从 skb 获取计费的 cgroup_id：优先使用 skb 所属 socket 的 cgroup。
+ * TCP 重传、软中断里由 ACK 驱动的发送、TSQ tasklet 发出的包运行在任意任务上下文中，
+ * bpf_get_current_cgroup_id() 会把它们算到无关的 cgroup 上。
+ * 只有没有完整 socket 时（如部分内核自身发出的控制包）才回退到当前任务的 cgroup，
+ * 此时 *from_task 置 1，祖先层级也要按当前任务查找。
+ */
+static __always_inline __u64 get_cgroup_id_from_skb(struct __sk_buff *skb, int ingress, int *from_task)
+{
+	__u64 cgid = bpf_skb_cgroup_id(skb);
+
+	*from_task = 0;
+	if (cgid)
+		return cgid;
+	/* 接收路径运行在软中断中，当前任务与该包无关，不做回退 */
+	if (ingress)
 		return 0;
+	*from_task = 1;
+	return bpf_get_current_cgroup_id();
+}
 
-	/* 获取cgroup ID */
-	return BPF_CORE_READ(cgrp, kn, id);
+/* 取第 level 层祖先的 cgroup_id，来源须与 get_cgroup_id_from_skb 一致 */
+static __always_inline __u64 get_ancestor_cgroup_id(struct __sk_buff *skb, int level, int from_task)
+{
+	if (from_task)
+		return bpf_get_current_ancestor_cgroup_id(level);
+	return bpf_skb_ancestor_cgroup_id(skb, level);
 }
 
-/* 配置与状态分离的双 map 设计（BTF-defined maps） */
+/*
+ * 加载时由用户态写入（.rodata）。为 0 时 dbg_printk 所在分支在校验阶段即被裁剪，
+ * 数据路径上不再有 bpf_printk 的开销。
+ */
+const volatile __u32 limiter_debug = 0;
+
+#define dbg_printk(fmt, ...)				\
+	do {						\
+		if (limiter_debug)			\
+			bpf_printk(fmt, ##__VA_ARGS__);	\
+	} while (0)
+
+/* 配置与状态合并的单 map 设计（BTF-defined maps），容量与分配方式由加载器调整 */
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 4096);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
 	__type(key, __u64);
-	__type(value, struct rate_limit_config);
-} rate_limit_config_map SEC(".maps");
+	__type(value, struct rate_limit_full_info);
+} rate_limit_map SEC(".maps");
 
+/* 入方向规则：与出方向相互独立的令牌桶 */
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 4096);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
 	__type(key, __u64);
-	__type(value, struct rate_limit_state);
-} rate_limit_state_map SEC(".maps");
+	__type(value, struct rate_limit_full_info);
+} rate_limit_ingress_map SEC(".maps");
+
+/*
+ * cgroup 本地存储版本的出/入方向规则，值结构与 hash map 相同。
+ * 加载器探测内核支持后设置 use_cgrp_storage，并只创建其中一组 map。
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_cgrp_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_ingress_cgrp_map SEC(".maps");
+
+const volatile __u32 use_cgrp_storage = 0;
+
+extern struct cgroup *bpf_cgroup_from_id(__u64 cgid) __ksym __weak;
+extern void bpf_cgroup_release(struct cgroup *cgrp) __ksym __weak;
+
+/*
+ * 按 cgroup_id 查找规则。本地存储模式下先由 id 取得 cgroup 引用，
+ * 存储随 cgroup 以 RCU 方式释放，释放引用后指针在本次程序执行期间仍然有效。
+ */
+/* 规则过滤位图，两个方向共用；数组查找由校验器内联为直接访存，没有辅助函数调用 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, RULE_FILTER_WORDS);
+	__type(key, __u32);
+	__type(value, __u64);
+} rate_limit_filter SEC(".maps");
+
+/* 该 cgroup 可能有规则时返回 1；返回 0 时一定没有规则 */
+static __always_inline int rule_filter_match(__u64 cgid)
+{
+	__u32 bit = rule_filter_bit(cgid);
+	__u32 word = bit >> 6;
+	__u64 *w = bpf_map_lookup_elem(&rate_limit_filter, &word);
+
+	return w && (*w & (1ULL << (bit & 63)));
+}
+
+static __always_inline struct rate_limit_full_info *lookup_rule(__u64 cgid, int ingress)
+{
+	if (use_cgrp_storage) {
+		struct rate_limit_full_info *info;
+		struct cgroup *cgrp = bpf_cgroup_from_id(cgid);
+
+		if (!cgrp)
+			return NULL;
+		if (ingress)
+			info = bpf_cgrp_storage_get(&rate_limit_ingress_cgrp_map, cgrp, 0, 0);
+		else
+			info = bpf_cgrp_storage_get(&rate_limit_cgrp_map, cgrp, 0, 0);
+		bpf_cgroup_release(cgrp);
+		return info;
+	}
+	if (ingress)
+		return bpf_map_lookup_elem(&rate_limit_ingress_map, &cgid);
+	return bpf_map_lookup_elem(&rate_limit_map, &cgid);
+}
+
+/* 出方向流量分类：按 (规则 cgroup_id, 目的前缀) 最长匹配 */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, struct class_lpm_key);
+	__type(value, struct class_set);
+} rate_limit_class_lpm SEC(".maps");
+
+/* 分类子桶：值结构与规则相同，只使用其中的字节/包令牌桶 */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, struct class_bucket_key);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_class_map SEC(".maps");
+
+/* 按出口网卡区分的桶：值结构与规则相同，使用其中的配置与状态 */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, struct dev_bucket_key);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_dev_map SEC(".maps");
+
+/*
+ * tc 模式的匹配表：fwmark / 入口网卡精确匹配，源地址按前缀最长匹配，值为规则的 cgroup_id。
+ * rate_limit_tc_cfg 记录哪几类表非空，没有对应匹配项时不查表。
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, TC_MAX_MATCHES);
+	__type(key, struct tc_match_key);
+	__type(value, __u64);
+} rate_limit_tc_match SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, TC_MAX_MATCHES);
+	__type(key, struct tc_src_key);
+	__type(value, __u64);
+} rate_limit_tc_src SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct tc_match_cfg);
+} rate_limit_tc_cfg SEC(".maps");
+
+/* 公平分享：每个 socket 的近期用量，socket 释放时由内核一并回收 */
+struct {
+	__uint(type, BPF_MAP_TYPE_SK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct sock_usage);
+} sock_usage_map SEC(".maps");
+
+/* 原地进程规则：以 tgid 为键，值结构与 cgroup 规则相同 */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_pid_map SEC(".maps");
+
+/* 原地进程规则条数，由用户态维护；为 0 时出方向不查进程规则，也不记录 socket 创建者 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u32);
+} rate_limit_pid_count SEC(".maps");
+
+/* socket 的创建进程，accept 出的 socket 经 BPF_F_CLONE 继承监听 socket 的记录 */
+struct {
+	__uint(type, BPF_MAP_TYPE_SK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC | BPF_F_CLONE);
+	__type(key, int);
+	__type(value, struct sock_owner);
+} sock_owner_map SEC(".maps");
+
+/*
+ * 分时速率：以规则槽位为键的时间窗表。每个窗约 160 字节，多数规则没有时间窗，
+ * 因此用按需分配的 hash 而不是按槽位预分配的数组。
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct rate_schedule);
+} rate_limit_sched_map SEC(".maps");
+
+/* 单调时钟到本地墙上时间的偏移，由用户态在设置时间窗、reload 时校准 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct limiter_clock);
+} limiter_clock_map SEC(".maps");
+
+/*
+ * 整机出方向总限速：单条目数组，值结构与规则相同，未启用时条目全为 0（以热区的 bucket_size 判断）。
+ * 用户态为它分配一个规则槽位，计数器与分片额度沿用按槽位索引的每 CPU 数组。
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct rate_limit_full_info);
+} rate_limit_host_map SEC(".maps");
+
+/* 本机流量绕过的开关与本机地址数，单条目数组，由用户态在加载与地址变化时写入 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct local_bypass);
+} rate_limit_local_cfg SEC(".maps");
+
+/* 控制包放行的开关、长度门槛与额度，单条目数组，由用户态在加载与修改时写入 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct ctrl_pass);
+} rate_limit_ctrl_cfg SEC(".maps");
+
+/* 本机地址：只做完整地址的精确匹配，用 hash 而不是 LPM */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, LOCAL_MAX_ADDRS);
+	__type(key, struct local_addr_key);
+	__type(value, __u8);
+} rate_limit_local_addrs SEC(".maps");
+
+/* 按规则槽位 (config.slot) 索引的每 CPU 计数器，用户态汇总各 CPU 的值 */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct rate_limit_stats);
+} rate_limit_stats_map SEC(".maps");
+
+/* 分片模式的每 CPU 本地额度，按规则槽位索引 */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct rate_limit_pcpu);
+} rate_limit_pcpu_map SEC(".maps");
+
+/* 规则的冷参数（pace 视界、公平分享窗口、tcm 黄色标记），按规则槽位索引，由用户态随规则写入 */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, LIMIT_DEFAULT_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct rate_limit_mode_cfg);
+} rate_limit_mode_map SEC(".maps");
+
+/* 数组查找由校验器内联，只在用到冷参数的模式下调用；时间窗与网卡桶的配置带有规则本身的槽位 */
+static __always_inline struct rate_limit_mode_cfg *mode_cfg(struct rate_limit_config *conf)
+{
+	__u32 slot = conf->slot;
+
+	return bpf_map_lookup_elem(&rate_limit_mode_map, &slot);
+}
+
+static __always_inline struct rate_limit_stats *rule_stats(struct rate_limit_config *conf)
+{
+	__u32 slot = conf->slot;
+
+	return bpf_map_lookup_elem(&rate_limit_stats_map, &slot);
+}
+
+static __always_inline void count_verdict(struct rate_limit_config *conf, int verdict, __u64 packet_len)
+{
+	struct rate_limit_stats *stats = rule_stats(conf);
+
+	if (!stats)
+		return;
+	if (verdict) {
+		stats->pass_pkts++;
+		stats->pass_bytes += packet_len;
+		if (verdict & (VERDICT_CN | VERDICT_MARK))
+			stats->mark_pkts++;
+	} else {
+		stats->drop_pkts++;
+		stats->drop_bytes += packet_len;
+	}
+}
 
 
 /*
@@ -98,62 +437,1128 @@ TCP/UDP 协议处理 -> IP 路由 -> 邻居表 -> 网卡队列驱动 -> 网卡
 
 */
 
-SEC("cgroup_skb/egress")
-int limit_egress(struct __sk_buff *skb)
+/* pace 模式下一个包把时间轴推后的时长：len/rate，开启包速率时至少 1/pps */
+static __always_inline __u64 pace_delay_ns(struct rate_limit_config *conf, __u64 packet_len)
 {
-	/* 当前时间 (ns) 与该包长度 */
-	__u64 now = bpf_ktime_get_ns();
-	__u64 packet_len = skb->len;
-	/* 以 cgroup_id 作为限速维度 */
-	//__u64 cgid = get_cgroup_id_from_skb(skb);
-	__u64 cgid = bpf_get_current_cgroup_id();
-	__u64 pid_tgid = bpf_get_current_pid_tgid();
-	u32 pid = (u32)(pid_tgid >> 32);  // 修正：获取线程组ID (tgid)
-	u32 tid = (u32)(pid_tgid);        // 获取线程ID (pid)
-	struct rate_limit_config *conf;
-	struct rate_limit_state *st;
+	__u64 delay_ns = (packet_len * conf->ns_mult) >> PACE_NS_SHIFT;
 
-    bpf_printk("cgid=%llu pid=%u tid=%u len=%u\n", cgid, pid, tid, skb->len);
-	conf = bpf_map_lookup_elem(&rate_limit_config_map, &cgid);
-	st = bpf_map_lookup_elem(&rate_limit_state_map, &cgid);
-	if (!conf) {
-		/* 未配置限速则放行 */
-		bpf_printk("no conf found,pass\n");
-		return 1;
-	}
-	if (!st) {
-		/* 首次状态初始化：放行当前包 */
-		struct rate_limit_state init = {};
-		init.tokens = conf->bucket_size; /* 或 0，视业务取舍 */
-		init.last_update_ns = now;
-		bpf_map_update_elem(&rate_limit_state_map, &cgid, &init, 0);
-		bpf_printk("no state found,pass\n");
-		return 1;
-	}
+	if ((conf->features & RULE_F_PPS) && delay_ns < conf->pkt_ns)
+		delay_ns = conf->pkt_ns;
+	return delay_ns;
+}
+
+/*
+ * pace 模式：把令牌桶换算到时间轴上。next_tx_ns 是下一个包允许离开的时刻，
+ * 每个包把它向后推 len/rate 秒；它最多可以落后当前时间 bucket_size/rate 秒，
+ * 这部分就是允许的突发。推算出的时刻写入 skb->tstamp，交给 fq 延迟发送。
+ */
+static __always_inline int pace_egress(struct __sk_buff *skb, struct rate_limit_config *conf,
+				       struct rate_limit_full_info *b, __u64 now, __u64 packet_len)
+{
+	struct rate_limit_state *st = &b->state;
+	__u64 delay_ns = pace_delay_ns(conf, packet_len);
+	__u64 burst_ns = conf->fill_ns;
+	struct rate_limit_mode_cfg *mc = mode_cfg(conf);
+	__u64 horizon_ns = mc && mc->horizon_ns ? mc->horizon_ns : DEFAULT_PACE_HORIZON_NS;
+	__u64 tx;
+
+	/* 包速率：突发取两个桶中较小的一个 */
+	if ((conf->features & RULE_F_PPS) && burst_ns > conf->pkt_fill_ns)
+		burst_ns = conf->pkt_fill_ns;
 
-	/* 进入临界区：保护 tokens/last_update_ns 更新 */
 	bpf_spin_lock(&st->lock);
+	tx = b->ext.next_tx_ns;
+	if (tx + burst_ns < now)
+		tx = now - burst_ns;
+	tx += delay_ns;
+	/* 超出视界：排队过久，仍然丢弃，且不推进时间轴 */
+	if (tx > now + horizon_ns) {
+		bpf_spin_unlock(&st->lock);
+		return 0;
+	}
+	b->ext.next_tx_ns = tx;
+	st->last_update_ns = now;
+	bpf_spin_unlock(&st->lock);
+
+	/* 仍在突发额度内的包无需延迟；已有更晚的 tstamp（如 TCP 自身 pacing）则保留 */
+	if (tx > now && tx > skb->tstamp)
+		skb->tstamp = tx;
+	return 1;
+}
 
+/*
+ * 按时间差补充令牌，调用方须持有 b->state.lock。
+ * 定点乘法代替除法，不足一个令牌的部分留在 state.frac 中累积到下次，
+ * 低速率、小包时也不会少发令牌；空闲超过 fill_ns 时直接装满，乘法不会溢出。
+ */
+static __always_inline void refill_tokens(struct rate_limit_config *conf, struct rate_limit_full_info *b, __u64 now)
+{
+	struct rate_limit_state *st = &b->state;
 	__u64 time_delta_ns = now - st->last_update_ns;
-	__u64 tokens_to_add = (time_delta_ns * conf->rate_bps) / 1000000000ULL;
 
-	/* 将新令牌加入桶中，并且不能超过桶的最大容量（来自 config） */
-	st->tokens += tokens_to_add;
-	if (st->tokens > conf->bucket_size) {
+	if (time_delta_ns >= conf->fill_ns) {
 		st->tokens = conf->bucket_size;
+		st->frac = 0;
+	} else {
+		/* 分时速率切换时间窗后 refill_shift 可能变小，旧的小数部分按新的位数截断 */
+		__u64 acc = time_delta_ns * conf->refill_mult + (st->frac & ((1ULL << conf->refill_shift) - 1));
+
+		st->tokens += acc >> conf->refill_shift;
+		st->frac = acc & ((1ULL << conf->refill_shift) - 1);
+		/* 将新令牌加入桶中，并且不能超过桶的最大容量（来自 config） */
+		if (st->tokens >= conf->bucket_size) {
+			st->tokens = conf->bucket_size;
+			st->frac = 0;
+		}
+	}
+
+	/* 包令牌：空闲超过 pkt_fill_ns 直接装满，否则 delta*pps 不会溢出 */
+	if (conf->features & RULE_F_PPS) {
+		struct rate_limit_state_ext *ext = &b->ext;
+		__u64 pkt_cap = conf->pkt_burst * PKT_TOKEN_UNIT;
+
+		if (time_delta_ns >= conf->pkt_fill_ns)
+			ext->pkt_tokens = pkt_cap;
+		else
+			ext->pkt_tokens += time_delta_ns * conf->pps;
+		if (ext->pkt_tokens > pkt_cap)
+			ext->pkt_tokens = pkt_cap;
 	}
 	st->last_update_ns = now;
+}
+
+/*
+ * 字节桶与包桶都足够时同时扣减，调用方须持有 b->state.lock。
+ * reserve 为扣减后字节桶至少要剩下的令牌（公平分享模式下由 socket 用量决定）。
+ */
+static __always_inline int consume_tokens(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+					  __u64 packet_len, __u64 reserve)
+{
+	int pps = conf->features & RULE_F_PPS;
+
+	if (b->state.tokens < packet_len + reserve)
+		return 0;
+	if (pps && b->ext.pkt_tokens < PKT_TOKEN_UNIT)
+		return 0;
+	b->state.tokens -= packet_len;
+	if (pps)
+		b->ext.pkt_tokens -= PKT_TOKEN_UNIT;
+	return 1;
+}
+
+/* 包速率桶已空：丢包由 --pps 造成，不按控制包放行（控制包额度不能绕过包速率上限） */
+static __always_inline int pkt_bucket_empty(struct rate_limit_config *conf, struct rate_limit_full_info *b)
+{
+	return (conf->features & RULE_F_PPS) && b->ext.pkt_tokens < PKT_TOKEN_UNIT;
+}
+
+/* police 模式：按时间差补充令牌，足够则扣减放行，否则丢弃 */
+static __always_inline int police_egress(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+					 __u64 now, __u64 packet_len, __u64 reserve)
+{
+	struct rate_limit_state *st = &b->state;
+	__u64 tokens;
+
+	/* 进入临界区：保护 tokens/last_update_ns 更新 */
+	bpf_spin_lock(&st->lock);
+	refill_tokens(conf, b, now);
+
+	/* 判断是否可放行并扣减（字节与包令牌） */
+	if (consume_tokens(conf, b, packet_len, reserve)) {
+		tokens = st->tokens;
+		bpf_spin_unlock(&st->lock);
+		dbg_printk("tokens=%llu len=%llu\n", tokens, packet_len);
+		return 1;
+	}
+	bpf_spin_unlock(&st->lock);
+	return 0;
+}
+
+/*
+ * ecn 模式：令牌检查同 police。用户态已把硬阈值的透支额度并入 bucket_size，
+ * 扣减后剩余令牌低于 ecn_mark（透支额度 + 软阈值）时，对 ECT 包标记 CE，
+ * 并返回 CN 让本机发送方立即降窗，比丢包后等待重传超时代价小得多。
+ */
+static __always_inline int ecn_egress(struct __sk_buff *skb, struct rate_limit_config *conf,
+				      struct rate_limit_full_info *b, __u64 now, __u64 packet_len,
+				      __u64 reserve)
+{
+	struct rate_limit_state *st = &b->state;
+	__u64 tokens;
+
+	bpf_spin_lock(&st->lock);
+	refill_tokens(conf, b, now);
+	if (!consume_tokens(conf, b, packet_len, reserve)) {
+		bpf_spin_unlock(&st->lock);
+		return 0;
+	}
+	tokens = st->tokens;
+	bpf_spin_unlock(&st->lock);
+
+	if (tokens >= conf->ecn_mark)
+		return 1;
+	bpf_skb_ecn_set_ce(skb);
+	return 1 | VERDICT_CN;
+}
+
+/*
+ * tcm 模式：先按同一时间差补充峰值桶与承诺桶，再按色盲 trTCM 着色。
+ * 红色不扣任何令牌；黄色只扣峰值桶；绿色两个桶都扣。
+ */
+static __always_inline int tcm_egress(struct __sk_buff *skb, struct rate_limit_config *conf,
+				      struct rate_limit_full_info *b, __u64 now, __u64 packet_len)
+{
+	struct rate_limit_state *st = &b->state;
+	struct rate_limit_state_ext *ext = &b->ext;
+	struct rate_limit_mode_cfg *mc;
+	__u64 time_delta_ns;
+
+	bpf_spin_lock(&st->lock);
+	time_delta_ns = now - st->last_update_ns;
+	if (time_delta_ns >= conf->peak_fill_ns) {
+		ext->peak_tokens = conf->peak_bucket;
+		ext->peak_frac = 0;
+	} else {
+		__u64 acc = time_delta_ns * conf->peak_mult + (ext->peak_frac & ((1ULL << conf->peak_shift) - 1));
+
+		ext->peak_tokens += acc >> conf->peak_shift;
+		ext->peak_frac = acc & ((1ULL << conf->peak_shift) - 1);
+		if (ext->peak_tokens >= conf->peak_bucket) {
+			ext->peak_tokens = conf->peak_bucket;
+			ext->peak_frac = 0;
+		}
+	}
+	refill_tokens(conf, b, now);
 
-	/* 判断是否可放行并扣减 */
+	if (ext->peak_tokens < packet_len) {
+		bpf_spin_unlock(&st->lock);
+		return 0;
+	}
+	ext->peak_tokens -= packet_len;
 	if (st->tokens >= packet_len) {
-		st->tokens -= packet_len;//消耗令牌
+		st->tokens -= packet_len;
+		bpf_spin_unlock(&st->lock);
+		return 1;
+	}
+	bpf_spin_unlock(&st->lock);
+
+	/* 黄色包才需要标记值，绿色包不查冷参数 */
+	mc = mode_cfg(conf);
+	if (mc)
+		skb->mark = mc->yellow_mark;
+	return 1 | VERDICT_MARK;
+}
+
+/* 时间窗是否覆盖当天第 sec 秒（wday 为星期几，0 为星期日） */
+static __always_inline int window_active(struct sched_window *w, __u32 sec, __u32 wday)
+{
+	if (w->start_sec < w->end_sec)
+		return (w->days & (1U << wday)) && sec >= w->start_sec && sec < w->end_sec;
+	/* 跨零点：零点之前的部分属于当天，之后的部分属于前一天 */
+	if (sec >= w->start_sec)
+		return !!(w->days & (1U << wday));
+	if (sec < w->end_sec)
+		return !!(w->days & (1U << ((wday + 6) % 7)));
+	return 0;
+}
+
+/*
+ * 分时速率：返回当前生效的配置（命中的时间窗的配置，或规则本身的配置）。
+ * 每隔 SCHED_RECHECK_NS 才按墙上时间重新选窗，其余包只读缓存的窗号，
+ * 时间窗切换的延迟因此不超过 1ms。缓存字段在锁外读写：几个 CPU 同时重新选窗
+ * 得到的结果相同，互相覆盖无妨。不内联，避免在祖先循环中展开多份。
+ */
+static __noinline struct rate_limit_config *sched_config(struct rate_limit_config *conf,
+							 struct rate_limit_full_info *b, __u64 now)
+{
+	struct rate_schedule *sched;
+	__u32 slot = conf->slot;
+	__u32 idx;
+
+	sched = bpf_map_lookup_elem(&rate_limit_sched_map, &slot);
+	if (!sched)
+		return conf;
+
+	if (now >= b->ext.sched_next_ns) {
+		struct limiter_clock *clk;
+		__u32 zero = 0;
+		__u64 wall, day;
+		__u32 sec, wday;
+		int i;
+
+		clk = bpf_map_lookup_elem(&limiter_clock_map, &zero);
+		wall = (__u64)((__s64)now + (clk ? clk->offset_ns : 0)) / 1000000000ULL;
+		day = wall / SCHED_DAY_SECS;
+		sec = wall - day * SCHED_DAY_SECS;
+		wday = (day + 4) % 7; /* 1970-01-01 为星期四 */
+
+		idx = 0;
+		for (i = 0; i < LIMIT_MAX_WINDOWS; i++) {
+			if (i >= sched->count)
+				break;
+			if (window_active(&sched->w[i], sec, wday)) {
+				idx = i + 1;
+				break;
+			}
+		}
+		b->state.sched_idx = idx;
+		b->ext.sched_next_ns = now + SCHED_RECHECK_NS;
+	} else {
+		idx = b->state.sched_idx;
+	}
+
+	/* 用户态缩短时间窗表后，旧的窗号可能越界 */
+	if (idx == 0 || idx > LIMIT_MAX_WINDOWS || idx > sched->count)
+		return conf;
+	return &sched->w[idx - 1].config;
+}
 
+/*
+ * 祖先规则的扣减：只做令牌检查，不走 pace/分片。祖先规则可能从未有包直接命中过，
+ * 因此在这里也负责首次初始化。
+ */
+static __always_inline int take_tokens(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+				       __u64 now, __u64 packet_len)
+{
+	struct rate_limit_state *st = &b->state;
+
+	bpf_spin_lock(&st->lock);
+	if (!st->last_update_ns) {
+		st->tokens = conf->bucket_size;
+		b->ext.pkt_tokens = conf->pkt_burst * PKT_TOKEN_UNIT;
+		st->frac = 0;
+		st->last_update_ns = now;
+	}
+	refill_tokens(conf, b, now);
+	if (!consume_tokens(conf, b, packet_len, 0)) {
 		bpf_spin_unlock(&st->lock);
-		bpf_printk("cgid=%llu  tokens=%llu len=%u \n", cgid,st->tokens, skb->len );
+		return 0;
+	}
+	bpf_spin_unlock(&st->lock);
+	return 1;
+}
+
+/* 撤销一个包的放行计数：包在后面的层被丢弃，已扣的令牌随之退还 */
+static __always_inline void uncount_pass(struct rate_limit_config *conf, __u64 packet_len)
+{
+	struct rate_limit_stats *stats = rule_stats(conf);
+
+	if (stats) {
+		stats->pass_pkts--;
+		stats->pass_bytes -= packet_len;
+	}
+}
+
+/* 退还一个包的字节与包令牌，不超过桶容量 */
+static __always_inline void refund_tokens(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+					  __u64 packet_len)
+{
+	struct rate_limit_state *st = &b->state;
+
+	bpf_spin_lock(&st->lock);
+	st->tokens += packet_len;
+	if (st->tokens > conf->bucket_size)
+		st->tokens = conf->bucket_size;
+	if (conf->features & RULE_F_PPS) {
+		b->ext.pkt_tokens += PKT_TOKEN_UNIT;
+		if (b->ext.pkt_tokens > conf->pkt_burst * PKT_TOKEN_UNIT)
+			b->ext.pkt_tokens = conf->pkt_burst * PKT_TOKEN_UNIT;
+	}
+	bpf_spin_unlock(&st->lock);
+}
+
+/* pace 模式的退还：时间轴往回拨一个包的间隔，回拨到 0 即整桶突发可用 */
+static __always_inline void refund_pace(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+					__u64 packet_len)
+{
+	__u64 delay_ns = pace_delay_ns(conf, packet_len);
+
+	bpf_spin_lock(&b->state.lock);
+	if (b->ext.next_tx_ns > delay_ns)
+		b->ext.next_tx_ns -= delay_ns;
+	else
+		b->ext.next_tx_ns = 0;
+	bpf_spin_unlock(&b->state.lock);
+}
+
+/* tcm 模式的退还：峰值桶总是扣过，绿色包（green 为 1）还扣过承诺桶 */
+static __always_inline void refund_tcm(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+				       __u64 packet_len, int green)
+{
+	struct rate_limit_state *st = &b->state;
+
+	bpf_spin_lock(&st->lock);
+	b->ext.peak_tokens += packet_len;
+	if (b->ext.peak_tokens > conf->peak_bucket)
+		b->ext.peak_tokens = conf->peak_bucket;
+	if (green) {
+		st->tokens += packet_len;
+		if (st->tokens > conf->bucket_size)
+			st->tokens = conf->bucket_size;
+	}
+	bpf_spin_unlock(&st->lock);
+}
+
+/*
+ * 退还 mask 所标记祖先上已扣减的令牌，并撤销其放行计数。
+ * 只在丢包路径上执行，重新查找一次 map 即可，不必在栈上保存指针。
+ */
+static __always_inline void refund_ancestors(struct __sk_buff *skb, int ingress, __u32 mask,
+					     int from_task, __u64 packet_len)
+{
+	int i;
+
+#pragma unroll
+	for (i = 1; i <= LIMIT_MAX_NEST_LEVEL; i++) {
+		struct rate_limit_full_info *anc;
+		__u64 id;
+
+		if (!(mask & (1U << i)))
+			continue;
+		id = get_ancestor_cgroup_id(skb, i, from_task);
+		anc = lookup_rule(id, ingress);
+		if (!anc || anc->config.mode == LIMIT_MODE_PACE || anc->config.mode == LIMIT_MODE_SHAPE)
+			continue;
+
+		refund_tokens(&anc->config, anc, packet_len);
+		uncount_pass(&anc->config, packet_len);
+	}
+}
+
+/*
+ * 依次扣减各祖先规则，全部成功返回 1。某层不足时记一次丢弃，
+ * 退还更浅层级上已扣的令牌后返回 0；该层的包速率桶已空时 *pps_drop 置 1。
+ * pace 模式的祖先不参与层级扣减。
+ */
+static __always_inline int charge_ancestors(struct __sk_buff *skb, int ingress, __u32 mask,
+					    int from_task, __u64 now, __u64 packet_len, int *pps_drop)
+{
+	int i;
+
+#pragma unroll
+	for (i = 1; i <= LIMIT_MAX_NEST_LEVEL; i++) {
+		struct rate_limit_full_info *anc;
+		struct rate_limit_config *ac;
+		__u64 id;
+
+		if (!(mask & (1U << i)))
+			continue;
+		id = get_ancestor_cgroup_id(skb, i, from_task);
+		anc = lookup_rule(id, ingress);
+		if (!anc || anc->config.mode == LIMIT_MODE_PACE || anc->config.mode == LIMIT_MODE_SHAPE)
+			continue;
+
+		ac = &anc->config;
+		if (ac->features & RULE_F_SCHED)
+			ac = sched_config(ac, anc, now);
+		if (!take_tokens(ac, anc, now, packet_len)) {
+			*pps_drop = pkt_bucket_empty(ac, anc);
+			count_verdict(&anc->config, 0, packet_len);
+			refund_ancestors(skb, ingress, mask & ((1U << i) - 1), from_task, packet_len);
+			return 0;
+		}
+		count_verdict(&anc->config, 1, packet_len);
+	}
+	return 1;
+}
+
+/*
+ * 解析出方向包的目的地址、协议与目的端口，在规则的分类表中查找第一个匹配的分类。
+ * 按网络层头部的相对偏移读取，cgroup_skb 与 tc 程序通用；非首分片没有端口，只按地址与协议匹配。
+ */
+static __always_inline int classify_egress(struct __sk_buff *skb, __u64 cgid, struct class_match *out)
+{
+	struct class_lpm_key key = {};
+	struct class_set *set;
+	__u32 l4_off = 0;
+	__u16 dport = 0;
+	__u8 proto;
+	int i;
+
+	if (skb->protocol == bpf_htons(ETH_P_IP)) {
+		struct iphdr iph;
+
+		if (bpf_skb_load_bytes_relative(skb, 0, &iph, sizeof(iph), BPF_HDR_START_NET))
+			return 0;
+		proto = iph.protocol;
+		key.addr[10] = 0xff;
+		key.addr[11] = 0xff;
+		__builtin_memcpy(&key.addr[12], &iph.daddr, 4);
+		if (!(iph.frag_off & bpf_htons(0x1fff)))
+			l4_off = iph.ihl * 4;
+	} else if (skb->protocol == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr ip6h;
+
+		if (bpf_skb_load_bytes_relative(skb, 0, &ip6h, sizeof(ip6h), BPF_HDR_START_NET))
+			return 0;
+		proto = ip6h.nexthdr;
+		__builtin_memcpy(key.addr, &ip6h.daddr, 16);
+		l4_off = sizeof(ip6h);
+	} else {
+		return 0;
+	}
+
+	if (l4_off && (proto == IPPROTO_TCP || proto == IPPROTO_UDP)) {
+		__be16 ports[2];
+
+		if (bpf_skb_load_bytes_relative(skb, l4_off, ports, sizeof(ports), BPF_HDR_START_NET) == 0)
+			dport = bpf_ntohs(ports[1]);
+	}
+
+	key.prefixlen = CLASS_KEY_CGID_BITS + 128;
+	key.cgid_hi = cgid >> 32;
+	key.cgid_lo = (__u32)cgid;
+	set = bpf_map_lookup_elem(&rate_limit_class_lpm, &key);
+	if (!set)
+		return 0;
+
+#pragma unroll
+	for (i = 0; i < LIMIT_MAX_CLASSES; i++) {
+		struct class_match *m = &set->m[i];
+
+		if (i >= set->count)
+			break;
+		if (m->proto && m->proto != proto)
+			continue;
+		if (m->port_hi && (dport < m->port_lo || dport > m->port_hi))
+			continue;
+		*out = *m;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * 公平分享：取该包所属 socket 的用量记录，并按窗口衰减（每过一个窗口减半，
+ * 超过两个窗口清零）。没有完整 socket 的包不参与，按零用量处理。
+ */
+static __always_inline struct sock_usage *sock_usage_get(struct __sk_buff *skb,
+							 struct rate_limit_config *conf, __u64 now)
+{
+	struct bpf_sock *sk = skb->sk;
+	struct rate_limit_mode_cfg *mc;
+	struct sock_usage *u;
+	__u64 elapsed;
+
+	if (!sk)
+		return NULL;
+	mc = mode_cfg(conf);
+	if (!mc)
+		return NULL;
+	sk = bpf_sk_fullsock(sk);
+	if (!sk)
+		return NULL;
+	u = bpf_sk_storage_get(&sock_usage_map, sk, 0, BPF_SK_STORAGE_GET_F_CREATE);
+	if (!u)
+		return NULL;
+
+	elapsed = now - u->window_start;
+	if (elapsed >= mc->fair_window_ns) {
+		u->bytes = elapsed >= 2 * mc->fair_window_ns ? 0 : u->bytes >> 1;
+		u->window_start = now;
+	}
+	return u;
+}
+
+/*
+ * 分片模式：先扣本地额度，不足时才加锁从共享桶领取最多 shard_batch 字节。
+ * 共享桶发放的令牌总量不变，误差只来自滞留在各 CPU 上的额度（上限 ncpu * shard_batch）。
+ * 同一 CPU 上软中断可能打断进程上下文，本地额度的更新因此不是严格原子的，
+ * 偶发的丢失更新同样落在上述误差范围内。
+ */
+static __always_inline int sharded_egress(struct rate_limit_config *conf, struct rate_limit_full_info *b,
+					  __u64 now, __u64 packet_len)
+{
+	struct rate_limit_state *st = &b->state;
+	__u32 slot = conf->slot;
+	struct rate_limit_pcpu *pc = bpf_map_lookup_elem(&rate_limit_pcpu_map, &slot);
+	__u64 local, need, grant;
+
+	if (!pc)
+		return police_egress(conf, b, now, packet_len, 0);
+
+	local = pc->tokens;
+	if (local >= packet_len) {
+		pc->tokens = local - packet_len;
 		return 1;
 	}
+
+	need = packet_len - local;
+	grant = conf->shard_batch > need ? conf->shard_batch : need;
+
+	bpf_spin_lock(&st->lock);
+	refill_tokens(conf, b, now);
+	if (st->tokens < need) {
+		bpf_spin_unlock(&st->lock);
+		return 0;
+	}
+	if (grant > st->tokens)
+		grant = st->tokens;
+	st->tokens -= grant;
 	bpf_spin_unlock(&st->lock);
+
+	pc->tokens = local + grant - packet_len;
+	return 1;
+}
+
+/* 分片模式的退还：令牌退回本 CPU 的本地额度，与扣减时取自同一处，共享桶的发放总量不变 */
+static __always_inline void refund_shard(struct rate_limit_config *conf, __u64 packet_len)
+{
+	__u32 slot = conf->slot;
+	struct rate_limit_pcpu *pc = bpf_map_lookup_elem(&rate_limit_pcpu_map, &slot);
+
+	if (pc)
+		pc->tokens += packet_len;
+}
+
+/*
+ * 本机流量：出方向看目的地址，入方向看源地址。回环地址 (127.0.0.0/8、::1) 直接判断，
+ * 其余在本机地址表中精确查找。只在包所属的 cgroup 或进程有规则时调用。
+ */
+static __always_inline int local_traffic(struct __sk_buff *skb, int ingress)
+{
+	struct local_addr_key key = {};
+	struct local_bypass *lb;
+	__u32 zero = 0;
+
+	lb = bpf_map_lookup_elem(&rate_limit_local_cfg, &zero);
+	if (!lb || !lb->enabled)
+		return 0;
+
+	if (skb->protocol == bpf_htons(ETH_P_IP)) {
+		/* saddr/daddr 在 IPv4 头部的偏移 */
+		if (bpf_skb_load_bytes(skb, ingress ? 12 : 16, &key.addr[12], 4))
+			return 0;
+		if (key.addr[12] == 127)
+			return 1;
+		key.addr[10] = 0xff;
+		key.addr[11] = 0xff;
+	} else if (skb->protocol == bpf_htons(ETH_P_IPV6)) {
+		__u32 *w = (__u32 *)key.addr;
+
+		/* saddr/daddr 在 IPv6 头部的偏移 */
+		if (bpf_skb_load_bytes(skb, ingress ? 8 : 24, key.addr, 16))
+			return 0;
+		if (!(w[0] | w[1] | w[2]) && w[3] == bpf_htonl(1))
+			return 1;
+	} else {
+		return 0;
+	}
+
+	if (!lb->addr_count)
+		return 0;
+	return bpf_map_lookup_elem(&rate_limit_local_addrs, &key) != NULL;
+}
+
+/*
+ * 控制包：只看 TCP。不超过 max_len 的 TCP 包直接算，更长的包看标志位，SYN/FIN/RST
+ * 或没有负载的纯 ACK 才算；UDP 等其他协议的小包不算，免得小包洪泛借额度绕过限速。
+ * GSO 大包（gso_segs > 1）一律不算：它总带着数据，BIG TCP 的大包长度字段还为 0。
+ * 只在包将被丢弃时调用，放行的包不付出解析头部的开销。
+ */
+static __always_inline int ctrl_packet(struct __sk_buff *skb, struct ctrl_pass *cp)
+{
+	__u32 l4_off, l4_len;
+	__u8 tcp[2]; /* TCP 头部第 12、13 字节：数据偏移与标志位 */
+
+	if (skb->gso_segs > 1)
+		return 0;
+	if (skb->protocol == bpf_htons(ETH_P_IP)) {
+		struct iphdr iph;
+
+		if (bpf_skb_load_bytes_relative(skb, 0, &iph, sizeof(iph), BPF_HDR_START_NET))
+			return 0;
+		if (iph.protocol != IPPROTO_TCP || (iph.frag_off & bpf_htons(0x1fff)))
+			return 0;
+		l4_off = iph.ihl * 4;
+		if (bpf_ntohs(iph.tot_len) < l4_off)
+			return 0;
+		l4_len = bpf_ntohs(iph.tot_len) - l4_off;
+	} else if (skb->protocol == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr ip6h;
+
+		if (bpf_skb_load_bytes_relative(skb, 0, &ip6h, sizeof(ip6h), BPF_HDR_START_NET))
+			return 0;
+		if (ip6h.nexthdr != IPPROTO_TCP)
+			return 0;
+		/* payload_len 为 0 是 jumbogram（BIG TCP），长度不可信 */
+		if (!ip6h.payload_len)
+			return 0;
+		l4_off = sizeof(ip6h);
+		l4_len = bpf_ntohs(ip6h.payload_len);
+	} else {
+		return 0;
+	}
+
+	if (skb->len <= cp->max_len)
+		return 1;
+
+	if (bpf_skb_load_bytes_relative(skb, l4_off + 12, tcp, sizeof(tcp), BPF_HDR_START_NET))
+		return 0;
+	if (tcp[1] & (TCPHDR_FIN | TCPHDR_SYN | TCPHDR_RST))
+		return 1;
+	/* 纯 ACK：按 IP 头部的长度字段，TCP 头部之后没有负载 */
+	return (tcp[1] & TCPHDR_ACK) && l4_len <= (__u32)(tcp[0] >> 4) * 4;
+}
+
+/*
+ * 桶不足时的控制包额度：info 为规则本身（不是网卡桶或分类子桶），额度与令牌一样在
+ * 规则的锁内补充与扣减，整条规则每秒最多放行 pps 个控制包，与 CPU 数无关。
+ */
+static __always_inline int ctrl_allow(struct __sk_buff *skb, struct rate_limit_full_info *info, __u64 now)
+{
+	struct rate_limit_state_ext *ext = &info->ext;
+	struct ctrl_pass *cp;
+	__u32 zero = 0;
+	__u64 cap, delta;
+	int ok = 0;
+
+	cp = bpf_map_lookup_elem(&rate_limit_ctrl_cfg, &zero);
+	if (!cp || !cp->enabled || !cp->pps)
+		return 0;
+	if (!ctrl_packet(skb, cp))
+		return 0;
+
+	/* 每秒补充 pps 个包、最多积攒 pps 个：空闲满一秒直接装满，不足一秒时乘积不会溢出 */
+	cap = cp->pps * PKT_TOKEN_UNIT;
+	bpf_spin_lock(&info->state.lock);
+	delta = now - ext->ctrl_last_ns;
+	if (delta >= 1000000000ULL)
+		ext->ctrl_tokens = cap;
+	else if (ext->ctrl_tokens + delta * cp->pps < cap)
+		ext->ctrl_tokens += delta * cp->pps;
+	else
+		ext->ctrl_tokens = cap;
+	ext->ctrl_last_ns = now;
+	if (ext->ctrl_tokens >= PKT_TOKEN_UNIT) {
+		ext->ctrl_tokens -= PKT_TOKEN_UNIT;
+		ok = 1;
+	}
+	bpf_spin_unlock(&info->state.lock);
+	if (!ok)
+		return 0;
+
+	struct rate_limit_stats *stats = rule_stats(&info->config);
+	if (stats)
+		stats->ctrl_pkts++;
+	return 1;
+}
+
+/*
+ * 整机总限速：未启用时只有一次数组查找。默认以分片方式扣减，各 CPU 先用本地额度，
+ * 不足时才去抢共享桶的锁，众核机器上不会所有包都争同一把锁。
+ * 共享桶的 last_update_ns 为 0 时补充逻辑直接装满，不需要单独初始化。
+ */
+static __always_inline int host_cap_egress(__u64 now, __u64 packet_len)
+{
+	struct rate_limit_full_info *host;
+	__u32 zero = 0;
+	int verdict;
+
+	host = bpf_map_lookup_elem(&rate_limit_host_map, &zero);
+	if (!host || !host->config.bucket_size)
+		return 1;
+
+	if (host->config.features & RULE_F_SHARD)
+		verdict = sharded_egress(&host->config, host, now, packet_len);
+	else
+		verdict = police_egress(&host->config, host, now, packet_len, 0);
+	count_verdict(&host->config, verdict, packet_len);
+	return verdict;
+}
+
+/* 撤销 host_cap_egress 对一个已放行包的扣减 */
+static __always_inline void refund_host_cap(__u64 packet_len)
+{
+	struct rate_limit_full_info *host;
+	__u32 zero = 0;
+
+	host = bpf_map_lookup_elem(&rate_limit_host_map, &zero);
+	if (!host || !host->config.bucket_size)
+		return;
+
+	if (host->config.features & RULE_F_SHARD)
+		refund_shard(&host->config, packet_len);
+	else
+		refund_tokens(&host->config, host, packet_len);
+	uncount_pass(&host->config, packet_len);
+}
+
+static __always_inline int pid_rules_present(void)
+{
+	__u32 zero = 0;
+	__u32 *cnt = bpf_map_lookup_elem(&rate_limit_pid_count, &zero);
+
+	return cnt && *cnt;
+}
+
+/*
+ * 包所属进程：优先取 socket 创建时记录的 tgid。程序加载或规则设置之前创建的 socket
+ * 没有记录，退回当前任务的 tgid，只在进程自己发送（进程上下文）时才准确。
+ */
+static __always_inline __u32 skb_owner_tgid(struct __sk_buff *skb)
+{
+	struct bpf_sock *sk = skb->sk;
+
+	if (sk) {
+		sk = bpf_sk_fullsock(sk);
+		if (sk) {
+			struct sock_owner *o = bpf_sk_storage_get(&sock_owner_map, sk, 0, 0);
+
+			if (o)
+				return o->tgid;
+		}
+	}
+	return bpf_get_current_pid_tgid() >> 32;
+}
+
+/* pid_limit_egress 的返回值 */
+#define PID_VERDICT_DROP    0 /* 进程规则不足，丢弃 */
+#define PID_VERDICT_NO_RULE 1 /* 没有进程规则 */
+#define PID_VERDICT_PASS    2 /* 进程规则放行，整机的桶已扣过（或按控制包额度放行），cgroup 规则不再扣 */
+
+/*
+ * 原地进程规则：只做 police（含包速率），放行后再扣整机的桶，任一不足即丢弃。
+ * 放行后包仍要经过 cgroup 规则；两个桶都扣过令牌时 *charged 指向进程规则，
+ * 包被 cgroup 规则丢弃时由调用方退还（按控制包额度放行的包没有扣令牌，不退还）。
+ */
+static __always_inline int pid_limit_egress(struct __sk_buff *skb, struct rate_limit_full_info **charged)
+{
+	struct rate_limit_full_info *info;
+	__u64 packet_len = skb->len, now;
+	__u32 tgid;
+	int verdict;
+
+	if (!pid_rules_present())
+		return PID_VERDICT_NO_RULE;
+	tgid = skb_owner_tgid(skb);
+	info = bpf_map_lookup_elem(&rate_limit_pid_map, &tgid);
+	if (!info || local_traffic(skb, 0))
+		return PID_VERDICT_NO_RULE;
+
+	now = bpf_ktime_get_ns();
+	verdict = take_tokens(&info->config, info, now, packet_len);
+	if (!verdict) {
+		/* 包速率桶已空时照常丢弃 */
+		if (!pkt_bucket_empty(&info->config, info))
+			verdict = ctrl_allow(skb, info, now);
+	} else if (!host_cap_egress(now, packet_len)) {
+		refund_tokens(&info->config, info, packet_len);
+		verdict = ctrl_allow(skb, info, now);
+	} else {
+		*charged = info;
+	}
+	count_verdict(&info->config, verdict, packet_len);
+	return verdict ? PID_VERDICT_PASS : PID_VERDICT_DROP;
+}
+
+/*
+ * 按规则 cgid 对包计费，cgroup 钩子与 tc 程序共用，ingress 区分出/入方向的规则表。
+ * 入方向的规则由用户态固定写为 police 模式（接收路径无法延迟发送）。
+ * tc 为 1 时包没有本机 socket：不查祖先规则（祖先层级由 socket 的 cgroup 决定）、
+ * 不做公平分享，ecn 模式按 police 处理（标记 CE 的辅助函数只能用于 cgroup_skb）。
+ * tc 总是常量，内联后无关的分支在编译时裁剪。host_charged 为 1 时包已由进程规则扣过整机的桶。
+ */
+static __always_inline int rate_limit_rule(struct __sk_buff *skb, __u64 cgid, int ingress,
+					   int from_task, int tc, int host_charged)
+{
+	struct rate_limit_full_info *info, *b;
+	struct rate_limit_config *conf, *rc;
+	struct rate_limit_state *st;
+	__u64 now, packet_len;
+	int verdict;
+
+	/* 当前时间 (ns) 与该包长度 */
+	now = bpf_ktime_get_ns();
+	packet_len = skb->len;
+
+	dbg_printk("cgid=%llu len=%u ingress=%d\n", cgid, skb->len, ingress);
+	info = lookup_rule(cgid, ingress);
+	if (!info) {
+		/* 未配置限速则放行 */
+		return 1;
+	}
+	conf = &info->config;
+	b = info;
+
+	/*
+	 * shape 模式：这里只做分类，把规则的 HTB 类写进 skb->priority，排队与整形交给网卡上的 qdisc，
+	 * 令牌桶、流量分类、网卡桶、时间窗与整机限速都不参与。入方向的 shape 规则在用户态已换成 police。
+	 */
+	if (!ingress && conf->mode == LIMIT_MODE_SHAPE) {
+		if (conf->slot <= SHAPE_MAX_SLOT)
+			skb->priority = (SHAPE_HTB_MAJOR << 16) | (SHAPE_MINOR_BASE + conf->slot);
+		count_verdict(conf, 1, packet_len);
+		return 1;
+	}
+
+	/*
+	 * 按出口网卡区分的桶：命中时换用该网卡的配置与状态，不再按时间窗切换；
+	 * cgroup 出方向钩子运行时出口设备已经选定，skb->ifindex 即出口网卡。
+	 */
+	rc = conf;
+	if (!ingress && (conf->features & RULE_F_DEVS)) {
+		struct dev_bucket_key dk = { .cgid = cgid, .ifindex = skb->ifindex };
+		struct rate_limit_full_info *dev = bpf_map_lookup_elem(&rate_limit_dev_map, &dk);
+
+		if (dev) {
+			rc = &dev->config;
+			b = dev;
+		}
+	}
+
+	/* 分时速率：令牌桶按当前时间窗的参数补充与扣减，分类、祖先与计数仍归属规则本身 */
+	if (rc == conf && (conf->features & RULE_F_SCHED))
+		rc = sched_config(conf, b, now);
+
+	st = &b->state;
+	if (!st->last_update_ns) {
+		/* 首次状态初始化（用户态新写入的规则）：装满令牌并放行当前包 */
+		int init = 0;
+		bpf_spin_lock(&st->lock);
+		if (!st->last_update_ns) {
+			st->tokens = rc->bucket_size; /* 或 0，视业务取舍 */
+			st->frac = 0;
+			b->ext.pkt_tokens = rc->pkt_burst * PKT_TOKEN_UNIT;
+			b->ext.peak_tokens = rc->peak_bucket;
+			b->ext.peak_frac = 0;
+			b->ext.next_tx_ns = 0;
+			st->last_update_ns = now;
+			init = 1;
+		}
+		bpf_spin_unlock(&st->lock);
+		if (init) {
+			struct rate_limit_stats *stats = rule_stats(conf);
+			if (stats)
+				stats->state_init++;
+			dbg_printk("cgid=%llu no state found,pass\n", cgid);
+			return 1;
+		}
+	}
+
+	/* 流量分类：命中 bypass 的包不扣本规则的桶，命中限速分类的包改扣分类子桶 */
+	struct rate_limit_full_info *sub = NULL;
+	int bypass = 0;
+	if (!ingress && (conf->features & RULE_F_CLASSES)) {
+		struct class_match m;
+
+		if (classify_egress(skb, cgid, &m)) {
+			if (m.action == CLASS_ACTION_BYPASS) {
+				bypass = 1;
+			} else {
+				struct class_bucket_key bk = { .cgid = cgid, .id = m.id };
+				sub = bpf_map_lookup_elem(&rate_limit_class_map, &bk);
+			}
+		}
+	}
+
+	/* 嵌套规则：先扣各层祖先，任一层不足直接丢弃（控制包改用额度放行，包速率桶已空的除外） */
+	int pps_drop = 0;
+	if (!tc && (conf->features & RULE_F_ANCESTORS) &&
+	    !charge_ancestors(skb, ingress, conf->ancestor_mask, from_task, now, packet_len, &pps_drop)) {
+		verdict = pps_drop ? 0 : ctrl_allow(skb, info, now);
+		count_verdict(conf, verdict, packet_len);
+		return verdict;
+	}
+
+	/*
+	 * 公平分享：放行后桶里至少要剩下该 socket 的近期用量（封顶 fair_reserve）。
+	 * 桶充裕时所有连接都不受影响；桶紧张时近期用量大的连接先碰到门槛，
+	 * 轻量连接仍可用到保留的那部分令牌，总速率依旧受桶限制。
+	 */
+	struct sock_usage *usage = NULL;
+	__u64 reserve = 0;
+	if (!tc && (rc->features & RULE_F_FAIR) && !bypass && !sub) {
+		usage = sock_usage_get(skb, rc, now);
+		if (usage)
+			reserve = usage->bytes < rc->fair_reserve ? usage->bytes : rc->fair_reserve;
+	}
+
+	if (bypass)
+		verdict = 1;
+	else if (sub)
+		verdict = take_tokens(&sub->config, sub, now, packet_len);
+	else if (!ingress && rc->mode == LIMIT_MODE_PACE)
+		verdict = pace_egress(skb, rc, b, now, packet_len);
+	else if (!tc && !ingress && rc->mode == LIMIT_MODE_ECN)
+		verdict = ecn_egress(skb, rc, b, now, packet_len, reserve);
+	else if (!ingress && rc->mode == LIMIT_MODE_TCM)
+		verdict = tcm_egress(skb, rc, b, now, packet_len);
+	else if (rc->features & RULE_F_SHARD)
+		verdict = sharded_egress(rc, b, now, packet_len);
+	else
+		verdict = police_egress(rc, b, now, packet_len, reserve);
+
+	/*
+	 * 整机总限速（只限出方向）：本规则放行之后再扣整机的桶。整机桶不足时退还本规则
+	 * 与祖先已扣的令牌：分片模式退回本 CPU 的本地额度，pace 模式回拨时间轴，
+	 * tcm 模式按包的颜色退还峰值桶与承诺桶。
+	 */
+	int host_drop = 0;
+	if (verdict && !ingress && !host_charged && !host_cap_egress(now, packet_len)) {
+		if (sub)
+			refund_tokens(&sub->config, sub, packet_len);
+		else if (!bypass && rc->mode == LIMIT_MODE_PACE)
+			refund_pace(rc, b, packet_len);
+		else if (!bypass && rc->mode == LIMIT_MODE_TCM)
+			refund_tcm(rc, b, packet_len, !(verdict & VERDICT_MARK));
+		else if (!bypass && (rc->features & RULE_F_SHARD))
+			refund_shard(rc, packet_len);
+		else if (!bypass)
+			refund_tokens(rc, b, packet_len);
+		verdict = 0;
+		host_drop = 1;
+	}
+
+	if (usage && verdict)
+		usage->bytes += packet_len;
+
+	/*
+	 * 本层或整机不足：祖先已扣的令牌退还；控制包改用额度放行，不扣任何一层的桶。
+	 * 本层（或分类子桶）的包速率桶已空时照常丢弃，控制包额度不能绕过 --pps。
+	 */
+	if (!verdict) {
+		if (!tc && (conf->features & RULE_F_ANCESTORS))
+			refund_ancestors(skb, ingress, conf->ancestor_mask, from_task, packet_len);
+		if (host_drop || !(sub ? pkt_bucket_empty(&sub->config, sub) : pkt_bucket_empty(rc, b)))
+			verdict = ctrl_allow(skb, info, now);
+	}
+
+	count_verdict(conf, verdict, packet_len);
+	return verdict & ~VERDICT_MARK;
+}
+
+/* cgroup 钩子：以 socket 所属 cgroup_id 作为限速维度；host_charged 见 rate_limit_rule */
+static __always_inline int rate_limit_skb(struct __sk_buff *skb, int ingress, int host_charged)
+{
+	int from_task;
+	__u64 cgid = get_cgroup_id_from_skb(skb, ingress, &from_task);
+
+	/* 快速路径：没有规则的 cgroup（主机上的绝大多数流量）查一位即放行 */
+	if (!rule_filter_match(cgid))
+		return 1;
+
+	/* 本机流量（如 sidecar 经回环访问本机服务）不计费，也不碰桶的锁 */
+	if (local_traffic(skb, ingress))
+		return 1;
+
+	return rate_limit_rule(skb, cgid, ingress, from_task, 0, host_charged);
+}
+
+/*
+ * tc 模式：按 fwmark、入口网卡、源地址前缀的顺序找到规则的 cgroup_id，没有匹配项返回 0。
+ * 入口网卡取 skb->ingress_ifindex，即转发流量进入本机时经过的 veth/tap。
+ */
+static __always_inline __u64 tc_match_rule(struct __sk_buff *skb)
+{
+	struct tc_match_cfg *cfg;
+	__u32 zero = 0;
+	__u64 *cgid;
+
+	cfg = bpf_map_lookup_elem(&rate_limit_tc_cfg, &zero);
+	if (!cfg || !cfg->types)
+		return 0;
+
+	if ((cfg->types & (1U << TC_MATCH_MARK)) && skb->mark) {
+		struct tc_match_key k = { .type = TC_MATCH_MARK, .value = skb->mark };
+
+		cgid = bpf_map_lookup_elem(&rate_limit_tc_match, &k);
+		if (cgid)
+			return *cgid;
+	}
+	if ((cfg->types & (1U << TC_MATCH_IIF)) && skb->ingress_ifindex) {
+		struct tc_match_key k = { .type = TC_MATCH_IIF, .value = skb->ingress_ifindex };
+
+		cgid = bpf_map_lookup_elem(&rate_limit_tc_match, &k);
+		if (cgid)
+			return *cgid;
+	}
+	if (cfg->types & (1U << TC_MATCH_SRC)) {
+		struct tc_src_key k = { .prefixlen = 128 };
+
+		if (skb->protocol == bpf_htons(ETH_P_IP)) {
+			/* saddr 在 IPv4 头部的偏移 */
+			if (bpf_skb_load_bytes_relative(skb, 12, &k.addr[12], 4, BPF_HDR_START_NET))
+				return 0;
+			k.addr[10] = 0xff;
+			k.addr[11] = 0xff;
+		} else if (skb->protocol == bpf_htons(ETH_P_IPV6)) {
+			/* saddr 在 IPv6 头部的偏移 */
+			if (bpf_skb_load_bytes_relative(skb, 8, k.addr, 16, BPF_HDR_START_NET))
+				return 0;
+		} else {
+			return 0;
+		}
+		cgid = bpf_map_lookup_elem(&rate_limit_tc_src, &k);
+		if (cgid)
+			return *cgid;
+	}
 	return 0;
 }
 
+SEC("cgroup_skb/egress")
+int limit_egress(struct __sk_buff *skb)
+{
+	struct rate_limit_full_info *pid_info = NULL;
+	int pid_verdict = pid_limit_egress(skb, &pid_info);
+	int verdict;
+
+	if (pid_verdict == PID_VERDICT_DROP) {
+		dbg_printk("pid rule drop len=%u\n", skb->len);
+		return 0;
+	}
+	verdict = rate_limit_skb(skb, 0, pid_verdict == PID_VERDICT_PASS);
+
+	/* 进程规则放行、cgroup 规则丢弃：退还进程规则与整机已扣的令牌 */
+	if (!verdict && pid_info) {
+		refund_tokens(&pid_info->config, pid_info, skb->len);
+		uncount_pass(&pid_info->config, skb->len);
+		refund_host_cap(skb->len);
+	}
+	return verdict;
+}
+
+SEC("cgroup_skb/ingress")
+int limit_ingress(struct __sk_buff *skb)
+{
+	return rate_limit_skb(skb, 1, 0);
+}
+
+/*
+ * 挂在网卡 tcx 出方向，只处理没有在 cgroup 钩子上计过费的包：所属 socket 的 cgroup
+ * 已有规则的本机流量直接交给后续程序，避免同一个包扣两次令牌。
+ */
+SEC("tc")
+int limit_tc(struct __sk_buff *skb)
+{
+	__u64 sk_cgid = bpf_skb_cgroup_id(skb);
+	__u64 cgid;
+
+	if (sk_cgid && rule_filter_match(sk_cgid) && lookup_rule(sk_cgid, 0))
+		return TC_ACT_UNSPEC;
+
+	cgid = tc_match_rule(skb);
+	if (!cgid || !rule_filter_match(cgid))
+		return TC_ACT_UNSPEC;
+
+	return rate_limit_rule(skb, cgid, 0, 0, 1, 0) ? TC_ACT_UNSPEC : TC_ACT_SHOT;
+}
+
+/*
+ * 记录 socket 的创建进程。sock_create 运行在调用 socket() 的进程上下文中，
+ * 此时的 tgid 才可靠。没有原地进程规则时不分配存储。
+ */
+SEC("cgroup/sock_create")
+int tag_sock_owner(struct bpf_sock *sk)
+{
+	struct sock_owner *o;
+
+	if (!pid_rules_present())
+		return 1;
+	o = bpf_sk_storage_get(&sock_owner_map, sk, 0, BPF_SK_STORAGE_GET_F_CREATE);
+	if (o)
+		o->tgid = bpf_get_current_pid_tgid() >> 32;
+	return 1;
+}
+
 char _license[] SEC("license") = "GPL";
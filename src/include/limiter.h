@@ -6,6 +6,7 @@ typedef unsigned char __u8;
 typedef unsigned short __u16;
 typedef unsigned int __u32;
 typedef unsigned long long __u64;
+typedef long long __s64;
 /*
 令牌桶原理：
 桶 (Bucket)：一个容器，用于存放“令牌”。
@@ -19,24 +20,352 @@ typedef unsigned long long __u64;
 不足令牌：如果没有，数据包会被延迟或丢弃，直到有足够的令牌被加入桶中。这起到了限速的作用。
 */
 
+/* 限速模式 */
+#define LIMIT_MODE_POLICE 0  /* 令牌不足直接丢包 */
+#define LIMIT_MODE_PACE   1  /* 计算最早发送时间(EDT)写入 skb->tstamp，由 fq 延迟发送 */
+#define LIMIT_MODE_ECN    2  /* 同 police，但令牌低于软阈值时标记 CE 并返回 CN，耗尽后才丢包 */
+#define LIMIT_MODE_TCM    3  /* 双速率三色标记 (trTCM)：绿色放行，黄色放行并打标记，红色丢弃 */
+#define LIMIT_MODE_SHAPE  4  /* 只分类不丢包：把规则对应的 HTB 类写入 skb->priority，由网卡上的 qdisc 排队整形 */
+
+/*
+ * tcm 模式黄色包的 skb->mark：高 24 位为固定前缀，低 6 位为要改写成的 DSCP。
+ * cgroup_skb 不能改写包内容，由出口网卡上的 tc 规则按该标记改写 DSCP。
+ */
+#define TCM_YELLOW_MARK_BASE 0x4c544300U
+#define TCM_YELLOW_MARK_MASK 0xffffff00U
+#define TCM_DEFAULT_YELLOW_DSCP 8  /* CS1（低优先级） */
+
+/*
+ * shape 模式：用户态在整形网卡上装 HTB 根 qdisc 51:，未限速的流量走默认类 51:1，
+ * 规则按槽位占用 51:(SHAPE_MINOR_BASE + slot)；classid 的次号只有 16 位，槽位超过 SHAPE_MAX_SLOT 的规则不能用 shape。
+ */
+#define SHAPE_HTB_MAJOR     0x51
+#define SHAPE_DEFAULT_MINOR 0x1
+#define SHAPE_MINOR_BASE    0x10
+#define SHAPE_MAX_SLOT      (0xffffU - SHAPE_MINOR_BASE)
+
+/* pace 模式默认视界：排队时延超过该值的包仍然丢弃 */
+#define DEFAULT_PACE_HORIZON_NS 2000000000ULL
+
+/* 包令牌的计量单位：1 个包 = PKT_TOKEN_UNIT 个包令牌，补充时只需乘法 (delta_ns * pps) */
+#define PKT_TOKEN_UNIT 1000000000ULL
+
+/*
+ * 定点补充：tokens += (delta_ns * refill_mult) >> refill_shift，其中
+ * refill_mult ≈ rate_bps * 2^refill_shift / 1e9，由用户态计算，数据路径上没有除法。
+ * refill_shift 不超过 REFILL_MAX_SHIFT，并保证 fill_ns * refill_mult 不溢出 64 位。
+ */
+#define REFILL_MAX_SHIFT 40
+
+/* pace 模式：每字节耗时 ns_mult = 1e9 * 2^PACE_NS_SHIFT / rate_bps */
+#define PACE_NS_SHIFT 20
+
+/* 层级限速：可同时扣减的祖先规则所在的最大 cgroup 层级（根为 0 层） */
+#define LIMIT_MAX_NEST_LEVEL 8
+
+/*
+ * 规则容量：hash 规则表与按槽位索引的每 CPU 数组的默认条目数，
+ * 加载时可用 bpf_map__set_max_entries 调整，上限防止每 CPU 数组占用过多内存。
+ */
+#define LIMIT_DEFAULT_MAX_RULES 4096
+#define LIMIT_MAX_RULES_LIMIT   (1U << 20)
+
+/*
+ * 流量分类（仅出方向）：按目的前缀 + 协议 + 目的端口范围把规则内的流量分开，
+ * 命中的分类或使用自己的子桶限速，或完全绕过本规则。
+ */
+#define LIMIT_MAX_CLASSES   8
+#define CLASS_ACTION_LIMIT  0  /* 改由分类自己的子桶限速（不再扣规则的桶） */
+#define CLASS_ACTION_BYPASS 1  /* 不受本规则限速（祖先规则仍然生效） */
+
+/*
+ * 分时速率（limiter schedule）：每条规则最多 LIMIT_MAX_WINDOWS 个时间窗，
+ * 数据路径每隔 SCHED_RECHECK_NS 重新选一次生效的窗，不依赖用户态定时唤醒。
+ */
+#define LIMIT_MAX_WINDOWS 8
+#define SCHED_RECHECK_NS  1000000ULL
+#define SCHED_DAY_SECS    86400U
+
+/*
+ * 规则过滤位图（rate_limit_filter）：cgroup_id 散列到一位。数据路径先查这一位，未置位
+ * （该 cgroup 没有规则）的包不取时间、不查规则表直接放行。用户态写入规则时置位，
+ * set/list 时按现存的规则目录清除已删除规则的位，误判只会多查一次规则表；reload 时 map 重建。
+ */
+#define RULE_FILTER_SHIFT 18                              /* 2^18 位，共 32KB */
+#define RULE_FILTER_WORDS (1U << (RULE_FILTER_SHIFT - 6)) /* 每个数组元素 64 位 */
+
+/* 乘法散列：cgroup_id 是连续分配的 inode 号，取乘积的高位使相邻的 id 分散开 */
+static inline __u32 rule_filter_bit(__u64 cgid)
+{
+	return (__u32)((cgid * 0x9E3779B97F4A7C15ULL) >> (64 - RULE_FILTER_SHIFT));
+}
+
+/*
+ * 按出口网卡区分的桶：以 (规则 cgroup_id, ifindex) 为键，值结构与规则相同。
+ * 配置沿用规则的其余参数，只换速率与容量（不分片），计数仍归属规则本身；
+ * 出方向的包按 skb->ifindex 查找，没有该网卡的桶时使用规则本身（通配）。
+ */
+#define LIMIT_MAX_DEVS 8
+
+struct dev_bucket_key {
+	__u64 cgid;
+	__u32 ifindex;
+	__u32 pad;
+};
+
+/*
+ * 本机流量绕过：出方向目的地址（入方向为源地址）是回环或本机地址的包不经过任何桶。
+ * 回环地址在数据路径直接判断；本机地址由用户态按网卡地址同步到以完整地址为键的表中，
+ * IPv4 以 ::ffff:a.b.c.d 表示。
+ */
+#define LOCAL_MAX_ADDRS 256
+
+struct local_addr_key {
+	__u8 addr[16];
+};
+
+struct local_bypass {
+	__u32 enabled;    /* 非 0 时启用，默认启用 */
+	__u32 addr_count; /* 本机地址表的条目数，为 0 时只判断回环地址 */
+};
+
+/*
+ * 控制包放行：桶不足、本要丢弃的 TCP 包如果是控制包（SYN/FIN/RST、纯 ACK）或不超过 max_len 字节，
+ * 改用控制包额度放行，不扣规则的桶。额度按规则计，放在规则值的 ext 中、在规则的锁内扣减，
+ * 每秒补充 pps 个包，最多积攒 pps 个。包速率桶 (--pps) 已空时照常丢弃，额度不能绕过包速率上限。
+ * 丢掉本机发出的 ACK 会拖慢反方向的下载，丢掉 SYN/FIN 会让建连、关闭等到重传超时。
+ */
+#define CTRL_DEFAULT_MAX_LEN 128
+#define CTRL_DEFAULT_PPS     200
+#define CTRL_MAX_PPS         1000000
+
+/* 控制包放行的设置（rate_limit_ctrl_cfg 的值），单条目数组，由用户态在加载与修改时写入 */
+struct ctrl_pass {
+	__u32 enabled;    /* 非 0 时启用，默认启用 */
+	__u32 max_len;    /* 不超过该长度（skb->len）的 TCP 包都算控制包，0 表示只看 TCP 标志 */
+	__u64 pps;        /* 每条规则每秒的额度（包） */
+};
+
+/*
+ * tc 模式：limit_tc 挂在选定网卡的 tcx 出方向上，限制没有本机 socket 的流量
+ * （经 veth/网桥转发的容器流量、tap 后的虚拟机流量）。包按 fwmark、入口网卡、源地址前缀
+ * 的顺序匹配到一条规则的 cgroup_id，再走与 cgroup 钩子相同的规则与令牌桶。
+ * 源地址前缀表的键与分类表相同，IPv4 以 ::ffff:a.b.c.d 表示。
+ */
+#define TC_MATCH_MARK 1
+#define TC_MATCH_IIF  2
+#define TC_MATCH_SRC  3
+#define TC_MAX_MATCHES 1024
+#define TC_MAX_DEVS 16
+
+/* fwmark / 入口网卡匹配 (rate_limit_tc_match) 的键 */
+struct tc_match_key {
+	__u32 type;   /* TC_MATCH_MARK / TC_MATCH_IIF */
+	__u32 value;  /* skb->mark 或入口网卡的 ifindex */
+};
+
+/* 源地址前缀匹配 (rate_limit_tc_src) 的键 */
+struct tc_src_key {
+	__u32 prefixlen;
+	__u8 addr[16];
+};
+
+/* 单条目数组：bit TC_MATCH_* 表示该类匹配项非空，数据路径跳过空的表 */
+struct tc_match_cfg {
+	__u32 types;
+	__u32 pad;
+};
+
+/*
+ * rate_limit_config.features 的位：对应的字段非 0。police 模式的包只读 config 的前 32 字节，
+ * 其余字段在这里有对应位时才读；由用户态在写入 map 之前按字段重新计算（sync_rule_features）。
+ */
+#define RULE_F_PPS       (1U << 0) // pps 非 0：包速率桶
+#define RULE_F_SHARD     (1U << 1) // shard_batch 非 0：分片模式
+#define RULE_F_FAIR      (1U << 2) // fair_reserve 非 0：公平分享
+#define RULE_F_ANCESTORS (1U << 3) // ancestor_mask 非 0：层级限速
+#define RULE_F_CLASSES   (1U << 4) // class_count 非 0：流量分类
+#define RULE_F_SCHED     (1U << 5) // sched_count 非 0：分时速率
+#define RULE_F_DEVS      (1U << 6) // dev_count 非 0：按出口网卡区分的桶
+
+/*
+ * 规则配置。前 32 字节是 police 模式每个包都要读的字段，与 rate_limit_state 合起来
+ * 正好是规则值的前 64 字节；其后的字段只在 features 有对应位或对应模式下读取。
+ */
 struct rate_limit_config {
-	__u64 rate_bps;      // 限速字节/秒
 	__u64 bucket_size;   // 令牌桶大小
+	__u64 refill_mult;   // 定点补充乘数：每纳秒补充的令牌数 << refill_shift
+	__u64 fill_ns;       // 字节桶从空到满所需时间；空闲超过它直接装满，避免乘法溢出
+	__u32 slot;          // 规则槽位：每 CPU 统计数组与 rate_limit_mode_map 的下标，由用户态分配
+	__u8 mode;           // LIMIT_MODE_*
+	__u8 refill_shift;   // 定点补充的小数位数，不超过 REFILL_MAX_SHIFT
+	__u8 features;       // RULE_F_*
+	__u8 pad;
+	__u64 pps;           // 包速率（包/秒），0 表示不限包数
+	__u64 shard_batch;   // 分片模式：每个 CPU 每次从共享桶批量领取的字节数，0 表示精确模式
+	__u64 fair_reserve;  // 公平分享：桶中为近期用量小的 socket 保留的字节数，0 表示不启用
+	__u32 ancestor_mask; // 层级限速：bit i 表示第 i 层祖先 cgroup 上的规则也要扣减，由用户态计算
+	__u8 class_count;    // 出方向流量分类数，非 0 时数据路径查分类表；由 limiter class 维护
+	__u8 sched_count;    // 分时速率的时间窗数，非 0 时数据路径查 rate_limit_sched_map；由 limiter schedule 维护
+	__u8 dev_count;      // 按出口网卡区分的桶数，非 0 时出方向查 rate_limit_dev_map；由 limiter set --dev 维护
+	__u8 count_pad;
+	__u64 rate_bps;      // 限速字节/秒
+	__u64 pkt_burst;     // 包令牌桶容量（包）
+	__u64 pkt_fill_ns;   // 包令牌桶从空到满所需时间，由用户态按 pkt_burst/pps 计算
+	__u64 ns_mult;       // pace 模式：每字节耗时（纳秒）<< PACE_NS_SHIFT
+	__u64 pkt_ns;        // pace 模式：包速率对应的最小包间隔（纳秒）
+	__u64 ecn_mark;      // ecn 模式：扣减后剩余令牌低于此值时标记拥塞；bucket_size 已含硬阈值的透支额度
+	__u64 peak_bucket;   // tcm 模式：峰值桶容量 (PBS)；承诺速率/容量即 rate_bps/bucket_size
+	__u64 peak_mult;     // tcm 模式：峰值桶的定点补充乘数，含义同 refill_mult
+	__u64 peak_fill_ns;  // tcm 模式：峰值桶从空到满所需时间
+	__u32 peak_shift;    // tcm 模式：峰值桶定点补充的小数位数
+	__u32 peak_pad;
+};
+
+/*
+ * 规则的冷参数（rate_limit_mode_map 的值，按规则槽位索引）：只在 pace、tcm 模式与公平分享下读取，
+ * 且不随时间窗、网卡桶变化，整条规则一份。用户态写入规则之前先写好。
+ */
+struct rate_limit_mode_cfg {
+	__u64 horizon_ns;    // pace 模式下允许的最大延迟，0 表示使用默认值
+	__u64 fair_window_ns;// 公平分享：socket 用量的统计窗口（按规则本身的填满时间），每过一个窗口用量减半
+	__u32 yellow_mark;   // tcm 模式：黄色包写入的 skb->mark（TCM_YELLOW_MARK_BASE | DSCP）
+	__u32 pad;
 };
 
 /* BPF 自旋锁类型 */
 /* 用户态：由 libbpf.h 提供定义 */
 /* BPF 端：由 vmlinux.h 提供定义 */
 
+/* police 模式每个包都要读写的状态，位于规则值的开头 */
 struct rate_limit_state {
-	struct bpf_spin_lock lock; // 并发保护（BPF端）
+	struct bpf_spin_lock lock; // 并发保护（BPF端），同时保护 rate_limit_state_ext
+	__u32 sched_idx;           // 分时速率：当前生效的时间窗编号 + 1，0 表示使用规则本身的速率
 	__u64 tokens;              // 当前桶内令牌数
 	__u64 last_update_ns;      // 上次更新令牌的时间戳
+	__u64 frac;                // 字节令牌补充后剩余的小数部分（refill_shift 位定点），下次补充时累加
 };
 
-struct rate_limit_full_info {
+/* 只在包速率、pace、分时速率、tcm 与控制包额度下读写的状态，放在规则值的末尾 */
+struct rate_limit_state_ext {
+	__u64 pkt_tokens;          // 包令牌（以 PKT_TOKEN_UNIT 为一个包）
+	__u64 next_tx_ns;          // pace 模式：下一个包的最早发送时间（EDT 虚拟时钟）
+	__u64 sched_next_ns;       // 分时速率：下次重新选择时间窗的时刻
+	__u64 peak_tokens;         // tcm 模式：峰值桶令牌
+	__u64 peak_frac;           // tcm 模式：峰值桶补充的小数部分
+	__u64 ctrl_tokens;         // 控制包额度：剩余的包令牌（以 PKT_TOKEN_UNIT 为一个包）
+	__u64 ctrl_last_ns;        // 控制包额度上次补充的时间
+};
+
+/*
+ * 分时速率的一个时间窗：本地时间 [start_sec, end_sec) 秒（当天零点起），
+ * end_sec 小于 start_sec 表示跨零点，零点之后的部分属于前一天。
+ * config 为该时间窗内生效的速率参数，由用户态按规则的其余参数完整计算。
+ */
+struct sched_window {
+	__u32 start_sec;
+	__u32 end_sec;
+	__u32 days;          // bit 0 为星期日 ... bit 6 为星期六
+	__u32 pad;
 	struct rate_limit_config config;
+};
+
+/* rate_limit_sched_map 的值（以规则槽位为键），窗按编号顺序匹配，取第一个命中的 */
+struct rate_schedule {
+	__u32 count;
+	__u32 pad;
+	struct sched_window w[LIMIT_MAX_WINDOWS];
+};
+
+/* limiter_clock_map 的值：本地墙上时间 = bpf_ktime_get_ns() + offset_ns，由用户态校准 */
+struct limiter_clock {
+	__s64 offset_ns;
+};
+
+/* 公平分享模式下每个 socket 的近期用量（sock_usage_map 的值，socket 本地存储） */
+struct sock_usage {
+	__u64 bytes;         // 近期放行的字节数，按窗口衰减
+	__u64 window_start;  // 当前统计窗口的起点
+};
+
+/*
+ * 原地进程规则：socket 创建时记录所属进程（sock_owner_map 的值，socket 本地存储）。
+ * 带 BPF_F_CLONE，accept 得到的 socket 继承监听 socket 的记录。
+ */
+struct sock_owner {
+	__u32 tgid;          // 创建 socket 的进程 (tgid)
+	__u32 pad;
+};
+
+/* 分片模式下每个 CPU 持有的本地额度（rate_limit_pcpu_map 的值，按槽位索引） */
+struct rate_limit_pcpu {
+	__u64 tokens;        // 已从共享桶领取、尚未消耗的令牌
+};
+
+/* 每 CPU 计数器（rate_limit_stats_map 的值），用户态按 CPU 求和 */
+struct rate_limit_stats {
+	__u64 pass_pkts;     // 放行包数（含 pace 模式下被延迟的包）
+	__u64 pass_bytes;    // 放行字节数
+	__u64 drop_pkts;     // 丢弃包数
+	__u64 drop_bytes;    // 丢弃字节数
+	__u64 state_init;    // 状态初始化次数
+	__u64 mark_pkts;     // 带标记放行的包数：ecn 模式标记 CE/CN，tcm 模式的黄色包
+	__u64 ctrl_pkts;     // 桶不足、按控制包额度放行的包数（已计入 pass_pkts）
+};
+
+/*
+ * rate_limit_map 的值：配置与状态放在同一个结构中，每个包只需一次查找。
+ * 前 64 字节是 state（锁、令牌、时间戳）与 config 的前 32 字节，police 模式的包只访问这 64 字节；
+ * 其余配置与 ext 只在对应功能启用时访问，pace/tcm/公平分享的冷参数在 rate_limit_mode_map 中。
+ * 值在 map 元素中的起点由内核决定（hash 元素头之后按 8 字节对齐），这 64 字节不一定落在
+ * 同一条物理缓存行上，最多跨两条。
+ * state 由 BPF 更新；用户态更新配置时用 BPF_F_LOCK 读改写，保留当前令牌数。
+ * 新规则的 state.last_update_ns 为 0，由首个包完成初始化。
+ */
+struct rate_limit_full_info {
 	struct rate_limit_state state;
+	struct rate_limit_config config;
+	struct rate_limit_state_ext ext;
+} __attribute__((aligned(64)));
+
+/*
+ * 分类表 (LPM trie) 的键：前 64 位为规则 cgroup_id（总是全匹配），
+ * 其后 128 位为目的地址，IPv4 以 ::ffff:a.b.c.d 表示。
+ * cgroup_id 拆成两个 32 位字段，避免 prefixlen 之后出现填充。
+ */
+struct class_lpm_key {
+	__u32 prefixlen;
+	__u32 cgid_hi;
+	__u32 cgid_lo;
+	__u8 addr[16];
+};
+
+#define CLASS_KEY_CGID_BITS 64
+
+/* 单个分类的匹配条件 */
+struct class_match {
+	__u8 proto;          // IPPROTO_*，0 表示任意协议
+	__u8 action;         // CLASS_ACTION_*
+	__u8 id;             // 分类编号 0..LIMIT_MAX_CLASSES-1，子桶的键
+	__u8 pad;
+	__u16 port_lo;       // 目的端口范围（主机字节序），port_hi 为 0 表示任意端口
+	__u16 port_hi;
+};
+
+/*
+ * 分类表的值：覆盖该前缀的所有分类，已按前缀长度、端口范围、协议由具体到宽泛排好序，
+ * 数据路径取第一个匹配项。
+ */
+struct class_set {
+	__u32 count;
+	struct class_match m[LIMIT_MAX_CLASSES];
+};
+
+/* 分类子桶 (rate_limit_class_map) 的键 */
+struct class_bucket_key {
+	__u64 cgid;
+	__u32 id;
+	__u32 pad;
 };
 
 #endif /* LIMITER_H */
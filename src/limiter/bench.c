@@ -0,0 +1,122 @@
+#include "bench.h"
+#include "bpf.h"
+#include "cgroup.h"
+#include "managed.h"
+#include "utils.h"
+#include <bpf/bpf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/limits.h>
+
+#define BENCH_ROUNDS 5
+
+/* 构造 IPv4/TCP 测试帧：cgroup_skb 的 test_run 输入以以太网头开头，地址取自 TEST-NET-1 */
+static void build_test_packet(unsigned char *buf, unsigned int len)
+{
+	memset(buf, 0, len);
+	struct ethhdr *eth = (struct ethhdr *)buf;
+	eth->h_proto = htons(ETH_P_IP);
+
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons((unsigned short)(len - sizeof(*eth)));
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_TCP;
+	ip->saddr = htonl(0xc0000201); /* 192.0.2.1 */
+	ip->daddr = htonl(0xc0000202); /* 192.0.2.2 */
+
+	struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+	tcp->source = htons(40000);
+	tcp->dest = htons(80);
+	tcp->doff = 5;
+	tcp->ack = 1;
+}
+
+/* 本进程所在的 cgroup v2 路径（/proc/self/cgroup 的 "0::" 行），失败时为空串 */
+static void self_cgroup_path(char *out, size_t out_sz)
+{
+	out[0] = '\0';
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (!f) return;
+	char line[PATH_MAX];
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3) != 0) continue;
+		char *nl = strchr(line, '\n');
+		if (nl) *nl = '\0';
+		snprintf(out, out_sz, "/sys/fs/cgroup%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+		break;
+	}
+	fclose(f);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	__u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* 对一个程序跑 BENCH_ROUNDS 轮，每轮 repeat 次，输出每包耗时的最小值与中位数 */
+static int bench_prog(const char *prog_name, const unsigned char *pkt, unsigned int len, unsigned int repeat)
+{
+	int fd = bpf_get_attached_prog_fd(prog_name);
+	if (fd < 0) {
+		fprintf(stderr, "未找到已附加的 %s（eBPF 程序未加载？）\n", prog_name);
+		return -1;
+	}
+
+	__u32 ns[BENCH_ROUNDS];
+	__u32 retval = 0;
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		struct bpf_test_run_opts opts;
+		memset(&opts, 0, sizeof(opts));
+		opts.sz = sizeof(opts);
+		opts.data_in = pkt;
+		opts.data_size_in = len;
+		opts.repeat = (int)repeat;
+		if (bpf_prog_test_run_opts(fd, &opts) != 0) {
+			fprintf(stderr, "%s: BPF_PROG_TEST_RUN 失败: %s\n", prog_name, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		ns[r] = opts.duration;
+		retval = opts.retval;
+	}
+	close(fd);
+
+	qsort(ns, BENCH_ROUNDS, sizeof(ns[0]), cmp_u32);
+	printf("%-14s %-10u %-10u %-8u %s\n", prog_name, ns[0], ns[BENCH_ROUNDS / 2], repeat,
+	       retval ? "放行" : "丢弃");
+	return 0;
+}
+
+int do_bench(unsigned int repeat, unsigned int pkt_len)
+{
+	unsigned int min_len = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct tcphdr);
+	if (pkt_len < min_len) pkt_len = min_len;
+	unsigned char *pkt = calloc(1, pkt_len);
+	if (!pkt) return 1;
+	build_test_packet(pkt, pkt_len);
+
+	char cg_path[PATH_MAX];
+	self_cgroup_path(cg_path, sizeof(cg_path));
+	size_t root_len = strlen(MANAGED_ROOT);
+	int managed = strncmp(cg_path, MANAGED_ROOT, root_len) == 0 &&
+		      (cg_path[root_len] == '/' || cg_path[root_len] == '\0');
+	printf("测试包: %u 字节 IPv4/TCP，所属 cgroup: %s%s\n", pkt_len, cg_path[0] ? cg_path : "(未知)",
+	       managed ? "（受管，测得的是受管路径，会消耗该规则的令牌）" : "（未受管）");
+	printf("%-14s %-10s %-10s %-8s %s\n", "程序", "最小ns/包", "中位ns/包", "次数/轮", "结果");
+
+	int ret = 0;
+	if (bench_prog("limit_egress", pkt, pkt_len, repeat) != 0) ret = 1;
+	if (bench_prog("limit_ingress", pkt, pkt_len, repeat) != 0) ret = 1;
+	free(pkt);
+	return ret;
+}
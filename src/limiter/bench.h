@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * 便捷子命令：bench - 用 BPF_PROG_TEST_RUN 测量已附加的 limit_egress/limit_ingress
+ * 处理单个包的平均耗时。测试包的 socket 属于本进程所在的 cgroup，
+ * 从未受管的 cgroup 运行时测得的就是未受管流量的快速路径开销。
+ */
+int do_bench(unsigned int repeat, unsigned int pkt_len);
+
+#endif /* BENCH_H */
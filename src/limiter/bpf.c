@@ -14,17 +14,239 @@
 #include <fcntl.h>
 #include "managed.h"
 #include "cgroup.h"
+#include "record.h"
+#include "class.h"
+#include "schedule.h"
+#include "dev.h"
+#include "tc.h"
+#include "shape.h"
 #include <bpf/libbpf.h>
 #include <linux/bpf.h>
 #include <sys/syscall.h>
+#include <sys/file.h>
+#include <time.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
 
 
 /* 前置声明，确保在严格编译下无隐式声明 */
 unsigned long long get_cgroup_id(const char *cgroup_path);
-static int bpf_attach_cgroup(int prog_fd, const char *attach_cg_path, unsigned int attach_flags);
+static int bpf_attach_cgroup(int prog_fd, const char *attach_cg_path,
+			     enum bpf_attach_type type, unsigned int attach_flags);
+
+/*
+ * 本工具的 BPF 程序：程序名、cgroup 附加类型与 link 固定路径。
+ * optional 的程序在内核不支持时不加载，也不附加。
+ */
+static const struct {
+	const char *name;
+	enum bpf_attach_type type;
+	const char *link_pin;
+	int optional;
+} limiter_progs[] = {
+	{ "limit_egress",   BPF_CGROUP_INET_EGRESS,      PIN_LINK_PERSISTENT,  0 },
+	{ "limit_ingress",  BPF_CGROUP_INET_INGRESS,     PIN_LINK_INGRESS,     0 },
+	{ "tag_sock_owner", BPF_CGROUP_INET_SOCK_CREATE, PIN_LINK_SOCK_CREATE, 1 },
+};
+#define LIMITER_PROG_CNT ((int)(sizeof(limiter_progs) / sizeof(limiter_progs[0])))
+
+/*
+ * 需要固定到 bpffs 的 map：对象内名称与固定路径。
+ * 规则表只会创建 hash 与 cgroup 本地存储两组中的一组，固定到同一路径。
+ */
+static const struct {
+	const char *name;
+	const char *pin;
+} limiter_maps[] = {
+	{ "rate_limit_map",              PIN_MAP_RULES },
+	{ "rate_limit_ingress_map",      PIN_MAP_INGRESS },
+	{ "rate_limit_cgrp_map",         PIN_MAP_RULES },
+	{ "rate_limit_ingress_cgrp_map", PIN_MAP_INGRESS },
+	{ "rate_limit_class_lpm",        PIN_MAP_CLASS_LPM },
+	{ "rate_limit_class_map",        PIN_MAP_CLASS },
+	{ "rate_limit_pid_map",          PIN_MAP_PID },
+	{ "rate_limit_pid_count",        PIN_MAP_PID_COUNT },
+	{ "rate_limit_filter",           PIN_MAP_FILTER },
+	{ "rate_limit_host_map",         PIN_MAP_HOST },
+	{ "rate_limit_sched_map",        PIN_MAP_SCHED },
+	{ "limiter_clock_map",           PIN_MAP_CLOCK },
+	{ "rate_limit_local_cfg",        PIN_MAP_LOCAL_CFG },
+	{ "rate_limit_local_addrs",      PIN_MAP_LOCAL_ADDRS },
+	{ "rate_limit_ctrl_cfg",         PIN_MAP_CTRL_CFG },
+	{ "rate_limit_dev_map",          PIN_MAP_DEV },
+	{ "rate_limit_tc_match",         PIN_MAP_TC_MATCH },
+	{ "rate_limit_tc_src",           PIN_MAP_TC_SRC },
+	{ "rate_limit_tc_cfg",           PIN_MAP_TC_CFG },
+	{ "rate_limit_stats_map",   PIN_MAP_STATS },
+	{ "rate_limit_pcpu_map",    PIN_MAP_PCPU },
+	{ "rate_limit_mode_map",    PIN_MAP_MODE },
+};
+#define LIMITER_MAP_CNT ((int)(sizeof(limiter_maps) / sizeof(limiter_maps[0])))
+
+/* 按程序名查找本工具的程序，返回下标；不是则返回 -1 */
+static int find_limiter_prog(const char *prog_name)
+{
+	for (int i = 0; i < LIMITER_PROG_CNT; i++) {
+		if (strcmp(prog_name, limiter_progs[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int limiter_prog_attach_type(const char *prog_name)
+{
+	int idx = find_limiter_prog(prog_name);
+	return idx < 0 ? -1 : (int)limiter_progs[idx].type;
+}
+
+/* 方向对应的规则 map 固定路径 */
+static const char *rule_map_pin(unsigned int direction)
+{
+	return (direction == LIMIT_DIR_INGRESS) ? PIN_MAP_INGRESS : PIN_MAP_RULES;
+}
+
+
+/* 在 bpf_object__load 之前改写 .rodata 中的全局常量（通过 BTF 定位变量偏移） */
+static int bpf_set_rodata(struct bpf_object *obj, const char *var_name, const void *val, size_t val_sz)
+{
+	struct btf *btf = bpf_object__btf(obj);
+	if (!btf) return -1;
+
+	__s32 sec_id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+	if (sec_id < 0) return -1;
+	const struct btf_type *sec = btf__type_by_id(btf, sec_id);
+	const struct btf_var_secinfo *vs = btf_var_secinfos(sec);
+
+	for (int i = 0; i < btf_vlen(sec); i++) {
+		const struct btf_type *var = btf__type_by_id(btf, vs[i].type);
+		if (strcmp(btf__name_by_offset(btf, var->name_off), var_name) != 0) continue;
+		if (vs[i].size != val_sz) return -1;
+
+		struct bpf_map *map;
+		bpf_object__for_each_map(map, obj) {
+			const char *name = bpf_map__name(map);
+			size_t len = strlen(name);
+			if (!bpf_map__is_internal(map) || len < 7 || strcmp(name + len - 7, ".rodata") != 0)
+				continue;
+			size_t data_sz = 0;
+			void *data = bpf_map__initial_value(map, &data_sz);
+			if (!data || vs[i].offset + val_sz > data_sz) return -1;
+			memcpy((char *)data + vs[i].offset, val, val_sz);
+			return 0;
+		}
+		return -1;
+	}
+	return -1;
+}
+
+/* 加载时使用的规则容量与规则表分配方式 */
+struct map_sizing {
+	unsigned int max_rules;
+	unsigned int map_alloc;  /* MAP_ALLOC_PREALLOC / MAP_ALLOC_DYNAMIC；本地存储模式下为 MAP_ALLOC_KEEP */
+};
+
+/* 按规则容量调整条目数的 map；rule_table 为 1 的是可选择分配方式的 hash 规则表 */
+static const struct {
+	const char *name;
+	int rule_table;
+} sized_maps[] = {
+	{ "rate_limit_map",         1 },
+	{ "rate_limit_ingress_map", 1 },
+	{ "rate_limit_pid_map",     1 },
+	{ "rate_limit_stats_map",   0 },
+	{ "rate_limit_pcpu_map",    0 },
+	{ "rate_limit_mode_map",    0 },
+	{ "rate_limit_class_lpm",   0 },
+	{ "rate_limit_class_map",   0 },
+	{ "rate_limit_sched_map",   0 },
+	{ "rate_limit_dev_map",     0 },
+};
+
+/* 命令行未指定的项沿用上次记录，首次加载使用编译时的默认值 */
+static void resolve_map_sizing(const struct LoadOptions *opts, struct map_sizing *sz)
+{
+	sz->max_rules = LIMIT_DEFAULT_MAX_RULES;
+	sz->map_alloc = MAP_ALLOC_PREALLOC;
+	(void)load_map_options(&sz->max_rules, &sz->map_alloc);
+	if (opts && opts->max_rules) sz->max_rules = opts->max_rules;
+	if (opts && opts->map_alloc != MAP_ALLOC_KEEP) sz->map_alloc = opts->map_alloc;
+
+	if (sz->max_rules == 0 || sz->max_rules > LIMIT_MAX_RULES_LIMIT) {
+		sz->max_rules = LIMIT_DEFAULT_MAX_RULES;
+	}
+	if (sz->map_alloc != MAP_ALLOC_DYNAMIC) {
+		sz->map_alloc = MAP_ALLOC_PREALLOC;
+	}
+}
+
+/* 在 bpf_object__load 之前设置容量与分配方式 */
+static int apply_map_sizing(struct bpf_object *obj, const struct map_sizing *sz)
+{
+	for (size_t i = 0; i < sizeof(sized_maps) / sizeof(sized_maps[0]); i++) {
+		struct bpf_map *m = bpf_object__find_map_by_name(obj, sized_maps[i].name);
+		if (!m) continue;
+		if (bpf_map__set_max_entries(m, sz->max_rules) != 0) {
+			fprintf(stderr, "无法设置 %s 的容量: %s\n", sized_maps[i].name, strerror(errno));
+			return -1;
+		}
+		if (!sized_maps[i].rule_table) continue;
+		__u32 flags = bpf_map__map_flags(m);
+		if (sz->map_alloc == MAP_ALLOC_DYNAMIC) {
+			flags |= BPF_F_NO_PREALLOC;
+		} else {
+			flags &= ~BPF_F_NO_PREALLOC;
+		}
+		if (bpf_map__set_map_flags(m, flags) != 0) {
+			fprintf(stderr, "无法设置 %s 的分配方式: %s\n", sized_maps[i].name, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 读取已固定 map 的容量与分配方式，map 不存在返回 -1 */
+static int get_loaded_map_sizing(struct map_sizing *sz)
+{
+	struct bpf_map_info info = {0};
+	__u32 info_len = sizeof(info);
+	int fd = bpf_obj_get(PIN_MAP_STATS);
+	if (fd < 0) return -1;
+	int err = bpf_map_get_info_by_fd(fd, &info, &info_len);
+	close(fd);
+	if (err != 0) return -1;
+	sz->max_rules = info.max_entries;
+
+	sz->map_alloc = MAP_ALLOC_KEEP;
+	fd = bpf_obj_get(PIN_MAP_RULES);
+	if (fd < 0) return 0;
+	memset(&info, 0, sizeof(info));
+	info_len = sizeof(info);
+	if (bpf_map_get_info_by_fd(fd, &info, &info_len) == 0 && info.type == BPF_MAP_TYPE_HASH) {
+		sz->map_alloc = (info.map_flags & BPF_F_NO_PREALLOC) ? MAP_ALLOC_DYNAMIC : MAP_ALLOC_PREALLOC;
+	}
+	close(fd);
+	return 0;
+}
 
+/* set 指定的容量或分配方式与已加载的不同（需要重新创建 map） */
+static int map_sizing_changed(const struct LoadOptions *opts)
+{
+	struct map_sizing cur;
+	if (!opts || get_loaded_map_sizing(&cur) != 0) return 0;
+	if (opts->max_rules && opts->max_rules != cur.max_rules) return 1;
+	if (opts->map_alloc != MAP_ALLOC_KEEP && cur.map_alloc != MAP_ALLOC_KEEP &&
+	    opts->map_alloc != cur.map_alloc) return 1;
+	return 0;
+}
 
-static int bpf_load_program(const char *bpf_obj_path, struct bpf_object **out_obj, int *out_prog_fd)
+/*
+ * 打开并加载 BPF 对象。use_storage 为 1 时规则放在 cgroup 本地存储中，
+ * 否则不创建本地存储 map（其引用被 libbpf 屏蔽，对应分支在校验时被裁剪）。
+ */
+static int bpf_open_and_load(const char *bpf_obj_path, const struct LoadOptions *opts,
+			     const struct map_sizing *sz, int use_storage, struct bpf_object **out_obj)
 {
 	//指针赋值
 	struct bpf_object *obj = bpf_object__open_file(bpf_obj_path, NULL);
@@ -32,299 +254,2480 @@ static int bpf_load_program(const char *bpf_obj_path, struct bpf_object **out_ob
 		fprintf(stderr, "bpf_object__open_file failed: %s (path=%s)\n", strerror(errno), bpf_obj_path);
 		return 1;
 	}
+
+	/* 调试输出开关：只在加载时决定，默认关闭 */
+	__u32 debug = (opts && opts->debug) ? 1 : 0;
+	if (bpf_set_rodata(obj, "limiter_debug", &debug, sizeof(debug)) != 0) {
+		fprintf(stderr, "warning: 无法设置 limiter_debug，调试输出保持关闭\n");
+	}
+
+	__u32 storage = use_storage ? 1 : 0;
+	if (bpf_set_rodata(obj, "use_cgrp_storage", &storage, sizeof(storage)) != 0) {
+		storage = 0;
+	}
+	const char *unused[2][2] = {
+		{ "rate_limit_cgrp_map", "rate_limit_ingress_cgrp_map" },
+		{ "rate_limit_map", "rate_limit_ingress_map" },
+	};
+	for (int i = 0; i < 2; i++) {
+		struct bpf_map *m = bpf_object__find_map_by_name(obj, unused[storage][i]);
+		if (m) (void)bpf_map__set_autocreate(m, false);
+	}
+
+	/*
+	 * 记录 socket 创建者需要 sock_create 程序能取当前 tgid 并使用 socket 本地存储，
+	 * 较旧的内核不支持时不加载该程序，原地进程规则退回按当前任务计费。
+	 */
+	if (libbpf_probe_bpf_helper(BPF_PROG_TYPE_CGROUP_SOCK, BPF_FUNC_sk_storage_get, NULL) != 1 ||
+	    libbpf_probe_bpf_helper(BPF_PROG_TYPE_CGROUP_SOCK, BPF_FUNC_get_current_pid_tgid, NULL) != 1) {
+		struct bpf_program *p = bpf_object__find_program_by_name(obj, "tag_sock_owner");
+		if (p) (void)bpf_program__set_autoload(p, false);
+	}
+
+	if (apply_map_sizing(obj, sz) != 0) {
+		bpf_object__close(obj);
+		return 1;
+	}
+
 	int err_load = bpf_object__load(obj);
 	if (err_load) {
-		fprintf(stderr, "bpf_object__load failed: %s\n", strerror(-err_load));
+		if (!storage) {
+			fprintf(stderr, "bpf_object__load failed: %s\n", strerror(-err_load));
+		}
 		bpf_object__close(obj);
 		return 1;
 	}
 
-	// 3. 获取程序句柄
-	struct bpf_program *prog = bpf_object__find_program_by_name(obj, "limit_egress");
-	if (!prog) {
-		fprintf(stderr, "program 'limit_egress' not found\n");
-		bpf_object__close(obj);
+	*out_obj = obj;
+	return 0;
+}
+
+static int bpf_load_program(const char *bpf_obj_path, const struct LoadOptions *opts,
+			    struct bpf_object **out_obj)
+{
+	struct bpf_object *obj = NULL;
+	struct map_sizing sz;
+	resolve_map_sizing(opts, &sz);
+
+	/*
+	 * 优先使用 cgroup 本地存储：需要 CGRP_STORAGE map (6.2+) 且 cgroup_skb 能调用
+	 * bpf_cgroup_from_id 等 kfunc（较新内核），任一不满足则回退到 hash map。
+	 */
+	int use_storage = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_CGRP_STORAGE, NULL) == 1;
+	if (use_storage && bpf_open_and_load(bpf_obj_path, opts, &sz, 1, &obj) != 0) {
+		fprintf(stderr, "warning: 内核不支持在 cgroup_skb 中使用 cgroup 本地存储，回退到 hash map\n");
+		use_storage = 0;
+	}
+	if (!use_storage && bpf_open_and_load(bpf_obj_path, opts, &sz, 0, &obj) != 0) {
 		return 1;
 	}
 
-    /* 先使用 bpf_prog_attach 传递 attach_flags（如 BPF_F_ALLOW_MULTI） */
-    int prog_fd = bpf_program__fd(prog);
-    if (prog_fd < 0) {
-        fprintf(stderr, "获取 prog fd 失败\n");
-        bpf_object__close(obj);
-        return 1;
-    }
+	// 3. 检查程序句柄
+	for (int i = 0; i < LIMITER_PROG_CNT; i++) {
+		struct bpf_program *prog = bpf_object__find_program_by_name(obj, limiter_progs[i].name);
+		if (limiter_progs[i].optional && (!prog || bpf_program__fd(prog) < 0)) {
+			fprintf(stderr, "warning: 内核不支持 %s，原地进程规则按当前任务计费\n", limiter_progs[i].name);
+			continue;
+		}
+		if (!prog || bpf_program__fd(prog) < 0) {
+			fprintf(stderr, "program '%s' not found\n", limiter_progs[i].name);
+			bpf_object__close(obj);
+			return 1;
+		}
+	}
 
-	*out_prog_fd=prog_fd;
+	printf("规则存储: %s，容量 %u 条%s%s\n", use_storage ? "cgroup 本地存储" : "hash map", sz.max_rules,
+	       use_storage ? "" : "，", use_storage ? "" : map_alloc_name(sz.map_alloc));
+	if (save_map_options(sz.max_rules, sz.map_alloc) != 0) {
+		fprintf(stderr, "warning: 无法保存规则容量记录，reload 将使用默认容量\n");
+	}
 	*out_obj=obj;
 	return 0;
 }
 
 
 
+/* path 是否为 root 本身或位于 root 之下 */
+static int path_within(const char *path, const char *root)
+{
+	size_t len = strlen(root);
+	return strncmp(path, root, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * 解析附加范围：spec 为 NULL 时沿用记录（没有记录为根 cgroup）；"root" 为根 cgroup，
+ * "managed" 为托管目录，其余为逗号分隔的 cgroup 路径（相对路径相对 cgroup 根）。
+ * 范围之间不能互相包含，否则子树里的包会被计费两次；cgroup 规则都建在托管目录下，
+ * 范围不含托管目录时自动补上（verbose 时提示）。返回 cgroup 数，出错返回 -1。
+ */
+static int resolve_attach_scope(const char *spec, char (*paths)[PATH_MAX], int max, int verbose)
+{
+	if (!spec) {
+		int n = load_attach_scope(paths, max);
+		if (n > 0) return n;
+		spec = "root";
+	}
+	if (strcmp(spec, "root") == 0) {
+		snprintf(paths[0], PATH_MAX, "%s", ATTACH_POINT);
+		return 1;
+	}
+
+	char *dup = strdup(spec);
+	if (!dup) return -1;
+	int n = 0;
+	char *save = NULL;
+	for (char *tok = strtok_r(dup, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (n >= max) {
+			fprintf(stderr, "附加范围最多 %d 个 cgroup\n", max);
+			goto err;
+		}
+		char raw[PATH_MAX];
+		int len;
+		if (strcmp(tok, "managed") == 0) {
+			len = snprintf(raw, sizeof(raw), "%s", MANAGED_ROOT);
+		} else if (tok[0] == '/') {
+			len = snprintf(raw, sizeof(raw), "%s", tok);
+		} else {
+			len = snprintf(raw, sizeof(raw), "%s/%s", CGROUPFS_ROOT, tok);
+		}
+		if (len < 0 || (size_t)len >= sizeof(raw)) goto err;
+		if (strcmp(raw, MANAGED_ROOT) == 0 && ensure_dir(MANAGED_ROOT, 0755) != 0) goto err;
+		if (!realpath(raw, paths[n])) {
+			fprintf(stderr, "无效的附加范围 %s: %s\n", tok, strerror(errno));
+			goto err;
+		}
+		if (!path_within(paths[n], CGROUPFS_ROOT)) {
+			fprintf(stderr, "附加范围必须是 cgroup v2 目录: %s\n", paths[n]);
+			goto err;
+		}
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "附加范围不能为空\n");
+		goto err;
+	}
+
+	int managed_covered = 0;
+	for (int i = 0; i < n; i++) {
+		for (int j = i + 1; j < n; j++) {
+			if (path_within(paths[i], paths[j]) || path_within(paths[j], paths[i])) {
+				fprintf(stderr, "附加范围 %s 与 %s 互相包含，子树中的包会被重复计费\n", paths[i], paths[j]);
+				goto err;
+			}
+		}
+		if (path_within(MANAGED_ROOT, paths[i])) {
+			managed_covered = 1;
+		} else if (path_within(paths[i], MANAGED_ROOT)) {
+			fprintf(stderr, "附加范围不能位于托管目录之内: %s\n", paths[i]);
+			goto err;
+		}
+	}
+	if (!managed_covered) {
+		if (n >= max) {
+			fprintf(stderr, "附加范围最多 %d 个 cgroup（含托管目录）\n", max);
+			goto err;
+		}
+		if (ensure_dir(MANAGED_ROOT, 0755) != 0) goto err;
+		snprintf(paths[n++], PATH_MAX, "%s", MANAGED_ROOT);
+		if (verbose) printf("附加范围不含托管目录，已加入 %s\n", MANAGED_ROOT);
+	}
+	free(dup);
+	return n;
+err:
+	free(dup);
+	return -1;
+}
+
+int bpf_attach_scope(char (*paths)[PATH_MAX], int max)
+{
+	return resolve_attach_scope(NULL, paths, max, 0);
+}
+
+int bpf_path_in_attach_scope(const char *path)
+{
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int n = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+	for (int i = 0; i < n; i++) {
+		if (path_within(path, scope[i])) return 1;
+	}
+	return 0;
+}
+
+/* set 指定的附加范围与已记录的不同（需要重新附加）返回 1，指定的范围无效返回 -1 */
+static int attach_scope_changed(const struct LoadOptions *opts)
+{
+	if (!opts || !opts->attach_scope) return 0;
+	char cur[ATTACH_SCOPE_MAX][PATH_MAX];
+	char want[ATTACH_SCOPE_MAX][PATH_MAX];
+	int n_cur = resolve_attach_scope(NULL, cur, ATTACH_SCOPE_MAX, 0);
+	int n_want = resolve_attach_scope(opts->attach_scope, want, ATTACH_SCOPE_MAX, 0);
+	if (n_want < 0) return -1;
+	if (n_cur != n_want) return 1;
+	for (int i = 0; i < n_cur; i++) {
+		if (strcmp(cur[i], want[i]) != 0) return 1;
+	}
+	return 0;
+}
+
+/* 附加范围 scope 上第 idx 个程序的 link 固定路径：根 cgroup 沿用原来的路径，其余加 _<cgroup id> 后缀 */
+static int build_link_pin(int idx, const char *scope, char *out, size_t out_size)
+{
+	int len;
+	if (strcmp(scope, ATTACH_POINT) == 0) {
+		len = snprintf(out, out_size, "%s", limiter_progs[idx].link_pin);
+	} else {
+		unsigned long long cgid = get_cgroup_id(scope);
+		if (cgid == 0ULL) return -1;
+		len = snprintf(out, out_size, "%s_%llu", limiter_progs[idx].link_pin, cgid);
+	}
+	return (len < 0 || (size_t)len >= out_size) ? -1 : 0;
+}
+
+/*
+ * tc 模式：固定 limit_tc，供 limiter tc attach 在加载之后使用，并重新附加到记录中的网卡。
+ * 失败只影响 tc 模式，不回滚 cgroup 钩子。
+ */
+static void restore_tc_devs(struct bpf_object *obj)
+{
+	struct bpf_program *prog = bpf_object__find_program_by_name(obj, "limit_tc");
+	(void)unlink(PIN_PROG_TC);
+	if (!prog || bpf_program__fd(prog) < 0 || bpf_program__pin(prog, PIN_PROG_TC) != 0) {
+		fprintf(stderr, "warning: 无法固定 limit_tc，tc 模式不可用\n");
+		return;
+	}
+	char names[TC_MAX_DEVS][16];
+	int n = load_tc_dev_record(names, TC_MAX_DEVS);
+	for (int i = 0; i < n; i++) {
+		(void)bpf_tc_attach_dev(names[i]);
+	}
+}
+
 /* 加载 eBPF 程序并固定到文件系统 */
 static int do_load_bpf_program(const struct LoadOptions *opts)
 {
 	struct bpf_object *obj = NULL;
-	int prog_fd = -1;
 
     // 2. 加载 eBPF 对象
     const char *bpf_obj_path = (opts && opts->bpf_obj_path) ? opts->bpf_obj_path : DEFAULT_BPF_OBJ;
 	unsigned int attach_flags = (opts ? opts->attach_flags : BPF_F_ALLOW_MULTI);
 	AttachMode attach_mode = (opts ? opts->attach_mode : ATTACH_MODE_LINK);
-	//opts->cgroup_path具体cgroup
-	//必须附加到根cgroup
-	const char *attach_cg_path = ATTACH_POINT;
+	/*
+	 * 附加范围默认是根 cgroup（所有进程都经过程序）；只限托管目录或几个 slice 时，
+	 * 范围外的流量完全不经过程序。opts->cgroup_path 是规则的父目录，与附加范围无关。
+	 */
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int scope_cnt = resolve_attach_scope(opts ? opts->attach_scope : NULL, scope, ATTACH_SCOPE_MAX, 1);
+	if (scope_cnt <= 0) {
+		return 1;
+	}
+
+	/* 创建bpffs目录 */
+	if (ensure_dir(BPFFS_DIR, 0755) != 0) {
+		return 1;
+	}
+
+	int ret = bpf_load_program(bpf_obj_path, opts, &obj);//后续出错都要释放obj
+	if (ret != 0) {
+		fprintf(stderr, "bpf_load_program failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	// 根据附加模式选择不同的附加方式，每个附加范围上 egress 与 ingress 程序一并附加（未加载的可选程序除外）
+	for (int s = 0; s < scope_cnt; s++) {
+		for (int i = 0; i < LIMITER_PROG_CNT; i++) {
+			int prog_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, limiter_progs[i].name));
+			if (prog_fd < 0 && limiter_progs[i].optional) {
+				continue;
+			}
+			if (attach_mode == ATTACH_MODE_LINK) {
+				char pin[PATH_MAX];
+				if (build_link_pin(i, scope[s], pin, sizeof(pin)) != 0) {
+					fprintf(stderr, "无法生成 %s 的 link 固定路径\n", scope[s]);
+					goto err;
+				}
+				ret = bpf_attach_cgroup_with_link(prog_fd, scope[s], limiter_progs[i].type, pin);
+				if (ret != 0) {
+					fprintf(stderr, "bpf_attach_cgroup_with_link(%s) failed: %s\n", limiter_progs[i].name, strerror(errno));
+					goto err;
+				}
+			} else {
+				ret = bpf_attach_cgroup(prog_fd, scope[s], limiter_progs[i].type, attach_flags);
+				if (ret != 0) {
+					fprintf(stderr, "bpf_attach_cgroup(%s) failed: %s\n", limiter_progs[i].name, strerror(errno));
+					goto err;
+				}
+			}
+		}
+	}
+
+	// 7. 固定 map
+	for (int i = 0; i < LIMITER_MAP_CNT; i++) {
+		struct bpf_map *pm = bpf_object__find_map_by_name(obj, limiter_maps[i].name);
+		if (!pm || bpf_map__fd(pm) < 0) continue; /* 未创建的那一组规则表 */
+		(void)unlink(limiter_maps[i].pin);
+		if (bpf_map__pin(pm, limiter_maps[i].pin) != 0 && errno != EEXIST) {
+			fprintf(stderr, "warning: 无法固定 %s: %s\n", limiter_maps[i].name, strerror(errno));
+			goto err;
+		}
+	}
+
+	restore_tc_devs(obj);
+
+	if (save_attach_scope((const char (*)[PATH_MAX])scope, scope_cnt) != 0) {
+		fprintf(stderr, "warning: 无法保存附加范围记录，reload 将附加到根 cgroup\n");
+	}
+	for (int s = 0; s < scope_cnt; s++) {
+		printf("eBPF 程序已加载并固定 (attach to: %s)\n", scope[s]);
+	}
+	return 0;
+err:
+	/* 回滚已附加的程序，避免只有部分范围或单个方向生效；未附加的项删除/分离失败可忽略 */
+	for (int s = 0; s < scope_cnt; s++) {
+		int cg_fd = (attach_mode == ATTACH_MODE_LINK) ? -1 : open_cgroup_fd(scope[s]);
+		for (int i = 0; i < LIMITER_PROG_CNT; i++) {
+			int prog_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, limiter_progs[i].name));
+			if (prog_fd < 0) continue;
+			if (attach_mode == ATTACH_MODE_LINK) {
+				char pin[PATH_MAX];
+				if (build_link_pin(i, scope[s], pin, sizeof(pin)) == 0) (void)unlink(pin);
+			} else if (cg_fd >= 0) {
+				(void)bpf_prog_detach2(prog_fd, cg_fd, limiter_progs[i].type);
+			}
+		}
+		if (cg_fd >= 0) close(cg_fd);
+	}
+	bpf_object__close(obj);
+	return 1;
+}
+
+
+static int bpf_attach_cgroup(int prog_fd, const char *attach_cg_path,
+			     enum bpf_attach_type type, unsigned int attach_flags)
+{
+	// 只使用 bpf_prog_attach 方式附加程序（支持 MULTI 但不持久化）
+	int cg_fd = open_cgroup_fd(attach_cg_path);
+	if (cg_fd < 0) {
+		fprintf(stderr, "open %s failed: %s\n", attach_cg_path, strerror(errno));
+		return 1;
+	}
+
+	if (bpf_prog_attach(prog_fd, cg_fd, type, attach_flags) != 0) {
+		fprintf(stderr, "bpf_prog_attach 失败: %s\n", strerror(errno));
+		close(cg_fd);
+		return 1;
+	}
+	
+	close(cg_fd);
+	printf("eBPF 程序已通过 prog_attach 方式附加 (attach to: %s)\n", attach_cg_path);
+	return 0;
+}
+
+/* 使用 bpf_link 方式附加程序到 cgroup（支持持久化） */
+int bpf_attach_cgroup_with_link(int prog_fd, const char *cgroup_path,
+				enum bpf_attach_type type, const char *pin_path)
+{
+	// 打开目标 cgroup
+	int cg_fd = open_cgroup_fd(cgroup_path);
+	if (cg_fd < 0) {
+		fprintf(stderr, "open %s failed: %s\n", cgroup_path, strerror(errno));
+		return 1;
+	}
+
+	// 使用 bpf_link 方式附加程序
+	struct bpf_link_create_opts opts = {0};
+	opts.sz = sizeof(opts);
+	int link_fd = bpf_link_create(prog_fd, cg_fd, type, &opts);
+	if (link_fd < 0) {
+		fprintf(stderr, "bpf_link_create 失败: %s\n", strerror(errno));
+		close(cg_fd);
+		return 1;
+	}
+
+	// 固定 link 到文件系统（持久化）
+	(void)unlink(pin_path); // 忽略不存在的错误
+	if (bpf_obj_pin(link_fd, pin_path) != 0) {
+		fprintf(stderr, "warning: 无法固定链接到 %s（可能未挂载 bpffs）\n", pin_path);
+		close(link_fd);
+		close(cg_fd);
+		return 1;
+	}
+	
+	close(link_fd);
+	close(cg_fd);
+	printf("eBPF 程序已通过 link 方式附加并持久化 (attach to: %s, pin: %s)\n", cgroup_path, pin_path);
+	return 0;
+}
+
+/* 遍历 pin 目录下本工具的 link（各附加范围各一组）；回调返回非 0 时停止遍历，该值作为返回值 */
+typedef int (*link_pin_fn)(const char *pin_path, void *arg);
+static int for_each_link_pin(link_pin_fn fn, void *arg)
+{
+	DIR *dir = opendir(BPFFS_DIR);
+	if (!dir) return 0;
+	int ret = 0;
+	struct dirent *entry;
+	while (ret == 0 && (entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, PIN_LINK_PREFIX, strlen(PIN_LINK_PREFIX)) != 0) continue;
+		char pin_path[PATH_MAX];
+		if (SAFE_PATH_JOIN(pin_path, BPFFS_DIR, entry->d_name) != 0) continue;
+		ret = fn(pin_path, arg);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* 读取固定的 link 指向的程序 id，失败返回 -1 */
+static int link_pin_prog_id(const char *pin_path, __u32 *prog_id)
+{
+	int link_fd = bpf_obj_get(pin_path);
+	if (link_fd < 0) return -1;
+	struct bpf_link_info link_info;
+	__u32 info_len = sizeof(link_info);
+	memset(&link_info, 0, sizeof(link_info));
+	int err = bpf_obj_get_info_by_fd(link_fd, &link_info, &info_len);
+	close(link_fd);
+	if (err != 0) return -1;
+	*prog_id = link_info.prog_id;
+	return 0;
+}
+
+static int link_pin_exists(const char *pin_path, void *arg)
+{
+	(void)pin_path;
+	(void)arg;
+	return 1;
+}
+
+/* 检查 link 是否已附加（任一附加范围） */
+int bpf_is_link_attached(const char *cgroup_path)
+{
+	(void)cgroup_path; // 暂时不使用，附加范围内的 link 都固定在同一目录
+	return for_each_link_pin(link_pin_exists, NULL);
+}
+
+/* 卸载单个 pinned link：成功返回 1，不存在返回 0，失败返回 -1 */
+static int detach_link_pin(const char *pin_path)
+{
+	// 首先尝试从内核中分离 link
+	int link_fd = bpf_obj_get(pin_path);
+	if (link_fd >= 0) {
+		// 从内核中分离 link
+		if (bpf_link_detach(link_fd) == 0) {
+			close(link_fd);
+			// 然后删除 pinned link 文件
+			if (unlink(pin_path) == 0) {
+				printf("已卸载程序 (通过删除 link pin): %s\n", pin_path);
+				return 1;
+			}
+		} else {
+			close(link_fd);
+		}
+	}
+	
+	// 如果无法打开 link 文件，尝试直接删除
+	if (unlink(pin_path) == 0) {
+		printf("已卸载程序 (通过删除 link pin): %s\n", pin_path);
+		return 1;
+	}
+	
+	// 如果 pin 文件不存在，说明程序可能已经被卸载
+	if (errno == ENOENT) {
+		return 0; // 没有需要卸载的程序
+	}
+	
+	fprintf(stderr, "卸载 %s 失败: %s\n", pin_path, strerror(errno));
+	return -1;
+}
+
+/* 卸载 link 的计数；prog_id 非 0 时只卸载指向该程序的 link */
+struct link_detach_ctx {
+	__u32 prog_id;
+	int total;
+	int failed;
+};
+
+static int detach_link_cb(const char *pin_path, void *arg)
+{
+	struct link_detach_ctx *ctx = arg;
+	__u32 prog_id = 0;
+	if (ctx->prog_id && (link_pin_prog_id(pin_path, &prog_id) != 0 || prog_id != ctx->prog_id)) {
+		return 0;
+	}
+	int n = detach_link_pin(pin_path);
+	if (n < 0) ctx->failed = 1; else ctx->total += n;
+	return 0;
+}
+
+/* 卸载 link 附加的程序（所有附加范围），返回卸载的数量 */
+int bpf_detach_link(const char *cgroup_path)
+{
+	(void)cgroup_path;
+	struct link_detach_ctx ctx = { 0 };
+	(void)for_each_link_pin(detach_link_cb, &ctx);
+	return (ctx.failed && ctx.total == 0) ? -1 : ctx.total;
+}
+
+/*
+ * 计算定点补充参数：在不溢出的前提下取尽量多的小数位。
+ * 补充时 delta_ns < fill_ns，需保证 fill_ns * refill_mult 加上小数进位仍小于 2^64。
+ */
+static void compute_fixed_refill(unsigned long long rate, unsigned long long bucket,
+				 __u32 *shift_out, __u64 *mult_out, __u64 *fill_out)
+{
+	const unsigned __int128 limit = (unsigned __int128)1 << 64;
+	unsigned __int128 fill = ((unsigned __int128)bucket * 1000000000ULL + rate - 1) / rate;
+	unsigned int shift = REFILL_MAX_SHIFT;
+	unsigned __int128 mult = 0;
+
+	for (;;) {
+		mult = (((unsigned __int128)rate << shift) + 500000000ULL) / 1000000000ULL;
+		if (shift == 0 || fill * mult + ((unsigned __int128)1 << shift) < limit) break;
+		shift--;
+	}
+	if (mult == 0) mult = 1;
+
+	*shift_out = shift;
+	*mult_out = (__u64)mult;
+	*fill_out = fill >= limit ? ~0ULL : (__u64)fill;
+}
+
+static void compute_refill_params(struct rate_limit_config *conf)
+{
+	__u32 shift = 0;
+	compute_fixed_refill(conf->rate_bps, conf->bucket_size, &shift, &conf->refill_mult, &conf->fill_ns);
+	conf->refill_shift = (__u8)shift;
+	conf->ns_mult = (__u64)((((unsigned __int128)1000000000ULL << PACE_NS_SHIFT) + conf->rate_bps / 2) / conf->rate_bps);
+}
+
+/* 按字段重新计算 features，数据路径只凭这些位决定是否读取 config 热区之外的字段；写入 map 之前调用 */
+static void sync_rule_features(struct rate_limit_config *conf)
+{
+	__u8 f = 0;
+	if (conf->pps) f |= RULE_F_PPS;
+	if (conf->shard_batch) f |= RULE_F_SHARD;
+	if (conf->fair_reserve) f |= RULE_F_FAIR;
+	if (conf->ancestor_mask) f |= RULE_F_ANCESTORS;
+	if (conf->class_count) f |= RULE_F_CLASSES;
+	if (conf->sched_count) f |= RULE_F_SCHED;
+	if (conf->dev_count) f |= RULE_F_DEVS;
+	conf->features = f;
+}
+
+/* 将用户态规则转换为 BPF 侧配置；入方向的包已经到达本机，无法 pace，只做 police */
+static void fill_rate_limit_config(const LimiterConfig *cfg, unsigned int direction,
+				   struct rate_limit_config *conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->rate_bps = cfg->rate_bps;
+	conf->bucket_size = cfg->bucket_size;
+	conf->mode = (direction == LIMIT_DIR_INGRESS) ? LIMIT_MODE_POLICE : cfg->mode;
+
+	/*
+	 * ecn 模式：把硬阈值的透支额度并入桶容量，数据路径只需比较剩余令牌与 ecn_mark。
+	 * 剩余令牌在 [ecn_mark, bucket_size] 放行，[0, ecn_mark) 放行并标记，不足才丢包。
+	 */
+	if (conf->mode == LIMIT_MODE_ECN) {
+		unsigned long long soft = cfg->ecn_soft ? cfg->ecn_soft : cfg->bucket_size / 2;
+		if (soft > cfg->bucket_size) soft = cfg->bucket_size;
+		conf->bucket_size = cfg->bucket_size + cfg->ecn_hard;
+		conf->ecn_mark = cfg->ecn_hard + soft;
+	}
+
+	/* 补充与 pace 所需的除法全部在这里做完 */
+	if (conf->rate_bps > 0 && conf->bucket_size > 0) {
+		compute_refill_params(conf);
+	}
+
+	/*
+	 * tcm 模式：承诺速率/容量沿用 rate_bps/bucket_size，峰值桶按同样的定点方式补充。
+	 * 峰值容量默认等于承诺容量。
+	 */
+	if (conf->mode == LIMIT_MODE_TCM && cfg->peak_rate > 0) {
+		conf->peak_bucket = cfg->peak_burst ? cfg->peak_burst : cfg->bucket_size;
+		compute_fixed_refill(cfg->peak_rate, conf->peak_bucket, &conf->peak_shift, &conf->peak_mult,
+				     &conf->peak_fill_ns);
+	}
+
+	/* 包速率桶：容量默认等于 pps，预先算好填满整桶与补充一个包令牌所需的时间 */
+	if (cfg->pps > 0) {
+		conf->pps = cfg->pps;
+		conf->pkt_burst = cfg->pkt_burst ? cfg->pkt_burst : cfg->pps;
+		conf->pkt_fill_ns = conf->pkt_burst * 1000000000ULL / conf->pps;
+		conf->pkt_ns = 1000000000ULL / conf->pps;
+	}
+
+	/* 公平分享：保留 fair_pct% 的桶给近期用量小的 socket，统计窗口见 fill_rate_limit_mode */
+	if (cfg->fair_pct > 0 && conf->mode != LIMIT_MODE_PACE) {
+		conf->fair_reserve = cfg->bucket_size / 100 * cfg->fair_pct;
+		if (conf->fair_reserve == 0) conf->fair_reserve = 1;
+	}
+
+	/*
+	 * 分片模式：各 CPU 滞留额度之和不超过桶容量的 shard_tolerance%，
+	 * 据此得到每个 CPU 单次领取的批量。本地额度只记字节，与包速率桶不能同时使用。
+	 */
+	if (cfg->shard_tolerance > 0 && conf->mode == LIMIT_MODE_POLICE && conf->pps == 0 &&
+	    conf->fair_reserve == 0) {
+		int ncpus = libbpf_num_possible_cpus();
+		if (ncpus < 1) ncpus = 1;
+		conf->shard_batch = cfg->bucket_size / 100 * cfg->shard_tolerance / (unsigned long long)ncpus;
+		if (conf->shard_batch == 0) conf->shard_batch = 1;
+	}
+}
+
+/*
+ * 规则的冷参数，整条规则一份，不随时间窗与网卡桶变化。
+ * 公平分享的用量按桶的填满时间统计，限制在 10ms-1s 之间，
+ * 既能反映当前的突发，又不会因窗口过短而失去区分度。
+ */
+static void fill_rate_limit_mode(const LimiterConfig *cfg, unsigned int direction,
+				 struct rate_limit_mode_cfg *mc)
+{
+	struct rate_limit_config conf;
+	fill_rate_limit_config(cfg, direction, &conf);
+
+	memset(mc, 0, sizeof(*mc));
+	if (direction != LIMIT_DIR_INGRESS) {
+		mc->horizon_ns = cfg->horizon_ns;
+	}
+	if (conf.mode == LIMIT_MODE_TCM && cfg->peak_rate > 0) {
+		mc->yellow_mark = TCM_YELLOW_MARK_BASE | (cfg->yellow_dscp & 0x3f);
+	}
+	if (conf.fair_reserve) {
+		mc->fair_window_ns = conf.fill_ns;
+		if (mc->fair_window_ns < 10000000ULL) mc->fair_window_ns = 10000000ULL;
+		if (mc->fair_window_ns > 1000000000ULL) mc->fair_window_ns = 1000000000ULL;
+	}
+}
+
+/* 写入槽位上的冷参数；先于规则本身写入，规则生效时数据路径读到的一定是本规则的值 */
+static int write_rule_mode(const LimiterConfig *cfg, unsigned int direction, __u32 slot)
+{
+	int fd = bpf_obj_get(PIN_MAP_MODE);
+	if (fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_MODE, strerror(errno));
+		return -1;
+	}
+	struct rate_limit_mode_cfg mc;
+	fill_rate_limit_mode(cfg, direction, &mc);
+	int err = bpf_map_update_elem(fd, &slot, &mc, BPF_ANY);
+	if (err != 0) {
+		fprintf(stderr, "无法写入规则的冷参数: %s\n", strerror(errno));
+	}
+	close(fd);
+	return err;
+}
+
+/* 规则 map 是否为 cgroup 本地存储（键为 cgroup fd），否则为以 cgroup_id 为键的 hash map */
+static int is_cgrp_storage_map(int map_fd)
+{
+	struct bpf_map_info info = {0};
+	__u32 info_len = sizeof(info);
+	if (bpf_map_get_info_by_fd(map_fd, &info, &info_len) != 0) return 0;
+	return info.type == BPF_MAP_TYPE_CGRP_STORAGE;
+}
+
+/* 规则 map 的键：hash map 用 cgroup_id，cgroup 本地存储用打开的 cgroup 目录 fd */
+struct rule_key {
+	__u64 cgid;
+	int cg_fd;
+	int storage;
+};
+
+static int rule_key_init(struct rule_key *key, int map_fd, const char *cgroup_path, __u64 cgid)
+{
+	key->cgid = cgid;
+	key->cg_fd = -1;
+	key->storage = is_cgrp_storage_map(map_fd);
+	if (!key->storage) {
+		return cgid ? 0 : -1;
+	}
+	if (!cgroup_path) {
+		errno = EINVAL;
+		return -1;
+	}
+	key->cg_fd = open_cgroup_fd(cgroup_path);
+	return key->cg_fd < 0 ? -1 : 0;
+}
+
+static const void *rule_key_ptr(const struct rule_key *key)
+{
+	return key->storage ? (const void *)&key->cg_fd : (const void *)&key->cgid;
+}
+
+static void rule_key_release(struct rule_key *key)
+{
+	if (key->cg_fd >= 0) close(key->cg_fd);
+	key->cg_fd = -1;
+}
+
+/*
+ * 计算嵌套规则的祖先位图：逐级向上检查 MANAGED_ROOT 之下的父目录，
+ * 在同方向 map 中已有规则的层级置位。pace 模式的规则不参与层级扣减。
+ */
+static __u32 compute_ancestor_mask(int map_fd, const char *cgroup_path)
+{
+	if (!cgroup_path) return 0;
+
+	size_t root_len = strlen(MANAGED_ROOT);
+	if (strncmp(cgroup_path, MANAGED_ROOT, root_len) != 0 || cgroup_path[root_len] != '/') {
+		return 0;
+	}
+
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s", cgroup_path) >= (int)sizeof(path)) return 0;
+
+	__u32 mask = 0;
+	char *slash;
+	while ((slash = strrchr(path, '/')) != NULL && (size_t)(slash - path) > root_len) {
+		*slash = '\0';
+		int level = get_cgroup_level(path);
+		if (level <= 0 || level > LIMIT_MAX_NEST_LEVEL) continue;
+
+		struct rule_key key;
+		struct rate_limit_full_info anc;
+		if (rule_key_init(&key, map_fd, path, get_cgroup_id(path)) != 0) {
+			rule_key_release(&key);
+			continue;
+		}
+		int err = bpf_map_lookup_elem(map_fd, rule_key_ptr(&key), &anc);
+		rule_key_release(&key);
+		if (err != 0) continue;
+		if (anc.config.mode == LIMIT_MODE_PACE || anc.config.mode == LIMIT_MODE_SHAPE) {
+			fprintf(stderr, "warning: 父规则 %s 为 %s 模式，不参与层级限速\n", path,
+				limit_mode_name(anc.config.mode));
+			continue;
+		}
+		mask |= 1U << level;
+	}
+	return mask;
+}
+
+/*
+ * 置位与重建位图之间用 RUNTIME_DIR "/filter.lock" 串行。set 先建规则目录再置位：
+ * 重建开始前建好的目录会被遍历到，之后建的目录要等重建写完才置位，都不会被清掉。
+ * 取锁失败返回 -1，调用方照常继续（只是失去互斥）。
+ */
+static int lock_rule_filter(void)
+{
+	char path[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "filter.lock") != 0) return -1;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void unlock_rule_filter(int lock_fd)
+{
+	if (lock_fd >= 0) close(lock_fd);
+}
+
+/*
+ * 在规则过滤位图中标记该 cgroup，否则数据路径会走快速路径直接放行。
+ * 先于规则写入，规则生效时该位一定已经置上；规则目录删除后由 bpf_rebuild_rule_filter 清除。
+ */
+static int rule_filter_add(int filter_fd, unsigned long long cgid)
+{
+	__u32 bit = rule_filter_bit(cgid);
+	__u32 word = bit >> 6;
+	__u64 val = 0;
+	if (bpf_map_lookup_elem(filter_fd, &word, &val) != 0) return -1;
+	if (val & (1ULL << (bit & 63))) return 0;
+	val |= 1ULL << (bit & 63);
+	return bpf_map_update_elem(filter_fd, &word, &val, BPF_ANY) == 0 ? 0 : -1;
+}
+
+static int mark_rule_filter(unsigned long long cgid)
+{
+	int fd = bpf_obj_get(PIN_MAP_FILTER);
+	if (fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_FILTER, strerror(errno));
+		return -1;
+	}
+	int lock_fd = lock_rule_filter();
+	int err = rule_filter_add(fd, cgid);
+	if (err != 0) {
+		fprintf(stderr, "无法更新规则过滤位图: %s\n", strerror(errno));
+	}
+	unlock_rule_filter(lock_fd);
+	close(fd);
+	return err;
+}
+
+/* 把规则目录的 cgroup 记入待写入的位图 */
+static int collect_rule_filter_bit(const char *rule_path, unsigned long long bucket,
+				   unsigned long long rate, void *arg)
+{
+	__u64 *words = arg;
+	(void)bucket;
+	(void)rate;
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 0;
+	__u32 bit = rule_filter_bit(cgid);
+	words[bit >> 6] |= 1ULL << (bit & 63);
+	return 0;
+}
+
+int bpf_rebuild_rule_filter(void)
+{
+	int fd = bpf_obj_get(PIN_MAP_FILTER);
+	if (fd < 0) return 0; /* 程序未加载 */
+
+	__u64 *want = calloc(RULE_FILTER_WORDS, sizeof(*want));
+	if (!want) {
+		close(fd);
+		return -1;
+	}
+
+	int lock_fd = lock_rule_filter();
+	int cleared = 0;
+	if (for_each_rule_dir(MANAGED_ROOT, collect_rule_filter_bit, want) < 0) {
+		cleared = -1;
+		goto out;
+	}
+	/* 只清除不再有规则目录的位，从不在这里置位，逐字比较、只写有变化的字 */
+	for (__u32 w = 0; w < RULE_FILTER_WORDS; w++) {
+		__u64 cur = 0;
+		if (bpf_map_lookup_elem(fd, &w, &cur) != 0) {
+			cleared = -1;
+			break;
+		}
+		__u64 stale = cur & ~want[w];
+		if (!stale) continue;
+		__u64 val = cur & want[w];
+		if (bpf_map_update_elem(fd, &w, &val, BPF_ANY) != 0) {
+			cleared = -1;
+			break;
+		}
+		cleared += __builtin_popcountll(stale);
+	}
+	if (cleared < 0) {
+		fprintf(stderr, "warning: 无法重建规则过滤位图: %s\n", strerror(errno));
+	}
+out:
+	unlock_rule_filter(lock_fd);
+	free(want);
+	close(fd);
+	return cleared;
+}
+
+/* 规则未记录方向时按出方向处理（兼容旧记录） */
+static unsigned int rule_direction(const LimiterConfig *cfg)
+{
+	return cfg->direction ? cfg->direction : LIMIT_DIR_EGRESS;
+}
+
+/* 恢复时写入一条规则；状态清零，由首个包初始化 */
+static int restore_rule_entry(int map_fd, unsigned long long cgid, const LimiterConfig *lc,
+			      unsigned int direction, __u32 slot)
+{
+	struct rate_limit_full_info info;
+	memset(&info, 0, sizeof(info));
+	fill_rate_limit_config(lc, direction, &info.config);
+	info.config.slot = slot;
+	info.config.ancestor_mask = compute_ancestor_mask(map_fd, lc->cgroup_path);
+
+	struct rule_key key;
+	int err = rule_key_init(&key, map_fd, lc->cgroup_path, cgid);
+	if (err == 0) {
+		err = mark_rule_filter(cgid);
+	}
+	if (err == 0) {
+		err = write_rule_mode(lc, direction, slot);
+	}
+	sync_rule_features(&info.config);
+	if (err == 0) {
+		err = bpf_map_update_elem(map_fd, rule_key_ptr(&key), &info, BPF_ANY);
+	}
+	rule_key_release(&key);
+	return err;
+}
+
+static void restore_rule_classes(const char *rule_path, unsigned long long cgid);
+static void restore_rule_schedule(const LimiterConfig *base);
+static void restore_rule_devs(const LimiterConfig *base);
+static int sync_limiter_clock(void);
+
+struct restore_ctx {
+	int cfg_fd;
+	int in_fd;
+	int pid_fd;
+	__u32 next_slot;  /* 刚加载的 map 为空，槽位顺序分配即可（两个方向各占一个） */
+	__u32 max_slots;  /* 规则容量，超出的规则无法恢复 */
+	int restored;
+	int dropped;
+};
+
+static int restore_rule_dir(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	struct restore_ctx *ctx = arg;
+
+	/* 获取 cgroup ID */
+	unsigned long long cgid_backfill = get_cgroup_id(rule_path);
+	if (cgid_backfill == 0ULL) return 0;
+
+	/* 目录名给出 bucket/rate，规则记录（若有）补全其余参数 */
+	LimiterConfig lc = { .cgid = cgid_backfill, .rate_bps = rate, .bucket_size = bucket };
+	(void)load_rule_record(cgid_backfill, &lc);
+	lc.cgroup_path = rule_path;
+
+	unsigned int dir_mask = rule_direction(&lc);
+	unsigned int need = ((dir_mask & LIMIT_DIR_EGRESS) ? 1 : 0) + ((dir_mask & LIMIT_DIR_INGRESS) ? 1 : 0);
+	if (ctx->next_slot + need > ctx->max_slots) {
+		ctx->dropped++;
+		return 0;
+	}
+	int ok = 0;
+	if ((dir_mask & LIMIT_DIR_EGRESS) &&
+	    restore_rule_entry(ctx->cfg_fd, cgid_backfill, &lc, LIMIT_DIR_EGRESS, ctx->next_slot) == 0) {
+		ctx->next_slot++;
+		ok = 1;
+	}
+	if ((dir_mask & LIMIT_DIR_INGRESS) && ctx->in_fd >= 0 &&
+	    restore_rule_entry(ctx->in_fd, cgid_backfill, &lc, LIMIT_DIR_INGRESS, ctx->next_slot) == 0) {
+		ctx->next_slot++;
+		ok = 1;
+	}
+	if (ok) {
+		ctx->restored++;
+		if (dir_mask & LIMIT_DIR_EGRESS) {
+			restore_rule_classes(rule_path, cgid_backfill);
+			restore_rule_devs(&lc);
+		}
+		restore_rule_schedule(&lc);
+	}
+	return 0;
+}
+
+/* 按进程规则表的条目数更新 rate_limit_pid_count，BPF 侧据此跳过进程规则查找 */
+static void sync_pid_rule_count(int pid_fd)
+{
+	__u32 count = 0;
+	__u32 key = 0, next_key = 0;
+	int has_key = 0;
+	while (bpf_map_get_next_key(pid_fd, has_key ? &key : NULL, &next_key) == 0) {
+		count++;
+		key = next_key;
+		has_key = 1;
+	}
+
+	int cnt_fd = bpf_obj_get(PIN_MAP_PID_COUNT);
+	if (cnt_fd < 0) return;
+	__u32 zero = 0;
+	if (bpf_map_update_elem(cnt_fd, &zero, &count, BPF_ANY) != 0) {
+		fprintf(stderr, "warning: 无法更新进程规则计数: %s\n", strerror(errno));
+	}
+	close(cnt_fd);
+}
+
+/* 恢复一条原地进程规则；进程已退出或 tgid 已被复用时删除记录 */
+static int restore_pid_rule(unsigned int tgid, const LimiterConfig *cfg, unsigned long long starttime, void *arg)
+{
+	struct restore_ctx *ctx = arg;
+	unsigned long long cur_st = 0ULL;
+	if (read_proc_starttime((pid_t)tgid, &cur_st) != 0 || cur_st != starttime) {
+		printf("进程 %u 已退出，删除其原地规则记录\n", tgid);
+		(void)delete_pid_rule_record(tgid);
+		return 0;
+	}
+	if (ctx->next_slot >= ctx->max_slots) {
+		ctx->dropped++;
+		return 0;
+	}
+
+	struct rate_limit_full_info info;
+	memset(&info, 0, sizeof(info));
+	fill_rate_limit_config(cfg, LIMIT_DIR_EGRESS, &info.config);
+	info.config.slot = ctx->next_slot;
+	__u32 key = tgid;
+	sync_rule_features(&info.config);
+	if (bpf_map_update_elem(ctx->pid_fd, &key, &info, BPF_ANY) == 0) {
+		ctx->next_slot++;
+		ctx->restored++;
+	}
+	return 0;
+}
+
+/* 从托管目录（含嵌套规则）恢复所有配置到 rate_limit_map / rate_limit_ingress_map，再恢复原地进程规则 */
+/* 恢复整机总限速：map 刚创建，按顺序分配的下一个槽位写入即可 */
+static void restore_host_cap(struct restore_ctx *ctx)
+{
+	LimiterConfig host = { .direction = LIMIT_DIR_EGRESS };
+	if (load_host_cap_record(&host) != 0) return;
+	if (ctx->next_slot >= ctx->max_slots) {
+		ctx->dropped++;
+		return;
+	}
+	int fd = bpf_obj_get(PIN_MAP_HOST);
+	if (fd < 0) return;
+
+	struct rate_limit_full_info info;
+	memset(&info, 0, sizeof(info));
+	host.mode = LIMIT_MODE_POLICE;
+	fill_rate_limit_config(&host, LIMIT_DIR_EGRESS, &info.config);
+	info.config.slot = ctx->next_slot;
+	__u32 key = 0;
+	sync_rule_features(&info.config);
+	if (bpf_map_update_elem(fd, &key, &info, BPF_ANY) == 0) {
+		ctx->next_slot++;
+		printf("已恢复整机限速: rate=%llu bytes/s\n", host.rate_bps);
+	}
+	close(fd);
+}
+
+/* tc 模式的匹配项只以 cgroup_id 指向规则，与规则本身分开恢复 */
+static void restore_tc_matches(void)
+{
+	TcMatch m[TC_MAX_MATCHES];
+	int n = load_tc_match_record(m, TC_MAX_MATCHES);
+	if (n > 0 && bpf_sync_tc_matches(m, n) == 0) {
+		printf("已恢复 tc 匹配项 %d 个\n", n);
+	}
+}
+
+/* 槽位是重新分配的，整形网卡上的 HTB 类要按新槽位整体重建 */
+static void restore_shape_devs(void)
+{
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	if (n <= 0) return;
+	int classes = bpf_sync_shape_classes((const char (*)[16])names, n);
+	if (classes >= 0) {
+		printf("已重建 %d 个整形网卡上的 HTB（shape 规则 %d 条）\n", n, classes);
+	}
+}
+
+static int do_restore_configs(void)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_RULES);
+	if (cfg_fd < 0) {
+		// 如果 rate_limit_map 不存在，说明是首次加载或者 maps 被清理了
+		// 这种情况下不需要恢复配置，直接返回成功
+		if (errno == ENOENT) {
+			printf("rate_limit_map 不存在，跳过配置恢复\n");
+			return 0;
+		}
+		fprintf(stderr, "无法打开 rate_limit_map: %s\n", strerror(errno));
+		return -1;
+	}
+	int in_fd = bpf_obj_get(PIN_MAP_INGRESS);
+	if (in_fd < 0) {
+		fprintf(stderr, "warning: 无法打开 rate_limit_ingress_map，跳过入方向规则: %s\n", strerror(errno));
+	}
+
+	/* 时钟偏移随 map 一起保留，但系统时间或时区可能已经变化，每次 reload 重新校准 */
+	(void)sync_limiter_clock();
+
+	/* 父规则先于子规则写入，子规则据此计算祖先位图 */
+	struct restore_ctx ctx = { .cfg_fd = cfg_fd, .in_fd = in_fd, .pid_fd = -1, .max_slots = LIMIT_DEFAULT_MAX_RULES };
+	struct map_sizing cur;
+	if (get_loaded_map_sizing(&cur) == 0) {
+		ctx.max_slots = cur.max_rules;
+	}
+	int ret = for_each_rule_dir(MANAGED_ROOT, restore_rule_dir, &ctx);
+	close(cfg_fd);
+	if (in_fd >= 0) close(in_fd);
+
+	/* 原地进程规则不依赖托管目录，托管目录不存在时也要恢复 */
+	ctx.pid_fd = bpf_obj_get(PIN_MAP_PID);
+	if (ctx.pid_fd >= 0) {
+		(void)for_each_pid_rule_record(restore_pid_rule, &ctx);
+		sync_pid_rule_count(ctx.pid_fd);
+		close(ctx.pid_fd);
+	}
+	restore_host_cap(&ctx);
+	restore_tc_matches();
+	restore_shape_devs();
+	/* map 是新建的，本机地址表为空、开关为关，按记录重新同步 */
+	int local_on = load_local_bypass_record();
+	int local = bpf_sync_local_bypass(local_on);
+	if (local >= 0 && local_on) {
+		printf("本机流量绕过已启用（本机地址 %d 个）\n", local);
+	}
+	/* 控制包放行默认启用，同样按记录写入新建的 map */
+	CtrlPass cp;
+	load_ctrl_pass_record(&cp);
+	(void)bpf_sync_ctrl_pass(&cp);
+	if (ret < 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", MANAGED_ROOT);
+		return -1;
+	}
+
+	if (ctx.restored > 0) {
+		printf("已恢复 %d 个配置\n", ctx.restored);
+	}
+	if (ctx.dropped > 0) {
+		fprintf(stderr, "warning: 规则容量 %u 不足，%d 条规则未恢复；请用 limiter reload --max-rules <n> 扩容\n",
+			ctx.max_slots, ctx.dropped);
+	}
+	return ctx.restored;
+}
+
+struct slot_scan {
+	int map_fd;
+	unsigned char *used;
+	__u32 max_entries;
+};
+
+static void mark_slot(struct slot_scan *scan, const struct rate_limit_full_info *rule)
+{
+	if (rule->config.slot < scan->max_entries) {
+		scan->used[rule->config.slot] = 1;
+	}
+}
+
+/* cgroup 本地存储无法遍历键，改为按规则目录逐个查找 */
+static int mark_slot_of_dir(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)rate;
+	struct slot_scan *scan = arg;
+	struct rate_limit_full_info rule;
+	int cg_fd = open_cgroup_fd(rule_path);
+	if (cg_fd < 0) return 0;
+	if (bpf_map_lookup_elem(scan->map_fd, &cg_fd, &rule) == 0) {
+		mark_slot(scan, &rule);
+	}
+	close(cg_fd);
+	return 0;
+}
+
+/* 标记某个规则 map 中已占用的槽位 */
+static void mark_used_slots(const char *pin_path, unsigned char *used, __u32 max_entries)
+{
+	int fd = bpf_obj_get(pin_path);
+	if (fd < 0) return;
+
+	struct slot_scan scan = { .map_fd = fd, .used = used, .max_entries = max_entries };
+	if (is_cgrp_storage_map(fd)) {
+		(void)for_each_rule_dir(MANAGED_ROOT, mark_slot_of_dir, &scan);
+		close(fd);
+		return;
+	}
+
+	__u64 key = 0, next_key = 0;
+	int has_key = 0;
+	struct rate_limit_full_info rule;
+	while (bpf_map_get_next_key(fd, has_key ? &key : NULL, &next_key) == 0) {
+		if (bpf_map_lookup_elem(fd, &next_key, &rule) == 0) {
+			mark_slot(&scan, &rule);
+		}
+		key = next_key;
+		has_key = 1;
+	}
+	close(fd);
+}
+
+/* 为新规则分配未被占用的最小槽位（两个方向与进程规则共用计数器与分片数组，需一起扫描） */
+static int alloc_rule_slot(__u32 *slot_out)
+{
+	int stats_fd = bpf_obj_get(PIN_MAP_STATS);
+	if (stats_fd < 0) return -1;
+	struct bpf_map_info info = {0};
+	__u32 info_len = sizeof(info);
+	int err = bpf_map_get_info_by_fd(stats_fd, &info, &info_len);
+	close(stats_fd);
+	if (err != 0 || info.max_entries == 0) {
+		return -1;
+	}
+
+	unsigned char *used = calloc(info.max_entries, 1);
+	if (!used) return -1;
+
+	mark_used_slots(PIN_MAP_RULES, used, info.max_entries);
+	mark_used_slots(PIN_MAP_INGRESS, used, info.max_entries);
+	mark_used_slots(PIN_MAP_PID, used, info.max_entries);
+	/* 整机总限速是单条目数组，未启用时条目全为 0，不能按槽位 0 计 */
+	int host_fd = bpf_obj_get(PIN_MAP_HOST);
+	if (host_fd >= 0) {
+		struct rate_limit_full_info host;
+		__u32 key = 0;
+		if (bpf_map_lookup_elem(host_fd, &key, &host) == 0 && host.config.rate_bps &&
+		    host.config.slot < info.max_entries) {
+			used[host.config.slot] = 1;
+		}
+		close(host_fd);
+	}
+
+	int ret = -1;
+	__u32 in_use = 0;
+	for (__u32 i = 0; i < info.max_entries; i++) {
+		if (used[i]) {
+			in_use++;
+		} else if (ret != 0) {
+			*slot_out = i;
+			ret = 0;
+		}
+	}
+	free(used);
+
+	/* 用量达到 90% 时提前提醒，避免规则表写满后新规则无法生效 */
+	if (ret == 0 && (in_use + 1ULL) * 10 >= info.max_entries * 9ULL) {
+		fprintf(stderr, "warning: 规则槽位已使用 %u/%u，接近容量上限；可用 limiter reload --max-rules <n> 扩容\n",
+			in_use + 1, info.max_entries);
+	}
+	return ret;
+}
+
+/* 清零某个每 CPU 数组在指定槽位上的值 */
+static void reset_percpu_slot(const char *pin_path, __u32 slot, size_t value_size)
+{
+	int fd = bpf_obj_get(pin_path);
+	if (fd < 0) return;
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus > 0) {
+		void *zero = calloc(ncpus, value_size);
+		if (zero) {
+			(void)bpf_map_update_elem(fd, &slot, zero, BPF_ANY);
+			free(zero);
+		}
+	}
+	close(fd);
+}
+
+/* 清零槽位上的计数器与本地额度，避免新规则继承旧数据 */
+static void reset_rule_slot(__u32 slot)
+{
+	reset_percpu_slot(PIN_MAP_STATS, slot, sizeof(struct rate_limit_stats));
+	reset_percpu_slot(PIN_MAP_PCPU, slot, sizeof(struct rate_limit_pcpu));
+}
+
+/* 汇总某个槽位在各 CPU 上的计数器 */
+static int read_slot_stats(__u32 slot, struct rate_limit_stats *out)
+{
+	int stats_fd = bpf_obj_get(PIN_MAP_STATS);
+	if (stats_fd < 0) return -1;
+
+	int ncpus = libbpf_num_possible_cpus();
+	struct rate_limit_stats *values = ncpus > 0 ? calloc(ncpus, sizeof(*values)) : NULL;
+	if (!values) {
+		close(stats_fd);
+		return -1;
+	}
+	int err = bpf_map_lookup_elem(stats_fd, &slot, values);
+	close(stats_fd);
+	if (err == 0) {
+		for (int i = 0; i < ncpus; i++) {
+			out->pass_pkts += values[i].pass_pkts;
+			out->pass_bytes += values[i].pass_bytes;
+			out->drop_pkts += values[i].drop_pkts;
+			out->drop_bytes += values[i].drop_bytes;
+			out->state_init += values[i].state_init;
+			out->mark_pkts += values[i].mark_pkts;
+			out->ctrl_pkts += values[i].ctrl_pkts;
+		}
+	}
+	free(values);
+	return err ? -1 : 0;
+}
+
+/* 汇总指定规则在各 CPU 上的计数器 */
+int bpf_read_rule_stats(const char *cgroup_path, unsigned int direction, struct rate_limit_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	int cfg_fd = bpf_obj_get(rule_map_pin(direction));
+	if (cfg_fd < 0) return -1;
+	struct rate_limit_full_info rule;
+	struct rule_key key;
+	int err = rule_key_init(&key, cfg_fd, cgroup_path, get_cgroup_id(cgroup_path));
+	if (err == 0) {
+		err = bpf_map_lookup_elem(cfg_fd, rule_key_ptr(&key), &rule);
+	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	if (err) return -1;
+
+	return read_slot_stats(rule.config.slot, out);
+}
+
+int bpf_read_pid_stats(unsigned int tgid, struct rate_limit_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	int pid_fd = bpf_obj_get(PIN_MAP_PID);
+	if (pid_fd < 0) return -1;
+	struct rate_limit_full_info rule;
+	__u32 key = tgid;
+	int err = bpf_map_lookup_elem(pid_fd, &key, &rule);
+	close(pid_fd);
+	if (err) return -1;
+
+	return read_slot_stats(rule.config.slot, out);
+}
+
+/*
+ * 写入一条规则的值，key 为规则 map 的键。
+ * 已有规则：在锁内读出当前值，只替换配置部分，保留令牌等运行状态与槽位。
+ * 读与写之间被消耗的少量令牌会被“退回”，对限速精度影响可忽略。
+ * 新规则：状态清零（由首个包初始化），分配空闲槽位。
+ */
+static int write_rule_value(int cfg_fd, const void *key, const LimiterConfig *cfg,
+			    unsigned int direction, __u32 ancestor_mask)
+{
+	struct rate_limit_full_info rule;
+	__u64 flags = BPF_ANY;
+	int was_shape = 0;
+	memset(&rule, 0, sizeof(rule));
+	if (bpf_map_lookup_elem_flags(cfg_fd, key, &rule, BPF_F_LOCK) == 0) {
+		__u32 slot = rule.config.slot;
+		was_shape = rule.config.mode == LIMIT_MODE_SHAPE;
+		__u32 class_count = rule.config.class_count;
+		__u32 sched_count = rule.config.sched_count;
+		__u32 dev_count = rule.config.dev_count;
+		fill_rate_limit_config(cfg, direction, &rule.config);
+		rule.config.slot = slot;
+		rule.config.class_count = class_count;
+		rule.config.sched_count = sched_count;
+		rule.config.dev_count = dev_count;
+		rule.config.ancestor_mask = ancestor_mask;
+		if (rule.state.tokens > rule.config.bucket_size) {
+			rule.state.tokens = rule.config.bucket_size;
+		}
+		if (rule.ext.pkt_tokens > rule.config.pkt_burst * PKT_TOKEN_UNIT) {
+			rule.ext.pkt_tokens = rule.config.pkt_burst * PKT_TOKEN_UNIT;
+		}
+		if (rule.ext.peak_tokens > rule.config.peak_bucket) {
+			rule.ext.peak_tokens = rule.config.peak_bucket;
+		}
+		rule.state.frac = 0; /* refill_shift 可能变化，旧的小数部分作废 */
+		rule.ext.peak_frac = 0;
+		flags |= BPF_F_LOCK;
+	} else {
+		memset(&rule, 0, sizeof(rule));
+		fill_rate_limit_config(cfg, direction, &rule.config);
+		rule.config.ancestor_mask = ancestor_mask;
+		if (alloc_rule_slot(&rule.config.slot) != 0) {
+			fprintf(stderr, "无可用的规则槽位（规则数已达上限），可用 limiter reload --max-rules <n> 扩容\n");
+			return 1;
+		}
+		reset_rule_slot(rule.config.slot);
+	}
+	if (write_rule_mode(cfg, direction, rule.config.slot) != 0) {
+		return 1;
+	}
+
+	sync_rule_features(&rule.config);
+	if (bpf_map_update_elem(cfg_fd, key, &rule, flags) != 0) {
+		if (errno == E2BIG || errno == ENOMEM) {
+			fprintf(stderr, "规则表已满，无法写入新规则: %s\n", strerror(errno));
+		} else {
+			fprintf(stderr, "update config failed: %s\n", strerror(errno));
+		}
+		return 1;
+	}
+	/* shape 规则的整形由网卡上的 HTB 类完成，类按槽位编号 */
+	if (direction == LIMIT_DIR_EGRESS) {
+		shape_sync_rule(cfg, rule.config.slot, was_shape);
+	}
+	return 0;
+}
+
+/* 更新单个方向的规则 */
+static int update_rule_entry(const LimiterConfig *cfg, unsigned int direction)
+{
+	const char *pin_path = rule_map_pin(direction);
+	int cfg_fd = bpf_obj_get(pin_path);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", pin_path, strerror(errno));
+		return 1;
+	}
+
+	/* 本地存储模式下经由 cgroup fd 读写，hash 模式下以 cgroup_id 为键 */
+	struct rule_key key;
+	if (rule_key_init(&key, cfg_fd, cfg->cgroup_path, cfg->cgid) != 0) {
+		fprintf(stderr, "无法打开规则 cgroup %s: %s\n",
+			cfg->cgroup_path ? cfg->cgroup_path : "(未知)", strerror(errno));
+		rule_key_release(&key);
+		close(cfg_fd);
+		return 1;
+	}
+
+	__u32 ancestor_mask = compute_ancestor_mask(cfg_fd, cfg->cgroup_path);
+	int ret = mark_rule_filter(cfg->cgid) == 0 ? 0 : 1;
+	if (ret == 0) {
+		ret = write_rule_value(cfg_fd, rule_key_ptr(&key), cfg, direction, ancestor_mask);
+	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	return ret;
+}
+
+/* 删除单个方向的规则（方向从 both 改为单向时使用），不存在视为成功 */
+static void remove_rule_entry(const LimiterConfig *cfg, unsigned int direction)
+{
+	int cfg_fd = bpf_obj_get(rule_map_pin(direction));
+	if (cfg_fd < 0) return;
+	struct rule_key key;
+	if (rule_key_init(&key, cfg_fd, cfg->cgroup_path, cfg->cgid) == 0) {
+		(void)bpf_map_delete_elem(cfg_fd, rule_key_ptr(&key));
+	}
+	rule_key_release(&key);
+	close(cfg_fd);
+}
+
+int bpf_update_pid_rule(unsigned int tgid, const LimiterConfig *cfg)
+{
+	int pid_fd = bpf_obj_get(PIN_MAP_PID);
+	if (pid_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_PID, strerror(errno));
+		return 1;
+	}
+	__u32 key = tgid;
+	int ret = write_rule_value(pid_fd, &key, cfg, LIMIT_DIR_EGRESS, 0);
+	if (ret == 0) {
+		sync_pid_rule_count(pid_fd);
+	}
+	close(pid_fd);
+	return ret;
+}
+
+int bpf_remove_pid_rule(unsigned int tgid)
+{
+	int pid_fd = bpf_obj_get(PIN_MAP_PID);
+	if (pid_fd < 0) return -1;
+	__u32 key = tgid;
+	int ret = bpf_map_delete_elem(pid_fd, &key) == 0 ? 0 : -1;
+	sync_pid_rule_count(pid_fd);
+	close(pid_fd);
+	return ret;
+}
+
+/* 更新指定 cgroup 的配置 */
+/* 分类 a 的前缀是否覆盖分类 b 的前缀 */
+static int class_prefix_covers(const TrafficClass *a, const TrafficClass *b)
+{
+	if (a->prefix_len > b->prefix_len) return 0;
+	unsigned int full = a->prefix_len / 8;
+	unsigned int rem = a->prefix_len % 8;
+	if (memcmp(a->addr, b->addr, full) != 0) return 0;
+	if (rem == 0) return 1;
+	unsigned char mask = (unsigned char)(0xff << (8 - rem));
+	return (a->addr[full] & mask) == (b->addr[full] & mask);
+}
+
+/* 匹配顺序：前缀更长、端口范围更窄、指定了协议的分类在前，其余按编号 */
+static int class_more_specific(const TrafficClass *a, const TrafficClass *b)
+{
+	if (a->prefix_len != b->prefix_len) return a->prefix_len > b->prefix_len;
+	unsigned int wa = a->port_hi ? a->port_hi - a->port_lo : 65536;
+	unsigned int wb = b->port_hi ? b->port_hi - b->port_lo : 65536;
+	if (wa != wb) return wa < wb;
+	if (!a->proto != !b->proto) return a->proto != 0;
+	return a->id < b->id;
+}
+
+/* 前缀 p 处的分类表值：所有覆盖 p 的分类，按匹配顺序排好 */
+static void build_class_set(const TrafficClass *cls, int n, const TrafficClass *p, struct class_set *set)
+{
+	memset(set, 0, sizeof(*set));
+	for (int i = 0; i < n && set->count < LIMIT_MAX_CLASSES; i++) {
+		if (!class_prefix_covers(&cls[i], p)) continue;
+		/* 插入排序，顺带把原始下标暂存在 pad 中 */
+		__u32 pos = set->count;
+		while (pos > 0 && class_more_specific(&cls[i], &cls[set->m[pos - 1].pad])) {
+			set->m[pos] = set->m[pos - 1];
+			pos--;
+		}
+		set->m[pos].pad = (__u8)i;
+		set->count++;
+	}
+	for (__u32 k = 0; k < set->count; k++) {
+		const TrafficClass *c = &cls[set->m[k].pad];
+		set->m[k].proto = (__u8)c->proto;
+		set->m[k].action = (__u8)c->action;
+		set->m[k].id = (__u8)c->id;
+		set->m[k].pad = 0;
+		set->m[k].port_lo = (__u16)c->port_lo;
+		set->m[k].port_hi = (__u16)c->port_hi;
+	}
+}
+
+static void class_lpm_key_init(struct class_lpm_key *key, unsigned long long cgid, const TrafficClass *c)
+{
+	memset(key, 0, sizeof(*key));
+	key->prefixlen = CLASS_KEY_CGID_BITS + c->prefix_len;
+	key->cgid_hi = (__u32)(cgid >> 32);
+	key->cgid_lo = (__u32)cgid;
+	memcpy(key->addr, c->addr, sizeof(key->addr));
+}
+
+/* 删除分类表中属于该规则的全部前缀（每条规则最多 LIMIT_MAX_CLASSES 个） */
+static void clear_class_lpm(int lpm_fd, unsigned long long cgid)
+{
+	struct class_lpm_key key, next, stale[LIMIT_MAX_CLASSES];
+	int has_key = 0, n = 0;
+	while (bpf_map_get_next_key(lpm_fd, has_key ? &key : NULL, &next) == 0) {
+		if (next.cgid_hi == (__u32)(cgid >> 32) && next.cgid_lo == (__u32)cgid &&
+		    n < LIMIT_MAX_CLASSES) {
+			stale[n++] = next;
+		}
+		key = next;
+		has_key = 1;
+	}
+	for (int i = 0; i < n; i++) {
+		(void)bpf_map_delete_elem(lpm_fd, &stale[i]);
+	}
+}
+
+/* 写入或删除各分类的子桶；已有子桶在锁内读改写，保留当前令牌 */
+static int sync_class_buckets(int bucket_fd, unsigned long long cgid, const TrafficClass *cls, int n)
+{
+	for (unsigned int id = 0; id < LIMIT_MAX_CLASSES; id++) {
+		const TrafficClass *c = NULL;
+		for (int i = 0; i < n; i++) {
+			if (cls[i].id == id && cls[i].action == CLASS_ACTION_LIMIT) c = &cls[i];
+		}
+		struct class_bucket_key bk = { .cgid = cgid, .id = id };
+		if (!c) {
+			(void)bpf_map_delete_elem(bucket_fd, &bk);
+			continue;
+		}
+
+		LimiterConfig lc = {
+			.cgid = cgid,
+			.rate_bps = c->rate_bps,
+			.bucket_size = c->bucket_size,
+			.mode = LIMIT_MODE_POLICE,
+			.direction = LIMIT_DIR_EGRESS,
+		};
+		struct rate_limit_full_info b;
+		__u64 flags = BPF_ANY;
+		memset(&b, 0, sizeof(b));
+		if (bpf_map_lookup_elem_flags(bucket_fd, &bk, &b, BPF_F_LOCK) == 0) {
+			fill_rate_limit_config(&lc, LIMIT_DIR_EGRESS, &b.config);
+			if (b.state.tokens > c->bucket_size) b.state.tokens = c->bucket_size;
+			b.state.frac = 0;
+			flags |= BPF_F_LOCK;
+		} else {
+			memset(&b, 0, sizeof(b));
+			fill_rate_limit_config(&lc, LIMIT_DIR_EGRESS, &b.config);
+		}
+		sync_rule_features(&b.config);
+		if (bpf_map_update_elem(bucket_fd, &bk, &b, flags) != 0) {
+			fprintf(stderr, "无法写入分类 %u 的子桶: %s\n", id, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * 整机总限速：单条目数组，rate_bps 为 0 表示未启用。启用中修改时沿用槽位，
+ * 以 BPF_F_LOCK 读改写保留令牌；首次启用时分配槽位、状态清零。
+ */
+int bpf_update_host_cap(const LimiterConfig *cfg)
+{
+	int fd = bpf_obj_get(PIN_MAP_HOST);
+	if (fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_HOST, strerror(errno));
+		return 1;
+	}
+
+	__u32 key = 0;
+	struct rate_limit_full_info rule;
+	memset(&rule, 0, sizeof(rule));
+	int enabled = bpf_map_lookup_elem_flags(fd, &key, &rule, BPF_F_LOCK) == 0 && rule.config.rate_bps;
+	__u64 flags = BPF_ANY;
+
+	if (!cfg) {
+		/* 停用：整个条目清零，槽位随之释放 */
+		memset(&rule, 0, sizeof(rule));
+	} else {
+		LimiterConfig host = *cfg;
+		host.mode = LIMIT_MODE_POLICE;
+		host.direction = LIMIT_DIR_EGRESS;
+		if (enabled) {
+			__u32 slot = rule.config.slot;
+			fill_rate_limit_config(&host, LIMIT_DIR_EGRESS, &rule.config);
+			rule.config.slot = slot;
+			if (rule.state.tokens > rule.config.bucket_size) {
+				rule.state.tokens = rule.config.bucket_size;
+			}
+			rule.state.frac = 0;
+			flags |= BPF_F_LOCK;
+		} else {
+			memset(&rule, 0, sizeof(rule));
+			fill_rate_limit_config(&host, LIMIT_DIR_EGRESS, &rule.config);
+			if (alloc_rule_slot(&rule.config.slot) != 0) {
+				fprintf(stderr, "无可用的规则槽位（规则数已达上限），可用 limiter reload --max-rules <n> 扩容\n");
+				close(fd);
+				return 1;
+			}
+			reset_rule_slot(rule.config.slot);
+		}
+	}
+
+	int ret = 0;
+	sync_rule_features(&rule.config);
+	if (bpf_map_update_elem(fd, &key, &rule, flags) != 0) {
+		fprintf(stderr, "无法更新整机限速: %s\n", strerror(errno));
+		ret = 1;
+	}
+	close(fd);
+	return ret;
+}
+
+int bpf_read_host_stats(struct rate_limit_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	int fd = bpf_obj_get(PIN_MAP_HOST);
+	if (fd < 0) return -1;
+	struct rate_limit_full_info rule;
+	__u32 key = 0;
+	int err = bpf_map_lookup_elem(fd, &key, &rule);
+	close(fd);
+	if (err || !rule.config.rate_bps) return -1;
+
+	return read_slot_stats(rule.config.slot, out);
+}
+
+/* 收集本机网卡上的地址（去重），IPv4 转为 ::ffff:a.b.c.d，返回地址数 */
+static int collect_local_addrs(struct local_addr_key *keys, int max)
+{
+	struct ifaddrs *ifa_list = NULL;
+	if (getifaddrs(&ifa_list) != 0) {
+		fprintf(stderr, "无法读取网卡地址: %s\n", strerror(errno));
+		return -1;
+	}
+
+	int n = 0;
+	for (struct ifaddrs *ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr) continue;
+		struct local_addr_key k;
+		memset(&k, 0, sizeof(k));
+		if (ifa->ifa_addr->sa_family == AF_INET) {
+			const struct sockaddr_in *sin = (const struct sockaddr_in *)ifa->ifa_addr;
+			k.addr[10] = 0xff;
+			k.addr[11] = 0xff;
+			memcpy(&k.addr[12], &sin->sin_addr, 4);
+		} else if (ifa->ifa_addr->sa_family == AF_INET6) {
+			const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ifa->ifa_addr;
+			memcpy(k.addr, &sin6->sin6_addr, 16);
+		} else {
+			continue;
+		}
+
+		int dup = 0;
+		for (int i = 0; i < n && !dup; i++) {
+			dup = memcmp(&keys[i], &k, sizeof(k)) == 0;
+		}
+		if (dup) continue;
+		if (n >= max) {
+			fprintf(stderr, "warning: 本机地址超过 %d 个，其余地址的流量仍会计费\n", max);
+			break;
+		}
+		keys[n++] = k;
+	}
+	freeifaddrs(ifa_list);
+	return n;
+}
+
+int bpf_sync_local_bypass(int enabled)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_LOCAL_CFG);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_LOCAL_CFG, strerror(errno));
+		return -1;
+	}
+	int addr_fd = bpf_obj_get(PIN_MAP_LOCAL_ADDRS);
+	if (addr_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_LOCAL_ADDRS, strerror(errno));
+		close(cfg_fd);
+		return -1;
+	}
+
+	struct local_addr_key keys[LOCAL_MAX_ADDRS];
+	int n = enabled ? collect_local_addrs(keys, LOCAL_MAX_ADDRS) : 0;
+	if (n < 0) n = 0; /* 读不到网卡地址时仍绕过回环流量 */
+
+	/* 先写入新地址再删除已不存在的，同步过程中本机地址不会短暂地被计费 */
+	for (int i = 0; i < n; i++) {
+		__u8 one = 1;
+		if (bpf_map_update_elem(addr_fd, &keys[i], &one, BPF_ANY) != 0) {
+			fprintf(stderr, "warning: 无法写入本机地址: %s\n", strerror(errno));
+		}
+	}
+	struct local_addr_key cur, next;
+	int has = bpf_map_get_next_key(addr_fd, NULL, &cur) == 0;
+	while (has) {
+		has = bpf_map_get_next_key(addr_fd, &cur, &next) == 0;
+		int keep = 0;
+		for (int i = 0; i < n && !keep; i++) {
+			keep = memcmp(&keys[i], &cur, sizeof(cur)) == 0;
+		}
+		if (!keep) (void)bpf_map_delete_elem(addr_fd, &cur);
+		cur = next;
+	}
+
+	struct local_bypass lb = { .enabled = enabled ? 1 : 0, .addr_count = (__u32)n };
+	__u32 key = 0;
+	int ret = n;
+	if (bpf_map_update_elem(cfg_fd, &key, &lb, BPF_ANY) != 0) {
+		fprintf(stderr, "无法更新本机流量绕过设置: %s\n", strerror(errno));
+		ret = -1;
+	}
+	close(addr_fd);
+	close(cfg_fd);
+	return ret;
+}
+
+int bpf_read_local_bypass(unsigned int *enabled, unsigned char (*addrs)[16], int max)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_LOCAL_CFG);
+	if (cfg_fd < 0) return -1;
+	struct local_bypass lb;
+	__u32 key = 0;
+	int err = bpf_map_lookup_elem(cfg_fd, &key, &lb);
+	close(cfg_fd);
+	if (err) return -1;
+	*enabled = lb.enabled;
+
+	int addr_fd = bpf_obj_get(PIN_MAP_LOCAL_ADDRS);
+	if (addr_fd < 0) return 0;
+	int n = 0;
+	struct local_addr_key cur;
+	int has = bpf_map_get_next_key(addr_fd, NULL, &cur) == 0;
+	while (has && n < max) {
+		memcpy(addrs[n++], cur.addr, 16);
+		has = bpf_map_get_next_key(addr_fd, &cur, &cur) == 0;
+	}
+	close(addr_fd);
+	return n;
+}
+
+int bpf_sync_ctrl_pass(const CtrlPass *cp)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_CTRL_CFG);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_CTRL_CFG, strerror(errno));
+		return -1;
+	}
+	struct ctrl_pass val = { .enabled = cp->enabled ? 1 : 0, .max_len = cp->max_len, .pps = cp->pps };
+	__u32 key = 0;
+	int ret = 0;
+	if (bpf_map_update_elem(cfg_fd, &key, &val, BPF_ANY) != 0) {
+		fprintf(stderr, "无法更新控制包放行设置: %s\n", strerror(errno));
+		ret = -1;
+	}
+	close(cfg_fd);
+	return ret;
+}
+
+int bpf_read_ctrl_pass(CtrlPass *cp)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_CTRL_CFG);
+	if (cfg_fd < 0) return -1;
+	struct ctrl_pass val;
+	__u32 key = 0;
+	int err = bpf_map_lookup_elem(cfg_fd, &key, &val);
+	close(cfg_fd);
+	if (err) return -1;
+	cp->enabled = val.enabled;
+	cp->max_len = val.max_len;
+	cp->pps = val.pps;
+	return 0;
+}
+
+/* 在出方向规则上记录分类数，数据路径据此决定是否查分类表 */
+static int set_rule_class_count(const char *rule_path, unsigned long long cgid, __u32 count)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_RULES);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_RULES, strerror(errno));
+		return -1;
+	}
+	struct rule_key key;
+	struct rate_limit_full_info rule;
+	int err = rule_key_init(&key, cfg_fd, rule_path, cgid);
+	if (err == 0) {
+		err = bpf_map_lookup_elem_flags(cfg_fd, rule_key_ptr(&key), &rule, BPF_F_LOCK);
+		if (err != 0) {
+			fprintf(stderr, "规则 %s 没有出方向限速，流量分类不会生效\n", rule_path);
+		} else {
+			rule.config.class_count = count;
+			sync_rule_features(&rule.config);
+			err = bpf_map_update_elem(cfg_fd, rule_key_ptr(&key), &rule, BPF_EXIST | BPF_F_LOCK);
+			if (err != 0) {
+				fprintf(stderr, "无法更新规则 %s: %s\n", rule_path, strerror(errno));
+			}
+		}
+	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	return err ? -1 : 0;
+}
+
+int bpf_sync_rule_classes(const char *rule_path, unsigned long long cgid,
+			  const TrafficClass *cls, int n)
+{
+	if (n < 0 || n > LIMIT_MAX_CLASSES) return -1;
+
+	int lpm_fd = bpf_obj_get(PIN_MAP_CLASS_LPM);
+	int bucket_fd = bpf_obj_get(PIN_MAP_CLASS);
+	if (lpm_fd < 0 || bucket_fd < 0) {
+		fprintf(stderr, "无法打开分类表（eBPF 程序未加载？）: %s\n", strerror(errno));
+		if (lpm_fd >= 0) close(lpm_fd);
+		if (bucket_fd >= 0) close(bucket_fd);
+		return -1;
+	}
+
+	/* 先关闭分类查找，再整体重建前缀表，最后重新打开 */
+	int ret = set_rule_class_count(rule_path, cgid, 0);
+	if (ret == 0) {
+		clear_class_lpm(lpm_fd, cgid);
+		ret = sync_class_buckets(bucket_fd, cgid, cls, n);
+	}
+	for (int i = 0; ret == 0 && i < n; i++) {
+		struct class_lpm_key key;
+		struct class_set set;
+		class_lpm_key_init(&key, cgid, &cls[i]);
+		build_class_set(cls, n, &cls[i], &set);
+		if (bpf_map_update_elem(lpm_fd, &key, &set, BPF_ANY) != 0) {
+			fprintf(stderr, "无法写入分类表: %s\n", strerror(errno));
+			ret = -1;
+		}
+	}
+	if (ret == 0 && n > 0) {
+		ret = set_rule_class_count(rule_path, cgid, (__u32)n);
+	}
+	close(lpm_fd);
+	close(bucket_fd);
+	return ret;
+}
+
+/* 按分类记录重建规则的分类表，没有分类时不做任何事 */
+static void restore_rule_classes(const char *rule_path, unsigned long long cgid)
+{
+	TrafficClass cls[LIMIT_MAX_CLASSES];
+	int n = load_class_record(cgid, cls, LIMIT_MAX_CLASSES);
+	if (n <= 0 || !rule_path) return;
+	if (bpf_sync_rule_classes(rule_path, cgid, cls, n) != 0) {
+		fprintf(stderr, "warning: 规则 %s 的流量分类未能恢复\n", rule_path);
+	}
+}
+
+/*
+ * 校准 limiter_clock_map：本地墙上时间 = CLOCK_MONOTONIC (bpf_ktime_get_ns) + offset。
+ * 偏移含当前时区的 UTC 偏移，夏令时切换、改时区或手动调整系统时间后需要重新校准
+ * （speed-limiter-clock.timer 定时执行 schedule sync）；NTP 的微调只带来很小的漂移。
+ */
+static int sync_limiter_clock(void)
+{
+	struct timespec rt, mono;
+	if (clock_gettime(CLOCK_REALTIME, &rt) != 0 || clock_gettime(CLOCK_MONOTONIC, &mono) != 0) {
+		return -1;
+	}
+	time_t now = rt.tv_sec;
+	struct tm lt;
+	if (!localtime_r(&now, &lt)) return -1;
+
+	struct limiter_clock clk;
+	clk.offset_ns = ((__s64)rt.tv_sec - (__s64)mono.tv_sec + (__s64)lt.tm_gmtoff) * 1000000000LL +
+			((__s64)rt.tv_nsec - (__s64)mono.tv_nsec);
+
+	int fd = bpf_obj_get(PIN_MAP_CLOCK);
+	if (fd < 0) return -1;
+	__u32 key = 0;
+	int err = bpf_map_update_elem(fd, &key, &clk, BPF_ANY);
+	close(fd);
+	return err ? -1 : 0;
+}
+
+int bpf_sync_limiter_clock(void)
+{
+	if (sync_limiter_clock() != 0) {
+		fprintf(stderr, "无法校准时间窗时钟（eBPF 程序未加载？）: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * 写入单个方向规则的时间窗表：每个窗按规则的其余参数换上窗内的速率/容量后完整计算一份配置，
+ * 槽位等字段沿用规则本身。先写时间窗表再打开 sched_count；清除时顺序相反。
+ */
+static int sync_rule_schedule_dir(int sched_fd, const LimiterConfig *base, unsigned int direction,
+				  const RateWindow *w, int n)
+{
+	const char *pin_path = rule_map_pin(direction);
+	int cfg_fd = bpf_obj_get(pin_path);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", pin_path, strerror(errno));
+		return -1;
+	}
+	struct rule_key key;
+	struct rate_limit_full_info rule;
+	int err = rule_key_init(&key, cfg_fd, base->cgroup_path, base->cgid);
+	if (err == 0) {
+		err = bpf_map_lookup_elem_flags(cfg_fd, rule_key_ptr(&key), &rule, BPF_F_LOCK);
+		if (err != 0) {
+			fprintf(stderr, "规则 %s 没有%s方向限速\n", base->cgroup_path ? base->cgroup_path : "(未知)",
+				direction == LIMIT_DIR_INGRESS ? "入" : "出");
+		}
+	}
+	if (err != 0) {
+		rule_key_release(&key);
+		close(cfg_fd);
+		return -1;
+	}
+
+	__u32 slot = rule.config.slot;
+	if (n > 0) {
+		struct rate_schedule sched;
+		memset(&sched, 0, sizeof(sched));
+		sched.count = (__u32)n;
+		for (int i = 0; i < n; i++) {
+			LimiterConfig wc = *base;
+			wc.rate_bps = w[i].rate_bps;
+			wc.bucket_size = w[i].bucket_size;
+			/* tcm 模式要求峰值速率不低于承诺速率 */
+			if (wc.peak_rate && wc.peak_rate < wc.rate_bps) wc.peak_rate = wc.rate_bps;
+			sched.w[i].start_sec = w[i].start_sec;
+			sched.w[i].end_sec = w[i].end_sec;
+			sched.w[i].days = w[i].days;
+			fill_rate_limit_config(&wc, direction, &sched.w[i].config);
+			sched.w[i].config.slot = slot;
+			sched.w[i].config.ancestor_mask = rule.config.ancestor_mask;
+			sched.w[i].config.class_count = rule.config.class_count;
+			sync_rule_features(&sched.w[i].config);
+		}
+		if (bpf_map_update_elem(sched_fd, &slot, &sched, BPF_ANY) != 0) {
+			fprintf(stderr, "无法写入时间窗表: %s\n", strerror(errno));
+			err = -1;
+		}
+	}
+	if (err == 0) {
+		/* sched_next_ns 清零，下一个包立即按新的时间窗表选窗 */
+		rule.config.sched_count = (__u8)n;
+		sync_rule_features(&rule.config);
+		rule.ext.sched_next_ns = 0;
+		rule.state.sched_idx = 0;
+		err = bpf_map_update_elem(cfg_fd, rule_key_ptr(&key), &rule, BPF_EXIST | BPF_F_LOCK);
+		if (err != 0) {
+			fprintf(stderr, "无法更新规则 %s: %s\n", base->cgroup_path ? base->cgroup_path : "(未知)",
+				strerror(errno));
+		}
+	}
+	if (err == 0 && n == 0) {
+		(void)bpf_map_delete_elem(sched_fd, &slot);
+	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	return err ? -1 : 0;
+}
+
+int bpf_sync_rule_schedule(const LimiterConfig *base, const RateWindow *w, int n)
+{
+	if (n < 0 || n > LIMIT_MAX_WINDOWS) return -1;
+
+	int sched_fd = bpf_obj_get(PIN_MAP_SCHED);
+	if (sched_fd < 0) {
+		fprintf(stderr, "无法打开时间窗表（eBPF 程序未加载？）: %s\n", strerror(errno));
+		return -1;
+	}
+	if (n > 0 && sync_limiter_clock() != 0) {
+		fprintf(stderr, "warning: 无法校准时间窗时钟，时间窗可能按错误的时间生效\n");
+	}
 
-	//attach_cg_path不能为空
-	if (attach_cg_path == NULL) {
-		fprintf(stderr, "attach cgroup path can't be null\n");
-		return 1;
+	int ret = 0;
+	unsigned int dir_mask = rule_direction(base);
+	const unsigned int dirs[] = { LIMIT_DIR_EGRESS, LIMIT_DIR_INGRESS };
+	for (int i = 0; ret == 0 && i < 2; i++) {
+		if (dir_mask & dirs[i]) {
+			ret = sync_rule_schedule_dir(sched_fd, base, dirs[i], w, n);
+		}
 	}
+	close(sched_fd);
+	return ret;
+}
 
-	/* 创建托管 cgroup 目录 */
-	if (ensure_dir(attach_cg_path, 0755) != 0) {
-		return 1;
+/* 按时间窗记录重建规则的时间窗表，没有时间窗时不做任何事 */
+static void restore_rule_schedule(const LimiterConfig *base)
+{
+	RateWindow w[LIMIT_MAX_WINDOWS];
+	int n = load_schedule_record(base->cgid, w, LIMIT_MAX_WINDOWS);
+	if (n <= 0 || !base->cgroup_path) return;
+	if (bpf_sync_rule_schedule(base, w, n) != 0) {
+		fprintf(stderr, "warning: 规则 %s 的分时速率未能恢复\n", base->cgroup_path);
 	}
+}
 
-	/* 创建bpffs目录 */
-	if (ensure_dir(BPFFS_DIR, 0755) != 0) {
-		return 1;
+/* 在出方向规则上记录网卡桶数，数据路径据此决定是否查网卡桶表 */
+static int set_rule_dev_count(const LimiterConfig *base, __u32 count)
+{
+	const char *rule_path = base->cgroup_path ? base->cgroup_path : "(未知)";
+	int cfg_fd = bpf_obj_get(PIN_MAP_RULES);
+	if (cfg_fd < 0) {
+		fprintf(stderr, "无法打开 %s: %s\n", PIN_MAP_RULES, strerror(errno));
+		return -1;
+	}
+	struct rule_key key;
+	struct rate_limit_full_info rule;
+	int err = rule_key_init(&key, cfg_fd, base->cgroup_path, base->cgid);
+	if (err == 0) {
+		err = bpf_map_lookup_elem_flags(cfg_fd, rule_key_ptr(&key), &rule, BPF_F_LOCK);
+		if (err != 0) {
+			fprintf(stderr, "规则 %s 没有出方向限速，网卡桶不会生效\n", rule_path);
+		} else {
+			rule.config.dev_count = count;
+			sync_rule_features(&rule.config);
+			err = bpf_map_update_elem(cfg_fd, rule_key_ptr(&key), &rule, BPF_EXIST | BPF_F_LOCK);
+			if (err != 0) {
+				fprintf(stderr, "无法更新规则 %s: %s\n", rule_path, strerror(errno));
+			}
+		}
 	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	return err ? -1 : 0;
+}
 
-	int ret = bpf_load_program(bpf_obj_path, &obj, &prog_fd);//后续出错都要释放obj，prog_fd
-	if (ret != 0) {
-		fprintf(stderr, "bpf_load_program failed: %s\n", strerror(errno));
-		return 1;
+/* 规则出方向的配置，网卡桶的槽位、祖先与分类沿用它 */
+static int read_rule_egress_config(const LimiterConfig *base, struct rate_limit_config *out)
+{
+	int cfg_fd = bpf_obj_get(PIN_MAP_RULES);
+	if (cfg_fd < 0) return -1;
+	struct rule_key key;
+	struct rate_limit_full_info rule;
+	int err = rule_key_init(&key, cfg_fd, base->cgroup_path, base->cgid);
+	if (err == 0) {
+		err = bpf_map_lookup_elem(cfg_fd, rule_key_ptr(&key), &rule);
 	}
+	rule_key_release(&key);
+	close(cfg_fd);
+	if (err != 0) return -1;
+	*out = rule.config;
+	return 0;
+}
 
-	// 根据附加模式选择不同的附加方式
-	if (attach_mode == ATTACH_MODE_LINK) {
-		ret = bpf_attach_cgroup_with_link(prog_fd, attach_cg_path);
-		if (ret != 0) {
-			fprintf(stderr, "bpf_attach_cgroup_with_link failed: %s\n", strerror(errno));
-			goto err;
+/* 删除规则不再使用的网卡桶（网卡被移除或 ifindex 变化后留下的旧条目也一并删除） */
+static void clear_stale_dev_buckets(int dev_fd, unsigned long long cgid, const DevBucket *d, int n)
+{
+	struct dev_bucket_key stale[LIMIT_MAX_DEVS * 2];
+	int cnt;
+	do {
+		struct dev_bucket_key cur, next;
+		int has = 0;
+		cnt = 0;
+		while (cnt < (int)(sizeof(stale) / sizeof(stale[0])) &&
+		       bpf_map_get_next_key(dev_fd, has ? &cur : NULL, &next) == 0) {
+			cur = next;
+			has = 1;
+			if (cur.cgid != cgid) continue;
+			int keep = 0;
+			for (int i = 0; i < n; i++) {
+				if (d[i].ifindex == cur.ifindex) keep = 1;
+			}
+			if (!keep) stale[cnt++] = cur;
 		}
-	} else {
-		ret = bpf_attach_cgroup(prog_fd, attach_cg_path, attach_flags);
-		if (ret != 0) {
-			fprintf(stderr, "bpf_attach_cgroup failed: %s\n", strerror(errno));
-			goto err;
+		for (int i = 0; i < cnt; i++) {
+			(void)bpf_map_delete_elem(dev_fd, &stale[i]);
 		}
+	} while (cnt == (int)(sizeof(stale) / sizeof(stale[0])));
+}
+
+/*
+ * 写入规则出方向的网卡桶：每个桶按规则的其余参数换上该网卡的速率/容量后完整计算一份配置，
+ * 槽位、祖先与分类沿用规则本身，不分片（各 CPU 的本地额度按槽位存放，与规则本身共用）。
+ * 先关闭 dev_count 再重建，最后重新打开；已有的桶在锁内读改写，保留当前令牌。
+ */
+int bpf_sync_rule_devs(const LimiterConfig *base, const DevBucket *d, int n)
+{
+	if (n < 0 || n > LIMIT_MAX_DEVS) return -1;
+
+	int dev_fd = bpf_obj_get(PIN_MAP_DEV);
+	if (dev_fd < 0) {
+		fprintf(stderr, "无法打开网卡桶表（eBPF 程序未加载？）: %s\n", strerror(errno));
+		return -1;
 	}
 
-	// 7. 固定 map
-	struct bpf_map *pm;
-	pm = bpf_object__find_map_by_name(obj, "rate_limit_config_map");
-	if (pm) {
-		(void)unlink(PIN_MAP_CFG);
-		if (bpf_map__pin(pm, PIN_MAP_CFG) != 0 && errno != EEXIST) {
-			fprintf(stderr, "warning: 无法固定 config_map: %s\n", strerror(errno));
-			goto err;
-		}
+	struct rate_limit_config rc;
+	int ret = set_rule_dev_count(base, 0);
+	if (ret == 0) {
+		ret = read_rule_egress_config(base, &rc);
 	}
-	pm = bpf_object__find_map_by_name(obj, "rate_limit_state_map");
-	if (pm) {
-		(void)unlink(PIN_MAP_STATE);
-		if (bpf_map__pin(pm, PIN_MAP_STATE) != 0 && errno != EEXIST) {
-			fprintf(stderr, "warning: 无法固定 state_map: %s\n", strerror(errno));
-			goto err;
+	if (ret == 0) {
+		clear_stale_dev_buckets(dev_fd, base->cgid, d, n);
+	}
+	for (int i = 0; ret == 0 && i < n; i++) {
+		LimiterConfig dc = *base;
+		dc.rate_bps = d[i].rate_bps;
+		dc.bucket_size = d[i].bucket_size;
+		dc.shard_tolerance = 0;
+		/* tcm 模式要求峰值速率不低于承诺速率 */
+		if (dc.peak_rate && dc.peak_rate < dc.rate_bps) dc.peak_rate = dc.rate_bps;
+
+		struct dev_bucket_key dk = { .cgid = base->cgid, .ifindex = d[i].ifindex };
+		struct rate_limit_full_info b;
+		__u64 flags = BPF_ANY;
+		memset(&b, 0, sizeof(b));
+		if (bpf_map_lookup_elem_flags(dev_fd, &dk, &b, BPF_F_LOCK) == 0) {
+			fill_rate_limit_config(&dc, LIMIT_DIR_EGRESS, &b.config);
+			if (b.state.tokens > b.config.bucket_size) b.state.tokens = b.config.bucket_size;
+			if (b.ext.pkt_tokens > b.config.pkt_burst * PKT_TOKEN_UNIT) {
+				b.ext.pkt_tokens = b.config.pkt_burst * PKT_TOKEN_UNIT;
+			}
+			if (b.ext.peak_tokens > b.config.peak_bucket) b.ext.peak_tokens = b.config.peak_bucket;
+			b.state.frac = 0;
+			b.ext.peak_frac = 0;
+			flags |= BPF_F_LOCK;
+		} else {
+			memset(&b, 0, sizeof(b));
+			fill_rate_limit_config(&dc, LIMIT_DIR_EGRESS, &b.config);
 		}
+		b.config.slot = rc.slot;
+		b.config.ancestor_mask = rc.ancestor_mask;
+		b.config.class_count = rc.class_count;
+		sync_rule_features(&b.config);
+		if (bpf_map_update_elem(dev_fd, &dk, &b, flags) != 0) {
+			fprintf(stderr, "无法写入网卡 %s 的桶: %s\n", d[i].name, strerror(errno));
+			ret = -1;
+		}
+	}
+	if (ret == 0 && n > 0) {
+		ret = set_rule_dev_count(base, (__u32)n);
 	}
+	close(dev_fd);
+	return ret;
+}
 
-    printf("eBPF 程序已加载并固定 (attach to: %s)\n", attach_cg_path);
-	return 0;
-err:
-	bpf_object__close(obj);
-	return 1;
+/* 按网卡桶记录重建规则的网卡桶，没有网卡桶时不做任何事 */
+static void restore_rule_devs(const LimiterConfig *base)
+{
+	DevBucket d[LIMIT_MAX_DEVS];
+	int n = load_dev_record(base->cgid, d, LIMIT_MAX_DEVS);
+	if (n <= 0 || !base->cgroup_path) return;
+	if (bpf_sync_rule_devs(base, d, n) != 0) {
+		fprintf(stderr, "warning: 规则 %s 的网卡桶未能恢复\n", base->cgroup_path);
+	}
 }
 
+static void tc_src_key_init(struct tc_src_key *key, const TcMatch *m)
+{
+	memset(key, 0, sizeof(*key));
+	key->prefixlen = m->prefix_len;
+	memcpy(key->addr, m->addr, sizeof(key->addr));
+}
 
-static int bpf_attach_cgroup(int prog_fd, const char *attach_cg_path, unsigned int attach_flags)
+/* 删除匹配表中不在 keys 里的项，遍历时先取下一个键再删除 */
+static void clear_stale_tc_keys(int fd, const void *keys, int n, size_t key_sz)
 {
-	// 只使用 bpf_prog_attach 方式附加程序（支持 MULTI 但不持久化）
-	int cg_fd = open_cgroup_fd(attach_cg_path);
-	if (cg_fd < 0) {
-		fprintf(stderr, "open %s failed: %s\n", attach_cg_path, strerror(errno));
-		return 1;
+	unsigned char cur[sizeof(struct tc_src_key)], next[sizeof(struct tc_src_key)];
+	int has = bpf_map_get_next_key(fd, NULL, cur) == 0;
+	while (has) {
+		has = bpf_map_get_next_key(fd, cur, next) == 0;
+		int keep = 0;
+		for (int i = 0; i < n && !keep; i++) {
+			keep = memcmp((const unsigned char *)keys + (size_t)i * key_sz, cur, key_sz) == 0;
+		}
+		if (!keep) (void)bpf_map_delete_elem(fd, cur);
+		memcpy(cur, next, key_sz);
 	}
+}
 
-	if (bpf_prog_attach(prog_fd, cg_fd, BPF_CGROUP_INET_EGRESS, attach_flags) != 0) {
-		fprintf(stderr, "bpf_prog_attach 失败: %s\n", strerror(errno));
-		close(cg_fd);
-		return 1;
+int bpf_sync_tc_matches(const TcMatch *m, int n)
+{
+	int match_fd = bpf_obj_get(PIN_MAP_TC_MATCH);
+	int src_fd = bpf_obj_get(PIN_MAP_TC_SRC);
+	int cfg_fd = bpf_obj_get(PIN_MAP_TC_CFG);
+	int ret = 0;
+	if (match_fd < 0 || src_fd < 0 || cfg_fd < 0) {
+		fprintf(stderr, "无法打开 tc 匹配表: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
 	}
-	
-	close(cg_fd);
-	printf("eBPF 程序已通过 prog_attach 方式附加 (attach to: %s)\n", attach_cg_path);
-	return 0;
+
+	struct tc_match_key match_keys[TC_MAX_MATCHES];
+	struct tc_src_key src_keys[TC_MAX_MATCHES];
+	int n_match = 0, n_src = 0;
+	__u32 types = 0;
+
+	/* 先写入新项再删除旧项，同步过程中已有的匹配不会短暂失效 */
+	for (int i = 0; i < n && i < TC_MAX_MATCHES; i++) {
+		__u64 cgid = m[i].cgid;
+		int err;
+		if (m[i].type == TC_MATCH_SRC) {
+			tc_src_key_init(&src_keys[n_src], &m[i]);
+			err = bpf_map_update_elem(src_fd, &src_keys[n_src], &cgid, BPF_ANY);
+			if (!err) n_src++;
+		} else {
+			match_keys[n_match] = (struct tc_match_key){ .type = m[i].type, .value = m[i].value };
+			err = bpf_map_update_elem(match_fd, &match_keys[n_match], &cgid, BPF_ANY);
+			if (!err) n_match++;
+		}
+		if (err) {
+			fprintf(stderr, "warning: 无法写入 tc 匹配项: %s\n", strerror(errno));
+			ret = -1;
+			continue;
+		}
+		types |= 1U << m[i].type;
+	}
+	clear_stale_tc_keys(match_fd, match_keys, n_match, sizeof(match_keys[0]));
+	clear_stale_tc_keys(src_fd, src_keys, n_src, sizeof(src_keys[0]));
+
+	struct tc_match_cfg cfg = { .types = types };
+	__u32 key = 0;
+	if (bpf_map_update_elem(cfg_fd, &key, &cfg, BPF_ANY) != 0) {
+		fprintf(stderr, "无法更新 tc 匹配设置: %s\n", strerror(errno));
+		ret = -1;
+	}
+out:
+	if (match_fd >= 0) close(match_fd);
+	if (src_fd >= 0) close(src_fd);
+	if (cfg_fd >= 0) close(cfg_fd);
+	return ret;
 }
 
-/* 使用 bpf_link 方式附加程序到 cgroup（支持持久化） */
-int bpf_attach_cgroup_with_link(int prog_fd, const char *cgroup_path)
+static int build_tc_link_pin(const char *ifname, char *out, size_t out_size)
 {
-	// 打开目标 cgroup
-	int cg_fd = open_cgroup_fd(cgroup_path);
-	if (cg_fd < 0) {
-		fprintf(stderr, "open %s failed: %s\n", cgroup_path, strerror(errno));
-		return 1;
+	int len = snprintf(out, out_size, "%s/%s%s", BPFFS_DIR, PIN_TC_LINK_PREFIX, ifname);
+	return (len < 0 || (size_t)len >= out_size) ? -1 : 0;
+}
+
+int bpf_tc_attach_dev(const char *ifname)
+{
+	unsigned int ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		fprintf(stderr, "找不到网卡 %s: %s\n", ifname, strerror(errno));
+		return -1;
+	}
+	char pin[PATH_MAX];
+	if (build_tc_link_pin(ifname, pin, sizeof(pin)) != 0) {
+		fprintf(stderr, "无法生成 %s 的 link 固定路径\n", ifname);
+		return -1;
+	}
+	int prog_fd = bpf_obj_get(PIN_PROG_TC);
+	if (prog_fd < 0) {
+		fprintf(stderr, "limit_tc 未加载，请先执行 limiter set 或 limiter reload\n");
+		return -1;
 	}
 
-	// 使用 bpf_link 方式附加程序
-	struct bpf_link_create_opts opts = {0};
-	opts.sz = sizeof(opts);
-	int link_fd = bpf_link_create(prog_fd, cg_fd, BPF_CGROUP_INET_EGRESS, &opts);
-	if (link_fd < 0) {
-		fprintf(stderr, "bpf_link_create 失败: %s\n", strerror(errno));
-		close(cg_fd);
-		return 1;
+	/* 网卡重建后旧 link 已随旧网卡失效，重新附加前先清掉同名的固定路径 */
+	int old_fd = bpf_obj_get(pin);
+	if (old_fd >= 0) {
+		(void)bpf_link_detach(old_fd);
+		close(old_fd);
 	}
+	(void)unlink(pin);
 
-	// 固定 link 到文件系统（持久化）
-	(void)unlink(PIN_LINK_PERSISTENT); // 忽略不存在的错误
-	if (bpf_obj_pin(link_fd, PIN_LINK_PERSISTENT) != 0) {
-		fprintf(stderr, "warning: 无法固定链接到 %s（可能未挂载 bpffs）\n", PIN_LINK_PERSISTENT);
+	int link_fd = bpf_link_create(prog_fd, (int)ifindex, BPF_TCX_EGRESS, NULL);
+	close(prog_fd);
+	if (link_fd < 0) {
+		fprintf(stderr, "无法附加 limit_tc 到 %s 的 tcx 出方向: %s（需要内核 6.6+）\n", ifname, strerror(errno));
+		return -1;
+	}
+	if (bpf_obj_pin(link_fd, pin) != 0) {
+		fprintf(stderr, "warning: 无法固定链接到 %s: %s\n", pin, strerror(errno));
 		close(link_fd);
-		close(cg_fd);
-		return 1;
+		return -1;
 	}
-	
 	close(link_fd);
-	close(cg_fd);
-	printf("eBPF 程序已通过 link 方式附加并持久化 (attach to: %s)\n", cgroup_path);
+	printf("limit_tc 已附加到 %s 的 tcx 出方向 (ifindex %u, pin: %s)\n", ifname, ifindex, pin);
 	return 0;
 }
 
-/* 检查 link 是否已附加 */
-int bpf_is_link_attached(const char *cgroup_path)
+int bpf_tc_detach_dev(const char *ifname)
 {
-	(void)cgroup_path; // 暂时不使用，因为 link 是全局的
-	return (access(PIN_LINK_PERSISTENT, F_OK) == 0) ? 1 : 0;
+	char pin[PATH_MAX];
+	if (build_tc_link_pin(ifname, pin, sizeof(pin)) != 0) return -1;
+	return detach_link_pin(pin);
 }
 
-/* 卸载 link 附加的程序 */
-int bpf_detach_link(const char *cgroup_path)
+int bpf_tc_dev_attached(const char *ifname)
 {
-	(void)cgroup_path; // link 是全局的，不需要指定 cgroup_path
-	
-	// 首先尝试从内核中分离 link
-	int link_fd = open(PIN_LINK_PERSISTENT, O_RDONLY);
-	if (link_fd >= 0) {
-		// 从内核中分离 link
-		if (bpf_link_detach(link_fd) == 0) {
-			close(link_fd);
-			// 然后删除 pinned link 文件
-			if (unlink(PIN_LINK_PERSISTENT) == 0) {
-				printf("已卸载 limit_egress 程序 (通过删除 link pin): %s\n", cgroup_path ? cgroup_path : "全局");
-				return 1;
-			}
-		} else {
-			close(link_fd);
-		}
-	}
-	
-	// 如果无法打开 link 文件，尝试直接删除
-	if (unlink(PIN_LINK_PERSISTENT) == 0) {
-		printf("已卸载 limit_egress 程序 (通过删除 link pin): %s\n", cgroup_path ? cgroup_path : "全局");
-		return 1;
-	}
-	
-	// 如果 pin 文件不存在，说明程序可能已经被卸载
-	if (errno == ENOENT) {
-		return 0; // 没有需要卸载的程序
-	}
-	
-	fprintf(stderr, "卸载 limit_egress 程序失败: %s\n", strerror(errno));
-	return -1;
+	char pin[PATH_MAX];
+	if (build_tc_link_pin(ifname, pin, sizeof(pin)) != 0) return 0;
+	return access(pin, F_OK) == 0;
 }
 
-/* 从托管目录恢复所有配置到 config_map */
-static int do_restore_configs(void)
+int bpf_detach_tc_links(void)
 {
-	int cfg_fd = bpf_obj_get(PIN_MAP_CFG);
-	if (cfg_fd < 0) {
-		// 如果 config_map 不存在，说明是首次加载或者 maps 被清理了
-		// 这种情况下不需要恢复配置，直接返回成功
-		if (errno == ENOENT) {
-			printf("config_map 不存在，跳过配置恢复\n");
-			return 0;
+	int total = 0;
+	DIR *dir = opendir(BPFFS_DIR);
+	if (dir) {
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (strncmp(entry->d_name, PIN_TC_LINK_PREFIX, strlen(PIN_TC_LINK_PREFIX)) != 0) continue;
+			char pin_path[PATH_MAX];
+			if (SAFE_PATH_JOIN(pin_path, BPFFS_DIR, entry->d_name) != 0) continue;
+			if (detach_link_pin(pin_path) > 0) total++;
 		}
-		fprintf(stderr, "无法打开 config_map: %s\n", strerror(errno));
-		return -1;
+		closedir(dir);
 	}
+	(void)unlink(PIN_PROG_TC);
+	return total;
+}
 
-	char *manage_dir = MANAGED_ROOT;
-	DIR *dir = opendir(manage_dir);
-	if (!dir) {
-		fprintf(stderr, "无法打开托管目录: %s\n", manage_dir);
-		close(cfg_fd);
-		return -1;
-	}
+struct shape_sync_ctx {
+	const char (*devs)[16];
+	int n;
+	int classes;
+};
 
-	struct dirent *entry;
-	int restored = 0;
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.') continue;
+static int sync_shape_rule_dir(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	struct shape_sync_ctx *ctx = arg;
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 0;
+
+	LimiterConfig lc = { .cgid = cgid, .rate_bps = rate, .bucket_size = bucket };
+	(void)load_rule_record(cgid, &lc);
+	lc.cgroup_path = rule_path;
+	if (lc.mode != LIMIT_MODE_SHAPE || !(rule_direction(&lc) & LIMIT_DIR_EGRESS)) return 0;
+
+	struct rate_limit_config rc;
+	if (read_rule_egress_config(&lc, &rc) != 0) return 0;
+	int ok = 1;
+	for (int i = 0; i < ctx->n; i++) {
+		if (shape_update_class(ctx->devs[i], rc.slot, rc.rate_bps, rc.bucket_size) != 0) ok = 0;
+	}
+	if (ok) ctx->classes++;
+	return 0;
+}
 
-		char rule_path[PATH_MAX];
-		SAFE_PATH_JOIN(rule_path, manage_dir, entry->d_name);
+int bpf_sync_shape_classes(const char (*devs)[16], int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (shape_reset_dev(devs[i]) != 0) return -1;
+	}
+	struct shape_sync_ctx ctx = { .devs = devs, .n = n };
+	(void)for_each_rule_dir(MANAGED_ROOT, sync_shape_rule_dir, &ctx);
+	return ctx.classes;
+}
 
-		/* 检查是否为目录 */
-		struct stat st;
-		if (stat(rule_path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+/* 子规则祖先位图的重算：一次只处理一个方向的规则表 */
+struct child_mask_ctx {
+	int cfg_fd;
+	int sched_fd;
+	int dev_fd;
+	unsigned int direction;
+};
 
-		/* 解析目录名格式：bucket_<bytes>_rate_<bps> */
-		unsigned long long bucket = 0ULL, rate = 0ULL;
-		if (sscanf(entry->d_name, "bucket_%llu_rate_%llu", &bucket, &rate) != 2) continue;
+/* 改写时间窗表与网卡桶中子规则配置的副本，二者的祖先位图都沿用规则本身 */
+static void sync_mask_copies(const struct child_mask_ctx *ctx, const struct rate_limit_config *rc, __u64 cgid)
+{
+	if (rc->sched_count && ctx->sched_fd >= 0) {
+		struct rate_schedule sched;
+		__u32 slot = rc->slot;
+		if (bpf_map_lookup_elem(ctx->sched_fd, &slot, &sched) == 0) {
+			for (__u32 i = 0; i < sched.count && i < LIMIT_MAX_WINDOWS; i++) {
+				sched.w[i].config.ancestor_mask = rc->ancestor_mask;
+				sync_rule_features(&sched.w[i].config);
+			}
+			(void)bpf_map_update_elem(ctx->sched_fd, &slot, &sched, BPF_EXIST);
+		}
+	}
+	if (ctx->direction != LIMIT_DIR_EGRESS || !rc->dev_count || ctx->dev_fd < 0) return;
+
+	struct dev_bucket_key cur, next;
+	int has = 0;
+	while (bpf_map_get_next_key(ctx->dev_fd, has ? &cur : NULL, &next) == 0) {
+		cur = next;
+		has = 1;
+		if (cur.cgid != cgid) continue;
+		struct rate_limit_full_info b;
+		if (bpf_map_lookup_elem_flags(ctx->dev_fd, &cur, &b, BPF_F_LOCK) != 0) continue;
+		b.config.ancestor_mask = rc->ancestor_mask;
+		sync_rule_features(&b.config);
+		(void)bpf_map_update_elem(ctx->dev_fd, &cur, &b, BPF_EXIST | BPF_F_LOCK);
+	}
+}
 
-		/* 获取 cgroup ID */
-		unsigned long long cgid_backfill = get_cgroup_id(rule_path);
-		if (cgid_backfill == 0ULL) continue;
+static int refresh_child_mask(const char *rule_path, unsigned long long bucket,
+			      unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)rate;
+	const struct child_mask_ctx *ctx = arg;
+	__u64 cgid = get_cgroup_id(rule_path);
+	struct rule_key key;
+	struct rate_limit_full_info rule;
+	if (rule_key_init(&key, ctx->cfg_fd, rule_path, cgid) != 0 ||
+	    bpf_map_lookup_elem_flags(ctx->cfg_fd, rule_key_ptr(&key), &rule, BPF_F_LOCK) != 0) {
+		rule_key_release(&key);
+		return 0;
+	}
 
-		/* 写入配置 */
-		struct rate_limit_config conf2;
-		conf2.rate_bps = rate;
-		conf2.bucket_size = bucket;
-		if (bpf_map_update_elem(cfg_fd, &cgid_backfill, &conf2, BPF_ANY) == 0) {
-			restored++;
+	__u32 mask = compute_ancestor_mask(ctx->cfg_fd, rule_path);
+	if (mask != rule.config.ancestor_mask) {
+		rule.config.ancestor_mask = mask;
+		sync_rule_features(&rule.config);
+		if (bpf_map_update_elem(ctx->cfg_fd, rule_key_ptr(&key), &rule, BPF_EXIST | BPF_F_LOCK) != 0) {
+			fprintf(stderr, "warning: 无法更新子规则 %s 的祖先位图: %s\n", rule_path, strerror(errno));
+		} else {
+			sync_mask_copies(ctx, &rule.config, cgid);
 		}
 	}
-	closedir(dir);
-	close(cfg_fd);
+	rule_key_release(&key);
+	return 0;
+}
+
+/*
+ * 规则写入或删除某个方向之后，重算其下已有子规则的祖先位图（父规则新建、删除、
+ * 改为 pace/shape 模式时子规则的位图都会变化），时间窗与网卡桶中的副本一并改写。
+ * 两个方向都要处理：方向从 both 改为单向时，另一方向的子规则要清掉这一层。
+ */
+static void refresh_child_masks(const char *rule_path)
+{
+	if (!rule_path) return;
 
-	if (restored > 0) {
-		printf("已恢复 %d 个配置\n", restored);
+	struct child_mask_ctx ctx = {
+		.sched_fd = bpf_obj_get(PIN_MAP_SCHED),
+		.dev_fd = bpf_obj_get(PIN_MAP_DEV),
+	};
+	const unsigned int dirs[] = { LIMIT_DIR_EGRESS, LIMIT_DIR_INGRESS };
+	for (int i = 0; i < 2; i++) {
+		ctx.direction = dirs[i];
+		ctx.cfg_fd = bpf_obj_get(rule_map_pin(dirs[i]));
+		if (ctx.cfg_fd < 0) continue;
+		(void)for_each_rule_dir(rule_path, refresh_child_mask, &ctx);
+		close(ctx.cfg_fd);
 	}
-	return restored;
+	if (ctx.sched_fd >= 0) close(ctx.sched_fd);
+	if (ctx.dev_fd >= 0) close(ctx.dev_fd);
 }
 
-/* 更新指定 cgroup 的配置 */
-static int do_update_config(unsigned long long cgid, unsigned long long rate, unsigned long long bucket)
+static int do_update_config(const LimiterConfig *cfg)
 {
+	unsigned long long cgid = cfg->cgid;
+	unsigned long long rate = cfg->rate_bps;
+	unsigned long long bucket = cfg->bucket_size;
 	if (rate == 0ULL || bucket == 0ULL) {
 		fprintf(stderr, "无效的配置参数: rate=%llu, bucket=%llu\n", rate, bucket);
 		return 1;
 	}
 
-	struct rate_limit_config conf;
-	conf.rate_bps = rate;
-	conf.bucket_size = bucket;
-
-	int cfg_fd = bpf_obj_get(PIN_MAP_CFG);
-	if (cfg_fd < 0) {
-		fprintf(stderr, "无法打开 config_map: %s\n", strerror(errno));
-		return 1;
-	}
-
-	int err = bpf_map_update_elem(cfg_fd, &cgid, &conf, BPF_ANY);
-	if (err) {
-		fprintf(stderr, "update config failed: %s\n", strerror(errno));
-		close(cfg_fd);
-		return 1;
+	unsigned int dir_mask = rule_direction(cfg);
+	const unsigned int dirs[] = { LIMIT_DIR_EGRESS, LIMIT_DIR_INGRESS };
+	for (int i = 0; i < 2; i++) {
+		if (dir_mask & dirs[i]) {
+			if (update_rule_entry(cfg, dirs[i]) != 0) {
+				return 1;
+			}
+			if (dirs[i] == LIMIT_DIR_EGRESS) {
+				restore_rule_classes(cfg->cgroup_path, cgid);
+				/* 网卡桶沿用规则的其余参数，要按新参数重新计算 */
+				restore_rule_devs(cfg);
+			}
+		} else {
+			remove_rule_entry(cfg, dirs[i]);
+		}
 	}
-	close(cfg_fd);
+	/* 规则参数变了，时间窗的配置要按新参数重新计算 */
+	restore_rule_schedule(cfg);
+	/* 本规则的方向或模式变了，已有子规则的祖先位图要随之重算 */
+	refresh_child_masks(cfg->cgroup_path);
 
-	printf("已更新配置：cgroup_id=%llu, rate=%llu, bucket=%llu\n", cgid, rate, bucket);
+	printf("已更新配置：cgroup_id=%llu, rate=%llu, bucket=%llu, mode=%s, direction=%s\n",
+	       cgid, rate, bucket, limit_mode_name(cfg->mode), limit_direction_name(dir_mask));
 	return 0;
 }
 
@@ -332,23 +2735,29 @@ static int do_update_config(unsigned long long cgid, unsigned long long rate, un
 static int is_bpf_program_loaded(void)
 {
 	// 检查 link 模式（持久化）
-	if (access(PIN_LINK_PERSISTENT, F_OK) == 0) {
+	if (bpf_is_link_attached(NULL)) {
 		return 1;
 	}
 	
-	// 检查 prog_attach 模式（通过检查是否有程序附加到根 cgroup）
-	int cg_fd = open_cgroup_fd(ATTACH_POINT);
-	if (cg_fd < 0) {
-		return 0;
+	// 检查 prog_attach 模式（通过检查是否有程序附加到附加范围内的 cgroup）
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int scope_cnt = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+	int loaded = 0;
+	for (int s = 0; s < scope_cnt && !loaded; s++) {
+		int cg_fd = open_cgroup_fd(scope[s]);
+		if (cg_fd < 0) {
+			continue;
+		}
+		for (int i = 0; i < LIMITER_PROG_CNT && !loaded; i++) {
+			__u32 prog_ids[256] = {0};
+			__u32 prog_cnt = 256;
+			int ret = bpf_prog_query(cg_fd, limiter_progs[i].type, 0, NULL, prog_ids, &prog_cnt);
+			// 如果查询成功且有程序附加，说明是 prog_attach 模式
+			loaded = (ret == 0 && prog_cnt > 0);
+		}
+		close(cg_fd);
 	}
-	
-	__u32 prog_ids[256] = {0};
-	__u32 prog_cnt = 256;
-	int ret = bpf_prog_query(cg_fd, BPF_CGROUP_INET_EGRESS, 0, NULL, prog_ids, &prog_cnt);
-	close(cg_fd);
-	
-	// 如果查询成功且有程序附加，说明是 prog_attach 模式
-	return (ret == 0 && prog_cnt > 0) ? 1 : 0;
+	return loaded;
 }
 
 /* 检查指定程序 ID 是否有对应的 bpf_link */
@@ -395,12 +2804,16 @@ const char* get_prog_attach_mode(__u32 prog_id)
 AttachMode get_current_attach_mode(void)
 {
 	// 检查 link 模式（持久化）- 这是最可靠的检测方法
-	if (access(PIN_LINK_PERSISTENT, F_OK) == 0) {
+	if (bpf_is_link_attached(NULL)) {
 		return ATTACH_MODE_LINK;
 	}
 	
-	// 如果没有 link 文件，检查是否有程序附加到根 cgroup
-	int cg_fd = open_cgroup_fd(ATTACH_POINT);
+	// 如果没有 link 文件，检查是否有程序附加到附加范围内的第一个 cgroup
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	if (bpf_attach_scope(scope, ATTACH_SCOPE_MAX) <= 0) {
+		return ATTACH_MODE_LINK;
+	}
+	int cg_fd = open_cgroup_fd(scope[0]);
 	if (cg_fd < 0) {
 		return ATTACH_MODE_LINK; // 默认返回 link 模式
 	}
@@ -442,8 +2855,70 @@ static int get_prog_info_name(int prog_fd, char *name_out, size_t name_sz)
 	return 0;
 }
 
-//卸载cgroup_path下的limit_egress
-int detach_limit_egress(const char *cgroup_path)
+/* 按程序名查找固定的 link 指向的程序 */
+struct link_prog_lookup {
+	const char *prog_name;
+	int prog_fd;
+};
+
+static int lookup_link_prog_cb(const char *pin_path, void *arg)
+{
+	struct link_prog_lookup *lk = arg;
+	__u32 prog_id = 0;
+	if (link_pin_prog_id(pin_path, &prog_id) != 0) return 0;
+	int pfd = bpf_prog_get_fd_by_id(prog_id);
+	if (pfd < 0) return 0;
+	char pname[BPF_OBJ_NAME_LEN] = {0};
+	if (get_prog_info_name(pfd, pname, sizeof(pname)) == 0 && strcmp(pname, lk->prog_name) == 0) {
+		lk->prog_fd = pfd;
+		return 1;
+	}
+	close(pfd);
+	return 0;
+}
+
+/*
+ * 取已附加的本工具程序的 fd（调用者负责关闭）：link 模式经由固定的 link 找到程序
+ * （各附加范围的 link 指向同一个程序），prog_attach 模式在附加范围的 cgroup 上按名称查找。
+ * 找不到返回 -1。
+ */
+int bpf_get_attached_prog_fd(const char *prog_name)
+{
+	int t = find_limiter_prog(prog_name);
+	if (t < 0) return -1;
+
+	struct link_prog_lookup lk = { .prog_name = prog_name, .prog_fd = -1 };
+	if (for_each_link_pin(lookup_link_prog_cb, &lk) > 0) {
+		return lk.prog_fd;
+	}
+
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int scope_cnt = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+	int found = -1;
+	for (int s = 0; s < scope_cnt && found < 0; s++) {
+		int cg_fd = open_cgroup_fd(scope[s]);
+		if (cg_fd < 0) continue;
+		__u32 prog_ids[256] = {0};
+		__u32 prog_cnt = 256;
+		if (bpf_prog_query(cg_fd, limiter_progs[t].type, 0, NULL, prog_ids, &prog_cnt) == 0) {
+			for (__u32 i = 0; i < prog_cnt && found < 0; i++) {
+				int pfd = bpf_prog_get_fd_by_id(prog_ids[i]);
+				if (pfd < 0) continue;
+				char pname[BPF_OBJ_NAME_LEN] = {0};
+				if (get_prog_info_name(pfd, pname, sizeof(pname)) == 0 && strcmp(pname, prog_name) == 0) {
+					found = pfd;
+				} else {
+					close(pfd);
+				}
+			}
+		}
+		close(cg_fd);
+	}
+	return found;
+}
+
+//卸载cgroup_path下的 limit_egress / limit_ingress
+int detach_limiter_progs(const char *cgroup_path)
 {
 	if (!cgroup_path) return -1;
 	int cg_fd = open_cgroup_fd(cgroup_path);
@@ -452,46 +2927,52 @@ int detach_limit_egress(const char *cgroup_path)
 		return -1;
 	}
 
-	__u32 prog_ids[256] = {0};
-	__u32 prog_cnt = 256;
-	int err = bpf_prog_query(cg_fd, BPF_CGROUP_INET_EGRESS, 0 /* query_flags */, NULL /* attach_flags_out */, prog_ids, &prog_cnt);
-	if (err != 0) {
-		fprintf(stderr, "bpf_prog_query failed: %s\n", strerror(errno));
-		close(cg_fd);
-		return -1;
-	}
-
 	int success = 0;
-	for (__u32 i = 0; i < prog_cnt; i++) {
-		int pfd = bpf_prog_get_fd_by_id(prog_ids[i]);
-		if (pfd < 0) continue;
-		char pname[BPF_OBJ_NAME_LEN] = {0};
-		if (get_prog_info_name(pfd, pname, sizeof(pname)) == 0) {
-			if (strcmp(pname, "limit_egress") == 0) {
-				if (bpf_prog_detach2(pfd, cg_fd, BPF_CGROUP_INET_EGRESS) != 0) {
-					fprintf(stderr, "bpf_prog_detach2 failed for %s: %s\n", cgroup_path, strerror(errno));
-				} else {
-					success++;
+	for (int t = 0; t < LIMITER_PROG_CNT; t++) {
+		__u32 prog_ids[256] = {0};
+		__u32 prog_cnt = 256;
+		int err = bpf_prog_query(cg_fd, limiter_progs[t].type, 0 /* query_flags */, NULL /* attach_flags_out */, prog_ids, &prog_cnt);
+		if (err != 0) {
+			fprintf(stderr, "bpf_prog_query failed: %s\n", strerror(errno));
+			close(cg_fd);
+			return -1;
+		}
+
+		for (__u32 i = 0; i < prog_cnt; i++) {
+			int pfd = bpf_prog_get_fd_by_id(prog_ids[i]);
+			if (pfd < 0) continue;
+			char pname[BPF_OBJ_NAME_LEN] = {0};
+			if (get_prog_info_name(pfd, pname, sizeof(pname)) == 0) {
+				if (strcmp(pname, limiter_progs[t].name) == 0) {
+					if (bpf_prog_detach2(pfd, cg_fd, limiter_progs[t].type) != 0) {
+						fprintf(stderr, "bpf_prog_detach2 failed for %s: %s\n", cgroup_path, strerror(errno));
+					} else {
+						success++;
+					}
 				}
 			}
+			close(pfd);
 		}
-		close(pfd);
 	}
 	close(cg_fd);
 	return success;
 }
 
+static int purge_link_cb(const char *pin_path, void *arg)
+{
+	int *removed_count = arg;
+	if (unlink(pin_path) == 0) {
+		printf("已取消 BPF 程序链接: %s\n", pin_path);
+		(*removed_count)++;
+	}
+	return 0;
+}
+
 int bpf_purge_links(void)
 {
 	int removed_count = 0;
-	char link_files[][PATH_MAX] = {PIN_LINK_PERSISTENT };
 	
-	for (int i = 0; i < 1; i++) {
-		if (unlink(link_files[i]) == 0) {
-			printf("已取消 BPF 程序链接: %s\n", link_files[i]);
-			removed_count++;
-		}
-	}
+	(void)for_each_link_pin(purge_link_cb, &removed_count);
 
 	if (removed_count == 0) {
 		printf("BPF 程序链接不存在或已取消\n");
@@ -503,10 +2984,9 @@ int bpf_purge_links(void)
 int bpf_purge_maps(void)
 {
 	int removed_count = 0;
-	char map_files[][PATH_MAX] = { PIN_MAP_CFG, PIN_MAP_STATE };
-	for (int i = 0; i < 2; i++) {
-		if (unlink(map_files[i]) == 0) {
-			printf("已删除: %s\n", map_files[i]);
+	for (int i = 0; i < LIMITER_MAP_CNT; i++) {
+		if (unlink(limiter_maps[i].pin) == 0) {
+			printf("已删除: %s\n", limiter_maps[i].pin);
 			removed_count++;
 		}
 	}
@@ -514,7 +2994,20 @@ int bpf_purge_maps(void)
 	return removed_count;
 }
 
-int bpf_detach_limit_egress_all(void)
+int bpf_detach_scope_progs(void)
+{
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int scope_cnt = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+	int total = 0;
+	int failed = 0;
+	for (int s = 0; s < scope_cnt; s++) {
+		int n = detach_limiter_progs(scope[s]);
+		if (n < 0) failed = 1; else total += n;
+	}
+	return (failed && total == 0) ? -1 : total;
+}
+
+int bpf_detach_limiter_all(void)
 {
 	// 首先尝试卸载 link 模式
 	int link_result = bpf_detach_link(NULL);
@@ -526,7 +3019,7 @@ int bpf_detach_limit_egress_all(void)
 	// 如果没有 link 模式，则卸载 prog_attach 模式
 	int total = 0;
 	int failed = 0;
-	int n = detach_limit_egress(MANAGED_ROOT);
+	int n = detach_limiter_progs(MANAGED_ROOT);
 	if (n < 0) failed = 1; else total += n;
 	DIR *dir = opendir(MANAGED_ROOT);
 	if (!dir) return failed ? -1 : total;
@@ -537,7 +3030,7 @@ int bpf_detach_limit_egress_all(void)
 		if (SAFE_PATH_JOIN(rule_path, MANAGED_ROOT, entry->d_name) != 0) continue;
 		struct stat st;
 		if (stat(rule_path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
-		n = detach_limit_egress(rule_path);
+		n = detach_limiter_progs(rule_path);
 		if (n < 0) failed = 1; else total += n;
 	}
 	closedir(dir);
@@ -549,9 +3042,13 @@ int do_load(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int
 {
     int ret = 0;
 
-    unsigned long long cgid = cfg ? cfg->cgid : 0ULL;
     unsigned long long rate = cfg ? cfg->rate_bps : 0ULL;
     unsigned long long bucket = cfg ? cfg->bucket_size : 0ULL;
+    LimiterConfig rule = {0};
+    if (cfg) {
+        rule = *cfg;
+        rule.bucket_size = bucket ? bucket : rate;
+    }
 
     /* 场景1：仅更新配置（reload_flag == UPDATE_CONFIG_ONLY） */
     if (reload_flag == UPDATE_CONFIG_ONLY) {
@@ -559,11 +3056,14 @@ int do_load(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int
             fprintf(stderr, "eBPF 程序未加载，无法更新配置\n");
             return 1;
         }
-        return do_update_config(cgid, rate, bucket ? bucket : rate);
+        return do_update_config(&rule);
     }
 
     /* 场景2：重载程序（reload_flag == RELOAD_PROGRAM） */
     if (reload_flag == RELOAD_PROGRAM) {
+        /* 附加范围无效时不要先把现有程序卸掉 */
+        if (attach_scope_changed(opts) < 0) return 1;
+
         /* 先卸载现有程序 */
         (void)do_unload(0);
         
@@ -581,9 +3081,20 @@ int do_load(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int
     /* 检查是否需要重新加载（附加模式变化） */
     if (!need_load && opts) {
         AttachMode current_mode = get_current_attach_mode();
+        int scope_changed = attach_scope_changed(opts);
+        if (scope_changed < 0) return 1;
         if (current_mode != opts->attach_mode) {
             printf("检测到附加模式变化，重新加载程序\n");
             need_load = 1;
+        } else if (scope_changed) {
+            printf("检测到附加范围变化，重新加载程序\n");
+            (void)do_unload(0);
+            need_load = 1;
+        } else if (map_sizing_changed(opts)) {
+            /* 容量与分配方式只能在创建 map 时决定，规则随后从托管目录恢复 */
+            printf("检测到规则容量或分配方式变化，重新加载程序\n");
+            (void)do_unload(0);
+            need_load = 1;
         }
     }
     
@@ -597,7 +3108,7 @@ int do_load(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int
 
     /* 场景4：需要添加新配置 */
     if (rate != 0ULL) {
-        ret = do_update_config(cgid, rate, bucket ? bucket : rate);
+        ret = do_update_config(&rule);
         if (ret != 0) return ret;
     }
 
@@ -607,35 +3118,39 @@ int do_load(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int
 /* 卸载单个 BPF 程序 */
 static int unload_single_program(__u32 prog_id, const char *prog_name)
 {
-	// 只处理我们的 limit_egress 程序
-	if (strcmp(prog_name, "limit_egress") != 0) {
+	// 只处理我们的 limit_egress / limit_ingress 程序
+	int idx = find_limiter_prog(prog_name);
+	if (idx < 0) {
 		return 0;
 	}
 	
 	// 检查程序是否有对应的 bpf_link
 	if (has_bpf_link(prog_id)) {
-		// 有 link，使用 link 方式卸载
-		int result = bpf_detach_link(NULL);
-		if (result > 0) {
-			printf("已卸载 link 模式的程序 (ID: %u)\n", prog_id);
+		// 有 link，卸载各附加范围上指向该程序的 link
+		struct link_detach_ctx ctx = { .prog_id = prog_id };
+		(void)for_each_link_pin(detach_link_cb, &ctx);
+		if (ctx.total > 0) {
+			printf("已卸载 link 模式的程序 (ID: %u, link %d 个)\n", prog_id, ctx.total);
 			return 1;
 		}
 	} else {
-		// 没有 link，使用 prog_attach 方式卸载
+		// 没有 link，使用 prog_attach 方式从附加范围内的各 cgroup 卸载
 		int prog_fd = bpf_prog_get_fd_by_id(prog_id);
 		if (prog_fd >= 0) {
-			// 尝试从根 cgroup 卸载
-			int cg_fd = open_cgroup_fd(ATTACH_POINT);
-			if (cg_fd >= 0) {
-				int ret = bpf_prog_detach2(prog_fd, cg_fd, BPF_CGROUP_INET_EGRESS);
+			char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+			int scope_cnt = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+			int detached = 0;
+			for (int s = 0; s < scope_cnt; s++) {
+				int cg_fd = open_cgroup_fd(scope[s]);
+				if (cg_fd < 0) continue;
+				if (bpf_prog_detach2(prog_fd, cg_fd, limiter_progs[idx].type) == 0) detached++;
 				close(cg_fd);
-				if (ret == 0) {
-					printf("已卸载 prog_attach 模式的程序 (ID: %u)\n", prog_id);
-					close(prog_fd);
-					return 1;
-				}
 			}
 			close(prog_fd);
+			if (detached > 0) {
+				printf("已卸载 prog_attach 模式的程序 (ID: %u)\n", prog_id);
+				return 1;
+			}
 		}
 	}
 	
@@ -650,7 +3165,7 @@ int do_unload(unsigned long long cgid)
 	int total_detached = 0;
 	int failed = 0;
 	
-	// 遍历所有 BPF 程序，找到 limit_egress 程序并卸载
+	// 遍历所有 BPF 程序，找到 limit_egress / limit_ingress 程序并卸载
 	__u32 prog_id = 0;
 	while (bpf_prog_get_next_id(prog_id, &prog_id) == 0) {
 		int prog_fd = bpf_prog_get_fd_by_id(prog_id);
@@ -674,11 +3189,14 @@ int do_unload(unsigned long long cgid)
 		close(prog_fd);
 	}
 	
+	// 网卡上的 limit_tc 引用着即将删除的 map，一并卸载；网卡记录保留，加载时重新附加
+	total_detached += bpf_detach_tc_links();
+
 	// 清理 maps
 	bpf_purge_maps();
 	
 	if (total_detached > 0) {
-		printf("已卸载 %d 个 limit_egress 程序\n", total_detached);
+		printf("已卸载 %d 个限速程序\n", total_detached);
 	}
 	
 	return failed ? -1 : total_detached;
@@ -2,6 +2,8 @@
 #define BPF_H
 
 #include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/limits.h>
 
 /* 附加模式枚举 */
 typedef enum {
@@ -9,40 +11,205 @@ typedef enum {
     ATTACH_MODE_LINK = 1,         /* 使用 bpf_link，支持持久化但不支持 MULTI */
 } AttachMode;
 
+/* 规则表的内存分配方式 */
+#define MAP_ALLOC_KEEP     0  /* 沿用上次加载时的设置（首次为预分配） */
+#define MAP_ALLOC_PREALLOC 1  /* 加载时一次性分配全部条目 */
+#define MAP_ALLOC_DYNAMIC  2  /* BPF_F_NO_PREALLOC：按需分配，规则少时省内存 */
+
 /* 载入/附加程序的选项 */
 typedef struct LoadOptions {
     const char *bpf_obj_path;   /* BPF 对象文件路径 */
     const char *cgroup_path;    /* 目标 cgroup 路径（可选） */
     unsigned int attach_flags;  /* 传递给 bpf_prog_attach 的 flags，如 BPF_F_ALLOW_MULTI */
     AttachMode attach_mode;     /* 附加模式：prog_attach 或 link */
+    int debug;                  /* 非 0 时启用 BPF 侧 bpf_printk 调试输出（加载时生效） */
+    unsigned int max_rules;     /* 规则容量（槽位数），0 表示沿用上次设置 */
+    unsigned int map_alloc;     /* 规则表分配方式 MAP_ALLOC_* */
+    const char *attach_scope;   /* 附加范围：root、managed 或逗号分隔的 cgroup 路径，NULL 表示沿用上次设置 */
+    int update;                 /* set：同名规则已存在且参数不同时允许改写（--update） */
 } LoadOptions;
 
 
+/* 限速方向（位掩码，可组合） */
+#define LIMIT_DIR_EGRESS  0x1
+#define LIMIT_DIR_INGRESS 0x2
+#define LIMIT_DIR_BOTH    (LIMIT_DIR_EGRESS | LIMIT_DIR_INGRESS)
+
 typedef struct LimiterConfig {
     unsigned long long cgid;    /* 目标 cgroup id，可为 0 表示不写配置 */
     unsigned long long rate_bps;   /* 速率（bytes/s） */
     unsigned long long bucket_size;/* 桶大小（bytes）*/
+    unsigned int mode;             /* 限速模式 LIMIT_MODE_*，默认 police */
+    unsigned long long horizon_ns; /* pace 模式允许的最大延迟（ns），0 表示默认值 */
+    unsigned int shard_tolerance;  /* 分片模式允许的误差（桶容量的百分比），0 表示精确模式 */
+    unsigned int direction;        /* 限速方向 LIMIT_DIR_*，0 表示默认 egress */
+    const char *cgroup_path;       /* 规则 cgroup 路径，用于查找嵌套规则的祖先；可为 NULL */
+    unsigned long long pps;        /* 包速率（包/秒），0 表示不限包数 */
+    unsigned long long pkt_burst;  /* 包令牌桶容量（包），0 表示等于 pps */
+    unsigned long long ecn_soft;   /* ecn 模式：剩余令牌低于此值开始标记（bytes），0 表示桶容量的一半 */
+    unsigned long long ecn_hard;   /* ecn 模式：桶耗尽后允许继续透支并标记的字节数，超出才丢包 */
+    unsigned int fair_pct;         /* 公平分享：为轻量 socket 保留的桶容量百分比，0 表示不启用 */
+    unsigned long long peak_rate;  /* tcm 模式：峰值速率 PIR（bytes/s）；承诺速率即 rate_bps */
+    unsigned long long peak_burst; /* tcm 模式：峰值桶容量 PBS（bytes），0 表示等于 bucket_size */
+    unsigned int yellow_dscp;      /* tcm 模式：黄色包要改写成的 DSCP (0-63) */
 } LimiterConfig;
 
+/* 出方向流量分类（limiter class），匹配字段的含义见 limiter.h 的 struct class_match */
+typedef struct TrafficClass {
+    unsigned int id;               /* 分类编号 0..LIMIT_MAX_CLASSES-1 */
+    unsigned char addr[16];        /* 目的前缀，IPv4 以 ::ffff:a.b.c.d 表示，前缀外的位为 0 */
+    unsigned int prefix_len;       /* 按 128 位地址计的前缀长度 */
+    unsigned int proto;            /* IPPROTO_*，0 表示任意协议 */
+    unsigned int port_lo;          /* 目的端口范围，port_hi 为 0 表示任意端口 */
+    unsigned int port_hi;
+    unsigned int action;           /* CLASS_ACTION_* */
+    unsigned long long rate_bps;   /* 子桶速率（bytes/s），仅 CLASS_ACTION_LIMIT */
+    unsigned long long bucket_size;/* 子桶容量（bytes） */
+} TrafficClass;
+
+/* 分时速率的一个时间窗（limiter schedule），含义见 limiter.h 的 struct sched_window */
+typedef struct RateWindow {
+    unsigned int days;             /* 星期位图，bit 0 为星期日 ... bit 6 为星期六 */
+    unsigned int start_sec;        /* 本地时间，当天零点起的秒数 */
+    unsigned int end_sec;          /* 结束时刻（不含），小于 start_sec 表示跨零点；24:00 为 86400 */
+    unsigned long long rate_bps;   /* 窗内速率（bytes/s） */
+    unsigned long long bucket_size;/* 窗内桶容量（bytes） */
+} RateWindow;
+
+/* 按出口网卡区分的桶（limiter set --dev），含义见 limiter.h 的 struct dev_bucket_key */
+typedef struct DevBucket {
+    unsigned int ifindex;          /* 出口网卡，设置时由网卡名解析 */
+    char name[16];                 /* 网卡名（IF_NAMESIZE），reload 时按名字重新解析 ifindex */
+    unsigned long long rate_bps;   /* 经该网卡发出的速率（bytes/s） */
+    unsigned long long bucket_size;/* 桶容量（bytes） */
+} DevBucket;
+
+/* tc 模式的匹配项（limiter tc add），含义见 limiter.h 的 TC_MATCH_* */
+typedef struct TcMatch {
+    unsigned int type;             /* TC_MATCH_MARK / TC_MATCH_IIF / TC_MATCH_SRC */
+    unsigned int value;            /* fwmark，或入口网卡的 ifindex（由网卡名解析） */
+    char ifname[16];               /* 入口网卡名，reload 时按名字重新解析 ifindex */
+    unsigned char addr[16];        /* 源地址前缀（IPv4 映射为 ::ffff:a.b.c.d） */
+    unsigned int prefix_len;       /* 源地址前缀长度（0-128） */
+    unsigned long long cgid;       /* 匹配到的规则 */
+} TcMatch;
+
+/* 控制包放行的设置（limiter ctrl-pass），含义见 limiter.h 的 struct ctrl_pass */
+typedef struct CtrlPass {
+    unsigned int enabled;          /* 非 0 时启用 */
+    unsigned int max_len;          /* 不超过该长度的 TCP 包都算控制包，0 表示只看 TCP 标志 */
+    unsigned long long pps;        /* 每条规则每秒的额度（包） */
+} CtrlPass;
+
 /* 加载 eBPF 程序并设置限速规则 */
 int do_load(const LimiterConfig *cfg, const LoadOptions *opts, int reload_flag);
 
 /* 卸载 eBPF 程序 */
 int do_unload(unsigned long long cgid);
 
-/* 仅卸载附加在指定 cgroup 的名为 "limit_egress" 的程序 */
-int detach_limit_egress(const char *cgroup_path);
+/* 仅卸载附加在指定 cgroup 的本工具程序（limit_egress / limit_ingress） */
+int detach_limiter_progs(const char *cgroup_path);
+
+/* 取已附加的本工具程序（按程序名）的 fd，调用者负责关闭；找不到返回 -1 */
+int bpf_get_attached_prog_fd(const char *prog_name);
+
+/* 按程序名判断是否为本工具的程序，返回其 cgroup 附加类型；不是则返回 -1 */
+int limiter_prog_attach_type(const char *prog_name);
 
 /* Link 相关函数 */
-int bpf_attach_cgroup_with_link(int prog_fd, const char *cgroup_path);
+int bpf_attach_cgroup_with_link(int prog_fd, const char *cgroup_path,
+				enum bpf_attach_type type, const char *pin_path);
 int bpf_detach_link(const char *cgroup_path);
 int bpf_is_link_attached(const char *cgroup_path);
 
 /* 清理 pinned link 与 maps */
 int bpf_purge_links(void);
 int bpf_purge_maps(void);
-/* 批量 detach MANAGED_ROOT 及子目录的 limit_egress */
-int bpf_detach_limit_egress_all(void);
+/* 卸载附加范围内各 cgroup 上以 prog_attach 方式附加的本工具程序，返回卸载的数量，失败返回 -1 */
+int bpf_detach_scope_progs(void);
+
+/* 当前附加范围（各 cgroup 路径，缓冲区每项 PATH_MAX 字节），返回 cgroup 数；没有记录时为根 cgroup */
+int bpf_attach_scope(char (*paths)[PATH_MAX], int max);
+/* cgroup 目录 path 是否在当前附加范围内（范围内的 cgroup 本身或其子孙），是返回 1 */
+int bpf_path_in_attach_scope(const char *path);
+/* 批量 detach MANAGED_ROOT 及子目录的本工具程序 */
+int bpf_detach_limiter_all(void);
+
+/* 汇总指定规则 cgroup 在各 CPU 上的计数器；direction 取 LIMIT_DIR_EGRESS 或 LIMIT_DIR_INGRESS */
+struct rate_limit_stats;
+int bpf_read_rule_stats(const char *cgroup_path, unsigned int direction, struct rate_limit_stats *out);
+
+/*
+ * 原地进程规则（以 tgid 为键，只限出方向、police 模式）：写入或更新、删除、汇总计数器。
+ * 删除不存在的规则返回 -1。
+ */
+int bpf_update_pid_rule(unsigned int tgid, const LimiterConfig *cfg);
+int bpf_remove_pid_rule(unsigned int tgid);
+int bpf_read_pid_stats(unsigned int tgid, struct rate_limit_stats *out);
+
+/*
+ * 整机出方向总限速：cfg 为 NULL 时停用；读取计数器时未启用返回 -1。
+ * cfg 只使用 rate_bps、bucket_size 与 shard_tolerance（police 模式）。
+ */
+int bpf_update_host_cap(const LimiterConfig *cfg);
+int bpf_read_host_stats(struct rate_limit_stats *out);
+
+/*
+ * 本机流量绕过：enabled 为 0 时停用，否则按当前网卡地址重建本机地址表。
+ * 返回写入的地址数，失败返回 -1。
+ */
+int bpf_sync_local_bypass(int enabled);
+/* 读取本机流量绕过的开关与本机地址（IPv4 为 ::ffff:a.b.c.d），返回地址数，程序未加载返回 -1 */
+int bpf_read_local_bypass(unsigned int *enabled, unsigned char (*addrs)[16], int max);
+
+/* 控制包放行：写入/读取数据路径使用的设置，失败（程序未加载）返回 -1 */
+int bpf_sync_ctrl_pass(const CtrlPass *cp);
+int bpf_read_ctrl_pass(CtrlPass *cp);
+
+/* 按给定的分类重建规则的分类表与子桶，并更新出方向规则的 class_count；n 为 0 时清除 */
+int bpf_sync_rule_classes(const char *rule_path, unsigned long long cgid,
+			  const TrafficClass *cls, int n);
+
+/*
+ * 按规则参数 base（需含 cgid、cgroup_path、direction）与给定的时间窗，
+ * 重建规则各方向的时间窗表并校准时钟；n 为 0 时清除
+ */
+int bpf_sync_rule_schedule(const LimiterConfig *base, const RateWindow *w, int n);
+
+/*
+ * 按规则参数 base（需含 cgid、cgroup_path）与给定的网卡桶，重建规则出方向的网卡桶；
+ * n 为 0 时清除。规则没有出方向限速时返回 -1
+ */
+int bpf_sync_rule_devs(const LimiterConfig *base, const DevBucket *d, int n);
+
+/* 按给定的匹配项重建 tc 模式的匹配表（先写入新项再删除旧项），n 为 0 时清空 */
+int bpf_sync_tc_matches(const TcMatch *m, int n);
+
+/*
+ * 把 limit_tc 附加到网卡的 tcx 出方向，link 固定到 PIN_TC_LINK_PREFIX<网卡名>；
+ * 程序未加载或内核不支持 tcx 时返回 -1。detach 返回卸载的数量（未附加为 0），失败返回 -1
+ */
+int bpf_tc_attach_dev(const char *ifname);
+int bpf_tc_detach_dev(const char *ifname);
+/* 网卡上是否有本工具固定的 tc link */
+int bpf_tc_dev_attached(const char *ifname);
+/* 卸载所有网卡上的 limit_tc（unload/purge），返回卸载的数量 */
+int bpf_detach_tc_links(void);
+
+/*
+ * shape 模式：在给定的整形网卡上重建 HTB（删除旧的根 qdisc 后重装），再为每条出方向的 shape 规则
+ * 按其槽位建好类；程序未加载时只装根 qdisc 与默认类。返回建好的规则类数，失败返回 -1
+ */
+int bpf_sync_shape_classes(const char (*devs)[16], int n);
+
+/*
+ * 按托管目录下现存的规则目录重建规则过滤位图，清除已删除规则留下的位（位图只在写规则时置位）。
+ * set/list 时调用；程序未加载时什么都不做。返回清除的位数，失败返回 -1
+ */
+int bpf_rebuild_rule_filter(void);
+
+/* 重新校准数据路径使用的本地时间（改时区、夏令时切换后执行） */
+int bpf_sync_limiter_clock(void);
 
 /* 获取当前的附加模式 */
 AttachMode get_current_attach_mode(void);
@@ -28,6 +28,26 @@ unsigned long long get_cgroup_id(const char *cgroup_path) {
     return (unsigned long long)st.st_ino;
 }
 
+/* 计算 cgroup v2 路径的层级（根 cgroup 为 0），即 /sys/fs/cgroup 之后的路径分量数 */
+int get_cgroup_level(const char *cgroup_path)
+{
+	const char *root = "/sys/fs/cgroup";
+	size_t root_len = strlen(root);
+	if (!cgroup_path || strncmp(cgroup_path, root, root_len) != 0) return -1;
+
+	const char *p = cgroup_path + root_len;
+	if (*p != '\0' && *p != '/') return -1;
+
+	int level = 0;
+	while (*p) {
+		while (*p == '/') p++;
+		if (*p == '\0') break;
+		level++;
+		while (*p && *p != '/') p++;
+	}
+	return level;
+}
+
 /* 检查 cgroup 是否为空 */
 int is_cgroup_empty(const char *cgroup_path)
 {
@@ -7,6 +7,9 @@
 /* 获取 cgroup ID */
 unsigned long long get_cgroup_id(const char *cgroup_path);
 
+/* 计算 cgroup v2 路径的层级（根 cgroup 为 0），路径不在 cgroup 根下返回 -1 */
+int get_cgroup_level(const char *cgroup_path);
+
 /* 检查 cgroup 是否为空 */
 int is_cgroup_empty(const char *cgroup_path);
 
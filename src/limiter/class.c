@@ -0,0 +1,358 @@
+#include "class.h"
+#include "managed.h"
+#include "cgroup.h"
+#include "record.h"
+#include "utils.h"
+#include <linux/bpf.h>
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/limits.h>
+
+static const unsigned char v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* 构建分类记录文件路径 */
+static int build_class_record_path(unsigned long long cgid, char *path, size_t path_size)
+{
+	char id_str[32];
+	if (snprintf(id_str, sizeof(id_str), "%llu", cgid) >= (int)sizeof(id_str)) {
+		return -1;
+	}
+	return safe_path_join(path, path_size, RUNTIME_DIR, "classes", id_str, NULL);
+}
+
+int parse_class_dst(const char *str, TrafficClass *cls)
+{
+	char buf[INET6_ADDRSTRLEN + 8];
+	if (!str || snprintf(buf, sizeof(buf), "%s", str) >= (int)sizeof(buf)) return -1;
+
+	long len = -1;
+	char *slash = strchr(buf, '/');
+	if (slash) {
+		char *end = NULL;
+		*slash = '\0';
+		len = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || len < 0) return -1;
+	}
+
+	unsigned char addr[16] = {0};
+	unsigned int prefix_len;
+	if (inet_pton(AF_INET, buf, &addr[12]) == 1) {
+		if (len > 32) return -1;
+		memcpy(addr, v4_mapped_prefix, sizeof(v4_mapped_prefix));
+		prefix_len = 96 + (unsigned int)(len < 0 ? 32 : len);
+	} else if (inet_pton(AF_INET6, buf, addr) == 1) {
+		if (len > 128) return -1;
+		prefix_len = (unsigned int)(len < 0 ? 128 : len);
+	} else {
+		return -1;
+	}
+
+	/* 清零前缀之外的位，同一前缀只对应一个 LPM 键 */
+	for (unsigned int bit = prefix_len; bit < 128; bit++) {
+		addr[bit / 8] &= (unsigned char)~(0x80 >> (bit % 8));
+	}
+	memcpy(cls->addr, addr, sizeof(cls->addr));
+	cls->prefix_len = prefix_len;
+	return 0;
+}
+
+static void format_class_dst(const TrafficClass *cls, char *buf, size_t bufsz)
+{
+	char addr[INET6_ADDRSTRLEN] = "?";
+	if (cls->prefix_len >= 96 && memcmp(cls->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0) {
+		inet_ntop(AF_INET, &cls->addr[12], addr, sizeof(addr));
+		snprintf(buf, bufsz, "%s/%u", addr, cls->prefix_len - 96);
+	} else {
+		inet_ntop(AF_INET6, cls->addr, addr, sizeof(addr));
+		snprintf(buf, bufsz, "%s/%u", addr, cls->prefix_len);
+	}
+}
+
+int parse_class_proto(const char *str, unsigned int *proto_out)
+{
+	if (!str || !proto_out) return -1;
+	if (strcmp(str, "any") == 0) {
+		*proto_out = 0;
+	} else if (strcmp(str, "tcp") == 0) {
+		*proto_out = IPPROTO_TCP;
+	} else if (strcmp(str, "udp") == 0) {
+		*proto_out = IPPROTO_UDP;
+	} else if (strcmp(str, "icmp") == 0) {
+		*proto_out = IPPROTO_ICMP;
+	} else if (strcmp(str, "icmpv6") == 0) {
+		*proto_out = IPPROTO_ICMPV6;
+	} else {
+		char *end = NULL;
+		unsigned long v = strtoul(str, &end, 10);
+		if (end == str || *end != '\0' || v > 255) return -1;
+		*proto_out = (unsigned int)v;
+	}
+	return 0;
+}
+
+static const char *class_proto_name(unsigned int proto, char *buf, size_t bufsz)
+{
+	switch (proto) {
+	case 0: return "any";
+	case IPPROTO_TCP: return "tcp";
+	case IPPROTO_UDP: return "udp";
+	case IPPROTO_ICMP: return "icmp";
+	case IPPROTO_ICMPV6: return "icmpv6";
+	default:
+		snprintf(buf, bufsz, "%u", proto);
+		return buf;
+	}
+}
+
+int parse_class_ports(const char *str, unsigned int *lo_out, unsigned int *hi_out)
+{
+	if (!str || !lo_out || !hi_out) return -1;
+	char *end = NULL;
+	unsigned long lo = strtoul(str, &end, 10);
+	unsigned long hi = lo;
+	if (end == str) return -1;
+	if (*end == '-') {
+		const char *p = end + 1;
+		hi = strtoul(p, &end, 10);
+		if (end == p) return -1;
+	}
+	if (*end != '\0' || lo == 0 || hi > 65535 || lo > hi) return -1;
+	*lo_out = (unsigned int)lo;
+	*hi_out = (unsigned int)hi;
+	return 0;
+}
+
+static const char *class_action_name(unsigned int action)
+{
+	return action == CLASS_ACTION_BYPASS ? "bypass" : "limit";
+}
+
+int save_class_record(unsigned long long cgid, const TrafficClass *cls, int n)
+{
+	char path[PATH_MAX];
+	if (build_class_record_path(cgid, path, sizeof(path)) != 0) return -1;
+	if (n <= 0) {
+		if (unlink(path) != 0 && errno != ENOENT) return -1;
+		return 0;
+	}
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "classes") != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建分类记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		char dst[INET6_ADDRSTRLEN + 8];
+		format_class_dst(&cls[i], dst, sizeof(dst));
+		ret = fprintf(f, "id=%u dst=%s proto=%u port=%u-%u action=%s rate=%llu bucket=%llu\n",
+			      cls[i].id, dst, cls[i].proto, cls[i].port_lo, cls[i].port_hi,
+			      class_action_name(cls[i].action), cls[i].rate_bps, cls[i].bucket_size);
+	}
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入分类记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* 解析一行分类记录，格式见 save_class_record */
+static int parse_class_line(char *line, TrafficClass *cls)
+{
+	memset(cls, 0, sizeof(*cls));
+	int have_dst = 0;
+	char *save = NULL;
+	for (char *tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+		char *eq = strchr(tok, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		const char *val = eq + 1;
+		if (strcmp(tok, "id") == 0) {
+			cls->id = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "dst") == 0) {
+			have_dst = parse_class_dst(val, cls) == 0;
+		} else if (strcmp(tok, "proto") == 0) {
+			cls->proto = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "port") == 0) {
+			if (sscanf(val, "%u-%u", &cls->port_lo, &cls->port_hi) != 2) {
+				cls->port_lo = cls->port_hi = 0;
+			}
+		} else if (strcmp(tok, "action") == 0) {
+			cls->action = strcmp(val, "bypass") == 0 ? CLASS_ACTION_BYPASS : CLASS_ACTION_LIMIT;
+		} else if (strcmp(tok, "rate") == 0) {
+			cls->rate_bps = strtoull(val, NULL, 10);
+		} else if (strcmp(tok, "bucket") == 0) {
+			cls->bucket_size = strtoull(val, NULL, 10);
+		}
+	}
+	if (!have_dst || cls->id >= LIMIT_MAX_CLASSES) return -1;
+	if (cls->action == CLASS_ACTION_LIMIT && (cls->rate_bps == 0 || cls->bucket_size == 0)) return -1;
+	return 0;
+}
+
+int load_class_record(unsigned long long cgid, TrafficClass *cls, int max)
+{
+	char path[PATH_MAX];
+	if (build_class_record_path(cgid, path, sizeof(path)) != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	char line[256];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		if (parse_class_line(line, &cls[n]) != 0) {
+			fprintf(stderr, "警告: 规则 %llu 的分类记录中有无效行，已跳过\n", cgid);
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* 规则存在且限制出方向时返回其 cgroup_id，否则打印原因并返回 0 */
+static unsigned long long class_rule_cgid(const char *rule_path)
+{
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 0ULL;
+
+	LimiterConfig lc = {0};
+	(void)load_rule_record(cgid, &lc);
+	if (lc.direction == LIMIT_DIR_INGRESS) {
+		fprintf(stderr, "流量分类只作用于出方向，规则 %s 只限制入方向\n", rule_path);
+		return 0ULL;
+	}
+	return cgid;
+}
+
+static int same_class_match(const TrafficClass *a, const TrafficClass *b)
+{
+	return a->prefix_len == b->prefix_len && memcmp(a->addr, b->addr, sizeof(a->addr)) == 0 &&
+	       a->proto == b->proto && a->port_lo == b->port_lo && a->port_hi == b->port_hi;
+}
+
+int do_class_add(const char *rule_path, const TrafficClass *cls_in)
+{
+	unsigned long long cgid = class_rule_cgid(rule_path);
+	if (cgid == 0ULL) return 1;
+
+	TrafficClass cls[LIMIT_MAX_CLASSES];
+	int n = load_class_record(cgid, cls, LIMIT_MAX_CLASSES);
+	if (n >= LIMIT_MAX_CLASSES) {
+		fprintf(stderr, "每条规则最多 %d 个分类\n", LIMIT_MAX_CLASSES);
+		return 1;
+	}
+
+	unsigned int used = 0;
+	for (int i = 0; i < n; i++) {
+		if (same_class_match(&cls[i], cls_in)) {
+			fprintf(stderr, "已存在匹配条件相同的分类 id=%u，请先删除\n", cls[i].id);
+			return 1;
+		}
+		used |= 1U << cls[i].id;
+	}
+	unsigned int id = 0;
+	while (used & (1U << id)) id++;
+
+	cls[n] = *cls_in;
+	cls[n].id = id;
+	if (bpf_sync_rule_classes(rule_path, cgid, cls, n + 1) != 0) {
+		return 1;
+	}
+	if (save_class_record(cgid, cls, n + 1) != 0) {
+		fprintf(stderr, "警告: 保存分类记录失败，reload 后该分类将丢失\n");
+	}
+
+	char dst[INET6_ADDRSTRLEN + 8];
+	format_class_dst(&cls[n], dst, sizeof(dst));
+	printf("已添加分类 id=%u dst=%s action=%s 到规则 %s\n", id, dst,
+	       class_action_name(cls[n].action), rule_path);
+	return 0;
+}
+
+int do_class_del(const char *rule_path, unsigned int id)
+{
+	unsigned long long cgid = class_rule_cgid(rule_path);
+	if (cgid == 0ULL) return 1;
+
+	TrafficClass cls[LIMIT_MAX_CLASSES];
+	int n = load_class_record(cgid, cls, LIMIT_MAX_CLASSES);
+	int found = -1;
+	for (int i = 0; i < n; i++) {
+		if (cls[i].id == id) found = i;
+	}
+	if (found < 0) {
+		fprintf(stderr, "规则 %s 没有分类 id=%u\n", rule_path, id);
+		return 1;
+	}
+	memmove(&cls[found], &cls[found + 1], (size_t)(n - found - 1) * sizeof(cls[0]));
+	n--;
+
+	if (bpf_sync_rule_classes(rule_path, cgid, cls, n) != 0) {
+		return 1;
+	}
+	if (save_class_record(cgid, cls, n) != 0) {
+		fprintf(stderr, "警告: 更新分类记录失败\n");
+	}
+	printf("已删除规则 %s 的分类 id=%u\n", rule_path, id);
+	return 0;
+}
+
+static int print_rule_classes(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)rate;
+	(void)arg;
+
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 0;
+
+	TrafficClass cls[LIMIT_MAX_CLASSES];
+	int n = load_class_record(cgid, cls, LIMIT_MAX_CLASSES);
+	for (int i = 0; i < n; i++) {
+		char dst[INET6_ADDRSTRLEN + 8];
+		char proto_buf[8];
+		char ports[16] = "any";
+		char rate_str[24] = "-";
+		char bucket_str[24] = "-";
+		format_class_dst(&cls[i], dst, sizeof(dst));
+		if (cls[i].port_hi) {
+			snprintf(ports, sizeof(ports), "%u-%u", cls[i].port_lo, cls[i].port_hi);
+		}
+		if (cls[i].action == CLASS_ACTION_LIMIT) {
+			snprintf(rate_str, sizeof(rate_str), "%llu", cls[i].rate_bps);
+			snprintf(bucket_str, sizeof(bucket_str), "%llu", cls[i].bucket_size);
+		}
+		printf("%-3u %-28s %-6s %-11s %-7s %-12s %-12s %s\n",
+		       cls[i].id, dst, class_proto_name(cls[i].proto, proto_buf, sizeof(proto_buf)),
+		       ports, class_action_name(cls[i].action), rate_str, bucket_str, rule_path);
+	}
+	return 0;
+}
+
+int do_class_list(const char *rule_path)
+{
+	printf("%-3s %-28s %-6s %-11s %-7s %-12s %-12s %s\n",
+	       "id", "dst", "proto", "port", "action", "rate", "bucket", "规则路径");
+	if (rule_path) {
+		return print_rule_classes(rule_path, 0, 0, NULL);
+	}
+	if (for_each_rule_dir(MANAGED_ROOT, print_rule_classes, NULL) < 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", MANAGED_ROOT);
+		return 1;
+	}
+	return 0;
+}
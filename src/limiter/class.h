@@ -0,0 +1,24 @@
+#ifndef CLASS_H
+#define CLASS_H
+
+#include "bpf.h"
+
+/*
+ * 出方向流量分类记录：保存在 RUNTIME_DIR "/classes/<cgid>"，每行一个分类，
+ * reload 时据此重建分类表。load 返回读到的分类数（没有记录为 0），
+ * save 在 n 为 0 时删除记录文件。
+ */
+int load_class_record(unsigned long long cgid, TrafficClass *cls, int max);
+int save_class_record(unsigned long long cgid, const TrafficClass *cls, int n);
+
+/* 匹配条件解析：目的前缀（CIDR，省略长度表示单个地址）、协议名或编号、端口或端口范围 */
+int parse_class_dst(const char *str, TrafficClass *cls);
+int parse_class_proto(const char *str, unsigned int *proto_out);
+int parse_class_ports(const char *str, unsigned int *lo_out, unsigned int *hi_out);
+
+/* 便捷子命令：class add/del/list；rule_path 为规则 cgroup 路径，list 传 NULL 列出全部规则 */
+int do_class_add(const char *rule_path, const TrafficClass *cls);
+int do_class_del(const char *rule_path, unsigned int id);
+int do_class_list(const char *rule_path);
+
+#endif /* CLASS_H */
@@ -3,57 +3,747 @@
 #include "bpf.h"
 #include "cgroup.h"
 #include "utils.h"
+#include "record.h"
+#include "class.h"
+#include "schedule.h"
+#include "dev.h"
+#include "tc.h"
+#include "shape.h"
+#include "bench.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <linux/limits.h>
 #include <dirent.h>
+#include <net/if.h>
 #include <linux/bpf.h>
+#include "../include/limiter.h"
 
 /* 打印使用说明 */
 void print_usage(FILE *out)
 {
 	fprintf(out,
 		"用法:\n"
-		"  limiter set [--pid <pid>] --rate <rate> [--bucket <bucket>] [--bpf-obj <path>] [--deamon]\n"
+		"  limiter set [--pid <pid> [--in-place]] --rate <rate> [--bucket <bucket>] [--mode pace|police|ecn|tcm|shape] [--horizon <ms>]\n"
+		"              [--shard <percent>] [--direction in|out|both] [--parent <rule>]\n"
+		"              [--pps <packets> [--pkt-burst <packets>]] [--ecn-soft <bytes>] [--ecn-hard <bytes>]\n"
+		"              [--fair <percent>] [--peak-rate <rate> [--peak-burst <bytes>] [--yellow-dscp <n>]]\n"
+		"              [--max-rules <n>] [--map-alloc prealloc|dynamic] [--attach-scope <scope>]\n"
+		"              [--update] [--bpf-obj <path>] [--deamon] [--debug]\n"
+		"  limiter set --dev <ifname> (--rule <rule> | --last) --rate <rate> [--bucket <bucket>]\n"
 		"  limiter move --pid <pid> [--cgroup-path <path> | --cgid <id> | --last]\n"
-        "  limiter reload [-o <bpf.o>] [--cgroup-path <path>] [--attach-flag]\n"
+        "  limiter reload [-o <bpf.o>] [--cgroup-path <path>] [--attach-flag] [--debug]\n"
+        "                 [--max-rules <n>] [--map-alloc prealloc|dynamic] [--attach-scope <scope>]\n"
+		"  limiter class add (--rule <rule> | --last) --dst <cidr> [--proto tcp|udp|<n>] [--port <p>[-<p>]]\n"
+		"                    (--rate <rate> [--bucket <bucket>] | --bypass)\n"
+		"  limiter class del (--rule <rule> | --last) --id <n>\n"
+		"  limiter class list [--rule <rule> | --last]\n"
+		"  limiter schedule add (--rule <rule> | --last) [--days <days>] --from <HH:MM> --to <HH:MM>\n"
+		"                       --rate <rate> [--bucket <bucket>]\n"
+		"  limiter schedule del (--rule <rule> | --last) --id <n>\n"
+		"  limiter schedule list [--rule <rule> | --last]\n"
+		"  limiter schedule sync\n"
+		"  limiter tc add (--rule <rule> | --last) (--mark <n> | --iif <ifname> | --src <cidr>)\n"
+		"  limiter tc del (--mark <n> | --iif <ifname> | --src <cidr>)\n"
+		"  limiter tc attach|detach --dev <ifname>\n"
+		"  limiter tc list\n"
+		"  limiter shape add|del --dev <ifname>\n"
+		"  limiter shape list\n"
+		"  limiter host-cap [--rate <rate> [--bucket <bucket>] [--shard <percent>] | --off]\n"
+		"  limiter local-bypass [--on | --off | --sync | --watch]\n"
+		"  limiter ctrl-pass [--on | --off] [--size <bytes>] [--pps <packets>]\n"
+		"  limiter bench [--repeat <n>] [--size <bytes>]\n"
 		"  limiter unset --pid <pid>\n"
+		"  limiter unset --dev <ifname> (--rule <rule> | --last)\n"
 		"  limiter unload\n"
-		"  limiter list [--pid | --bpf]\n"
+		"  limiter list [--pid | --bpf | --stats]\n"
 		"  limiter purge\n"
 		"  limiter --help\n\n"
 		"说明:\n"
-		"- 本工具通过 eBPF 程序在 cgroup egress 钩子上进行令牌桶限速。\n"
+		"- 本工具通过 eBPF 程序在 cgroup egress/ingress 钩子上进行令牌桶限速。\n"
 		"- 自动管理 cgroup。可先设置规则（输出路径与ID），再通过 move 迁移进程；reload 为全局重载。\n"
-		"- 规则按 cgroup_id 保存在 config_map；状态在 state_map 中，仅 eBPF 更新。\n"
-		"- 链接会固定(pin)到 " PIN_LINK_PERSISTENT "；map 固定到 " BPFFS_DIR "/。\n\n"
+		"- 规则按 cgroup_id 保存在 rate_limit_map（出方向）与 rate_limit_ingress_map（入方向），\n"
+		"  配置与状态同在一个值中；状态仅由 eBPF 更新。\n"
+		"- 链接会固定(pin)到 " PIN_LINK_PERSISTENT " 与 " PIN_LINK_INGRESS "（其他附加范围加 _<cgroup id> 后缀）；\n"
+		"  map 固定到 " BPFFS_DIR "/。\n\n"
 		"命令:\n"
 		"  set               设置限速规则（可选迁移进程）\n"
 		"  move              将进程迁移到指定规则（支持 --last）\n"
 		"  reload            全局重载程序与数据结构（对所有规则生效）\n"
-		"  unset             取消进程限速（自动清理空 cgroup）\n"
+		"  class             管理规则内的出方向流量分类（按目的前缀/协议/端口分出子桶或绕过规则）\n"
+		"  schedule          管理规则的分时速率（按星期与本地时刻切换速率，由 eBPF 程序自行切换）\n"
+		"  tc                tc 模式：在网卡的 tcx 出方向限制没有本机 socket 的转发流量（容器 veth、虚拟机 tap），\n"
+		"                    按 fwmark、入口网卡、源地址前缀的顺序匹配到规则，沿用规则的令牌桶（需要内核 6.6+）\n"
+		"  shape             管理 shape 模式的整形网卡：在网卡上安装本工具生成的 HTB，shape 规则各占一个类\n"
+		"  host-cap          整机出方向总限速：经各规则放行的包再扣一个整机的桶；不带参数时显示当前设置\n"
+		"  local-bypass      本机流量绕过（默认启用）：目的为回环或本机地址的出方向包、源为这些地址的入方向包\n"
+		"                    不计费；--sync 按当前网卡地址重新同步，--watch 常驻监听网卡地址变化并自动同步\n"
+		"                    （由 speed-limiter-addr-watch.service 运行），不带参数时显示当前状态\n"
+		"  ctrl-pass         控制包放行（默认启用）：桶不足时，不超过 --size 字节的 TCP 包与 TCP SYN/FIN/RST、纯 ACK\n"
+		"                    改用每条规则每秒 --pps 个包的额度放行，避免丢掉 ACK 拖慢反方向的流量；\n"
+		"                    不带参数时显示当前设置\n"
+		"  bench             测量已附加程序处理一个包的耗时（BPF_PROG_TEST_RUN，测试包属于本进程的 cgroup）\n"
+		"  unset             取消进程限速（自动清理空 cgroup）；带 --dev 时删除规则在该网卡上的桶\n"
 		"  unload            卸载 eBPF 程序（不修改配置）\n"
 		"  list              列出所有限速规则和状态\n"
 		"  list --pid        列出cgroup_id和进程ID\n"
 		"  list --bpf        列出cgroup_id、BPF程序名和加载时间\n"
+		"  list --stats      列出每条规则的放行/丢弃计数（各 CPU 汇总）\n"
 		"  purge             清理所有限速规则\n\n"
 		"参数:\n"
 		"  --pid/-p         目标进程 ID\n"
+		"  --in-place       set：按进程 (tgid) 限速，不迁移进程的 cgroup；规则按 socket 的创建进程计费，\n"
+		"                    只限出方向、police 模式（可带 --pps），unset --pid 取消\n"
 		"  --rate/-r         限速值，支持单位：k/K=1024, m/M=1024*1024（如：1m, 512k）\n"
 		"  --bucket/-b       令牌桶大小，支持单位同上（可选，默认等于 rate）\n"
+		"  --mode/-m         限速模式：police 令牌不足即丢包（默认）；pace 写入最早发送时间，\n"
+		"                    由出口网卡上的 fq qdisc 延迟发送（需 tc qdisc replace dev <if> root fq）\n"
+		"                    ecn 令牌低于软阈值时放行并标记 CE/返回 CN（TCP 主动降窗），透支完硬阈值才丢包\n"
+		"                    tcm 双速率三色标记：未超承诺速率放行，超出承诺未超峰值的包放行并打标记\n"
+		"                    (由出口网卡上的 tc pedit 按标记改写 DSCP)，超出峰值丢包\n"
+		"                    shape 不丢包，只把规则对应的 HTB 类写入 skb->priority，由整形网卡上的 HTB\n"
+		"                    按 --rate/--bucket 排队整形（需先 limiter shape add --dev <if>）；\n"
+		"                    分类、网卡桶、时间窗、整机限速对 shape 规则不生效\n"
+		"  --peak-rate       tcm 模式：峰值速率（不小于 --rate），单位同 --rate\n"
+		"  --peak-burst      tcm 模式：峰值桶容量（默认等于 --bucket）\n"
+		"  --yellow-dscp     tcm 模式：超出承诺速率的包要改写成的 DSCP（0-63，默认 8 即 CS1）\n"
+		"  --ecn-soft        ecn 模式：剩余令牌低于此值开始标记（默认桶容量的一半），单位同 --rate\n"
+		"  --ecn-hard        ecn 模式：令牌耗尽后还可透支并标记的字节数（默认 0），超出才丢包\n"
+		"  --update          set：同一 --rate/--bucket 的规则已存在而 --mode 等参数不同时，确认改写该规则\n"
+		"                    (目录内所有进程都受影响)；不加时拒绝，可换一个 --rate/--bucket 另建规则\n"
+		"  --horizon         pace 模式允许的最大延迟（毫秒，默认 2000），超出仍丢包\n"
+		"  --shard           分片模式（仅 police）：各 CPU 缓存本地额度、批量领取令牌以减少锁竞争，\n"
+		"                    参数为允许的误差（桶容量的百分比，1-100）\n"
+		"  --fair            公平分享（police/ecn）：按 socket 统计近期用量，桶紧张时用量大的连接先被限制，\n"
+		"                    参数为给轻量连接保留的桶容量百分比（1-100）；不能与 --shard 同时使用\n"
+		"  --direction       限速方向：out 出方向（默认）；in 入方向（下载）；both 两个方向各用一个桶。\n"
+		"                    入方向只支持 police 模式，--mode pace/ecn 只作用于出方向\n"
+		"  --parent          在已有规则下创建嵌套规则（规则路径，或相对 " MANAGED_ROOT " 的路径）；\n"
+		"                    包须在本规则与各级父规则上都有令牌才放行\n"
+		"  --pps             包速率上限（包/秒），与字节限速同时生效；不能与 --shard 同时使用\n"
+		"                    ctrl-pass：控制包额度（包/秒，每条规则，默认 %u，上限 %u）\n"
+		"  --pkt-burst       包令牌桶容量（包，默认等于 --pps）\n"
+		"  --max-rules       规则容量（条，默认 %u，上限 %u），在加载时设置到规则表与计数器数组；\n"
+		"                    未指定时沿用上次加载的值，set 指定了不同的值会重新加载程序\n"
+		"  --map-alloc       规则表分配方式：prealloc 加载时一次分配（默认）；dynamic 按需分配\n"
+		"                    (BPF_F_NO_PREALLOC)，容量大而规则少时省内存\n"
+		"  --attach-scope    程序附加的范围：root 根 cgroup（默认，所有进程都经过程序）；managed 只附加到\n"
+		"                    " MANAGED_ROOT "；或逗号分隔的 cgroup 路径（相对路径相对 " CGROUPFS_ROOT "，如 system.slice），\n"
+		"                    每个 cgroup 各一组 link，范围外的流量不经过程序。范围不能互相包含，不含托管目录时自动加入；\n"
+		"                    --in-place 规则与整机总限速只对范围内的进程生效。未指定时沿用上次设置\n"
+		"  --dev             set/unset：按出口网卡区分的桶，经该网卡发出的包改用这里的 --rate/--bucket，\n"
+		"                    其余参数沿用规则本身；没有对应网卡桶的包按规则本身限速。每条规则最多 %d 个，只限出方向\n"
+		"                    tc attach/detach：附加/卸载 limit_tc 的网卡（通常是上联网卡）\n"
+		"                    shape add/del：加入/移出整形网卡（安装/删除网卡上的 HTB 根 qdisc %x:）\n"
+		"  --rule            class/schedule/tc/set --dev：规则路径，或相对 " MANAGED_ROOT " 的路径\n"
+		"  --mark/--iif/--src tc：按 fwmark（非 0）、入口网卡名或源地址前缀匹配；同一条件再次 add 时改指向新规则\n"
+		"  --dst             class：目的前缀，如 10.0.0.0/8、2001:db8::/32；::/0 匹配全部\n"
+		"  --proto/--port    class：协议（默认任意）与目的端口或端口范围（默认任意，仅 TCP/UDP）\n"
+		"  --bypass          class：命中的流量不受本规则限速；否则按分类的 --rate/--bucket 单独限速\n"
+		"  --days            schedule：生效的星期，如 mon-fri、sat,sun、fri-mon，默认 all\n"
+		"  --from/--to       schedule：本地时刻 HH:MM[:SS]，--to 可为 24:00；--to 早于 --from 表示跨零点；\n"
+		"                    时间窗按 id 顺序匹配，取第一个命中的，都不命中时使用规则本身的 --rate\n"
+		"  --repeat/--size   bench：每轮运行次数（默认 1000000）与测试包长度（默认 64）\n"
+		"  --off             host-cap：停用整机总限速；ctrl-pass：停用控制包放行\n"
+		"                    host-cap 的 --shard 默认 %u（0 表示精确模式，所有 CPU 共用一把锁）\n"
+		"  --size            ctrl-pass：按长度算作控制包的 TCP 包上限（字节，默认 %u，0 表示只看 TCP 标志）\n"
 		"  --bpf-obj/-o      BPF 对象路径（可选，默认 " DEFAULT_BPF_OBJ ")\n"
 		"  --deamon/-d         使用 bpf_prog_attach 方式附加（不支持持久化，但支持 MULTI）\n"
 		"  --cgroup-path     目标 cgroup v2 路径\n"
 		"  --cgid            目标 cgroup ID\n"
 		"  --last            使用最近设置的规则\n"
 		"  --attach-flag     传入附加标志\n"
+		"  --debug           加载时启用 BPF 调试输出（trace_pipe），默认关闭\n",
+		CTRL_DEFAULT_PPS, CTRL_MAX_PPS, LIMIT_DEFAULT_MAX_RULES, LIMIT_MAX_RULES_LIMIT, LIMIT_MAX_DEVS,
+		SHAPE_HTB_MAJOR, HOST_CAP_DEFAULT_SHARD, CTRL_DEFAULT_MAX_LEN
 	);
 }
 
+/* 解析十进制整数选项，整个参数都必须是数字且不小于 min；出错时打印提示并返回 -1 */
+static int parse_u64_option(const char *name, const char *arg, unsigned long long min, unsigned long long *out)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long long v = strtoull(arg, &end, 10);
+	if (end == arg || *end != '\0' || arg[0] == '-' || errno == ERANGE || v < min) {
+		fprintf(stderr, "无效的 %s: %s（应为不小于 %llu 的十进制整数）\n", name, arg, min);
+		return -1;
+	}
+	*out = v;
+	return 0;
+}
+
+/* 解析 --max-rules / --map-alloc，出错时打印提示并返回 -1 */
+static int parse_map_option(int opt, const char *arg, unsigned int *max_rules, unsigned int *map_alloc)
+{
+	if (opt == 'C') {
+		unsigned long n = strtoul(arg, NULL, 10);
+		if (n == 0 || n > LIMIT_MAX_RULES_LIMIT) {
+			fprintf(stderr, "无效的 --max-rules: %s（取值 1-%u）\n", arg, LIMIT_MAX_RULES_LIMIT);
+			return -1;
+		}
+		*max_rules = (unsigned int)n;
+		return 0;
+	}
+	if (parse_map_alloc(arg, map_alloc) != 0) {
+		fprintf(stderr, "无效的 --map-alloc: %s（支持 prealloc/dynamic）\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+/* 规则路径：绝对路径原样使用，否则相对 MANAGED_ROOT；去掉尾部斜杠 */
+static int resolve_rule_arg(const char *arg, char *out, size_t out_sz)
+{
+	int n = (arg[0] == '/')
+		? snprintf(out, out_sz, "%s", arg)
+		: snprintf(out, out_sz, "%s/%s", MANAGED_ROOT, arg);
+	if (n < 0 || (size_t)n >= out_sz) {
+		fprintf(stderr, "规则路径过长\n");
+		return -1;
+	}
+	while (n > 1 && out[n - 1] == '/') out[--n] = '\0';
+	return 0;
+}
+
+/* --rule / --last 指定的规则路径，都没有时打印提示并返回 -1 */
+static int resolve_rule_or_last(const char *rule, int use_last, const char *cmd, char *out, size_t out_sz)
+{
+	if (use_last) {
+		unsigned long long last_id = 0ULL;
+		if (read_last_rule(out, out_sz, &last_id) != 0) {
+			fprintf(stderr, "没有可用的最近规则，请先执行 limiter set\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (rule) {
+		return resolve_rule_arg(rule, out, out_sz);
+	}
+	fprintf(stderr, "%s 需要 --rule 或 --last\n", cmd);
+	return -1;
+}
+
+/* 网卡名须放得进 IFNAMSIZ（含结尾的 0） */
+static int check_dev_name(const char *name)
+{
+	if (!name[0] || strlen(name) >= IFNAMSIZ) {
+		fprintf(stderr, "无效的网卡名: %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* limiter local-bypass [--on | --off | --sync | --watch] */
+static int parse_local_bypass_args(int argc, char **argv)
+{
+	int opt;
+	int action = LOCAL_BYPASS_SHOW;
+
+	static struct option local_opts[] = {
+		{"on", no_argument, 0, 'E'},
+		{"off", no_argument, 0, 'O'},
+		{"sync", no_argument, 0, 's'},
+		{"watch", no_argument, 0, 'w'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 1, argv + 1, "EOswh", local_opts, NULL)) != -1) {
+		int next;
+		switch (opt) {
+		case 'E': next = LOCAL_BYPASS_ON; break;
+		case 'O': next = LOCAL_BYPASS_OFF; break;
+		case 's': next = LOCAL_BYPASS_SYNC; break;
+		case 'w': next = LOCAL_BYPASS_WATCH; break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+		if (action != LOCAL_BYPASS_SHOW && action != next) {
+			fprintf(stderr, "local-bypass 的 --on、--off、--sync 与 --watch 只能选一个\n");
+			return 1;
+		}
+		action = next;
+	}
+	return do_local_bypass(action);
+}
+
+/* limiter ctrl-pass [--on | --off] [--size <bytes>] [--pps <packets>] */
+static int parse_ctrl_pass_args(int argc, char **argv)
+{
+	int opt;
+	int action = CTRL_PASS_SHOW;
+	int max_len = -1;
+	long long pps = -1;
+
+	static struct option ctrl_opts[] = {
+		{"on", no_argument, 0, 'E'},
+		{"off", no_argument, 0, 'O'},
+		{"size", required_argument, 0, 'z'},
+		{"pps", required_argument, 0, 'K'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 1, argv + 1, "EOz:K:h", ctrl_opts, NULL)) != -1) {
+		char *end = NULL;
+		unsigned long long v;
+		switch (opt) {
+		case 'E':
+		case 'O': {
+			int next = (opt == 'E') ? CTRL_PASS_ON : CTRL_PASS_OFF;
+			if (action != CTRL_PASS_SHOW && action != next) {
+				fprintf(stderr, "ctrl-pass 的 --on 与 --off 只能选一个\n");
+				return 1;
+			}
+			action = next;
+			break;
+		}
+		case 'z':
+			v = strtoull(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || v > 65535) {
+				fprintf(stderr, "无效的 --size: %s（取值 0-65535）\n", optarg);
+				return 1;
+			}
+			max_len = (int)v;
+			break;
+		case 'K':
+			v = strtoull(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || v == 0 || v > CTRL_MAX_PPS) {
+				fprintf(stderr, "无效的 --pps: %s（取值 1-%u）\n", optarg, CTRL_MAX_PPS);
+				return 1;
+			}
+			pps = (long long)v;
+			break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+	return do_ctrl_pass(action, max_len, pps);
+}
+
+/* limiter host-cap [--rate ... | --off] */
+static int parse_host_cap_args(int argc, char **argv)
+{
+	int opt;
+	const char *rate_str = NULL;
+	const char *bucket_str = NULL;
+	const char *bpf_obj_path = DEFAULT_BPF_OBJ;
+	unsigned int shard_tolerance = HOST_CAP_DEFAULT_SHARD;
+	int off = 0;
+
+	static struct option host_opts[] = {
+		{"rate", required_argument, 0, 'r'},
+		{"bucket", required_argument, 0, 'b'},
+		{"shard", required_argument, 0, 'S'},
+		{"off", no_argument, 0, 'O'},
+		{"bpf-obj", required_argument, 0, 'o'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 1, argv + 1, "r:b:S:Oo:h", host_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'r': rate_str = optarg; break;
+		case 'b': bucket_str = optarg; break;
+		case 'S': {
+			char *end = NULL;
+			unsigned long v = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || v > 100) {
+				fprintf(stderr, "无效的 --shard 误差: %s（取值 0-100）\n", optarg);
+				return 1;
+			}
+			shard_tolerance = (unsigned int)v;
+			break;
+		}
+		case 'O': off = 1; break;
+		case 'o': bpf_obj_path = optarg; break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+
+	if (off && rate_str) {
+		fprintf(stderr, "host-cap 的 --rate 与 --off 不能同时使用\n");
+		return 1;
+	}
+	struct LimiterConfig cfg = { .shard_tolerance = shard_tolerance };
+	if (rate_str) {
+		cfg.rate_bps = parse_size(rate_str);
+		cfg.bucket_size = (bucket_str && bucket_str[0] != '\0') ? parse_size(bucket_str) : cfg.rate_bps;
+		if (cfg.rate_bps == 0ULL || cfg.bucket_size == 0ULL) {
+			fprintf(stderr, "无效的 rate/bucket 参数\n");
+			return 1;
+		}
+	} else if (bucket_str) {
+		fprintf(stderr, "host-cap 的 --bucket 需要与 --rate 一起使用\n");
+		return 1;
+	}
+
+	struct LoadOptions opts = {
+		.bpf_obj_path = bpf_obj_path,
+		.attach_flags = BPF_F_ALLOW_MULTI,
+		.attach_mode = ATTACH_MODE_LINK,
+	};
+	return do_host_cap(&cfg, &opts, off);
+}
+
+/* limiter schedule add/del/list/sync */
+static int parse_schedule_args(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "schedule 需要子命令 add/del/list/sync\n");
+		print_usage(stderr);
+		return 1;
+	}
+	const char *sub = argv[2];
+	int opt;
+	const char *rule = NULL;
+	int use_last = 0;
+	const char *from = NULL;
+	const char *to = NULL;
+	const char *rate_str = NULL;
+	const char *bucket_str = NULL;
+	long id = -1;
+	RateWindow win = { .days = 0x7f };
+
+	static struct option schedule_opts[] = {
+		{"rule", required_argument, 0, 'R'},
+		{"last", no_argument, 0, 'L'},
+		{"days", required_argument, 0, 'D'},
+		{"from", required_argument, 0, 'f'},
+		{"to", required_argument, 0, 't'},
+		{"rate", required_argument, 0, 'r'},
+		{"bucket", required_argument, 0, 'b'},
+		{"id", required_argument, 0, 'i'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 2, argv + 2, "R:LD:f:t:r:b:i:h", schedule_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'R': rule = optarg; break;
+		case 'L': use_last = 1; break;
+		case 'D':
+			if (parse_sched_days(optarg, &win.days) != 0) {
+				fprintf(stderr, "无效的星期: %s（如 all、mon-fri、sat,sun）\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f': from = optarg; break;
+		case 't': to = optarg; break;
+		case 'r': rate_str = optarg; break;
+		case 'b': bucket_str = optarg; break;
+		case 'i': id = strtol(optarg, NULL, 10); break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+
+	if (strcmp(sub, "sync") == 0) {
+		return do_schedule_sync();
+	}
+
+	char rule_path[PATH_MAX] = {0};
+	if (use_last) {
+		unsigned long long last_id = 0ULL;
+		if (read_last_rule(rule_path, sizeof(rule_path), &last_id) != 0) {
+			fprintf(stderr, "没有可用的最近规则，请先执行 limiter set\n");
+			return 1;
+		}
+	} else if (rule) {
+		if (resolve_rule_arg(rule, rule_path, sizeof(rule_path)) != 0) return 1;
+	}
+
+	if (strcmp(sub, "list") == 0) {
+		return do_schedule_list(rule_path[0] ? rule_path : NULL);
+	}
+	if (!rule_path[0]) {
+		fprintf(stderr, "schedule %s 需要 --rule 或 --last\n", sub);
+		return 1;
+	}
+
+	if (strcmp(sub, "del") == 0) {
+		if (id < 0 || id >= LIMIT_MAX_WINDOWS) {
+			fprintf(stderr, "schedule del 需要 --id（0-%d）\n", LIMIT_MAX_WINDOWS - 1);
+			return 1;
+		}
+		return do_schedule_del(rule_path, (unsigned int)id);
+	}
+	if (strcmp(sub, "add") != 0) {
+		fprintf(stderr, "未知的 schedule 子命令: %s\n", sub);
+		print_usage(stderr);
+		return 1;
+	}
+
+	if (!from || parse_sched_time(from, 0, &win.start_sec) != 0 ||
+	    !to || parse_sched_time(to, 1, &win.end_sec) != 0) {
+		fprintf(stderr, "schedule add 需要有效的 --from/--to（HH:MM，--to 可为 24:00）\n");
+		return 1;
+	}
+	if (win.start_sec == win.end_sec) {
+		fprintf(stderr, "--from 与 --to 不能相同\n");
+		return 1;
+	}
+	win.rate_bps = rate_str ? parse_size(rate_str) : 0ULL;
+	win.bucket_size = (bucket_str && bucket_str[0] != '\0') ? parse_size(bucket_str) : win.rate_bps;
+	if (win.rate_bps == 0ULL || win.bucket_size == 0ULL) {
+		fprintf(stderr, "schedule add 需要有效的 --rate/--bucket\n");
+		return 1;
+	}
+	return do_schedule_add(rule_path, &win);
+}
+
+/* limiter class add/del/list */
+static int parse_class_args(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "class 需要子命令 add/del/list\n");
+		print_usage(stderr);
+		return 1;
+	}
+	const char *sub = argv[2];
+	int opt;
+	const char *rule = NULL;
+	int use_last = 0;
+	const char *dst = NULL;
+	const char *rate_str = NULL;
+	const char *bucket_str = NULL;
+	long id = -1;
+	TrafficClass cls = { .action = CLASS_ACTION_LIMIT };
+	int bypass = 0;
+
+	static struct option class_opts[] = {
+		{"rule", required_argument, 0, 'R'},
+		{"last", no_argument, 0, 'L'},
+		{"dst", required_argument, 0, 'd'},
+		{"proto", required_argument, 0, 'P'},
+		{"port", required_argument, 0, 'n'},
+		{"rate", required_argument, 0, 'r'},
+		{"bucket", required_argument, 0, 'b'},
+		{"bypass", no_argument, 0, 'y'},
+		{"id", required_argument, 0, 'i'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 2, argv + 2, "R:Ld:P:n:r:b:yi:h", class_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'R': rule = optarg; break;
+		case 'L': use_last = 1; break;
+		case 'd': dst = optarg; break;
+		case 'P':
+			if (parse_class_proto(optarg, &cls.proto) != 0) {
+				fprintf(stderr, "无效的协议: %s（支持 tcp/udp/icmp/icmpv6/any 或 0-255）\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (parse_class_ports(optarg, &cls.port_lo, &cls.port_hi) != 0) {
+				fprintf(stderr, "无效的端口: %s（如 873 或 8000-9000）\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r': rate_str = optarg; break;
+		case 'b': bucket_str = optarg; break;
+		case 'y': bypass = 1; break;
+		case 'i': id = strtol(optarg, NULL, 10); break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+
+	char rule_path[PATH_MAX] = {0};
+	if (use_last) {
+		unsigned long long last_id = 0ULL;
+		if (read_last_rule(rule_path, sizeof(rule_path), &last_id) != 0) {
+			fprintf(stderr, "没有可用的最近规则，请先执行 limiter set\n");
+			return 1;
+		}
+	} else if (rule) {
+		if (resolve_rule_arg(rule, rule_path, sizeof(rule_path)) != 0) return 1;
+	}
+
+	if (strcmp(sub, "list") == 0) {
+		return do_class_list(rule_path[0] ? rule_path : NULL);
+	}
+	if (!rule_path[0]) {
+		fprintf(stderr, "class %s 需要 --rule 或 --last\n", sub);
+		return 1;
+	}
+
+	if (strcmp(sub, "del") == 0) {
+		if (id < 0 || id >= LIMIT_MAX_CLASSES) {
+			fprintf(stderr, "class del 需要 --id（0-%d）\n", LIMIT_MAX_CLASSES - 1);
+			return 1;
+		}
+		return do_class_del(rule_path, (unsigned int)id);
+	}
+	if (strcmp(sub, "add") != 0) {
+		fprintf(stderr, "未知的 class 子命令: %s\n", sub);
+		print_usage(stderr);
+		return 1;
+	}
+
+	if (!dst || parse_class_dst(dst, &cls) != 0) {
+		fprintf(stderr, "class add 需要有效的 --dst（如 10.0.0.0/8）\n");
+		return 1;
+	}
+	if (bypass == (rate_str != NULL)) {
+		fprintf(stderr, "class add 需要 --rate 或 --bypass 之一\n");
+		return 1;
+	}
+	if (bypass) {
+		cls.action = CLASS_ACTION_BYPASS;
+	} else {
+		cls.rate_bps = parse_size(rate_str);
+		cls.bucket_size = (bucket_str && bucket_str[0] != '\0') ? parse_size(bucket_str) : cls.rate_bps;
+		if (cls.rate_bps == 0ULL || cls.bucket_size == 0ULL) {
+			fprintf(stderr, "无效的 rate/bucket 参数\n");
+			return 1;
+		}
+	}
+	return do_class_add(rule_path, &cls);
+}
+
+/* limiter tc add/del/list/attach/detach */
+static int parse_tc_args(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "tc 需要子命令 add/del/list/attach/detach\n");
+		print_usage(stderr);
+		return 1;
+	}
+	const char *sub = argv[2];
+	int opt;
+	const char *rule = NULL;
+	int use_last = 0;
+	const char *dev_name = NULL;
+	TcMatch m;
+	int match_cnt = 0;
+	memset(&m, 0, sizeof(m));
+
+	static struct option tc_opts[] = {
+		{"rule", required_argument, 0, 'R'},
+		{"last", no_argument, 0, 'L'},
+		{"mark", required_argument, 0, 'k'},
+		{"iif", required_argument, 0, 'i'},
+		{"src", required_argument, 0, 's'},
+		{"dev", required_argument, 0, 'V'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 2, argv + 2, "R:Lk:i:s:V:h", tc_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'R': rule = optarg; break;
+		case 'L': use_last = 1; break;
+		case 'k': {
+			char *end = NULL;
+			unsigned long v = strtoul(optarg, &end, 0);
+			if (end == optarg || *end != '\0' || v == 0 || v > 0xffffffffUL) {
+				fprintf(stderr, "无效的 --mark: %s（非 0 的 32 位整数，可用 0x 前缀）\n", optarg);
+				return 1;
+			}
+			m.type = TC_MATCH_MARK;
+			m.value = (unsigned int)v;
+			match_cnt++;
+			break;
+		}
+		case 'i':
+			if (check_dev_name(optarg) != 0) return 1;
+			m.type = TC_MATCH_IIF;
+			snprintf(m.ifname, sizeof(m.ifname), "%s", optarg);
+			match_cnt++;
+			break;
+		case 's':
+			if (parse_tc_src(optarg, &m) != 0) {
+				fprintf(stderr, "无效的 --src: %s（如 10.244.1.0/24）\n", optarg);
+				return 1;
+			}
+			m.type = TC_MATCH_SRC;
+			match_cnt++;
+			break;
+		case 'V': dev_name = optarg; break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+
+	if (strcmp(sub, "list") == 0) {
+		return do_tc_list();
+	}
+	if (strcmp(sub, "attach") == 0 || strcmp(sub, "detach") == 0) {
+		if (!dev_name) {
+			fprintf(stderr, "tc %s 需要 --dev\n", sub);
+			return 1;
+		}
+		if (check_dev_name(dev_name) != 0) return 1;
+		return strcmp(sub, "attach") == 0 ? do_tc_attach(dev_name) : do_tc_detach(dev_name);
+	}
+	if (strcmp(sub, "add") != 0 && strcmp(sub, "del") != 0) {
+		fprintf(stderr, "未知的 tc 子命令: %s\n", sub);
+		print_usage(stderr);
+		return 1;
+	}
+
+	if (match_cnt != 1) {
+		fprintf(stderr, "tc %s 需要 --mark、--iif、--src 之一\n", sub);
+		return 1;
+	}
+	if (strcmp(sub, "del") == 0) {
+		return do_tc_del(&m);
+	}
+	char rule_path[PATH_MAX] = {0};
+	if (resolve_rule_or_last(rule, use_last, "tc add", rule_path, sizeof(rule_path)) != 0) return 1;
+	return do_tc_add(rule_path, &m);
+}
+
+static int parse_shape_args(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "shape 需要子命令 add/del/list\n");
+		print_usage(stderr);
+		return 1;
+	}
+	const char *sub = argv[2];
+	int opt;
+	const char *dev_name = NULL;
+
+	static struct option shape_opts[] = {
+		{"dev", required_argument, 0, 'V'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc - 2, argv + 2, "V:h", shape_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'V': dev_name = optarg; break;
+		case 'h': print_usage(stdout); return 0;
+		default: print_usage(stderr); return 1;
+		}
+	}
+
+	if (strcmp(sub, "list") == 0) {
+		return do_shape_list();
+	}
+	if (strcmp(sub, "add") != 0 && strcmp(sub, "del") != 0) {
+		fprintf(stderr, "未知的 shape 子命令: %s\n", sub);
+		print_usage(stderr);
+		return 1;
+	}
+	if (!dev_name) {
+		fprintf(stderr, "shape %s 需要 --dev\n", sub);
+		return 1;
+	}
+	if (check_dev_name(dev_name) != 0) return 1;
+	return strcmp(sub, "add") == 0 ? do_shape_add(dev_name) : do_shape_del(dev_name);
+}
+
 /* 解析便捷模式参数 */
 int parse_convenient_args(int argc, char **argv)
 {
@@ -65,25 +755,132 @@ int parse_convenient_args(int argc, char **argv)
 			const char *rate_str = NULL;
 			const char *bucket_str = NULL;
 			const char *bpf_obj_path = DEFAULT_BPF_OBJ;
+			unsigned int mode = LIMIT_MODE_POLICE;
+			unsigned long long horizon_ms = 0ULL;
+			unsigned int shard_tolerance = 0;
+			unsigned int direction = LIMIT_DIR_EGRESS;
+			const char *parent = NULL;
+			unsigned long long pps = 0ULL;
+			unsigned long long pkt_burst = 0ULL;
+			unsigned int max_rules = 0;
+			unsigned int map_alloc = MAP_ALLOC_KEEP;
+			const char *attach_scope = NULL;
+			const char *ecn_soft_str = NULL;
+			const char *ecn_hard_str = NULL;
+			unsigned int fair_pct = 0;
+			int in_place = 0;
+			const char *peak_rate_str = NULL;
+			const char *peak_burst_str = NULL;
+			unsigned int yellow_dscp = TCM_DEFAULT_YELLOW_DSCP;
+			int yellow_set = 0;
+			const char *dev_name = NULL;
+			const char *rule = NULL;
+			int use_last = 0;
 
 			static struct option set_opts[] = {
 				{"pid", required_argument, 0, 'p'},
+				{"in-place", no_argument, 0, 'I'},
 				{"rate", required_argument, 0, 'r'},
 				{"bucket", required_argument, 0, 'b'},
+				{"mode", required_argument, 0, 'm'},
+				{"horizon", required_argument, 0, 'H'},
+				{"shard", required_argument, 0, 'S'},
+				{"direction", required_argument, 0, 'T'},
+				{"parent", required_argument, 0, 'N'},
+				{"pps", required_argument, 0, 'K'},
+				{"pkt-burst", required_argument, 0, 'B'},
+				{"max-rules", required_argument, 0, 'C'},
+				{"map-alloc", required_argument, 0, 'A'},
+				{"attach-scope", required_argument, 0, 'G'},
+				{"ecn-soft", required_argument, 0, 'E'},
+				{"ecn-hard", required_argument, 0, 'F'},
+				{"fair", required_argument, 0, 'Q'},
+				{"peak-rate", required_argument, 0, 'P'},
+				{"peak-burst", required_argument, 0, 'U'},
+				{"yellow-dscp", required_argument, 0, 'Y'},
+				{"dev", required_argument, 0, 'V'},
+				{"rule", required_argument, 0, 'R'},
+				{"last", no_argument, 0, 'L'},
+				{"update", no_argument, 0, 'u'},
 				{"bpf-obj", required_argument, 0, 'o'},
 				{"deamon", no_argument, 0, 'd'},
+				{"debug", no_argument, 0, 'D'},
 				{"help", no_argument, 0, 'h'},
 				{0, 0, 0, 0}
 			};
 
 			int deamon = 0;
-			while ((opt = getopt_long(argc - 1, argv + 1, "p:r:b:o:dh", set_opts, NULL)) != -1) {
+			int debug = 0;
+			int update = 0;
+			while ((opt = getopt_long(argc - 1, argv + 1, "p:Ir:b:m:H:S:T:N:K:B:C:A:G:E:F:Q:P:U:Y:V:R:Luo:dh", set_opts, NULL)) != -1) {
 				switch (opt) {
 				case 'p': pid = (pid_t)strtoul(optarg, NULL, 10); break;
+				case 'I': in_place = 1; break;
 				case 'r': rate_str = optarg; break;
 				case 'b': bucket_str = optarg; break;
+				case 'm':
+					if (parse_limit_mode(optarg, &mode) != 0) {
+						fprintf(stderr, "无效的模式: %s（支持 pace/police/ecn/tcm/shape）\n", optarg);
+						return 1;
+					}
+					break;
+				case 'H':
+					if (parse_u64_option("--horizon", optarg, 0, &horizon_ms) != 0) return 1;
+					break;
+				case 'S':
+					shard_tolerance = (unsigned int)strtoul(optarg, NULL, 10);
+					if (shard_tolerance == 0 || shard_tolerance > 100) {
+						fprintf(stderr, "无效的 --shard 误差: %s（取值 1-100）\n", optarg);
+						return 1;
+					}
+					break;
+				case 'T':
+					if (parse_limit_direction(optarg, &direction) != 0) {
+						fprintf(stderr, "无效的方向: %s（支持 in/out/both）\n", optarg);
+						return 1;
+					}
+					break;
+				case 'N': parent = optarg; break;
+				case 'K':
+					if (parse_u64_option("--pps", optarg, 1, &pps) != 0) return 1;
+					break;
+				case 'B':
+					if (parse_u64_option("--pkt-burst", optarg, 1, &pkt_burst) != 0) return 1;
+					break;
+				case 'C':
+				case 'A':
+					if (parse_map_option(opt, optarg, &max_rules, &map_alloc) != 0) return 1;
+					break;
+				case 'G': attach_scope = optarg; break;
+				case 'E': ecn_soft_str = optarg; break;
+				case 'F': ecn_hard_str = optarg; break;
+				case 'Q':
+					fair_pct = (unsigned int)strtoul(optarg, NULL, 10);
+					if (fair_pct == 0 || fair_pct > 100) {
+						fprintf(stderr, "无效的 --fair 百分比: %s（取值 1-100）\n", optarg);
+						return 1;
+					}
+					break;
+				case 'P': peak_rate_str = optarg; break;
+				case 'U': peak_burst_str = optarg; break;
+				case 'Y': {
+					char *end = NULL;
+					unsigned long v = strtoul(optarg, &end, 0);
+					if (end == optarg || *end != '\0' || v > 63) {
+						fprintf(stderr, "无效的 --yellow-dscp: %s（取值 0-63）\n", optarg);
+						return 1;
+					}
+					yellow_dscp = (unsigned int)v;
+					yellow_set = 1;
+					break;
+				}
+				case 'V': dev_name = optarg; break;
+				case 'R': rule = optarg; break;
+				case 'L': use_last = 1; break;
+				case 'u': update = 1; break;
 				case 'o': bpf_obj_path = optarg; break;
 				case 'd': deamon = 1; break;
+				case 'D': debug = 1; break;
 				case 'h': print_usage(stdout); return 0;
 				default: print_usage(stderr); return 1;
 				}
@@ -94,19 +891,134 @@ int parse_convenient_args(int argc, char **argv)
 				print_usage(stderr);
 				return 1;
 			}
+			/* 网卡桶：只给已有规则加一个按出口网卡区分的桶，其余参数沿用规则本身 */
+			if (dev_name) {
+				if (pid || in_place || mode != LIMIT_MODE_POLICE || horizon_ms || shard_tolerance ||
+				    direction != LIMIT_DIR_EGRESS || parent || pps || pkt_burst || ecn_soft_str ||
+				    ecn_hard_str || fair_pct || peak_rate_str || peak_burst_str || yellow_set) {
+					fprintf(stderr, "--dev 只能与 --rule/--last、--rate、--bucket 同时使用，其余参数沿用规则本身\n");
+					return 1;
+				}
+				if (check_dev_name(dev_name) != 0) return 1;
+				char rule_path[PATH_MAX] = {0};
+				if (resolve_rule_or_last(rule, use_last, "set --dev", rule_path, sizeof(rule_path)) != 0) return 1;
+				DevBucket dev = { .rate_bps = parse_size(rate_str) };
+				dev.bucket_size = (bucket_str && bucket_str[0] != '\0') ? parse_size(bucket_str) : dev.rate_bps;
+				if (dev.rate_bps == 0ULL || dev.bucket_size == 0ULL) {
+					fprintf(stderr, "无效的 rate/bucket 参数\n");
+					return 1;
+				}
+				snprintf(dev.name, sizeof(dev.name), "%s", dev_name);
+				return do_dev_set(rule_path, &dev);
+			}
+			if (rule || use_last) {
+				fprintf(stderr, "--rule/--last 只能与 --dev 同时使用\n");
+				return 1;
+			}
+			if (shard_tolerance && mode != LIMIT_MODE_POLICE) {
+				fprintf(stderr, "--shard 仅适用于 police 模式\n");
+				return 1;
+			}
+			/* 包令牌以 PKT_TOKEN_UNIT 计量，容量须放得进 64 位 */
+			if (pps > 1000000000ULL || pkt_burst > 1000000000ULL) {
+				fprintf(stderr, "--pps/--pkt-burst 不能超过 1000000000\n");
+				return 1;
+			}
+			if (pkt_burst && !pps) {
+				fprintf(stderr, "--pkt-burst 需要同时指定 --pps\n");
+				return 1;
+			}
+			if ((ecn_soft_str || ecn_hard_str) && mode != LIMIT_MODE_ECN) {
+				fprintf(stderr, "--ecn-soft/--ecn-hard 仅适用于 --mode ecn\n");
+				return 1;
+			}
+			if (fair_pct && (mode == LIMIT_MODE_PACE || mode == LIMIT_MODE_TCM || mode == LIMIT_MODE_SHAPE ||
+					 shard_tolerance)) {
+				fprintf(stderr, "--fair 仅适用于 police/ecn 模式，且不能与 --shard 同时使用\n");
+				return 1;
+			}
+			if (pps && shard_tolerance) {
+				fprintf(stderr, "--pps 不能与 --shard 同时使用\n");
+				return 1;
+			}
+			if ((peak_rate_str || peak_burst_str || yellow_set) && mode != LIMIT_MODE_TCM) {
+				fprintf(stderr, "--peak-rate/--peak-burst/--yellow-dscp 仅适用于 --mode tcm\n");
+				return 1;
+			}
+			if (mode == LIMIT_MODE_TCM && (!peak_rate_str || pps)) {
+				fprintf(stderr, "tcm 模式需要 --peak-rate，且不能与 --pps 同时使用\n");
+				return 1;
+			}
+			/* 整形由 HTB 按字节速率完成，包速率桶在 shape 模式下无处生效 */
+			if (mode == LIMIT_MODE_SHAPE && pps) {
+				fprintf(stderr, "shape 模式不能与 --pps 同时使用\n");
+				return 1;
+			}
+			if (mode == LIMIT_MODE_SHAPE) {
+				char shape_devs[SHAPE_MAX_DEVS][16];
+				if (load_shape_dev_record(shape_devs, SHAPE_MAX_DEVS) == 0) {
+					fprintf(stderr, "shape 模式需要整形网卡，请先用 limiter shape add --dev <ifname> 添加\n");
+					return 1;
+				}
+			}
+			if (in_place && pid <= 0) {
+				fprintf(stderr, "--in-place 需要 --pid\n");
+				return 1;
+			}
+			if (in_place && (mode != LIMIT_MODE_POLICE || shard_tolerance || fair_pct ||
+					 direction != LIMIT_DIR_EGRESS || parent)) {
+				fprintf(stderr, "--in-place 只支持出方向 police 模式，不能与 --mode/--shard/--fair/--direction/--parent 同时使用\n");
+				return 1;
+			}
 			unsigned long long rate_num = parse_size(rate_str);
 			unsigned long long bucket_num = (bucket_str && bucket_str[0] != '\0') ? parse_size(bucket_str) : rate_num;
 			if (rate_num == 0ULL || bucket_num == 0ULL) {
 				fprintf(stderr, "无效的 rate/bucket 参数\n");
 				return 1;
 			}
-			struct LimiterConfig cfg = { .cgid = 0ULL, .rate_bps = rate_num, .bucket_size = bucket_num };
+			unsigned long long peak_rate = peak_rate_str ? parse_size(peak_rate_str) : 0ULL;
+			if (peak_rate_str && peak_rate < rate_num) {
+				fprintf(stderr, "--peak-rate 不能小于 --rate\n");
+				return 1;
+			}
+			struct LimiterConfig cfg = {
+				.cgid = 0ULL,
+				.rate_bps = rate_num,
+				.bucket_size = bucket_num,
+				.mode = mode,
+				.horizon_ns = horizon_ms * 1000000ULL,
+				.shard_tolerance = shard_tolerance,
+				.direction = direction,
+				.pps = pps,
+				.pkt_burst = pkt_burst,
+				.ecn_soft = ecn_soft_str ? parse_size(ecn_soft_str) : 0ULL,
+				.ecn_hard = ecn_hard_str ? parse_size(ecn_hard_str) : 0ULL,
+				.fair_pct = fair_pct,
+				.peak_rate = peak_rate,
+				.peak_burst = peak_burst_str ? parse_size(peak_burst_str) : 0ULL,
+				.yellow_dscp = yellow_dscp,
+			};
+			/* 嵌套规则：新规则目录创建在父规则目录下 */
+			char parent_path[PATH_MAX];
+			const char *base_path = MANAGED_ROOT;
+			if (parent) {
+				if (resolve_rule_arg(parent, parent_path, sizeof(parent_path)) != 0) return 1;
+				base_path = parent_path;
+			}
 			struct LoadOptions opts = { 
 				.bpf_obj_path = bpf_obj_path, 
-				.cgroup_path = MANAGED_ROOT, 
+				.cgroup_path = base_path, 
 				.attach_flags = BPF_F_ALLOW_MULTI,
 				.attach_mode = deamon ? ATTACH_MODE_PROG_ATTACH : ATTACH_MODE_LINK,
+				.debug = debug,
+				.max_rules = max_rules,
+				.map_alloc = map_alloc,
+				.attach_scope = attach_scope,
+				.update = update,
 			};
+			if (in_place) {
+				return do_set_in_place(pid, cfg, opts);
+			}
 			return do_set(pid, cfg, opts);
 		}
 		else if (strcmp(argv[1], "move") == 0) {
@@ -197,18 +1109,32 @@ int parse_convenient_args(int argc, char **argv)
             const char *bpf_obj_path = DEFAULT_BPF_OBJ;
             unsigned int attach_flags = BPF_F_ALLOW_MULTI; /* 默认启用 MULTI */
             const char *cgroup_path = NULL;
+            int debug = 0;
+            unsigned int max_rules = 0;
+            unsigned int map_alloc = MAP_ALLOC_KEEP;
+            const char *attach_scope = NULL;
 			static struct option reload_opts[] = {
 				{"bpf-obj", required_argument, 0, 'o'},
                 {"cgroup-path", required_argument, 0, 'p'},
                 {"attach-flag", no_argument, 0, 'm'},
+                {"debug", no_argument, 0, 'D'},
+                {"max-rules", required_argument, 0, 'C'},
+                {"map-alloc", required_argument, 0, 'A'},
+                {"attach-scope", required_argument, 0, 'G'},
 				{"help", no_argument, 0, 'h'},
 				{0, 0, 0, 0}
 			};
-            while ((opt = getopt_long(argc - 1, argv + 1, "o:p:mh", reload_opts, NULL)) != -1) {
+            while ((opt = getopt_long(argc - 1, argv + 1, "o:p:mC:A:G:h", reload_opts, NULL)) != -1) {
 				switch (opt) {
 				case 'o': bpf_obj_path = optarg; break;
                 case 'p': cgroup_path = optarg; break;
                 case 'm': attach_flags |= BPF_F_ALLOW_MULTI; break; /* 冪等设置 */
+                case 'D': debug = 1; break;
+                case 'C':
+                case 'A':
+                    if (parse_map_option(opt, optarg, &max_rules, &map_alloc) != 0) return 1;
+                    break;
+                case 'G': attach_scope = optarg; break;
 				case 'h': print_usage(stdout); return 0;
 				default: print_usage(stderr); return 1;
 				}
@@ -222,29 +1148,108 @@ int parse_convenient_args(int argc, char **argv)
                 .bpf_obj_path = bpf_obj_path, 
                 .cgroup_path = cgroup_path, 
                 .attach_flags = attach_flags,
-                .attach_mode = current_mode  /* 保持当前的附加模式 */
+                .attach_mode = current_mode,  /* 保持当前的附加模式 */
+                .debug = debug,
+                .max_rules = max_rules,
+                .map_alloc = map_alloc,
+                .attach_scope = attach_scope,
             };
             return do_load(&cfg, &opts, RELOAD_PROGRAM);
 		}
+		else if (strcmp(argv[1], "class") == 0) {
+			/* 便捷子命令：class add/del/list */
+			return parse_class_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "tc") == 0) {
+			/* 便捷子命令：tc add/del/list/attach/detach */
+			return parse_tc_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "shape") == 0) {
+			/* 便捷子命令：shape add/del/list */
+			return parse_shape_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "bench") == 0) {
+			/* 便捷子命令：bench */
+			int opt;
+			unsigned long repeat = 1000000;
+			unsigned long size = 64;
+
+			static struct option bench_opts[] = {
+				{"repeat", required_argument, 0, 'n'},
+				{"size", required_argument, 0, 's'},
+				{"help", no_argument, 0, 'h'},
+				{0, 0, 0, 0}
+			};
+
+			while ((opt = getopt_long(argc - 1, argv + 1, "n:s:h", bench_opts, NULL)) != -1) {
+				switch (opt) {
+				case 'n': repeat = strtoul(optarg, NULL, 10); break;
+				case 's': size = strtoul(optarg, NULL, 10); break;
+				case 'h': print_usage(stdout); return 0;
+				default: print_usage(stderr); return 1;
+				}
+			}
+			if (repeat == 0 || repeat > 100000000UL || size > 65535) {
+				fprintf(stderr, "无效的 --repeat（1-100000000）或 --size（不超过 65535）\n");
+				return 1;
+			}
+			return do_bench((unsigned int)repeat, (unsigned int)size);
+		}
+		else if (strcmp(argv[1], "ctrl-pass") == 0) {
+			/* 便捷子命令：ctrl-pass */
+			return parse_ctrl_pass_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "local-bypass") == 0) {
+			/* 便捷子命令：local-bypass */
+			return parse_local_bypass_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "host-cap") == 0) {
+			/* 便捷子命令：host-cap */
+			return parse_host_cap_args(argc, argv);
+		}
+		else if (strcmp(argv[1], "schedule") == 0) {
+			/* 便捷子命令：schedule add/del/list/sync */
+			return parse_schedule_args(argc, argv);
+		}
 		else if (strcmp(argv[1], "unset") == 0) {
 			/* 便捷子命令：unset */
 			int opt;
 			pid_t pid = 0;
+			const char *dev_name = NULL;
+			const char *rule = NULL;
+			int use_last = 0;
 
 			static struct option unset_opts[] = {
 				{"pid", required_argument, 0, 'p'},
+				{"dev", required_argument, 0, 'V'},
+				{"rule", required_argument, 0, 'R'},
+				{"last", no_argument, 0, 'L'},
 				{"help", no_argument, 0, 'h'},
 				{0, 0, 0, 0}
 			};
 
-			while ((opt = getopt_long(argc - 1, argv + 1, "p:h", unset_opts, NULL)) != -1) {
+			while ((opt = getopt_long(argc - 1, argv + 1, "p:V:R:Lh", unset_opts, NULL)) != -1) {
 				switch (opt) {
 				case 'p': pid = (pid_t)strtoul(optarg, NULL, 10); break;
+				case 'V': dev_name = optarg; break;
+				case 'R': rule = optarg; break;
+				case 'L': use_last = 1; break;
 				case 'h': print_usage(stdout); return 0;
 				default: print_usage(stderr); return 1;
 				}
 			}
 
+			if (dev_name) {
+				if (pid != 0) {
+					fprintf(stderr, "unset 的 --pid 与 --dev 不能同时使用\n");
+					return 1;
+				}
+				if (check_dev_name(dev_name) != 0) return 1;
+				char rule_path[PATH_MAX] = {0};
+				if (resolve_rule_or_last(rule, use_last, "unset --dev", rule_path, sizeof(rule_path)) != 0) return 1;
+				return do_dev_unset(rule_path, dev_name);
+			}
+
 			if (pid == 0) {
 				fprintf(stderr, "unset 需要 --pid\n");
 				print_usage(stderr);
@@ -255,26 +1260,28 @@ int parse_convenient_args(int argc, char **argv)
 		else if (strcmp(argv[1], "list") == 0) {
 			/* 便捷子命令：list */
 			int opt;
-			int list_pid = 0, list_bpf = 0;
+			int list_pid = 0, list_bpf = 0, list_stats = 0;
 
 			static struct option list_opts[] = {
 				{"pid", no_argument, 0, 'p'},
 				{"bpf", no_argument, 0, 'b'},
+				{"stats", no_argument, 0, 's'},
 				{"help", no_argument, 0, 'h'},
 				{0, 0, 0, 0}
 			};
 
-			while ((opt = getopt_long(argc - 1, argv + 1, "pbh", list_opts, NULL)) != -1) {
+			while ((opt = getopt_long(argc - 1, argv + 1, "pbsh", list_opts, NULL)) != -1) {
 				switch (opt) {
 				case 'p': list_pid = 1; break;
 				case 'b': list_bpf = 1; break;
+				case 's': list_stats = 1; break;
 				case 'h': print_usage(stdout); return 0;
 				default: print_usage(stderr); return 1;
 				}
 			}
 
-			if (list_pid && list_bpf) {
-				fprintf(stderr, "list 不能同时使用 --pid 和 --bpf\n");
+			if (list_pid + list_bpf + list_stats > 1) {
+				fprintf(stderr, "list 的 --pid、--bpf、--stats 只能选其一\n");
 				print_usage(stderr);
 				return 1;
 			}
@@ -283,6 +1290,8 @@ int parse_convenient_args(int argc, char **argv)
 				return do_list_cgroup_pids();
 			} else if (list_bpf) {
 				return do_list_cgroup_bpf();
+			} else if (list_stats) {
+				return do_list_stats();
 			} else {
 				return do_list_managed();
 			}
@@ -0,0 +1,204 @@
+#include "dev.h"
+#include "managed.h"
+#include "cgroup.h"
+#include "record.h"
+#include "utils.h"
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <linux/limits.h>
+
+/* 构建网卡桶记录文件路径 */
+static int build_dev_record_path(unsigned long long cgid, char *path, size_t path_size)
+{
+	char id_str[32];
+	if (snprintf(id_str, sizeof(id_str), "%llu", cgid) >= (int)sizeof(id_str)) {
+		return -1;
+	}
+	return safe_path_join(path, path_size, RUNTIME_DIR, "devs", id_str, NULL);
+}
+
+int save_dev_record(unsigned long long cgid, const DevBucket *d, int n)
+{
+	char path[PATH_MAX];
+	if (build_dev_record_path(cgid, path, sizeof(path)) != 0) return -1;
+	if (n <= 0) {
+		if (unlink(path) != 0 && errno != ENOENT) return -1;
+		return 0;
+	}
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "devs") != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建网卡桶记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		ret = fprintf(f, "name=%s ifindex=%u rate=%llu bucket=%llu\n",
+			      d[i].name, d[i].ifindex, d[i].rate_bps, d[i].bucket_size);
+	}
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入网卡桶记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* 解析一行网卡桶记录，格式见 save_dev_record */
+static int parse_dev_line(char *line, DevBucket *d)
+{
+	memset(d, 0, sizeof(*d));
+	char *save = NULL;
+	for (char *tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+		char *eq = strchr(tok, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		const char *val = eq + 1;
+		if (strcmp(tok, "name") == 0) {
+			snprintf(d->name, sizeof(d->name), "%s", val);
+		} else if (strcmp(tok, "ifindex") == 0) {
+			d->ifindex = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(tok, "rate") == 0) {
+			d->rate_bps = strtoull(val, NULL, 10);
+		} else if (strcmp(tok, "bucket") == 0) {
+			d->bucket_size = strtoull(val, NULL, 10);
+		}
+	}
+	if (!d->name[0] || d->rate_bps == 0 || d->bucket_size == 0) return -1;
+	/* 网卡重建（如重新加载驱动）后 ifindex 会变，以网卡名为准 */
+	unsigned int idx = if_nametoindex(d->name);
+	if (idx) d->ifindex = idx;
+	return d->ifindex ? 0 : -1;
+}
+
+int load_dev_record(unsigned long long cgid, DevBucket *d, int max)
+{
+	char path[PATH_MAX];
+	if (build_dev_record_path(cgid, path, sizeof(path)) != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	char line[256];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		if (parse_dev_line(line, &d[n]) != 0) {
+			fprintf(stderr, "警告: 规则 %llu 的网卡桶记录中有无效行，已跳过\n", cgid);
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* 读取规则参数（网卡桶沿用其模式、包速率等），规则没有出方向限速时打印原因并返回 -1 */
+static int dev_rule_config(const char *rule_path, LimiterConfig *lc)
+{
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return -1;
+
+	memset(lc, 0, sizeof(*lc));
+	if (load_rule_record(cgid, lc) != 0 || lc->rate_bps == 0ULL) {
+		fprintf(stderr, "规则 %s 没有参数记录，请先用 limiter set 设置\n", rule_path);
+		return -1;
+	}
+	if (lc->direction && !(lc->direction & LIMIT_DIR_EGRESS)) {
+		fprintf(stderr, "规则 %s 只限入方向，网卡桶只作用于出方向\n", rule_path);
+		return -1;
+	}
+	lc->cgid = cgid;
+	lc->cgroup_path = rule_path;
+	return 0;
+}
+
+/* 记录中与 name 同名的网卡桶下标，没有返回 -1 */
+static int find_dev(const DevBucket *d, int n, const char *name)
+{
+	for (int i = 0; i < n; i++) {
+		if (strcmp(d[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+int do_dev_set(const char *rule_path, const DevBucket *dev)
+{
+	LimiterConfig lc;
+	if (dev_rule_config(rule_path, &lc) != 0) return 1;
+
+	DevBucket nd = *dev;
+	nd.ifindex = if_nametoindex(nd.name);
+	if (nd.ifindex == 0) {
+		fprintf(stderr, "找不到网卡 %s: %s\n", nd.name, strerror(errno));
+		return 1;
+	}
+	if (lc.mode == LIMIT_MODE_TCM && lc.peak_rate < nd.rate_bps) {
+		fprintf(stderr, "warning: 网卡桶速率高于规则的 --peak-rate，该网卡的峰值速率按网卡桶速率计\n");
+	}
+
+	DevBucket d[LIMIT_MAX_DEVS];
+	int n = load_dev_record(lc.cgid, d, LIMIT_MAX_DEVS);
+	int idx = find_dev(d, n, nd.name);
+	if (idx < 0) {
+		if (n >= LIMIT_MAX_DEVS) {
+			fprintf(stderr, "每条规则最多 %d 个网卡桶\n", LIMIT_MAX_DEVS);
+			return 1;
+		}
+		idx = n++;
+	}
+	d[idx] = nd;
+	if (bpf_sync_rule_devs(&lc, d, n) != 0) {
+		return 1;
+	}
+	if (save_dev_record(lc.cgid, d, n) != 0) {
+		fprintf(stderr, "警告: 保存网卡桶记录失败，reload 后该网卡桶将丢失\n");
+	}
+	printf("已设置网卡桶: dev=%s (ifindex %u), rate=%llu bytes/s, bucket=%llu bytes, 规则 %s\n",
+	       nd.name, nd.ifindex, nd.rate_bps, nd.bucket_size, rule_path);
+	return 0;
+}
+
+int do_dev_unset(const char *rule_path, const char *ifname)
+{
+	LimiterConfig lc;
+	if (dev_rule_config(rule_path, &lc) != 0) return 1;
+
+	DevBucket d[LIMIT_MAX_DEVS];
+	int n = load_dev_record(lc.cgid, d, LIMIT_MAX_DEVS);
+	int idx = find_dev(d, n, ifname);
+	if (idx < 0) {
+		fprintf(stderr, "规则 %s 没有网卡 %s 的桶\n", rule_path, ifname);
+		return 1;
+	}
+	memmove(&d[idx], &d[idx + 1], (size_t)(n - idx - 1) * sizeof(d[0]));
+	n--;
+
+	if (bpf_sync_rule_devs(&lc, d, n) != 0) {
+		return 1;
+	}
+	if (save_dev_record(lc.cgid, d, n) != 0) {
+		fprintf(stderr, "警告: 更新网卡桶记录失败\n");
+	}
+	printf("已删除规则 %s 在网卡 %s 上的桶，经该网卡的流量改按规则本身限速\n", rule_path, ifname);
+	return 0;
+}
+
+void print_rule_devs(unsigned long long cgid)
+{
+	DevBucket d[LIMIT_MAX_DEVS];
+	int n = load_dev_record(cgid, d, LIMIT_MAX_DEVS);
+	for (int i = 0; i < n; i++) {
+		printf("%-12s %-12llu %-8s %-12s dev=%s (ifindex %u), bucket=%llu\n",
+		       "", d[i].rate_bps, "", "", d[i].name, d[i].ifindex, d[i].bucket_size);
+	}
+}
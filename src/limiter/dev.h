@@ -0,0 +1,24 @@
+#ifndef DEV_H
+#define DEV_H
+
+#include "bpf.h"
+
+/*
+ * 按出口网卡区分的桶记录：保存在 RUNTIME_DIR "/devs/<cgid>"，每行一个网卡，
+ * reload 或规则参数变化时据此重建网卡桶。load 返回读到的网卡数（没有记录为 0），
+ * 网卡仍存在时按网卡名重新解析 ifindex；save 在 n 为 0 时删除记录文件。
+ */
+int load_dev_record(unsigned long long cgid, DevBucket *d, int max);
+int save_dev_record(unsigned long long cgid, const DevBucket *d, int n);
+
+/*
+ * 便捷子命令：set --dev 添加或修改规则经该网卡发出时使用的桶，unset --dev 删除；
+ * rule_path 为规则 cgroup 路径，dev 的 name 为网卡名（ifindex 由此解析）
+ */
+int do_dev_set(const char *rule_path, const DevBucket *dev);
+int do_dev_unset(const char *rule_path, const char *ifname);
+
+/* 打印规则的网卡桶（limiter list 中规则行之后），没有网卡桶时不输出 */
+void print_rule_devs(unsigned long long cgid);
+
+#endif /* DEV_H */
@@ -3,6 +3,9 @@
 #include "cgroup.h"
 #include "bpf.h"
 #include "utils.h"
+#include "record.h"
+#include "dev.h"
+#include "shape.h"
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -19,6 +22,59 @@
 #include <fcntl.h>
 #include <bpf/bpf.h>
 #include <linux/bpf.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "../include/limiter.h"
+
+/*
+ * 规则目录名只含桶容量与速率，同名目录下已有的规则参数与本次不同时返回第一个不同的参数名，
+ * 相同返回 NULL；set 据此拒绝悄悄改写正在使用的规则（除非指定 --update）
+ */
+static const char *rule_option_mismatch(const LimiterConfig *old, const LimiterConfig *cfg)
+{
+    if (old->mode != cfg->mode) return "--mode";
+    if (old->horizon_ns != cfg->horizon_ns) return "--horizon";
+    if (old->shard_tolerance != cfg->shard_tolerance) return "--shard";
+    if (old->direction != cfg->direction) return "--direction";
+    if (old->pps != cfg->pps) return "--pps";
+    if (old->pkt_burst != cfg->pkt_burst) return "--pkt-burst";
+    if (old->ecn_soft != cfg->ecn_soft) return "--ecn-soft";
+    if (old->ecn_hard != cfg->ecn_hard) return "--ecn-hard";
+    if (old->fair_pct != cfg->fair_pct) return "--fair";
+    if (old->peak_rate != cfg->peak_rate) return "--peak-rate";
+    if (old->peak_burst != cfg->peak_burst) return "--peak-burst";
+    if (old->yellow_dscp != cfg->yellow_dscp) return "--yellow-dscp";
+    return NULL;
+}
+
+/* 删除一条失效的原地进程规则：进程已退出或 tgid 已被新进程复用；arg 指向清理计数 */
+static int prune_pid_rule(unsigned int tgid, const LimiterConfig *cfg, unsigned long long starttime, void *arg)
+{
+    int *pruned = arg;
+    unsigned long long cur_st = 0ULL;
+    (void)cfg;
+    if (read_proc_starttime((pid_t)tgid, &cur_st) == 0 && cur_st == starttime) return 0;
+
+    (void)bpf_remove_pid_rule(tgid);
+    (void)delete_pid_rule_record(tgid);
+    printf("进程 %u 已退出，删除其原地规则\n", tgid);
+    (*pruned)++;
+    return 0;
+}
+
+/*
+ * 原地进程规则以 tgid 为键，进程退出后条目仍留在规则表里，tgid 被复用时新进程会继承限速。
+ * set/list 开始时按记录中的进程启动时间清理失效的规则，返回清理的条数。
+ */
+static int prune_stale_pid_rules(void)
+{
+    int pruned = 0;
+    (void)for_each_pid_rule_record(prune_pid_rule, &pruned);
+    return pruned;
+}
 
 /* 便捷子命令：set - 设置进程限速 */
 int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOptions opts_in)
@@ -32,12 +88,25 @@ int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOption
     if (rate == 0ULL) return 1;
     if (bucket == 0ULL) return 1;
 
+    (void)prune_stale_pid_rules();
+
     /* 1. 确保托管根目录存在（默认 attach 到 MANAGED_ROOT） */
-    if (ensure_dir(default_cgroup_path, 0755) != 0) {
-        fprintf(stderr, "无法创建托管根目录: %s\n", default_cgroup_path);
+    if (ensure_dir(MANAGED_ROOT, 0755) != 0) {
+        fprintf(stderr, "无法创建托管根目录: %s\n", MANAGED_ROOT);
         return 1;
     }
 
+    /* 嵌套规则：父目录必须是托管目录下已存在的规则目录 */
+    if (strcmp(default_cgroup_path, MANAGED_ROOT) != 0) {
+        size_t root_len = strlen(MANAGED_ROOT);
+        struct stat st;
+        if (strncmp(default_cgroup_path, MANAGED_ROOT, root_len) != 0 || default_cgroup_path[root_len] != '/' ||
+            stat(default_cgroup_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "父规则不存在或不在托管目录下: %s\n", default_cgroup_path);
+            return 1;
+        }
+    }
+
     /* 2. 生成规则目录名并创建 */
     char rule_str[PATH_MAX];
     char rule_path[PATH_MAX];
@@ -50,6 +119,15 @@ int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOption
         return 1;
     }
 
+    int level = get_cgroup_level(rule_path);
+    if (level < 0 || level > LIMIT_MAX_NEST_LEVEL + 1) {
+        fprintf(stderr, "规则嵌套层级过深（最多 %d 层 cgroup）: %s\n", LIMIT_MAX_NEST_LEVEL + 1, rule_path);
+        return 1;
+    }
+
+    struct stat rule_st;
+    int existed = stat(rule_path, &rule_st) == 0 && S_ISDIR(rule_st.st_mode);
+
     if (ensure_dir(rule_path, 0755) != 0) {
         return 1;
     }
@@ -59,13 +137,35 @@ int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOption
     if (cgid == 0) return 1;
 
 
-    struct LimiterConfig cfg = { .cgid = cgid, .rate_bps = rate, .bucket_size = bucket };
+    struct LimiterConfig cfg = cfg_in;
+    cfg.cgid = cgid;
+    cfg.bucket_size = bucket;
+    cfg.cgroup_path = rule_path;
+
+    /* 同速率同桶容量的规则已存在：参数不同时须显式 --update，避免改掉别人正在用的规则 */
+    if (existed && !opts_in.update) {
+        struct LimiterConfig old = {
+            .mode = LIMIT_MODE_POLICE,
+            .direction = LIMIT_DIR_EGRESS,
+            .yellow_dscp = TCM_DEFAULT_YELLOW_DSCP,
+        };
+        const char *diff = NULL;
+        if (load_rule_record(cgid, &old) == 0 && (diff = rule_option_mismatch(&old, &cfg)) != NULL) {
+            fprintf(stderr, "规则 %s 已存在且 %s 等参数不同（现为 mode=%s, direction=%s）；\n"
+                    "如要修改该规则（目录内所有进程都受影响）请加 --update，否则换一个 --rate/--bucket\n",
+                    rule_path, diff, limit_mode_name(old.mode), limit_direction_name(old.direction));
+            return 1;
+        }
+    }
 	//ATTACH_POINT作为进程的附加路径，attach_flags作为附加选项
     struct LoadOptions opts = { 
         .bpf_obj_path = bpf_obj_path, 
         .cgroup_path = rule_path, 
         .attach_flags = (opts_in.attach_flags ? opts_in.attach_flags : BPF_F_ALLOW_MULTI),
-        .attach_mode = opts_in.attach_mode
+        .attach_mode = opts_in.attach_mode,
+        .debug = opts_in.debug,
+        .max_rules = opts_in.max_rules,
+        .map_alloc = opts_in.map_alloc,
     };
 
 	//cgroup_path作为进程的附加路径，attach_flags作为附加选项
@@ -73,7 +173,13 @@ int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOption
 	int ret = do_load(&cfg, &opts, 0);
     if (ret != 0) return ret;
 
-    /* 记录最近规则，便于后续 move 使用 */
+    /* 顺带清除已删除规则目录在过滤位图中留下的位 */
+    (void)bpf_rebuild_rule_filter();
+
+    /* 记录规则参数（供 reload 恢复）与最近规则（便于后续 move 使用） */
+    if (save_rule_record(&cfg) != 0) {
+        fprintf(stderr, "警告: 保存规则记录失败，reload 后将按目录名恢复默认参数\n");
+    }
     write_last_rule(rule_path, cgid);
 
     /* 可选：将进程移入此 cgroup（仅当提供了 pid） */
@@ -84,17 +190,319 @@ int do_set(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOption
         }
     }
 
-    printf("已设置限速: rate=%llu bytes/s, bucket=%llu bytes, cgroup=%s, cgroup_id=%llu\n",
-           rate, bucket, rule_path, (unsigned long long)cgid);
+    printf("已设置限速: rate=%llu bytes/s, bucket=%llu bytes, mode=%s, direction=%s, cgroup=%s, cgroup_id=%llu\n",
+           rate, bucket, limit_mode_name(cfg.mode), limit_direction_name(cfg.direction), rule_path,
+           (unsigned long long)cgid);
     if (pid <= 0) {
         printf("提示: 可使用 'limiter move --pid <PID> --last' 迁移进程进入该规则\n");
     }
     return 0;
 }
 
+/*
+ * 便捷子命令：set --pid --in-place - 规则写入以 tgid 为键的进程规则表，进程留在原 cgroup，
+ * 不影响 systemd 或容器运行时的 cgroup 记账。只支持出方向 police 模式（可带 --pps）。
+ */
+int do_set_in_place(pid_t pid, const struct LimiterConfig cfg_in, const struct LoadOptions opts_in)
+{
+	unsigned int tgid = 0;
+	unsigned long long starttime = 0ULL;
+	if (read_proc_tgid(pid, &tgid) != 0 || read_proc_starttime((pid_t)tgid, &starttime) != 0) {
+		fprintf(stderr, "进程 %d 不存在\n", pid);
+		return 1;
+	}
+
+	struct LimiterConfig cfg = cfg_in;
+	cfg.cgid = 0ULL;
+	cfg.bucket_size = cfg_in.bucket_size ? cfg_in.bucket_size : cfg_in.rate_bps;
+	cfg.direction = LIMIT_DIR_EGRESS;
+	cfg.cgroup_path = NULL;
+	if (cfg.rate_bps == 0ULL || cfg.bucket_size == 0ULL) return 1;
+
+	(void)prune_stale_pid_rules();
+
+	/* 托管根目录只用于 list 等命令的遍历，进程不会迁入 */
+	if (ensure_dir(MANAGED_ROOT, 0755) != 0) {
+		fprintf(stderr, "无法创建托管根目录: %s\n", MANAGED_ROOT);
+		return 1;
+	}
+
+	/* 只确保程序已加载（并恢复已有规则），不写 cgroup 规则 */
+	struct LimiterConfig none = {0};
+	struct LoadOptions opts = opts_in;
+	opts.cgroup_path = NULL;
+	if (!opts.attach_flags) opts.attach_flags = BPF_F_ALLOW_MULTI;
+	int ret = do_load(&none, &opts, 0);
+	if (ret != 0) return ret;
+
+	/* 进程规则只在附加了程序的 cgroup 里生效，范围外的进程写了规则也不会被限速 */
+	char cg_rel[PATH_MAX];
+	char cg_path[PATH_MAX];
+	if (read_proc_cgroup_v2_path((pid_t)tgid, cg_rel, sizeof(cg_rel)) != 0 ||
+	    SAFE_PATH_JOIN(cg_path, CGROUPFS_ROOT, cg_rel) != 0) {
+		fprintf(stderr, "无法读取进程 %u 的 cgroup\n", tgid);
+		return 1;
+	}
+	if (!bpf_path_in_attach_scope(cg_path)) {
+		fprintf(stderr, "进程 %u 所在的 cgroup %s 不在附加范围内，--in-place 规则不会生效；\n"
+			"请用 --attach-scope 把它加入范围，或去掉 --in-place 把进程迁入规则目录\n", tgid, cg_path);
+		return 1;
+	}
+
+	if (bpf_update_pid_rule(tgid, &cfg) != 0) return 1;
+	if (save_pid_rule_record(tgid, starttime, &cfg) != 0) {
+		fprintf(stderr, "警告: 保存进程规则记录失败，reload 后该规则将丢失\n");
+	}
+
+	printf("已设置进程限速（原地）: tgid=%u, rate=%llu bytes/s, bucket=%llu bytes\n",
+	       tgid, cfg.rate_bps, cfg.bucket_size);
+	if ((pid_t)tgid != pid) {
+		printf("提示: %d 是进程 %u 的线程，规则作用于整个进程\n", pid, tgid);
+	}
+	return 0;
+}
+
+int do_host_cap(const struct LimiterConfig *cfg_in, const struct LoadOptions *opts_in, int off)
+{
+	if (off) {
+		/* 程序未加载时 map 不存在，只需删除记录 */
+		if (access(PIN_MAP_HOST, F_OK) == 0 && bpf_update_host_cap(NULL) != 0) return 1;
+		(void)delete_host_cap_record();
+		printf("已停用整机限速\n");
+		return 0;
+	}
+
+	if (cfg_in->rate_bps == 0ULL) {
+		LimiterConfig host = {0};
+		if (load_host_cap_record(&host) != 0) {
+			printf("未设置整机限速\n");
+			return 0;
+		}
+		printf("整机限速: rate=%llu bytes/s, bucket=%llu bytes, shard=%u%%\n",
+		       host.rate_bps, host.bucket_size, host.shard_tolerance);
+		struct rate_limit_stats stats;
+		if (bpf_read_host_stats(&stats) == 0) {
+			printf("放行: %llu 包 / %llu 字节，丢弃: %llu 包 / %llu 字节\n",
+			       stats.pass_pkts, stats.pass_bytes, stats.drop_pkts, stats.drop_bytes);
+		} else {
+			printf("eBPF 程序未加载，整机限速未生效\n");
+		}
+		return 0;
+	}
+
+	struct LimiterConfig cfg = *cfg_in;
+	cfg.cgid = 0ULL;
+	cfg.bucket_size = cfg_in->bucket_size ? cfg_in->bucket_size : cfg_in->rate_bps;
+	cfg.mode = LIMIT_MODE_POLICE;
+	cfg.direction = LIMIT_DIR_EGRESS;
+	cfg.cgroup_path = NULL;
+
+	/* 只确保程序已加载（并恢复已有规则），不写 cgroup 规则 */
+	if (ensure_dir(MANAGED_ROOT, 0755) != 0) {
+		fprintf(stderr, "无法创建托管根目录: %s\n", MANAGED_ROOT);
+		return 1;
+	}
+	struct LimiterConfig none = {0};
+	struct LoadOptions opts = *opts_in;
+	opts.cgroup_path = NULL;
+	if (!opts.attach_flags) opts.attach_flags = BPF_F_ALLOW_MULTI;
+	int ret = do_load(&none, &opts, 0);
+	if (ret != 0) return ret;
+
+	if (bpf_update_host_cap(&cfg) != 0) return 1;
+	if (save_host_cap_record(&cfg) != 0) {
+		fprintf(stderr, "警告: 保存整机限速记录失败，reload 后该设置将丢失\n");
+	}
+	printf("已设置整机限速: rate=%llu bytes/s, bucket=%llu bytes, shard=%u%%\n",
+	       cfg.rate_bps, cfg.bucket_size, cfg.shard_tolerance);
+	return 0;
+}
+
+/* 地址变化后等待的时间：DHCP、SLAAC 往往连续增删几个地址，合并成一次同步 */
+#define ADDR_WATCH_SETTLE_MS 500
+
+/* 按记录同步本机地址表；程序未加载或绕过已停用时跳过，等加载或 --on 时再同步 */
+static void watch_sync_local_addrs(void)
+{
+	if (access(PIN_MAP_LOCAL_CFG, F_OK) != 0 || !load_local_bypass_record()) return;
+	int n = bpf_sync_local_bypass(1);
+	if (n >= 0) {
+		printf("已同步本机地址 %d 个\n", n);
+		fflush(stdout);
+	}
+}
+
+/* 本批 netlink 消息中是否有地址增删 */
+static int addr_changed(const char *buf, ssize_t len)
+{
+	for (const struct nlmsghdr *nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+	     nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) return 1;
+	}
+	return 0;
+}
+
+/*
+ * local-bypass --watch：订阅 RTMGRP_IPV4_IFADDR/RTMGRP_IPV6_IFADDR，网卡地址增删
+ * （DHCP 续租换地址、新增 IPv6 地址等）后重新同步本机地址表。
+ * 接收缓冲区溢出（ENOBUFS）时丢了哪些通知无从得知，直接整表重新同步。
+ */
+static int watch_local_addrs(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		fprintf(stderr, "无法创建 netlink socket: %s\n", strerror(errno));
+		return 1;
+	}
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+	};
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		fprintf(stderr, "无法订阅网卡地址变化: %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	/* 订阅之后先同步一次，启动前发生的变化不会漏掉 */
+	watch_sync_local_addrs();
+
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int dirty = 0;
+	for (;;) {
+		int r = poll(&pfd, 1, dirty ? ADDR_WATCH_SETTLE_MS : -1);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "等待网卡地址变化失败: %s\n", strerror(errno));
+			break;
+		}
+		if (r == 0) {
+			/* 一段时间内没有新的变化，同步一次 */
+			watch_sync_local_addrs();
+			dirty = 0;
+			continue;
+		}
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			if (errno == ENOBUFS) {
+				dirty = 1;
+				continue;
+			}
+			fprintf(stderr, "读取网卡地址变化失败: %s\n", strerror(errno));
+			break;
+		}
+		if (addr_changed(buf, len)) dirty = 1;
+	}
+	close(fd);
+	return 1;
+}
+
+int do_local_bypass(int action)
+{
+	if (action == LOCAL_BYPASS_WATCH) {
+		return watch_local_addrs();
+	}
+
+	int enabled = load_local_bypass_record();
+	if (action == LOCAL_BYPASS_ON || action == LOCAL_BYPASS_OFF) {
+		enabled = (action == LOCAL_BYPASS_ON);
+		if (save_local_bypass_record(enabled) != 0) {
+			fprintf(stderr, "警告: 保存本机流量绕过记录失败，reload 后恢复为启用\n");
+		}
+	}
+
+	if (action != LOCAL_BYPASS_SHOW) {
+		/* 程序未加载时只改记录，加载时按记录同步 */
+		if (access(PIN_MAP_LOCAL_CFG, F_OK) != 0) {
+			printf("本机流量绕过已%s（eBPF 程序加载后生效）\n", enabled ? "启用" : "停用");
+			return 0;
+		}
+		int n = bpf_sync_local_bypass(enabled);
+		if (n < 0) return 1;
+		if (enabled) {
+			printf("本机流量绕过已启用：回环地址与本机地址 %d 个\n", n);
+		} else {
+			printf("本机流量绕过已停用\n");
+		}
+		return 0;
+	}
+
+	unsigned int loaded_on = 0;
+	unsigned char addrs[LOCAL_MAX_ADDRS][16];
+	int n = bpf_read_local_bypass(&loaded_on, addrs, LOCAL_MAX_ADDRS);
+	if (n < 0) {
+		printf("本机流量绕过: %s（eBPF 程序未加载）\n", enabled ? "启用" : "停用");
+		return 0;
+	}
+	printf("本机流量绕过: %s，回环地址 127.0.0.0/8、::1 与以下本机地址 %d 个:\n",
+	       loaded_on ? "启用" : "停用", n);
+	static const unsigned char v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	for (int i = 0; i < n; i++) {
+		char buf[INET6_ADDRSTRLEN];
+		const char *str = (memcmp(addrs[i], v4_mapped, 12) == 0)
+			? inet_ntop(AF_INET, &addrs[i][12], buf, sizeof(buf))
+			: inet_ntop(AF_INET6, addrs[i], buf, sizeof(buf));
+		printf("  %s\n", str ? str : "?");
+	}
+	return 0;
+}
+
+int do_ctrl_pass(int action, int max_len, long long pps)
+{
+	CtrlPass cp;
+	load_ctrl_pass_record(&cp);
+	int changed = action != CTRL_PASS_SHOW || max_len >= 0 || pps >= 0;
+	if (action == CTRL_PASS_ON || action == CTRL_PASS_OFF) {
+		cp.enabled = (action == CTRL_PASS_ON);
+	}
+	if (max_len >= 0) cp.max_len = (unsigned int)max_len;
+	if (pps >= 0) cp.pps = (unsigned long long)pps;
+
+	if (changed) {
+		if (save_ctrl_pass_record(&cp) != 0) {
+			fprintf(stderr, "警告: 保存控制包放行记录失败，reload 后恢复为默认设置\n");
+		}
+		/* 程序未加载时只改记录，加载时按记录同步 */
+		if (access(PIN_MAP_CTRL_CFG, F_OK) == 0 && bpf_sync_ctrl_pass(&cp) != 0) {
+			return 1;
+		}
+	} else if (bpf_read_ctrl_pass(&cp) != 0) {
+		printf("（eBPF 程序未加载，以下为记录的设置）\n");
+	}
+
+	printf("控制包放行: %s，不超过 %u 字节的 TCP 包与 TCP SYN/FIN/RST、纯 ACK 在桶不足时使用额度放行，"
+	       "额度 %llu 包/秒（每条规则）\n",
+	       cp.enabled ? "启用" : "停用", cp.max_len, cp.pps);
+	return 0;
+}
+
+/* 取消原地进程规则：有规则返回 0，没有返回 -1 */
+static int unset_in_place(pid_t pid)
+{
+	unsigned int tgid = (unsigned int)pid;
+	(void)read_proc_tgid(pid, &tgid); /* 进程已退出时按 tgid 处理 */
+
+	LimiterConfig lc = {0};
+	unsigned long long starttime = 0ULL;
+	int have_record = load_pid_rule_record(tgid, &lc, &starttime) == 0;
+	int removed = bpf_remove_pid_rule(tgid) == 0;
+	if (!have_record && !removed) return -1;
+
+	(void)delete_pid_rule_record(tgid);
+	printf("已取消进程 %u 的原地限速\n", tgid);
+	return 0;
+}
+
 /* 便捷子命令：unset - 取消进程限速 */
 int do_unset(pid_t pid)
 {
+	/* 0. 原地进程规则：进程从未被迁移，不改动其 cgroup */
+	if (unset_in_place(pid) == 0) {
+		return 0;
+	}
+
 	/* 1. 查找进程当前所在的托管 cgroup */
 	char proc_cgroup[PATH_MAX];
 	char pid_str[32];
@@ -175,77 +583,145 @@ int do_unset(pid_t pid)
 	return 0;
 }
 
-/* 便捷子命令：list - 列出所有限速规则,其实应该从config map里获取 */
-int do_list_managed(void)
+static int walk_rule_dirs(const char *dir_path, rule_dir_fn fn, void *arg, int depth)
 {
-	char *managed_dir = MANAGED_ROOT;
-	DIR *dir = opendir(managed_dir);
+	DIR *dir = opendir(dir_path);
 	if (!dir) {
-		fprintf(stderr, "无法打开托管目录: %s\n", managed_dir);
-		return 1;
+		return depth == 0 ? -1 : 0;
 	}
 
-	printf("限速规则列表:\n");
-	printf("%-12s %-12s %-12s %-12s %s\n", "cgroup_id", "限速(bps)", "进程数", "状态", "规则路径");
-
+	int ret = 0;
 	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL) {
+	while (ret == 0 && (entry = readdir(dir)) != NULL) {
 		if (entry->d_name[0] == '.') continue;
 
 		char rule_path[PATH_MAX];
-		SAFE_PATH_JOIN(rule_path, managed_dir, entry->d_name);
+		if (SAFE_PATH_JOIN(rule_path, dir_path, entry->d_name) != 0) continue;
 		/* 检查是否为目录 */
 		struct stat st;
 		if (stat(rule_path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
 
-		/* 解析规则目录名 */
+		/* 解析规则目录名，跳过格式不匹配的目录 */
 		unsigned long long bucket = 0, rate = 0;
-		if (sscanf(entry->d_name, "bucket_%llu_rate_%llu", &bucket, &rate) != 2) {
-			continue; /* 跳过格式不匹配的目录 */
+		if (sscanf(entry->d_name, "bucket_%llu_rate_%llu", &bucket, &rate) != 2) continue;
+
+		ret = fn(rule_path, bucket, rate, arg);
+		/* 嵌套规则：父规则先于子规则处理 */
+		if (ret == 0 && depth < LIMIT_MAX_NEST_LEVEL) {
+			ret = walk_rule_dirs(rule_path, fn, arg, depth + 1);
 		}
+	}
 
-		/* 统计进程数 */
-		char procs_path[PATH_MAX];
-		if (SAFE_PATH_JOIN(procs_path, rule_path, "cgroup.procs") != 0) {
-			fprintf(stderr, "进程路径过长: %s\n", rule_path);
-			continue;
+	closedir(dir);
+	return ret;
+}
+
+int for_each_rule_dir(const char *root, rule_dir_fn fn, void *arg)
+{
+	return walk_rule_dirs(root, fn, arg, 0);
+}
+
+static int print_managed_rule(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)arg;
+
+	/* 统计进程数 */
+	char procs_path[PATH_MAX];
+	if (SAFE_PATH_JOIN(procs_path, rule_path, "cgroup.procs") != 0) {
+		fprintf(stderr, "进程路径过长: %s\n", rule_path);
+		return 0;
+	}
+	FILE *f = fopen(procs_path, "r");
+	int proc_count = 0;
+	if (f) {
+		char line[64];
+		while (fgets(line, sizeof(line), f)) {
+			if (strlen(line) > 0) proc_count++;
 		}
-		FILE *f = fopen(procs_path, "r");
-		int proc_count = 0;
-		if (f) {
-			char line[64];
-			while (fgets(line, sizeof(line), f)) {
-				if (strlen(line) > 0) proc_count++;
-			}
-			fclose(f);
+		fclose(f);
+	}
+
+	/* 获取当前状态 */
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	char status[32] = "未知";
+	if (cgid != 0) {
+		/* 检查是否有 eBPF 链接（任一附加范围的 link 固定在同一目录下） */
+		if (bpf_is_link_attached(NULL)) {
+			strcpy(status, "活跃");
+		} else if (access(BPFFS_DIR, R_OK) != 0 && (errno == EACCES || errno == EPERM)) {
+			fprintf(stderr, "无法访问 pin 目录: %s: %s\n", BPFFS_DIR, strerror(errno));
+			strcpy(status, "未知");
+		} else {
+			strcpy(status, "未附加");
 		}
+	}
 
-		/* 获取当前状态 */
-		unsigned long long cgid = get_cgroup_id(rule_path);
-		char status[32] = "未知";
-		if (cgid != 0) {
-			/* 检查是否有 eBPF 链接 */
-			char pin_path[PATH_MAX]=PIN_LINK_PERSISTENT;
-			//(pin_path, sizeof(pin_path), "/sys/fs/bpf/speed_limiter/cg_%llu_egress", cgid);
-			int rc = access(pin_path, F_OK);
-			if (rc == 0) {
-				strcpy(status, "活跃");
-			} else {
-				int saved = errno;
-				if (saved == EACCES || saved == EPERM) {
-					fprintf(stderr, "无法访问 pin 路径: %s: %s\n", pin_path, strerror(saved));
-					strcpy(status, "未知");
-				} else {
-					strcpy(status, "未附加");
+	printf("%-12llu %-12llu %-8d %-12s %s\n",
+	       (unsigned long long)cgid, rate, proc_count, status, rule_path);
+	if (cgid != 0) {
+		print_rule_devs(cgid);
+	}
+	return 0;
+}
+
+/* 列出原地进程规则，首条前打印表头；arg 指向是否已打印表头 */
+static int print_pid_rule(unsigned int tgid, const LimiterConfig *cfg, unsigned long long starttime, void *arg)
+{
+	int *header = arg;
+	if (!*header) {
+		printf("\n原地进程规则:\n");
+		printf("%-12s %-12s %-12s %-12s %s\n", "tgid", "限速(bps)", "桶(bytes)", "状态", "进程名");
+		*header = 1;
+	}
+
+	unsigned long long cur_st = 0ULL;
+	int alive = read_proc_starttime((pid_t)tgid, &cur_st) == 0 && cur_st == starttime;
+
+	char comm[64] = "-";
+	if (alive) {
+		char comm_path[PATH_MAX];
+		char tgid_str[32];
+		snprintf(tgid_str, sizeof(tgid_str), "%u", tgid);
+		if (SAFE_PATH_JOIN(comm_path, "/proc", tgid_str, "comm") == 0) {
+			FILE *f = fopen(comm_path, "r");
+			if (f) {
+				if (fgets(comm, sizeof(comm), f)) {
+					char *nl = strchr(comm, '\n');
+					if (nl) *nl = '\0';
 				}
+				fclose(f);
 			}
 		}
+	}
 
-		printf("%-12llu %-12llu %-8d %-12s %s\n",
-		       (unsigned long long)cgid, rate, proc_count, status, rule_path);
+	printf("%-12u %-12llu %-12llu %-12s %s\n", tgid, cfg->rate_bps, cfg->bucket_size,
+	       alive ? "活跃" : "已退出", comm);
+	return 0;
+}
+
+/* 便捷子命令：list - 列出所有限速规则（含嵌套规则）,其实应该从config map里获取 */
+int do_list_managed(void)
+{
+	char *managed_dir = MANAGED_ROOT;
+	if (access(managed_dir, F_OK) != 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", managed_dir);
+		return 1;
 	}
 
-	closedir(dir);
+	(void)prune_stale_pid_rules();
+	(void)bpf_rebuild_rule_filter();
+
+	printf("限速规则列表:\n");
+	printf("%-12s %-12s %-12s %-12s %s\n", "cgroup_id", "限速(bps)", "进程数", "状态", "规则路径");
+
+	if (for_each_rule_dir(managed_dir, print_managed_rule, NULL) < 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", managed_dir);
+		return 1;
+	}
+
+	int header = 0;
+	(void)for_each_pid_rule_record(print_pid_rule, &header);
 	return 0;
 }
 
@@ -307,76 +783,76 @@ static int __attribute__((unused)) purge_empty_cgroups(void)
 int do_purge(void)
 {
 	printf("开始清理限速规则...\n\n");
-	/* 0. 先卸载所有已附加在托管目录的 limit_egress 程序 */
-	//int detached = bpf_detach_limit_egress_all();
-	int detached = detach_limit_egress(ATTACH_POINT);
+	/* 0. 先卸载所有已附加在托管目录的 limit_egress / limit_ingress 程序 */
+	//int detached = bpf_detach_limiter_all();
+	int detached = bpf_detach_scope_progs();
 	if (detached < 0) {
 		return 1;
 	}
+	/* 网卡 tcx 出方向上的 limit_tc 不在附加范围内，单独卸载 */
+	detached += bpf_detach_tc_links();
+	/* 整形网卡上本工具装的 HTB 连同各规则的类一起删除，网卡记录保留给 reload */
+	int shape_removed = shape_purge();
 	int bpf_unlinked = bpf_purge_maps();
 	int bpf_maps_removed = bpf_purge_links();
 
 	/* 3. 清理空的 cgroup 目录 */
 	//int cgroup_cleaned = purge_empty_cgroups();
 
-	printf("清理完成: 卸载程序=%d次, BPF链接=%d个, BPF maps=%d个\n",
-	       detached, bpf_unlinked, bpf_maps_removed);
+	printf("清理完成: 卸载程序=%d次, BPF链接=%d个, BPF maps=%d个, HTB=%d个\n",
+	       detached, bpf_unlinked, bpf_maps_removed, shape_removed);
 
 	return 0;
 }
 
+static int print_rule_pids(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)rate;
+	(void)arg;
+
+	/* 获取 cgroup ID */
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0) return 0;
+
+	/* 读取进程列表 */
+	char procs_path[PATH_MAX];
+	if (SAFE_PATH_JOIN(procs_path, rule_path, "cgroup.procs") != 0) {
+		/* 路径过长，跳过此规则 */
+		return 0;
+	}
+	FILE *f = fopen(procs_path, "r");
+	if (!f) return 0;
+
+	char line[64];
+	while (fgets(line, sizeof(line), f)) {
+		/* 移除换行符 */
+		char *nl = strchr(line, '\n');
+		if (nl) *nl = '\0';
+
+		if (strlen(line) > 0) {
+			printf("%llu %s\n", (unsigned long long)cgid, line);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
 /* 便捷子命令：list --pid - 列出cgroup_id和进程ID */
 int do_list_cgroup_pids(void)
 {
 	char *managed_root = MANAGED_ROOT;
-	DIR *dir = opendir(managed_root);
-	if (!dir) {
+	if (access(managed_root, F_OK) != 0) {
 		fprintf(stderr, "无法打开托管目录: %s,请先用set创建规则\n", managed_root);
 		return 1;
 	}
 
 	printf("cgroup_id  pid\n");
-	//从MANAGED_ROOT目录下读取子目录下的cgroup.procs
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.') continue;
-
-		char rule_path[PATH_MAX];
-		SAFE_PATH_JOIN(rule_path, managed_root, entry->d_name);
-
-		/* 过滤非目录项（避免把普通文件当作规则目录处理） */
-		struct stat st;
-		if (stat(rule_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
-			continue;
-		}
-
-		/* 获取 cgroup ID */
-		unsigned long long cgid = get_cgroup_id(rule_path);
-		if (cgid == 0) continue;
-
-		/* 读取进程列表 */
-        char procs_path[PATH_MAX];
-        if (SAFE_PATH_JOIN(procs_path, rule_path, "cgroup.procs") != 0) {
-            /* 路径过长，跳过此规则 */
-            continue;
-        }
-		FILE *f = fopen(procs_path, "r");
-		if (!f) continue;
-
-		char line[64];
-		while (fgets(line, sizeof(line), f)) {
-			/* 移除换行符 */
-			char *nl = strchr(line, '\n');
-			if (nl) *nl = '\0';
-
-			if (strlen(line) > 0) {
-				printf("%llu %s\n", (unsigned long long)cgid, line);
-			}
-		}
-		fclose(f);
+	//从MANAGED_ROOT目录下（含嵌套规则）读取规则目录下的cgroup.procs
+	if (for_each_rule_dir(managed_root, print_rule_pids, NULL) < 0) {
+		fprintf(stderr, "无法打开托管目录: %s,请先用set创建规则\n", managed_root);
+		return 1;
 	}
-
-	closedir(dir);
 	return 0;
 }
 
@@ -415,7 +891,7 @@ static void print_prog_info(__u32 prog_id, const struct bpf_prog_info *info, con
 }
 
 /* 检查程序是否附加到指定的cgroup */
-static int check_prog_attached_to_cgroup(__u32 prog_id, const char *cgroup_path)
+static int check_prog_attached_to_cgroup(__u32 prog_id, int attach_type, const char *cgroup_path)
 {
 	int cgroup_fd = open(cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
@@ -430,7 +906,7 @@ static int check_prog_attached_to_cgroup(__u32 prog_id, const char *cgroup_path)
 	p.prog_ids = prog_ids;
 	
 	int ret = 0;
-	if (bpf_prog_query_opts(cgroup_fd, BPF_CGROUP_INET_EGRESS, &p) == 0) {
+	if (bpf_prog_query_opts(cgroup_fd, (enum bpf_attach_type)attach_type, &p) == 0) {
 		for (__u32 i = 0; i < p.prog_cnt; i++) {
 			if (prog_ids[i] == prog_id) {
 				ret = 1;
@@ -443,12 +919,25 @@ static int check_prog_attached_to_cgroup(__u32 prog_id, const char *cgroup_path)
 	return ret;
 }
 
-/* 查找程序附加的cgroup并打印信息 */
-static int find_and_print_prog_attachment(__u32 prog_id, const struct bpf_prog_info *info)
+/* 查找程序附加的cgroup并打印信息：附加范围内的每个 cgroup 各一行 */
+static int find_and_print_prog_attachment(__u32 prog_id, int attach_type, const struct bpf_prog_info *info)
 {
+	char scope[ATTACH_SCOPE_MAX][PATH_MAX];
+	int scope_cnt = bpf_attach_scope(scope, ATTACH_SCOPE_MAX);
+	int found = 0;
+	for (int s = 0; s < scope_cnt; s++) {
+		if (check_prog_attached_to_cgroup(prog_id, attach_type, scope[s])) {
+			print_prog_info(prog_id, info, scope[s]);
+			found++;
+		}
+	}
+	if (found) {
+		return found;
+	}
+
 	char *attach_point = ATTACH_POINT;
-	/* 首先检查根cgroup */
-	if (check_prog_attached_to_cgroup(prog_id, attach_point)) {
+	/* 附加范围记录与实际不符时，检查根cgroup */
+	if (check_prog_attached_to_cgroup(prog_id, attach_type, attach_point)) {
 		print_prog_info(prog_id, info, attach_point);
 		return 1;
 	}
@@ -471,15 +960,14 @@ static int find_and_print_prog_attachment(__u32 prog_id, const struct bpf_prog_i
 		if (stat(test_path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
 		
 		/* 检查程序是否附加到此cgroup */
-		if (check_prog_attached_to_cgroup(prog_id, test_path)) {
+		if (check_prog_attached_to_cgroup(prog_id, attach_type, test_path)) {
 			print_prog_info(prog_id, info, test_path);
-			closedir(dir);
-			return 1;
+			found++;
 		}
 	}
 
 	closedir(dir);
-	return 0;
+	return found;
 }
 
 /* 处理单个BPF程序 */
@@ -497,9 +985,10 @@ static int process_bpf_program(__u32 prog_id)
 	__u32 info_len = sizeof(info);
 	
 	if (bpf_prog_get_info_by_fd(prog_fd, &info, &info_len) == 0) {
-		/* 检查是否是我们的limit_egress程序 */
-		if (strcmp(info.name, "limit_egress") == 0) {
-			find_and_print_prog_attachment(prog_id, &info);
+		/* 检查是否是我们的 limit_egress / limit_ingress 程序 */
+		int attach_type = limiter_prog_attach_type(info.name);
+		if (attach_type >= 0) {
+			find_and_print_prog_attachment(prog_id, attach_type, &info);
 		}
 	}
 	
@@ -532,3 +1021,83 @@ int do_list_cgroup_bpf(void)
 
 	return 0;
 }
+
+static int print_rule_stats(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)bucket;
+	(void)rate;
+	(void)arg;
+
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0) return 0;
+
+	/* 每个已配置的方向各输出一行 */
+	const unsigned int dirs[] = { LIMIT_DIR_EGRESS, LIMIT_DIR_INGRESS };
+	int shown = 0;
+	for (int i = 0; i < 2; i++) {
+		struct rate_limit_stats stats;
+		if (bpf_read_rule_stats(rule_path, dirs[i], &stats) != 0) continue;
+		printf("%-12llu %-5s %-12llu %-14llu %-12llu %-14llu %-12llu %-12llu %-8llu %s\n",
+		       cgid, limit_direction_name(dirs[i]), stats.pass_pkts, stats.pass_bytes,
+		       stats.drop_pkts, stats.drop_bytes, stats.mark_pkts, stats.ctrl_pkts, stats.state_init, rule_path);
+		shown++;
+	}
+	if (!shown) {
+		printf("%-12llu %-5s %-12s %-14s %-12s %-14s %-12s %-12s %-8s %s\n",
+		       cgid, "-", "-", "-", "-", "-", "-", "-", "-", rule_path);
+	}
+	return 0;
+}
+
+/* 原地进程规则的计数器：cgroup_id 列显示 pid:<tgid> */
+static int print_pid_rule_stats(unsigned int tgid, const LimiterConfig *cfg, unsigned long long starttime, void *arg)
+{
+	(void)cfg;
+	(void)starttime;
+	(void)arg;
+
+	char id[24];
+	snprintf(id, sizeof(id), "pid:%u", tgid);
+	struct rate_limit_stats stats;
+	if (bpf_read_pid_stats(tgid, &stats) != 0) {
+		printf("%-12s %-5s %-12s %-14s %-12s %-14s %-12s %-12s %-8s %s\n",
+		       id, "-", "-", "-", "-", "-", "-", "-", "-", "(原地)");
+		return 0;
+	}
+	printf("%-12s %-5s %-12llu %-14llu %-12llu %-14llu %-12llu %-12llu %-8llu %s\n",
+	       id, limit_direction_name(LIMIT_DIR_EGRESS), stats.pass_pkts, stats.pass_bytes,
+	       stats.drop_pkts, stats.drop_bytes, stats.mark_pkts, stats.ctrl_pkts, stats.state_init, "(原地)");
+	return 0;
+}
+
+/* 便捷子命令：list --stats - 列出每条规则的放行/丢弃计数 */
+int do_list_stats(void)
+{
+	char *managed_dir = MANAGED_ROOT;
+	if (access(managed_dir, F_OK) != 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", managed_dir);
+		return 1;
+	}
+
+	(void)prune_stale_pid_rules();
+	(void)bpf_rebuild_rule_filter();
+
+	printf("%-12s %-5s %-12s %-14s %-12s %-14s %-12s %-12s %-8s %s\n",
+	       "cgroup_id", "dir", "pass_pkts", "pass_bytes", "drop_pkts", "drop_bytes", "mark_pkts", "ctrl_pkts",
+	       "init", "规则路径");
+
+	if (for_each_rule_dir(managed_dir, print_rule_stats, NULL) < 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", managed_dir);
+		return 1;
+	}
+	(void)for_each_pid_rule_record(print_pid_rule_stats, NULL);
+
+	/* 整机总限速：计入所有经规则放行的出方向包 */
+	struct rate_limit_stats host;
+	if (bpf_read_host_stats(&host) == 0) {
+		printf("%-12s %-5s %-12llu %-14llu %-12llu %-14llu %-12llu %-12llu %-8llu %s\n",
+		       "host", limit_direction_name(LIMIT_DIR_EGRESS), host.pass_pkts, host.pass_bytes,
+		       host.drop_pkts, host.drop_bytes, host.mark_pkts, host.ctrl_pkts, host.state_init, "(整机)");
+	}
+	return 0;
+}
@@ -24,14 +24,42 @@
 //附加程序到到根，可以管所有进程。
 #define ATTACH_POINT "/sys/fs/cgroup"
 
+/* 附加范围（--attach-scope）最多包含的 cgroup 数，每个 cgroup 各有一组 link */
+#define ATTACH_SCOPE_MAX 16
+
 /* BPF FS 根与项目 pin 目录（不带尾斜杠） */
 #define BPFFS_ROOT "/sys/fs/bpf"
 #define BPFFS_DIR "/sys/fs/bpf/speed_limiter"
 
 /* 链接与 map 的固定路径（在项目 pin 目录下） */
 #define PIN_LINK_PERSISTENT  "/sys/fs/bpf/speed_limiter/link"
-#define PIN_MAP_CFG          "/sys/fs/bpf/speed_limiter/rate_limit_config_map"
-#define PIN_MAP_STATE        "/sys/fs/bpf/speed_limiter/rate_limit_state_map"
+#define PIN_LINK_INGRESS     "/sys/fs/bpf/speed_limiter/link_ingress"
+#define PIN_LINK_SOCK_CREATE "/sys/fs/bpf/speed_limiter/link_sock_create"
+/* 根 cgroup 以外的附加范围：上面的路径加 _<cgroup id> 后缀；pin 目录下以 link 开头的都是本工具的 link */
+#define PIN_LINK_PREFIX      "link"
+#define PIN_MAP_RULES        "/sys/fs/bpf/speed_limiter/rate_limit_map"
+#define PIN_MAP_INGRESS      "/sys/fs/bpf/speed_limiter/rate_limit_ingress_map"
+#define PIN_MAP_STATS        "/sys/fs/bpf/speed_limiter/rate_limit_stats_map"
+#define PIN_MAP_PCPU         "/sys/fs/bpf/speed_limiter/rate_limit_pcpu_map"
+#define PIN_MAP_MODE         "/sys/fs/bpf/speed_limiter/rate_limit_mode_map"
+#define PIN_MAP_CLASS_LPM    "/sys/fs/bpf/speed_limiter/rate_limit_class_lpm"
+#define PIN_MAP_CLASS        "/sys/fs/bpf/speed_limiter/rate_limit_class_map"
+#define PIN_MAP_PID          "/sys/fs/bpf/speed_limiter/rate_limit_pid_map"
+#define PIN_MAP_PID_COUNT    "/sys/fs/bpf/speed_limiter/rate_limit_pid_count"
+#define PIN_MAP_FILTER       "/sys/fs/bpf/speed_limiter/rate_limit_filter"
+#define PIN_MAP_HOST         "/sys/fs/bpf/speed_limiter/rate_limit_host_map"
+#define PIN_MAP_SCHED        "/sys/fs/bpf/speed_limiter/rate_limit_sched_map"
+#define PIN_MAP_CLOCK        "/sys/fs/bpf/speed_limiter/limiter_clock_map"
+#define PIN_MAP_LOCAL_CFG    "/sys/fs/bpf/speed_limiter/rate_limit_local_cfg"
+#define PIN_MAP_LOCAL_ADDRS  "/sys/fs/bpf/speed_limiter/rate_limit_local_addrs"
+#define PIN_MAP_CTRL_CFG     "/sys/fs/bpf/speed_limiter/rate_limit_ctrl_cfg"
+#define PIN_MAP_DEV          "/sys/fs/bpf/speed_limiter/rate_limit_dev_map"
+#define PIN_MAP_TC_MATCH     "/sys/fs/bpf/speed_limiter/rate_limit_tc_match"
+#define PIN_MAP_TC_SRC       "/sys/fs/bpf/speed_limiter/rate_limit_tc_src"
+#define PIN_MAP_TC_CFG       "/sys/fs/bpf/speed_limiter/rate_limit_tc_cfg"
+/* tc 模式：limit_tc 程序本身固定下来，供 limiter tc attach 随时附加；各网卡的 tcx link 为 tc_link_<网卡名> */
+#define PIN_PROG_TC          "/sys/fs/bpf/speed_limiter/prog_tc"
+#define PIN_TC_LINK_PREFIX   "tc_link_"
 
 /* 默认的 bpf 对象安装路径 */
 #define DEFAULT_BPF_OBJ "/usr/lib/speed_limiter/limiter.bpf.o"
@@ -43,9 +71,55 @@
 #define RUNTIME_DIR "/run/speed_limiter"
 #endif
 
+/*
+ * 规则目录回调：rule_path 为规则 cgroup 路径，bucket/rate 由目录名解析；
+ * 返回非 0 时停止遍历，该值作为 for_each_rule_dir 的返回值。
+ */
+typedef int (*rule_dir_fn)(const char *rule_path, unsigned long long bucket,
+			   unsigned long long rate, void *arg);
+
+/* 递归遍历 root 下的规则目录 bucket_<bytes>_rate_<bps>（父规则先于子规则），无法打开 root 返回 -1 */
+int for_each_rule_dir(const char *root, rule_dir_fn fn, void *arg);
+
 /* 便捷子命令：set - 设置进程限速 */
 int do_set(pid_t pid, const struct LimiterConfig cfg, const struct LoadOptions opts);
 
+/* 便捷子命令：set --pid --in-place - 按进程 (tgid) 限速，不迁移进程的 cgroup */
+int do_set_in_place(pid_t pid, const struct LimiterConfig cfg, const struct LoadOptions opts);
+
+/* 整机总限速默认的分片误差（桶容量的百分比），避免众核机器上所有包争同一把锁 */
+#define HOST_CAP_DEFAULT_SHARD 1
+
+/*
+ * 便捷子命令：host-cap - 整机出方向总限速。cfg->rate_bps 非 0 时设置（shard_tolerance 为分片误差），
+ * off 非 0 时停用，两者都没有时显示当前设置与计数
+ */
+int do_host_cap(const struct LimiterConfig *cfg, const struct LoadOptions *opts, int off);
+
+/* local-bypass 的操作 */
+#define LOCAL_BYPASS_SHOW 0
+#define LOCAL_BYPASS_ON   1
+#define LOCAL_BYPASS_OFF  2
+#define LOCAL_BYPASS_SYNC 3
+#define LOCAL_BYPASS_WATCH 4
+
+/*
+ * 便捷子命令：local-bypass - 本机流量绕过的开关、按网卡地址重新同步本机地址表，或显示当前状态；
+ * LOCAL_BYPASS_WATCH 常驻监听网卡地址变化并随之同步，不返回（出错时返回非 0）
+ */
+int do_local_bypass(int action);
+
+/* ctrl-pass 的操作 */
+#define CTRL_PASS_SHOW 0
+#define CTRL_PASS_ON   1
+#define CTRL_PASS_OFF  2
+
+/*
+ * 便捷子命令：ctrl-pass - 控制包放行的开关、长度门槛与额度，或显示当前设置；
+ * max_len、pps 为负数时不修改
+ */
+int do_ctrl_pass(int action, int max_len, long long pps);
+
 /* 便捷子命令：unset - 取消进程限速 */
 int do_unset(pid_t pid);
 
@@ -61,4 +135,7 @@ int do_list_cgroup_pids(void);
 /* 便捷子命令：list --bpf - 列出cgroup_id、BPF程序名和加载时间 */
 int do_list_cgroup_bpf(void);
 
+/* 便捷子命令：list --stats - 列出每条规则的放行/丢弃计数 */
+int do_list_stats(void);
+
 #endif /* MANAGED_H */
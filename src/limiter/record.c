@@ -0,0 +1,577 @@
+#include "record.h"
+#include "utils.h"
+#include <linux/bpf.h>
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <dirent.h>
+
+/* 构建规则记录文件路径 */
+static int build_rule_record_path(unsigned long long cgid, char *path, size_t path_size)
+{
+	char id_str[32];
+	if (snprintf(id_str, sizeof(id_str), "%llu", cgid) >= (int)sizeof(id_str)) {
+		return -1;
+	}
+	return safe_path_join(path, path_size, RUNTIME_DIR, "rules", id_str, NULL);
+}
+
+int parse_limit_mode(const char *name, unsigned int *mode_out)
+{
+	if (!name || !mode_out) return -1;
+	if (strcmp(name, "police") == 0) {
+		*mode_out = LIMIT_MODE_POLICE;
+	} else if (strcmp(name, "pace") == 0) {
+		*mode_out = LIMIT_MODE_PACE;
+	} else if (strcmp(name, "ecn") == 0) {
+		*mode_out = LIMIT_MODE_ECN;
+	} else if (strcmp(name, "tcm") == 0) {
+		*mode_out = LIMIT_MODE_TCM;
+	} else if (strcmp(name, "shape") == 0) {
+		*mode_out = LIMIT_MODE_SHAPE;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *limit_mode_name(unsigned int mode)
+{
+	switch (mode) {
+	case LIMIT_MODE_POLICE: return "police";
+	case LIMIT_MODE_PACE: return "pace";
+	case LIMIT_MODE_ECN: return "ecn";
+	case LIMIT_MODE_TCM: return "tcm";
+	case LIMIT_MODE_SHAPE: return "shape";
+	default: return "unknown";
+	}
+}
+
+int parse_limit_direction(const char *name, unsigned int *dir_out)
+{
+	if (!name || !dir_out) return -1;
+	if (strcmp(name, "out") == 0) {
+		*dir_out = LIMIT_DIR_EGRESS;
+	} else if (strcmp(name, "in") == 0) {
+		*dir_out = LIMIT_DIR_INGRESS;
+	} else if (strcmp(name, "both") == 0) {
+		*dir_out = LIMIT_DIR_BOTH;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *limit_direction_name(unsigned int direction)
+{
+	switch (direction) {
+	case 0:
+	case LIMIT_DIR_EGRESS: return "out";
+	case LIMIT_DIR_INGRESS: return "in";
+	case LIMIT_DIR_BOTH: return "both";
+	default: return "unknown";
+	}
+}
+
+int parse_map_alloc(const char *name, unsigned int *alloc_out)
+{
+	if (!name || !alloc_out) return -1;
+	if (strcmp(name, "prealloc") == 0) {
+		*alloc_out = MAP_ALLOC_PREALLOC;
+	} else if (strcmp(name, "dynamic") == 0) {
+		*alloc_out = MAP_ALLOC_DYNAMIC;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *map_alloc_name(unsigned int map_alloc)
+{
+	switch (map_alloc) {
+	case MAP_ALLOC_PREALLOC: return "prealloc";
+	case MAP_ALLOC_DYNAMIC: return "dynamic";
+	default: return "unknown";
+	}
+}
+
+int save_map_options(unsigned int max_rules, unsigned int map_alloc)
+{
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "maps") != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建 map 参数记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = fprintf(f, "max_rules=%u\nmap_alloc=%s\n", max_rules, map_alloc_name(map_alloc));
+	fclose(f);
+	return ret < 0 ? -1 : 0;
+}
+
+int load_map_options(unsigned int *max_rules, unsigned int *map_alloc)
+{
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "maps") != 0) return -1;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		char *nl = strchr(line, '\n');
+		if (nl) *nl = '\0';
+		char *eq = strchr(line, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		if (strcmp(line, "max_rules") == 0) {
+			*max_rules = (unsigned int)strtoul(eq + 1, NULL, 10);
+		} else if (strcmp(line, "map_alloc") == 0) {
+			(void)parse_map_alloc(eq + 1, map_alloc);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+int save_local_bypass_record(int enabled)
+{
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "local_bypass") != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建本机流量绕过记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = fprintf(f, "enabled=%d\n", enabled ? 1 : 0);
+	fclose(f);
+	return ret < 0 ? -1 : 0;
+}
+
+int load_local_bypass_record(void)
+{
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "local_bypass") != 0) return 1;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 1;
+
+	int enabled = 1;
+	char line[64];
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "enabled=", 8) == 0) {
+			enabled = atoi(line + 8) != 0;
+		}
+	}
+	fclose(f);
+	return enabled;
+}
+
+int save_ctrl_pass_record(const CtrlPass *cp)
+{
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "ctrl_pass") != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建控制包放行记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = fprintf(f, "enabled=%d\nmax_len=%u\npps=%llu\n", cp->enabled ? 1 : 0, cp->max_len, cp->pps);
+	fclose(f);
+	return ret < 0 ? -1 : 0;
+}
+
+void load_ctrl_pass_record(CtrlPass *cp)
+{
+	cp->enabled = 1;
+	cp->max_len = CTRL_DEFAULT_MAX_LEN;
+	cp->pps = CTRL_DEFAULT_PPS;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "ctrl_pass") != 0) return;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return;
+
+	char line[64];
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "enabled=", 8) == 0) {
+			cp->enabled = atoi(line + 8) != 0;
+		} else if (strncmp(line, "max_len=", 8) == 0) {
+			cp->max_len = (unsigned int)strtoul(line + 8, NULL, 10);
+		} else if (strncmp(line, "pps=", 4) == 0) {
+			cp->pps = strtoull(line + 4, NULL, 10);
+		}
+	}
+	fclose(f);
+	if (cp->pps > CTRL_MAX_PPS) cp->pps = CTRL_MAX_PPS;
+}
+
+int save_dev_list_record(const char *subdir, const char (*names)[16], int n)
+{
+	char path[PATH_MAX];
+	if (safe_path_join(path, sizeof(path), RUNTIME_DIR, subdir, "devs", NULL) != 0) return -1;
+	if (n <= 0) {
+		return (unlink(path) == 0 || errno == ENOENT) ? 0 : -1;
+	}
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, subdir) != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建网卡记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		ret = fprintf(f, "%s\n", names[i]);
+	}
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入网卡记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int load_dev_list_record(const char *subdir, char (*names)[16], int max)
+{
+	char path[PATH_MAX];
+	if (safe_path_join(path, sizeof(path), RUNTIME_DIR, subdir, "devs", NULL) != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	char line[64];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, " \t\n")] = '\0';
+		if (!line[0] || strlen(line) >= 16) continue;
+		snprintf(names[n], 16, "%s", line);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int save_attach_scope(const char (*paths)[PATH_MAX], int n)
+{
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "attach_scope") != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建附加范围记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		ret = fprintf(f, "%s\n", paths[i]);
+	}
+	fclose(f);
+	return ret < 0 ? -1 : 0;
+}
+
+int load_attach_scope(char (*paths)[PATH_MAX], int max)
+{
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "attach_scope") != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	while (n < max && fgets(paths[n], PATH_MAX, f)) {
+		char *nl = strchr(paths[n], '\n');
+		if (nl) *nl = '\0';
+		if (paths[n][0] != '/') continue;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* 写入规则参数字段，cgroup 规则与原地进程规则共用 */
+static int write_rule_fields(FILE *f, const LimiterConfig *cfg)
+{
+	return fprintf(f,
+		"rate=%llu\n"
+		"bucket=%llu\n"
+		"mode=%s\n"
+		"horizon_ns=%llu\n"
+		"shard_tolerance=%u\n"
+		"direction=%s\n"
+		"pps=%llu\n"
+		"pkt_burst=%llu\n"
+		"ecn_soft=%llu\n"
+		"ecn_hard=%llu\n"
+		"fair=%u\n"
+		"peak_rate=%llu\n"
+		"peak_burst=%llu\n"
+		"yellow_dscp=%u\n",
+		cfg->rate_bps, cfg->bucket_size, limit_mode_name(cfg->mode), cfg->horizon_ns,
+		cfg->shard_tolerance, limit_direction_name(cfg->direction), cfg->pps, cfg->pkt_burst,
+		cfg->ecn_soft, cfg->ecn_hard, cfg->fair_pct, cfg->peak_rate, cfg->peak_burst, cfg->yellow_dscp);
+}
+
+int save_rule_record(const LimiterConfig *cfg)
+{
+	if (!cfg || cfg->cgid == 0ULL) return -1;
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "rules") != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (build_rule_record_path(cfg->cgid, path, sizeof(path)) != 0) {
+		fprintf(stderr, "无法构建规则 %llu 的记录文件路径\n", cfg->cgid);
+		return -1;
+	}
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建规则记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	int ret = write_rule_fields(f, cfg);
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入规则记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * 读取规则参数字段，覆盖 cfg 中对应字段；未出现的字段保持原值。
+ * starttime 不为 NULL 时一并读取原地进程规则记录中的进程启动时间。
+ */
+static void read_rule_fields(FILE *f, const char *what, LimiterConfig *cfg, unsigned long long *starttime)
+{
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		char *nl = strchr(line, '\n');
+		if (nl) *nl = '\0';
+		char *eq = strchr(line, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		const char *key = line;
+		const char *val = eq + 1;
+
+		if (strcmp(key, "rate") == 0) {
+			cfg->rate_bps = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "bucket") == 0) {
+			cfg->bucket_size = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "mode") == 0) {
+			if (parse_limit_mode(val, &cfg->mode) != 0) {
+				fprintf(stderr, "警告: %s记录中的模式无效: %s\n", what, val);
+			}
+		} else if (strcmp(key, "horizon_ns") == 0) {
+			cfg->horizon_ns = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "shard_tolerance") == 0) {
+			cfg->shard_tolerance = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(key, "pps") == 0) {
+			cfg->pps = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "pkt_burst") == 0) {
+			cfg->pkt_burst = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "ecn_soft") == 0) {
+			cfg->ecn_soft = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "ecn_hard") == 0) {
+			cfg->ecn_hard = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "fair") == 0) {
+			cfg->fair_pct = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(key, "peak_rate") == 0) {
+			cfg->peak_rate = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "peak_burst") == 0) {
+			cfg->peak_burst = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "yellow_dscp") == 0) {
+			cfg->yellow_dscp = (unsigned int)strtoul(val, NULL, 10);
+		} else if (strcmp(key, "direction") == 0) {
+			if (parse_limit_direction(val, &cfg->direction) != 0) {
+				fprintf(stderr, "警告: %s记录中的方向无效: %s\n", what, val);
+			}
+		} else if (starttime && strcmp(key, "starttime") == 0) {
+			*starttime = strtoull(val, NULL, 10);
+		}
+	}
+}
+
+/* 读取规则记录，覆盖 cfg 中对应字段；未出现的字段保持原值 */
+int load_rule_record(unsigned long long cgid, LimiterConfig *cfg)
+{
+	if (!cfg) return -1;
+
+	char path[PATH_MAX];
+	if (build_rule_record_path(cgid, path, sizeof(path)) != 0) return -1;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+
+	char what[48];
+	snprintf(what, sizeof(what), "规则 %llu ", cgid);
+	read_rule_fields(f, what, cfg, NULL);
+	fclose(f);
+	cfg->cgid = cgid;
+	return 0;
+}
+
+/* 构建原地进程规则记录文件路径 */
+static int build_pid_rule_record_path(unsigned int tgid, char *path, size_t path_size)
+{
+	char id_str[32];
+	if (snprintf(id_str, sizeof(id_str), "%u", tgid) >= (int)sizeof(id_str)) {
+		return -1;
+	}
+	return safe_path_join(path, path_size, RUNTIME_DIR, "pids", id_str, NULL);
+}
+
+int save_pid_rule_record(unsigned int tgid, unsigned long long starttime, const LimiterConfig *cfg)
+{
+	if (!cfg || tgid == 0) return -1;
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "pids") != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (build_pid_rule_record_path(tgid, path, sizeof(path)) != 0) {
+		fprintf(stderr, "无法构建进程 %u 的规则记录文件路径\n", tgid);
+		return -1;
+	}
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建进程规则记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	int ret = fprintf(f, "starttime=%llu\n", starttime);
+	if (ret >= 0) ret = write_rule_fields(f, cfg);
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入进程规则记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int load_pid_rule_record(unsigned int tgid, LimiterConfig *cfg, unsigned long long *starttime)
+{
+	if (!cfg || !starttime) return -1;
+
+	char path[PATH_MAX];
+	if (build_pid_rule_record_path(tgid, path, sizeof(path)) != 0) return -1;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+
+	char what[48];
+	snprintf(what, sizeof(what), "进程 %u 的规则", tgid);
+	*starttime = 0ULL;
+	read_rule_fields(f, what, cfg, starttime);
+	fclose(f);
+	return 0;
+}
+
+int delete_pid_rule_record(unsigned int tgid)
+{
+	char path[PATH_MAX];
+	if (build_pid_rule_record_path(tgid, path, sizeof(path)) != 0) return -1;
+	if (unlink(path) != 0 && errno != ENOENT) {
+		fprintf(stderr, "无法删除进程规则记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int for_each_pid_rule_record(pid_rule_fn fn, void *arg)
+{
+	char dir_path[PATH_MAX];
+	if (SAFE_PATH_JOIN(dir_path, RUNTIME_DIR, "pids") != 0) return -1;
+	DIR *dir = opendir(dir_path);
+	if (!dir) return 0;
+
+	int ret = 0;
+	struct dirent *entry;
+	while (ret == 0 && (entry = readdir(dir)) != NULL) {
+		char *end = NULL;
+		unsigned long tgid = strtoul(entry->d_name, &end, 10);
+		if (entry->d_name[0] == '.' || *end != '\0' || tgid == 0 || tgid > 0xffffffffUL) continue;
+
+		LimiterConfig cfg = { .direction = LIMIT_DIR_EGRESS };
+		unsigned long long starttime = 0ULL;
+		if (load_pid_rule_record((unsigned int)tgid, &cfg, &starttime) != 0) continue;
+		ret = fn((unsigned int)tgid, &cfg, starttime, arg);
+	}
+	closedir(dir);
+	return ret;
+}
+
+int save_host_cap_record(const LimiterConfig *cfg)
+{
+	if (!cfg) return -1;
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "host_cap") != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建整机限速记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = write_rule_fields(f, cfg);
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入整机限速记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int load_host_cap_record(LimiterConfig *cfg)
+{
+	if (!cfg) return -1;
+
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "host_cap") != 0) return -1;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+
+	read_rule_fields(f, "整机限速", cfg, NULL);
+	fclose(f);
+	return cfg->rate_bps ? 0 : -1;
+}
+
+int delete_host_cap_record(void)
+{
+	char path[PATH_MAX];
+	if (SAFE_PATH_JOIN(path, RUNTIME_DIR, "host_cap") != 0) return -1;
+	if (unlink(path) != 0 && errno != ENOENT) {
+		fprintf(stderr, "无法删除整机限速记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
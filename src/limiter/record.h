@@ -0,0 +1,76 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "bpf.h"
+
+/*
+ * 规则参数记录：保存在 RUNTIME_DIR "/rules/<cgid>"。
+ * 规则目录名只编码了 bucket/rate，其余参数（模式等）靠该记录在 reload 时恢复。
+ */
+int save_rule_record(const LimiterConfig *cfg);
+int load_rule_record(unsigned long long cgid, LimiterConfig *cfg);
+
+/*
+ * 原地进程规则记录：保存在 RUNTIME_DIR "/pids/<tgid>"，字段同规则记录，另有进程启动时间，
+ * reload 时据此判断 tgid 是否已被新进程复用。
+ */
+int save_pid_rule_record(unsigned int tgid, unsigned long long starttime, const LimiterConfig *cfg);
+int load_pid_rule_record(unsigned int tgid, LimiterConfig *cfg, unsigned long long *starttime);
+int delete_pid_rule_record(unsigned int tgid);
+
+/* 遍历原地进程规则记录；回调返回非 0 时停止遍历，该值作为返回值 */
+typedef int (*pid_rule_fn)(unsigned int tgid, const LimiterConfig *cfg,
+			   unsigned long long starttime, void *arg);
+int for_each_pid_rule_record(pid_rule_fn fn, void *arg);
+
+/*
+ * 整机出方向总限速记录：保存在 RUNTIME_DIR "/host_cap"，字段同规则记录（rate、bucket、shard_tolerance），
+ * reload 时据此恢复。没有记录或未启用时 load 返回 -1。
+ */
+int save_host_cap_record(const LimiterConfig *cfg);
+int load_host_cap_record(LimiterConfig *cfg);
+int delete_host_cap_record(void);
+
+/* 本机流量绕过的开关记录：保存在 RUNTIME_DIR "/local_bypass"，没有记录时为启用 */
+int save_local_bypass_record(int enabled);
+int load_local_bypass_record(void);
+
+/* 控制包放行的设置记录：保存在 RUNTIME_DIR "/ctrl_pass"，没有记录时为默认设置（启用） */
+int save_ctrl_pass_record(const CtrlPass *cp);
+void load_ctrl_pass_record(CtrlPass *cp);
+
+/*
+ * 规则表容量与分配方式记录：保存在 RUNTIME_DIR "/maps"，reload 时沿用。
+ * 读取失败时保持输出参数不变。
+ */
+int save_map_options(unsigned int max_rules, unsigned int map_alloc);
+int load_map_options(unsigned int *max_rules, unsigned int *map_alloc);
+
+/*
+ * 网卡名列表记录：保存在 RUNTIME_DIR "/<subdir>/devs"，每行一个网卡名，tc 附加网卡（subdir 为 tc）
+ * 与 shape 整形网卡（subdir 为 shape）共用。load 返回读到的网卡数（没有记录为 0），
+ * save 在 n 为 0 时删除记录文件。
+ */
+int save_dev_list_record(const char *subdir, const char (*names)[16], int n);
+int load_dev_list_record(const char *subdir, char (*names)[16], int max);
+
+/*
+ * 附加范围记录：保存在 RUNTIME_DIR "/attach_scope"，每行一个 cgroup 路径，reload 时沿用。
+ * load 返回读到的路径数（没有记录为 0），每项缓冲区 PATH_MAX 字节。
+ */
+int save_attach_scope(const char (*paths)[PATH_MAX], int n);
+int load_attach_scope(char (*paths)[PATH_MAX], int max);
+
+/* 分配方式（prealloc/dynamic）与 MAP_ALLOC_* 互转，未知名称返回 -1 */
+int parse_map_alloc(const char *name, unsigned int *alloc_out);
+const char *map_alloc_name(unsigned int map_alloc);
+
+/* 限速模式与名称互转，未知名称返回 -1 */
+int parse_limit_mode(const char *name, unsigned int *mode_out);
+const char *limit_mode_name(unsigned int mode);
+
+/* 限速方向（in/out/both）与 LIMIT_DIR_* 互转，未知名称返回 -1 */
+int parse_limit_direction(const char *name, unsigned int *dir_out);
+const char *limit_direction_name(unsigned int direction);
+
+#endif /* RECORD_H */
@@ -0,0 +1,339 @@
+#include "schedule.h"
+#include "managed.h"
+#include "cgroup.h"
+#include "record.h"
+#include "utils.h"
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+static const char *const day_names[7] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+#define SCHED_ALL_DAYS 0x7fU
+
+/* 构建时间窗记录文件路径 */
+static int build_schedule_record_path(unsigned long long cgid, char *path, size_t path_size)
+{
+	char id_str[32];
+	if (snprintf(id_str, sizeof(id_str), "%llu", cgid) >= (int)sizeof(id_str)) {
+		return -1;
+	}
+	return safe_path_join(path, path_size, RUNTIME_DIR, "schedules", id_str, NULL);
+}
+
+static int parse_day_name(const char *str, size_t len)
+{
+	for (int i = 0; i < 7; i++) {
+		if (len == 3 && strncmp(str, day_names[i], 3) == 0) return i;
+	}
+	return -1;
+}
+
+int parse_sched_days(const char *str, unsigned int *days_out)
+{
+	if (!str || !days_out || !str[0]) return -1;
+	if (strcmp(str, "all") == 0) {
+		*days_out = SCHED_ALL_DAYS;
+		return 0;
+	}
+
+	unsigned int days = 0;
+	const char *p = str;
+	while (*p) {
+		const char *comma = strchr(p, ',');
+		size_t len = comma ? (size_t)(comma - p) : strlen(p);
+		const char *dash = memchr(p, '-', len);
+		int lo, hi;
+		if (dash) {
+			lo = parse_day_name(p, (size_t)(dash - p));
+			hi = parse_day_name(dash + 1, len - (size_t)(dash - p) - 1);
+		} else {
+			lo = hi = parse_day_name(p, len);
+		}
+		if (lo < 0 || hi < 0) return -1;
+		/* 区间可以跨周末，如 fri-mon */
+		for (int d = lo;; d = (d + 1) % 7) {
+			days |= 1U << d;
+			if (d == hi) break;
+		}
+		p += len;
+		if (*p == ',') p++;
+	}
+	*days_out = days;
+	return 0;
+}
+
+static void format_sched_days(unsigned int days, char *buf, size_t bufsz)
+{
+	if ((days & SCHED_ALL_DAYS) == SCHED_ALL_DAYS) {
+		snprintf(buf, bufsz, "all");
+		return;
+	}
+	size_t off = 0;
+	buf[0] = '\0';
+	for (int d = 0; d < 7 && off < bufsz; d++) {
+		if (!(days & (1U << d))) continue;
+		int n = snprintf(buf + off, bufsz - off, "%s%s", off ? "," : "", day_names[d]);
+		if (n < 0) break;
+		off += (size_t)n;
+	}
+}
+
+int parse_sched_time(const char *str, int allow_24, unsigned int *sec_out)
+{
+	if (!str || !sec_out) return -1;
+	unsigned int h = 0, m = 0, s = 0;
+	char tail;
+	int n = sscanf(str, "%u:%u:%u%c", &h, &m, &s, &tail);
+	if (n != 2 && n != 3) return -1;
+	if (m > 59 || s > 59) return -1;
+	if (h > 24 || (h == 24 && (!allow_24 || m || s))) return -1;
+	*sec_out = h * 3600 + m * 60 + s;
+	return 0;
+}
+
+static void format_sched_time(unsigned int sec, char *buf, size_t bufsz)
+{
+	if (sec % 60) {
+		snprintf(buf, bufsz, "%02u:%02u:%02u", sec / 3600, sec / 60 % 60, sec % 60);
+	} else {
+		snprintf(buf, bufsz, "%02u:%02u", sec / 3600, sec / 60 % 60);
+	}
+}
+
+int save_schedule_record(unsigned long long cgid, const RateWindow *w, int n)
+{
+	char path[PATH_MAX];
+	if (build_schedule_record_path(cgid, path, sizeof(path)) != 0) return -1;
+	if (n <= 0) {
+		if (unlink(path) != 0 && errno != ENOENT) return -1;
+		return 0;
+	}
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "schedules") != 0) return -1;
+	if (ensure_dir(dir, 0755) != 0) return -1;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建时间窗记录: %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		ret = fprintf(f, "days=%u start=%u end=%u rate=%llu bucket=%llu\n",
+			      w[i].days, w[i].start_sec, w[i].end_sec, w[i].rate_bps, w[i].bucket_size);
+	}
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入时间窗记录: %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* 解析一行时间窗记录，格式见 save_schedule_record */
+static int parse_schedule_line(char *line, RateWindow *w)
+{
+	memset(w, 0, sizeof(*w));
+	int have_start = 0, have_end = 0;
+	char *save = NULL;
+	for (char *tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+		char *eq = strchr(tok, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		const char *val = eq + 1;
+		if (strcmp(tok, "days") == 0) {
+			w->days = (unsigned int)strtoul(val, NULL, 10) & SCHED_ALL_DAYS;
+		} else if (strcmp(tok, "start") == 0) {
+			w->start_sec = (unsigned int)strtoul(val, NULL, 10);
+			have_start = 1;
+		} else if (strcmp(tok, "end") == 0) {
+			w->end_sec = (unsigned int)strtoul(val, NULL, 10);
+			have_end = 1;
+		} else if (strcmp(tok, "rate") == 0) {
+			w->rate_bps = strtoull(val, NULL, 10);
+		} else if (strcmp(tok, "bucket") == 0) {
+			w->bucket_size = strtoull(val, NULL, 10);
+		}
+	}
+	if (!have_start || !have_end || w->days == 0) return -1;
+	if (w->start_sec >= SCHED_DAY_SECS || w->end_sec > SCHED_DAY_SECS || w->start_sec == w->end_sec) return -1;
+	if (w->rate_bps == 0 || w->bucket_size == 0) return -1;
+	return 0;
+}
+
+int load_schedule_record(unsigned long long cgid, RateWindow *w, int max)
+{
+	char path[PATH_MAX];
+	if (build_schedule_record_path(cgid, path, sizeof(path)) != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	char line[256];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		if (parse_schedule_line(line, &w[n]) != 0) {
+			fprintf(stderr, "警告: 规则 %llu 的时间窗记录中有无效行，已跳过\n", cgid);
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* 读取规则参数（时间窗沿用其模式、包速率等），规则没有记录时打印原因并返回 -1 */
+static int schedule_rule_config(const char *rule_path, LimiterConfig *lc)
+{
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return -1;
+
+	memset(lc, 0, sizeof(*lc));
+	if (load_rule_record(cgid, lc) != 0 || lc->rate_bps == 0ULL) {
+		fprintf(stderr, "规则 %s 没有参数记录，请先用 limiter set 设置\n", rule_path);
+		return -1;
+	}
+	lc->cgid = cgid;
+	lc->cgroup_path = rule_path;
+	return 0;
+}
+
+/* 当前本地时间落在第几个时间窗（与数据路径的选择规则一致），都不命中返回 -1 */
+static int active_window(const RateWindow *w, int n)
+{
+	time_t now = time(NULL);
+	struct tm lt;
+	if (!localtime_r(&now, &lt)) return -1;
+	unsigned int sec = (unsigned int)(lt.tm_hour * 3600 + lt.tm_min * 60 + lt.tm_sec);
+	unsigned int wday = (unsigned int)lt.tm_wday;
+
+	for (int i = 0; i < n; i++) {
+		if (w[i].start_sec < w[i].end_sec) {
+			if ((w[i].days & (1U << wday)) && sec >= w[i].start_sec && sec < w[i].end_sec) return i;
+		} else if (sec >= w[i].start_sec) {
+			if (w[i].days & (1U << wday)) return i;
+		} else if (sec < w[i].end_sec) {
+			if (w[i].days & (1U << ((wday + 6) % 7))) return i;
+		}
+	}
+	return -1;
+}
+
+int do_schedule_add(const char *rule_path, const RateWindow *win)
+{
+	LimiterConfig lc;
+	if (schedule_rule_config(rule_path, &lc) != 0) return 1;
+	if (lc.mode == LIMIT_MODE_TCM && lc.peak_rate < win->rate_bps) {
+		fprintf(stderr, "warning: 时间窗速率高于规则的 --peak-rate，窗内峰值速率按时间窗速率计\n");
+	}
+
+	RateWindow w[LIMIT_MAX_WINDOWS];
+	int n = load_schedule_record(lc.cgid, w, LIMIT_MAX_WINDOWS);
+	if (n >= LIMIT_MAX_WINDOWS) {
+		fprintf(stderr, "每条规则最多 %d 个时间窗\n", LIMIT_MAX_WINDOWS);
+		return 1;
+	}
+	w[n] = *win;
+	if (bpf_sync_rule_schedule(&lc, w, n + 1) != 0) {
+		return 1;
+	}
+	if (save_schedule_record(lc.cgid, w, n + 1) != 0) {
+		fprintf(stderr, "警告: 保存时间窗记录失败，reload 后该时间窗将丢失\n");
+	}
+
+	char days[32], from[16], to[16];
+	format_sched_days(win->days, days, sizeof(days));
+	format_sched_time(win->start_sec, from, sizeof(from));
+	format_sched_time(win->end_sec, to, sizeof(to));
+	printf("已添加时间窗 id=%d %s %s-%s rate=%llu 到规则 %s\n", n, days, from, to, win->rate_bps, rule_path);
+	return 0;
+}
+
+int do_schedule_del(const char *rule_path, unsigned int id)
+{
+	LimiterConfig lc;
+	if (schedule_rule_config(rule_path, &lc) != 0) return 1;
+
+	RateWindow w[LIMIT_MAX_WINDOWS];
+	int n = load_schedule_record(lc.cgid, w, LIMIT_MAX_WINDOWS);
+	if (id >= (unsigned int)n) {
+		fprintf(stderr, "规则 %s 没有时间窗 id=%u\n", rule_path, id);
+		return 1;
+	}
+	memmove(&w[id], &w[id + 1], (size_t)(n - (int)id - 1) * sizeof(w[0]));
+	n--;
+
+	if (bpf_sync_rule_schedule(&lc, w, n) != 0) {
+		return 1;
+	}
+	if (save_schedule_record(lc.cgid, w, n) != 0) {
+		fprintf(stderr, "警告: 更新时间窗记录失败\n");
+	}
+	printf("已删除规则 %s 的时间窗 id=%u，其后的时间窗编号依次前移\n", rule_path, id);
+	return 0;
+}
+
+static int print_rule_schedule(const char *rule_path, unsigned long long bucket, unsigned long long rate, void *arg)
+{
+	(void)arg;
+
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 0;
+
+	RateWindow w[LIMIT_MAX_WINDOWS];
+	int n = load_schedule_record(cgid, w, LIMIT_MAX_WINDOWS);
+	if (n <= 0) return 0;
+
+	int active = active_window(w, n);
+	for (int i = 0; i < n; i++) {
+		char days[32], from[16], to[16];
+		format_sched_days(w[i].days, days, sizeof(days));
+		format_sched_time(w[i].start_sec, from, sizeof(from));
+		format_sched_time(w[i].end_sec, to, sizeof(to));
+		printf("%-3d %-28s %-8s %-8s %-12llu %-12llu %-4s %s\n",
+		       i, days, from, to, w[i].rate_bps, w[i].bucket_size, i == active ? "*" : "", rule_path);
+	}
+	if (active < 0 && rate) {
+		printf("%-3s %-28s %-8s %-8s %-12llu %-12llu %-4s %s\n",
+		       "-", "(其余时间)", "", "", rate, bucket, "*", rule_path);
+	}
+	return 0;
+}
+
+int do_schedule_list(const char *rule_path)
+{
+	printf("%-3s %-28s %-8s %-8s %-12s %-12s %-4s %s\n",
+	       "id", "days", "from", "to", "rate", "bucket", "当前", "规则路径");
+	if (rule_path) {
+		LimiterConfig lc;
+		if (schedule_rule_config(rule_path, &lc) != 0) return 1;
+		return print_rule_schedule(rule_path, lc.bucket_size, lc.rate_bps, NULL);
+	}
+	if (for_each_rule_dir(MANAGED_ROOT, print_rule_schedule, NULL) < 0) {
+		fprintf(stderr, "无法打开托管目录: %s\n", MANAGED_ROOT);
+		return 1;
+	}
+	return 0;
+}
+
+int do_schedule_sync(void)
+{
+	if (bpf_sync_limiter_clock() != 0) return 1;
+
+	time_t now = time(NULL);
+	struct tm lt;
+	char buf[64] = "?";
+	if (localtime_r(&now, &lt)) {
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S %Z", &lt);
+	}
+	printf("已按当前本地时间 %s 校准时间窗时钟\n", buf);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include "bpf.h"
+
+/*
+ * 分时速率记录：保存在 RUNTIME_DIR "/schedules/<cgid>"，每行一个时间窗，行序即匹配顺序，
+ * reload 或规则参数变化时据此重建时间窗表。load 返回读到的时间窗数（没有记录为 0），
+ * save 在 n 为 0 时删除记录文件。
+ */
+int load_schedule_record(unsigned long long cgid, RateWindow *w, int max);
+int save_schedule_record(unsigned long long cgid, const RateWindow *w, int n);
+
+/* 星期解析：all、单日或区间（mon-fri、fri-mon），可用逗号组合，如 sat,sun */
+int parse_sched_days(const char *str, unsigned int *days_out);
+/* 时刻解析：HH:MM 或 HH:MM:SS，得到当天零点起的秒数；allow_24 为 1 时接受 24:00 */
+int parse_sched_time(const char *str, int allow_24, unsigned int *sec_out);
+
+/* 便捷子命令：schedule add/del/list/sync；rule_path 为规则 cgroup 路径，list 传 NULL 列出全部规则 */
+int do_schedule_add(const char *rule_path, const RateWindow *w);
+int do_schedule_del(const char *rule_path, unsigned int id);
+int do_schedule_list(const char *rule_path);
+int do_schedule_sync(void);
+
+#endif /* SCHEDULE_H */
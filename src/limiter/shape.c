@@ -0,0 +1,279 @@
+#include "shape.h"
+#include "managed.h"
+#include "utils.h"
+#include "record.h"
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+/* 默认类不限速，只是给没有规则的流量一个 fq 叶子；HTB 用 64 位速率，取一个远超网卡的值 */
+#define SHAPE_DEFAULT_RATE "100gbit"
+
+int save_shape_dev_record(const char (*names)[16], int n)
+{
+	return save_dev_list_record("shape", names, n);
+}
+
+int load_shape_dev_record(char (*names)[16], int max)
+{
+	return load_dev_list_record("shape", names, max);
+}
+
+/*
+ * 执行 tc 命令（argv[0] 为 "tc"），成功返回 0。quiet 时丢弃错误输出，用于删除不存在的对象等预期内的失败；
+ * out 非空时收集标准输出（截断到 out_size - 1）。
+ */
+static int run_tc(char *const argv[], int quiet, char *out, size_t out_size)
+{
+	int pipefd[2] = { -1, -1 };
+	if (out && pipe(pipefd) != 0) {
+		fprintf(stderr, "无法创建管道: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "无法执行 tc: %s\n", strerror(errno));
+		if (out) {
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		return -1;
+	}
+	if (pid == 0) {
+		if (out) {
+			dup2(pipefd[1], STDOUT_FILENO);
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		if (quiet) {
+			int null_fd = open("/dev/null", O_WRONLY);
+			if (null_fd >= 0) {
+				dup2(null_fd, STDERR_FILENO);
+				close(null_fd);
+			}
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if (out) {
+		size_t len = 0;
+		ssize_t r;
+		close(pipefd[1]);
+		while ((r = read(pipefd[0], out + len, out_size - 1 - len)) > 0) {
+			len += (size_t)r;
+			if (len == out_size - 1) break;
+		}
+		out[len] = '\0';
+		close(pipefd[0]);
+	}
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	if (!WIFEXITED(status)) return -1;
+	if (WEXITSTATUS(status) == 127) {
+		fprintf(stderr, "无法执行 tc 命令，shape 模式需要安装 iproute2\n");
+		return -1;
+	}
+	return WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* classid 的文本形式（十六进制，tc 的写法），minor 为 0 时只有主号 */
+static void format_classid(unsigned int minor, char *buf, size_t bufsz)
+{
+	if (minor) {
+		snprintf(buf, bufsz, "%x:%x", SHAPE_HTB_MAJOR, minor);
+	} else {
+		snprintf(buf, bufsz, "%x:", SHAPE_HTB_MAJOR);
+	}
+}
+
+int shape_dev_installed(const char *ifname)
+{
+	char out[1024];
+	char *argv[] = { "tc", "qdisc", "show", "dev", (char *)ifname, "root", NULL };
+	if (run_tc(argv, 1, out, sizeof(out)) != 0) return 0;
+
+	char expect[32];
+	snprintf(expect, sizeof(expect), "qdisc htb %x: root", SHAPE_HTB_MAJOR);
+	return strstr(out, expect) != NULL;
+}
+
+int shape_remove_dev(const char *ifname)
+{
+	if (!shape_dev_installed(ifname)) return 0;
+	char handle[16];
+	format_classid(0, handle, sizeof(handle));
+	char *argv[] = { "tc", "qdisc", "del", "dev", (char *)ifname, "root", "handle", handle, NULL };
+	return run_tc(argv, 0, NULL, 0) == 0 ? 1 : -1;
+}
+
+int shape_reset_dev(const char *ifname)
+{
+	if (shape_remove_dev(ifname) < 0) return -1;
+
+	char handle[16], def[16], def_minor[16];
+	format_classid(0, handle, sizeof(handle));
+	format_classid(SHAPE_DEFAULT_MINOR, def, sizeof(def));
+	snprintf(def_minor, sizeof(def_minor), "%x", SHAPE_DEFAULT_MINOR);
+
+	/* replace 会替换网卡上原有的根 qdisc（例如 pace 模式用的 fq），fq 叶子仍然按 EDT 时间戳发送 */
+	char *root[] = { "tc", "qdisc", "replace", "dev", (char *)ifname, "root", "handle", handle,
+			 "htb", "default", def_minor, NULL };
+	char *cls[] = { "tc", "class", "replace", "dev", (char *)ifname, "parent", handle, "classid", def,
+			"htb", "rate", SHAPE_DEFAULT_RATE, NULL };
+	char *leaf[] = { "tc", "qdisc", "replace", "dev", (char *)ifname, "parent", def, "fq", NULL };
+	if (run_tc(root, 0, NULL, 0) != 0 || run_tc(cls, 0, NULL, 0) != 0 || run_tc(leaf, 0, NULL, 0) != 0) {
+		fprintf(stderr, "无法在网卡 %s 上安装 HTB\n", ifname);
+		return -1;
+	}
+	return 0;
+}
+
+int shape_update_class(const char *ifname, unsigned int slot, unsigned long long rate, unsigned long long bucket)
+{
+	if (slot > SHAPE_MAX_SLOT) {
+		fprintf(stderr, "规则槽位 %u 超出 shape 模式可用的范围 (0-%u)，该规则的流量走默认类\n",
+			slot, SHAPE_MAX_SLOT);
+		return -1;
+	}
+	if (!shape_dev_installed(ifname) && shape_reset_dev(ifname) != 0) return -1;
+
+	char handle[16], classid[16], rate_str[32], burst_str[32];
+	format_classid(0, handle, sizeof(handle));
+	format_classid(SHAPE_MINOR_BASE + slot, classid, sizeof(classid));
+	snprintf(rate_str, sizeof(rate_str), "%llubps", rate); /* tc 的 bps 为字节每秒 */
+	snprintf(burst_str, sizeof(burst_str), "%llu", bucket);
+
+	char *cls[] = { "tc", "class", "replace", "dev", (char *)ifname, "parent", handle, "classid", classid,
+			"htb", "rate", rate_str, "ceil", rate_str, "burst", burst_str, "cburst", burst_str, NULL };
+	char *leaf[] = { "tc", "qdisc", "replace", "dev", (char *)ifname, "parent", classid, "fq", NULL };
+	if (run_tc(cls, 0, NULL, 0) != 0 || run_tc(leaf, 0, NULL, 0) != 0) {
+		fprintf(stderr, "无法在网卡 %s 上设置 HTB 类 %s\n", ifname, classid);
+		return -1;
+	}
+	return 0;
+}
+
+int shape_delete_class(const char *ifname, unsigned int slot)
+{
+	if (slot > SHAPE_MAX_SLOT) return 0;
+	char classid[16];
+	format_classid(SHAPE_MINOR_BASE + slot, classid, sizeof(classid));
+	char *argv[] = { "tc", "class", "del", "dev", (char *)ifname, "classid", classid, NULL };
+	return run_tc(argv, 1, NULL, 0);
+}
+
+void shape_sync_rule(const LimiterConfig *cfg, unsigned int slot, int was_shape)
+{
+	int shape = cfg->mode == LIMIT_MODE_SHAPE;
+	if (!shape && !was_shape) return;
+
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	if (shape && n == 0) {
+		fprintf(stderr, "warning: 还没有整形网卡，shape 规则暂不生效，请用 limiter shape add --dev <ifname> 添加\n");
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		if (shape) {
+			(void)shape_update_class(names[i], slot, cfg->rate_bps, cfg->bucket_size);
+		} else {
+			(void)shape_delete_class(names[i], slot);
+		}
+	}
+}
+
+int shape_purge(void)
+{
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	int removed = 0;
+	for (int i = 0; i < n; i++) {
+		if (shape_remove_dev(names[i]) > 0) removed++;
+	}
+	return removed;
+}
+
+static int find_shape_dev(const char (*names)[16], int n, const char *ifname)
+{
+	for (int i = 0; i < n; i++) {
+		if (strcmp(names[i], ifname) == 0) return i;
+	}
+	return -1;
+}
+
+int do_shape_add(const char *ifname)
+{
+	if (if_nametoindex(ifname) == 0) {
+		fprintf(stderr, "网卡不存在: %s\n", ifname);
+		return 1;
+	}
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	int idx = find_shape_dev((const char (*)[16])names, n, ifname);
+	if (idx < 0 && n >= SHAPE_MAX_DEVS) {
+		fprintf(stderr, "shape 模式最多使用 %d 个整形网卡\n", SHAPE_MAX_DEVS);
+		return 1;
+	}
+
+	char one[1][16];
+	snprintf(one[0], sizeof(one[0]), "%s", ifname);
+	int classes = bpf_sync_shape_classes((const char (*)[16])one, 1);
+	if (classes < 0) return 1;
+	if (idx < 0) {
+		snprintf(names[n++], sizeof(names[0]), "%s", ifname);
+		if (save_shape_dev_record((const char (*)[16])names, n) != 0) {
+			fprintf(stderr, "警告: 保存整形网卡记录失败，reload 后不会重建 %s 上的 HTB\n", ifname);
+		}
+	}
+	printf("已在网卡 %s 上安装 HTB，shape 规则 %d 条\n", ifname, classes);
+	return 0;
+}
+
+int do_shape_del(const char *ifname)
+{
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	int idx = find_shape_dev((const char (*)[16])names, n, ifname);
+	if (idx >= 0) {
+		memmove(&names[idx], &names[idx + 1], (size_t)(n - idx - 1) * sizeof(names[0]));
+		n--;
+		if (save_shape_dev_record((const char (*)[16])names, n) != 0) {
+			fprintf(stderr, "警告: 更新整形网卡记录失败\n");
+		}
+	}
+	int ret = shape_remove_dev(ifname);
+	if (ret < 0) return 1;
+	if (ret == 0 && idx < 0) {
+		fprintf(stderr, "网卡 %s 不是整形网卡\n", ifname);
+		return 1;
+	}
+	return 0;
+}
+
+int do_shape_list(void)
+{
+	char names[SHAPE_MAX_DEVS][16];
+	int n = load_shape_dev_record(names, SHAPE_MAX_DEVS);
+	printf("%-16s %-8s %s\n", "网卡", "ifindex", "状态");
+	for (int i = 0; i < n; i++) {
+		printf("%-16s %-8u %s\n", names[i], if_nametoindex(names[i]),
+		       shape_dev_installed(names[i]) ? "已安装" : "未安装");
+	}
+	if (n > 0) {
+		printf("\n各类的排队与丢包统计: tc -s class show dev <ifname>（规则的类为 %x:<0x%x + 槽位>）\n",
+		       SHAPE_HTB_MAJOR, SHAPE_MINOR_BASE);
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "bpf.h"
+
+/* 整形网卡的最大数量 */
+#define SHAPE_MAX_DEVS 16
+
+/*
+ * shape 模式的整形网卡：记录保存在 RUNTIME_DIR "/shape/devs"，每行一个网卡名，
+ * reload 时据此重建 HTB。load 返回读到的网卡数（没有记录为 0），save 在 n 为 0 时删除记录文件。
+ */
+int load_shape_dev_record(char (*names)[16], int max);
+int save_shape_dev_record(const char (*names)[16], int n);
+
+/*
+ * 通过 tc 命令（iproute2）维护整形网卡上的 HTB：
+ * reset 删除本工具装的根 qdisc 后重建根 qdisc 51: 与默认类 51:1（不限速，叶子为 fq）；
+ * update_class 创建或修改规则槽位对应的类（rate/ceil 为规则速率，burst 为桶容量，叶子为 fq），
+ * 根 qdisc 不存在时先重建；delete_class 删除该类；remove 删除根 qdisc 连同所有类，没有装过返回 0。
+ * 失败返回 -1（tc 的错误信息直接输出到 stderr）。
+ */
+int shape_reset_dev(const char *ifname);
+int shape_update_class(const char *ifname, unsigned int slot, unsigned long long rate, unsigned long long bucket);
+int shape_delete_class(const char *ifname, unsigned int slot);
+int shape_remove_dev(const char *ifname);
+int shape_dev_installed(const char *ifname);
+
+/* 在所有整形网卡上同步一条规则的类：规则为 shape 模式时创建或修改，否则 was_shape 时删除 */
+void shape_sync_rule(const LimiterConfig *cfg, unsigned int slot, int was_shape);
+
+/* purge：删除所有整形网卡上的 HTB，返回删除的个数；网卡记录保留，reload 时重建 */
+int shape_purge(void);
+
+/*
+ * 便捷子命令：shape add 把网卡加入整形网卡并按现有的 shape 规则建好 HTB，
+ * shape del 移出并删除网卡上的 HTB，shape list 显示整形网卡与安装状态
+ */
+int do_shape_add(const char *ifname);
+int do_shape_del(const char *ifname);
+int do_shape_list(void);
+
+#endif /* SHAPE_H */
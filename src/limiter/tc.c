@@ -0,0 +1,368 @@
+#include "tc.h"
+#include "class.h"
+#include "managed.h"
+#include "cgroup.h"
+#include "record.h"
+#include "utils.h"
+#include "../include/limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/limits.h>
+
+static const unsigned char v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* 构建 tc 记录文件路径，name 为 matches（网卡记录见 save_dev_list_record） */
+static int build_tc_record_path(const char *name, char *path, size_t path_size)
+{
+	return safe_path_join(path, path_size, RUNTIME_DIR, "tc", name, NULL);
+}
+
+/* 打开 tc 记录文件准备写入，n 为 0 时删除记录并返回 NULL（*removed 置 1） */
+static FILE *open_tc_record(const char *name, int n, int *removed)
+{
+	char path[PATH_MAX];
+	*removed = 0;
+	if (build_tc_record_path(name, path, sizeof(path)) != 0) return NULL;
+	if (n <= 0) {
+		if (unlink(path) == 0 || errno == ENOENT) *removed = 1;
+		return NULL;
+	}
+
+	char dir[PATH_MAX];
+	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return NULL;
+	if (SAFE_PATH_JOIN(dir, RUNTIME_DIR, "tc") != 0) return NULL;
+	if (ensure_dir(dir, 0755) != 0) return NULL;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "无法创建 tc 记录: %s (%s)\n", path, strerror(errno));
+	}
+	return f;
+}
+
+int parse_tc_src(const char *str, TcMatch *m)
+{
+	TrafficClass cls;
+	memset(&cls, 0, sizeof(cls));
+	if (parse_class_dst(str, &cls) != 0) return -1;
+	memcpy(m->addr, cls.addr, sizeof(m->addr));
+	m->prefix_len = cls.prefix_len;
+	return 0;
+}
+
+static void format_tc_src(const TcMatch *m, char *buf, size_t bufsz)
+{
+	char addr[INET6_ADDRSTRLEN] = "?";
+	if (m->prefix_len >= 96 && memcmp(m->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0) {
+		inet_ntop(AF_INET, &m->addr[12], addr, sizeof(addr));
+		snprintf(buf, bufsz, "%s/%u", addr, m->prefix_len - 96);
+	} else {
+		inet_ntop(AF_INET6, m->addr, addr, sizeof(addr));
+		snprintf(buf, bufsz, "%s/%u", addr, m->prefix_len);
+	}
+}
+
+static const char *tc_match_type_name(unsigned int type)
+{
+	switch (type) {
+	case TC_MATCH_MARK: return "mark";
+	case TC_MATCH_IIF:  return "iif";
+	case TC_MATCH_SRC:  return "src";
+	default:            return "?";
+	}
+}
+
+/* 匹配条件的文本形式：mark 为十六进制，iif 为网卡名，src 为前缀 */
+static void format_tc_match(const TcMatch *m, char *buf, size_t bufsz)
+{
+	if (m->type == TC_MATCH_MARK) {
+		snprintf(buf, bufsz, "0x%x", m->value);
+	} else if (m->type == TC_MATCH_IIF) {
+		snprintf(buf, bufsz, "%s", m->ifname);
+	} else {
+		format_tc_src(m, buf, bufsz);
+	}
+}
+
+int save_tc_match_record(const TcMatch *m, int n)
+{
+	int removed = 0;
+	FILE *f = open_tc_record("matches", n, &removed);
+	if (!f) return removed ? 0 : -1;
+
+	int ret = 0;
+	for (int i = 0; i < n && ret >= 0; i++) {
+		char match[64];
+		format_tc_match(&m[i], match, sizeof(match));
+		ret = fprintf(f, "type=%s match=%s rule=%llu\n", tc_match_type_name(m[i].type), match, m[i].cgid);
+	}
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "无法写入 tc 匹配记录\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* 解析一行匹配记录，格式见 save_tc_match_record */
+static int parse_tc_match_line(char *line, TcMatch *m)
+{
+	const char *match = NULL;
+	memset(m, 0, sizeof(*m));
+	char *save = NULL;
+	for (char *tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+		char *eq = strchr(tok, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		const char *val = eq + 1;
+		if (strcmp(tok, "type") == 0) {
+			if (strcmp(val, "mark") == 0) m->type = TC_MATCH_MARK;
+			else if (strcmp(val, "iif") == 0) m->type = TC_MATCH_IIF;
+			else if (strcmp(val, "src") == 0) m->type = TC_MATCH_SRC;
+		} else if (strcmp(tok, "match") == 0) {
+			match = val;
+		} else if (strcmp(tok, "rule") == 0) {
+			m->cgid = strtoull(val, NULL, 10);
+		}
+	}
+	if (!match || m->cgid == 0ULL) return -1;
+
+	switch (m->type) {
+	case TC_MATCH_MARK:
+		m->value = (unsigned int)strtoul(match, NULL, 0);
+		return m->value ? 0 : -1;
+	case TC_MATCH_IIF:
+		if (!match[0] || strlen(match) >= sizeof(m->ifname)) return -1;
+		snprintf(m->ifname, sizeof(m->ifname), "%s", match);
+		/* 容器重建后 veth 的 ifindex 会变，以网卡名为准；网卡暂不存在时为 0 */
+		m->value = if_nametoindex(m->ifname);
+		return 0;
+	case TC_MATCH_SRC:
+		return parse_tc_src(match, m);
+	default:
+		return -1;
+	}
+}
+
+int load_tc_match_record(TcMatch *m, int max)
+{
+	char path[PATH_MAX];
+	if (build_tc_record_path("matches", path, sizeof(path)) != 0) return 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	int n = 0;
+	char line[256];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		if (parse_tc_match_line(line, &m[n]) != 0) {
+			fprintf(stderr, "警告: tc 匹配记录中有无效行，已跳过\n");
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int save_tc_dev_record(const char (*names)[16], int n)
+{
+	return save_dev_list_record("tc", names, n);
+}
+
+int load_tc_dev_record(char (*names)[16], int max)
+{
+	return load_dev_list_record("tc", names, max);
+}
+
+/* 两个匹配项的匹配条件是否相同（不比较指向的规则） */
+static int same_tc_match(const TcMatch *a, const TcMatch *b)
+{
+	if (a->type != b->type) return 0;
+	switch (a->type) {
+	case TC_MATCH_MARK: return a->value == b->value;
+	case TC_MATCH_IIF:  return strcmp(a->ifname, b->ifname) == 0;
+	default:            return a->prefix_len == b->prefix_len && memcmp(a->addr, b->addr, sizeof(a->addr)) == 0;
+	}
+}
+
+static int find_tc_match(const TcMatch *m, int n, const TcMatch *key)
+{
+	for (int i = 0; i < n; i++) {
+		if (same_tc_match(&m[i], key)) return i;
+	}
+	return -1;
+}
+
+/* 写入匹配表的项：网卡暂不存在的入口网卡匹配不写入，记录仍保留 */
+static int sync_tc_matches(const TcMatch *m, int n)
+{
+	TcMatch live[TC_MAX_MATCHES];
+	int cnt = 0;
+	for (int i = 0; i < n; i++) {
+		if (m[i].type == TC_MATCH_IIF && m[i].value == 0) continue;
+		live[cnt++] = m[i];
+	}
+	return bpf_sync_tc_matches(live, cnt);
+}
+
+int do_tc_add(const char *rule_path, const TcMatch *match)
+{
+	unsigned long long cgid = get_cgroup_id(rule_path);
+	if (cgid == 0ULL) return 1;
+
+	LimiterConfig lc;
+	memset(&lc, 0, sizeof(lc));
+	if (load_rule_record(cgid, &lc) != 0 || lc.rate_bps == 0ULL) {
+		fprintf(stderr, "规则 %s 没有参数记录，请先用 limiter set 设置\n", rule_path);
+		return 1;
+	}
+	if (lc.direction && !(lc.direction & LIMIT_DIR_EGRESS)) {
+		fprintf(stderr, "规则 %s 只限入方向，tc 模式只作用于出方向\n", rule_path);
+		return 1;
+	}
+	if (lc.mode == LIMIT_MODE_ECN) {
+		fprintf(stderr, "warning: tc 模式的包没有本机发送方可通知，ecn 规则按 police 处理\n");
+	}
+
+	TcMatch nm = *match;
+	nm.cgid = cgid;
+	if (nm.type == TC_MATCH_IIF) {
+		nm.value = if_nametoindex(nm.ifname);
+		if (nm.value == 0) {
+			fprintf(stderr, "找不到网卡 %s: %s\n", nm.ifname, strerror(errno));
+			return 1;
+		}
+	}
+
+	TcMatch m[TC_MAX_MATCHES];
+	int n = load_tc_match_record(m, TC_MAX_MATCHES);
+	int idx = find_tc_match(m, n, &nm);
+	if (idx < 0) {
+		if (n >= TC_MAX_MATCHES) {
+			fprintf(stderr, "tc 匹配项最多 %d 个\n", TC_MAX_MATCHES);
+			return 1;
+		}
+		idx = n++;
+	}
+	m[idx] = nm;
+	if (sync_tc_matches(m, n) != 0) {
+		return 1;
+	}
+	if (save_tc_match_record(m, n) != 0) {
+		fprintf(stderr, "警告: 保存 tc 匹配记录失败，reload 后该匹配项将丢失\n");
+	}
+
+	char text[64];
+	format_tc_match(&nm, text, sizeof(text));
+	printf("已添加 tc 匹配项: %s=%s -> 规则 %s (cgroup_id %llu)\n", tc_match_type_name(nm.type), text, rule_path, cgid);
+	char names[TC_MAX_DEVS][16];
+	if (load_tc_dev_record(names, TC_MAX_DEVS) == 0) {
+		printf("提示: 还没有附加 limit_tc 的网卡，请用 limiter tc attach --dev <ifname> 选择出口网卡\n");
+	}
+	return 0;
+}
+
+int do_tc_del(const TcMatch *match)
+{
+	TcMatch m[TC_MAX_MATCHES];
+	int n = load_tc_match_record(m, TC_MAX_MATCHES);
+	int idx = find_tc_match(m, n, match);
+	char text[64];
+	format_tc_match(match, text, sizeof(text));
+	if (idx < 0) {
+		fprintf(stderr, "没有 tc 匹配项 %s=%s\n", tc_match_type_name(match->type), text);
+		return 1;
+	}
+	memmove(&m[idx], &m[idx + 1], (size_t)(n - idx - 1) * sizeof(m[0]));
+	n--;
+
+	if (sync_tc_matches(m, n) != 0) {
+		return 1;
+	}
+	if (save_tc_match_record(m, n) != 0) {
+		fprintf(stderr, "警告: 更新 tc 匹配记录失败\n");
+	}
+	printf("已删除 tc 匹配项: %s=%s\n", tc_match_type_name(match->type), text);
+	return 0;
+}
+
+static int find_tc_dev(const char (*names)[16], int n, const char *ifname)
+{
+	for (int i = 0; i < n; i++) {
+		if (strcmp(names[i], ifname) == 0) return i;
+	}
+	return -1;
+}
+
+int do_tc_attach(const char *ifname)
+{
+	char names[TC_MAX_DEVS][16];
+	int n = load_tc_dev_record(names, TC_MAX_DEVS);
+	int idx = find_tc_dev((const char (*)[16])names, n, ifname);
+	if (idx < 0 && n >= TC_MAX_DEVS) {
+		fprintf(stderr, "tc 模式最多附加 %d 个网卡\n", TC_MAX_DEVS);
+		return 1;
+	}
+	if (bpf_tc_attach_dev(ifname) != 0) {
+		return 1;
+	}
+	if (idx < 0) {
+		snprintf(names[n++], sizeof(names[0]), "%s", ifname);
+		if (save_tc_dev_record((const char (*)[16])names, n) != 0) {
+			fprintf(stderr, "警告: 保存 tc 网卡记录失败，reload 后不会重新附加 %s\n", ifname);
+		}
+	}
+	return 0;
+}
+
+int do_tc_detach(const char *ifname)
+{
+	char names[TC_MAX_DEVS][16];
+	int n = load_tc_dev_record(names, TC_MAX_DEVS);
+	int idx = find_tc_dev((const char (*)[16])names, n, ifname);
+	if (idx >= 0) {
+		memmove(&names[idx], &names[idx + 1], (size_t)(n - idx - 1) * sizeof(names[0]));
+		n--;
+		if (save_tc_dev_record((const char (*)[16])names, n) != 0) {
+			fprintf(stderr, "警告: 更新 tc 网卡记录失败\n");
+		}
+	}
+	int ret = bpf_tc_detach_dev(ifname);
+	if (ret < 0) return 1;
+	if (ret == 0 && idx < 0) {
+		fprintf(stderr, "网卡 %s 上没有附加 limit_tc\n", ifname);
+		return 1;
+	}
+	return 0;
+}
+
+int do_tc_list(void)
+{
+	char names[TC_MAX_DEVS][16];
+	int nd = load_tc_dev_record(names, TC_MAX_DEVS);
+	printf("%-16s %-8s %s\n", "网卡", "ifindex", "状态");
+	for (int i = 0; i < nd; i++) {
+		printf("%-16s %-8u %s\n", names[i], if_nametoindex(names[i]),
+		       bpf_tc_dev_attached(names[i]) ? "已附加" : "未附加");
+	}
+
+	TcMatch m[TC_MAX_MATCHES];
+	int n = load_tc_match_record(m, TC_MAX_MATCHES);
+	printf("\n%-6s %-44s %s\n", "type", "match", "cgroup_id");
+	for (int i = 0; i < n; i++) {
+		char text[64];
+		format_tc_match(&m[i], text, sizeof(text));
+		if (m[i].type == TC_MATCH_IIF && m[i].value == 0) {
+			strncat(text, " (网卡不存在)", sizeof(text) - strlen(text) - 1);
+		}
+		printf("%-6s %-44s %llu\n", tc_match_type_name(m[i].type), text, m[i].cgid);
+	}
+	return 0;
+}
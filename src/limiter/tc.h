@@ -0,0 +1,30 @@
+#ifndef TC_H
+#define TC_H
+
+#include "bpf.h"
+
+/*
+ * tc 模式记录：匹配项保存在 RUNTIME_DIR "/tc/matches"，附加的网卡保存在 RUNTIME_DIR "/tc/devs"，
+ * 每行一项，reload 时据此重建匹配表并重新附加。load 返回读到的项数（没有记录为 0），
+ * 入口网卡按名字重新解析 ifindex（网卡不存在时为 0，不参与匹配但保留记录）；
+ * save 在 n 为 0 时删除记录文件。
+ */
+int load_tc_match_record(TcMatch *m, int max);
+int save_tc_match_record(const TcMatch *m, int n);
+int load_tc_dev_record(char (*names)[16], int max);
+int save_tc_dev_record(const char (*names)[16], int n);
+
+/* 源地址前缀解析（CIDR，省略长度表示单个地址），结果写入 m 的 addr/prefix_len */
+int parse_tc_src(const char *str, TcMatch *m);
+
+/*
+ * 便捷子命令：tc add 把匹配项指向规则（rule_path 为规则 cgroup 路径），同一匹配条件再次添加时改指向；
+ * tc del 按匹配条件删除；tc attach/detach 在网卡的 tcx 出方向附加/卸载 limit_tc；tc list 显示全部
+ */
+int do_tc_add(const char *rule_path, const TcMatch *m);
+int do_tc_del(const TcMatch *m);
+int do_tc_attach(const char *ifname);
+int do_tc_detach(const char *ifname);
+int do_tc_list(void);
+
+#endif /* TC_H */
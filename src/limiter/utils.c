@@ -358,6 +358,27 @@ int read_proc_starttime(pid_t pid, unsigned long long *starttime_out)
 	return 0;
 }
 
+int read_proc_tgid(pid_t pid, unsigned int *tgid_out)
+{
+	if (!tgid_out) return -1;
+	char proc_status[PATH_MAX];
+	char pid_str[32];
+	snprintf(pid_str, sizeof(pid_str), "%d", pid);
+	SAFE_PATH_JOIN(proc_status, "/proc", pid_str, "status");
+	FILE *f = fopen(proc_status, "r");
+	if (!f) return -1;
+	char line[256];
+	int ret = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Tgid: %u", tgid_out) == 1) {
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
 static int ensure_runtime_subdir(const char *sub)
 {
 	if (ensure_dir(RUNTIME_DIR, 0755) != 0) return -1;
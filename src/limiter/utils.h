@@ -42,6 +42,9 @@ int read_proc_cgroup_v2_path(pid_t pid, char *buf, size_t bufsz);
 /* 读取进程 starttime（/proc/<pid>/stat 第22项，单位为时钟ticks），返回0成功 */
 int read_proc_starttime(pid_t pid, unsigned long long *starttime_out);
 
+/* 读取线程所属进程的 tgid（/proc/<pid>/status 的 Tgid 行），返回0成功 */
+int read_proc_tgid(pid_t pid, unsigned int *tgid_out);
+
 /* 原始 cgroup 记录：保存/加载/删除（保存在 RUNTIME_DIR "/orig_cgrp/<pid>"） */
 int save_pid_original_cgroup(pid_t pid, const char *cgroup_path, unsigned long long starttime);
 int load_pid_original_cgroup(pid_t pid, char *path_out, size_t path_bufsz, unsigned long long *starttime_out);